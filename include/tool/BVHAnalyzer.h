@@ -0,0 +1,302 @@
+#pragma once
+#ifndef __BVHANALYZER_H__
+#define __BVHANALYZER_H__
+
+#include <glm/glm.hpp>
+
+#include <tool/BVHTree.h>
+#include <tool/Camera.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// BVH质量分析：由展平后的NodeArray统计树的结构指标，并用相机扫描统计遍历代价，结果输出为JSON，
+// 用于比较不同构建参数（划分方法、叶子大小、SBVH等），以及按模型跟踪构建质量的回归。
+// 各项指标：
+//   SAH代价：computeSAHCost()，以根节点表面积归一化
+//   深度/叶子大小直方图：按叶子统计
+//   重叠：内部节点两个子包围盒交集的表面积与父节点表面积之比
+//   空白空间：内部节点包围盒中未被两个子包围盒覆盖的体积比例（体积为0的扁平节点不参与统计）
+//   遍历代价：从相机位置出发，左右转动视线得到若干视角，每个视角width*height条主光线的最近交点查询
+
+struct BVHViewStats {
+	float yaw = 0.0f; // 相对相机朝向的偏转角（度）
+	double nodesPerRay = 0.0;
+	double trianglesPerRay = 0.0;
+	double hitRate = 0.0;
+};
+
+struct BVHAnalysis {
+	std::string name;
+
+	// 构建参数
+	std::string splitMethod;
+	int maxPrimsInNode = 0;
+	int leafPacketWidth = 0;
+	double buildTimeMs = 0.0;
+
+	// 树结构
+	int nodeNum = 0, interiorNum = 0, leafNum = 0;
+	int primitiveNum = 0;  // 三角形数
+	long long referenceNum = 0; // 叶子中的三角形引用总数（SBVH会重复引用）
+	float sahCost = 0.0f;
+	int maxDepth = 0;
+	double avgLeafDepth = 0.0;
+	double avgLeafSize = 0.0;
+	std::vector<int> depthHistogram;    // 第d项：深度为d的叶子数量
+	std::vector<int> leafSizeHistogram; // 第n项：含n个三角形的叶子数量
+
+	// 包围盒质量
+	double overlapMean = 0.0;      // 各内部节点重叠比例的平均值
+	double overlapWeighted = 0.0;  // 重叠表面积之和 / 根节点表面积，与SAH代价同一量纲
+	double emptySpaceMean = 0.0;   // 各内部节点空白体积比例的平均值
+	double emptySpaceWeighted = 0.0; // 空白体积之和 / 内部节点体积之和
+	int flatNodes = 0;             // 体积为0、未参与空白空间统计的内部节点数
+
+	// 遍历代价
+	int rayWidth = 0, rayHeight = 0;
+	double nodesPerRay = 0.0;
+	double trianglesPerRay = 0.0;
+	double hitRate = 0.0;
+	long long maxNodesPerRay = 0;
+	std::vector<BVHViewStats> views;
+};
+
+const char *SplitMethodName(SplitMethod method) {
+	switch (method) {
+	case SplitMethod::EqualCounts: return "EqualCounts";
+	case SplitMethod::SAH: return "SAH";
+	case SplitMethod::HLBVH: return "HLBVH";
+	case SplitMethod::SBVH: return "SBVH";
+	}
+	return "Unknown";
+}
+
+// views个视角的偏转角均匀分布在[-sweepDegrees, sweepDegrees]内，绕相机的WorldUp旋转
+BVHAnalysis AnalyzeBVH(const BVHTree &bvhTree, const Camera &camera, const std::string &name = "",
+					   int views = 9, float sweepDegrees = 40.0f, int width = 80, int height = 60) {
+	BVHAnalysis a;
+	a.name = name;
+	a.splitMethod = SplitMethodName(bvhTree.splitMethod);
+	a.maxPrimsInNode = bvhTree.maxPrimsInNode;
+	a.leafPacketWidth = bvhTree.leafPacketWidth;
+	a.buildTimeMs = bvhTree.buildTime * 1000.0;
+	a.nodeNum = bvhTree.nodeNum;
+	a.primitiveNum = bvhTree.meshNum;
+	if (!bvhTree.NodeArray || bvhTree.nodeNum == 0) return a;
+	a.sahCost = bvhTree.computeSAHCost();
+
+	auto nodeBound = [&](int i) {
+		const float *n = &bvhTree.NodeArray[i * 9];
+		return Bound3f(glm::vec3(n[0], n[1], n[2]), glm::vec3(n[3], n[4], n[5]));
+	};
+	auto volume = [](const Bound3f &b) {
+		if (b.IsEmpty()) return 0.0;
+		glm::vec3 d = b.Diagonal();
+		return (double)d.x * d.y * d.z;
+	};
+	// 空包围盒（pMin > pMax）的表面积为inf或nan，按0处理，相关比值不参与统计
+	auto area = [](const Bound3f &b) {
+		double s = b.IsEmpty() ? 0.0 : b.SurfaceArea();
+		return std::isfinite(s) ? s : 0.0;
+	};
+
+	// 深度优先顺序：第一个子节点为i+1，第二个子节点为childOffset
+	std::vector<int> depth(bvhTree.nodeNum, 0);
+	double rootArea = area(nodeBound(0));
+	double overlapSum = 0.0, overlapAreaSum = 0.0;
+	double emptySum = 0.0, emptyVolumeSum = 0.0, interiorVolumeSum = 0.0;
+	int emptyCount = 0;
+	long long leafDepthSum = 0;
+	for (int i = 0; i < bvhTree.nodeNum; i++) {
+		const float *n = &bvhTree.NodeArray[i * 9];
+		int nPrimitives = (int)n[6];
+		a.maxDepth = std::max(a.maxDepth, depth[i]);
+		if (nPrimitives > 0) {
+			a.leafNum++;
+			a.referenceNum += nPrimitives;
+			leafDepthSum += depth[i];
+			if ((int)a.depthHistogram.size() <= depth[i]) a.depthHistogram.resize(depth[i] + 1, 0);
+			a.depthHistogram[depth[i]]++;
+			if ((int)a.leafSizeHistogram.size() <= nPrimitives) a.leafSizeHistogram.resize(nPrimitives + 1, 0);
+			a.leafSizeHistogram[nPrimitives]++;
+			continue;
+		}
+		a.interiorNum++;
+		int first = i + 1, second = (int)n[8];
+		depth[first] = depth[second] = depth[i] + 1;
+
+		Bound3f parent = nodeBound(i), b0 = nodeBound(first), b1 = nodeBound(second);
+		Bound3f overlap = Intersect(b0, b1);
+		double overlapArea = area(overlap);
+		double parentArea = area(parent);
+		if (parentArea > 0.0) overlapSum += overlapArea / parentArea;
+		overlapAreaSum += overlapArea;
+
+		double vParent = volume(parent);
+		if (vParent > 0.0 && std::isfinite(vParent)) {
+			double vChildren = volume(b0) + volume(b1) - volume(overlap);
+			double empty = std::max(0.0, vParent - vChildren);
+			emptySum += empty / vParent;
+			emptyVolumeSum += empty;
+			interiorVolumeSum += vParent;
+			emptyCount++;
+		}
+		else {
+			a.flatNodes++;
+		}
+	}
+	if (a.leafNum > 0) {
+		a.avgLeafDepth = (double)leafDepthSum / a.leafNum;
+		a.avgLeafSize = (double)a.referenceNum / a.leafNum;
+	}
+	if (a.interiorNum > 0) a.overlapMean = overlapSum / a.interiorNum;
+	if (rootArea > 0.0) a.overlapWeighted = overlapAreaSum / rootArea;
+	if (emptyCount > 0) a.emptySpaceMean = emptySum / emptyCount;
+	if (interiorVolumeSum > 0.0) a.emptySpaceWeighted = emptyVolumeSum / interiorVolumeSum;
+
+	// 相机扫描
+	a.rayWidth = width;
+	a.rayHeight = height;
+	BVHTraversalStats total;
+	long long totalHits = 0;
+	for (int v = 0; v < views; v++) {
+		float yaw = (views > 1) ? -sweepDegrees + 2.0f * sweepDegrees * v / (views - 1) : 0.0f;
+		glm::mat3 rot = glm::mat3(glm::rotate(glm::mat4(1.0f), glm::radians(yaw), camera.WorldUp));
+		Camera view = camera;
+		view.Front = rot * camera.Front;
+		view.Right = rot * camera.Right;
+		view.Up = rot * camera.Up;
+		view.LeftBottomCorner = view.Front - view.halfW * view.Right - view.halfH * view.Up;
+
+		BVHTraversalStats stats;
+		long long hits = 0;
+		for (int j = 0; j < height; j++) {
+			for (int i = 0; i < width; i++) {
+				float x = ((float)i + 0.5f) / (float)width;
+				float y = ((float)j + 0.5f) / (float)height;
+				Ray ray = CameraRay(view, x, y);
+				long long nodesBefore = stats.nodesVisited;
+				hitRecord rec;
+				if (IntersectBVH(bvhTree, ray, rec, &stats)) hits++;
+				a.maxNodesPerRay = std::max(a.maxNodesPerRay, stats.nodesVisited - nodesBefore);
+			}
+		}
+		BVHViewStats vs;
+		vs.yaw = yaw;
+		if (stats.rays > 0) {
+			vs.nodesPerRay = (double)stats.nodesVisited / stats.rays;
+			vs.trianglesPerRay = (double)stats.primitivesTested / stats.rays;
+			vs.hitRate = (double)hits / stats.rays;
+		}
+		a.views.push_back(vs);
+		total.rays += stats.rays;
+		total.nodesVisited += stats.nodesVisited;
+		total.primitivesTested += stats.primitivesTested;
+		totalHits += hits;
+	}
+	if (total.rays > 0) {
+		a.nodesPerRay = (double)total.nodesVisited / total.rays;
+		a.trianglesPerRay = (double)total.primitivesTested / total.rays;
+		a.hitRate = (double)totalHits / total.rays;
+	}
+	return a;
+}
+
+std::string BVHAnalysisToJSON(const BVHAnalysis &a) {
+	auto quote = [](const std::string &s) {
+		std::string r = "\"";
+		for (char c : s) {
+			if (c == '"' || c == '\\') {
+				r += '\\';
+				r += c;
+			} else if (c == '\n') {
+				r += "\\n";
+			} else if (c == '\t') {
+				r += "\\t";
+			} else if (static_cast<unsigned char>(c) < 0x20) {
+				// 其余控制字符JSON中必须转义
+				char buf[8];
+				std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned char>(c));
+				r += buf;
+			} else {
+				r += c;
+			}
+		}
+		return r + "\"";
+	};
+	// JSON没有nan/inf，非有限值输出null
+	auto num = [](double v) {
+		if (!std::isfinite(v)) return std::string("null");
+		std::ostringstream o;
+		o << std::setprecision(6) << v;
+		return o.str();
+	};
+	auto intArray = [](const std::vector<int> &v) {
+		std::ostringstream o;
+		o << "[";
+		for (size_t i = 0; i < v.size(); i++) o << (i ? ", " : "") << v[i];
+		o << "]";
+		return o.str();
+	};
+
+	std::ostringstream o;
+	o << "{\n";
+	o << "  \"name\": " << quote(a.name) << ",\n";
+	o << "  \"build\": { \"splitMethod\": " << quote(a.splitMethod) << ", \"maxPrimsInNode\": " << a.maxPrimsInNode
+	  << ", \"leafPacketWidth\": " << a.leafPacketWidth << ", \"buildTimeMs\": " << num(a.buildTimeMs) << " },\n";
+	o << "  \"tree\": {\n";
+	o << "    \"nodes\": " << a.nodeNum << ", \"interiorNodes\": " << a.interiorNum << ", \"leaves\": " << a.leafNum << ",\n";
+	o << "    \"primitives\": " << a.primitiveNum << ", \"references\": " << a.referenceNum << ",\n";
+	o << "    \"sahCost\": " << num(a.sahCost) << ", \"maxDepth\": " << a.maxDepth
+	  << ", \"avgLeafDepth\": " << num(a.avgLeafDepth) << ", \"avgLeafSize\": " << num(a.avgLeafSize) << ",\n";
+	o << "    \"depthHistogram\": " << intArray(a.depthHistogram) << ",\n";
+	o << "    \"leafSizeHistogram\": " << intArray(a.leafSizeHistogram) << "\n";
+	o << "  },\n";
+	o << "  \"bounds\": { \"overlapMean\": " << num(a.overlapMean) << ", \"overlapWeighted\": " << num(a.overlapWeighted)
+	  << ", \"emptySpaceMean\": " << num(a.emptySpaceMean) << ", \"emptySpaceWeighted\": " << num(a.emptySpaceWeighted)
+	  << ", \"flatNodes\": " << a.flatNodes << " },\n";
+	o << "  \"traversal\": {\n";
+	o << "    \"raysPerView\": " << a.rayWidth * a.rayHeight << ", \"nodesPerRay\": " << num(a.nodesPerRay)
+	  << ", \"trianglesPerRay\": " << num(a.trianglesPerRay) << ", \"hitRate\": " << num(a.hitRate)
+	  << ", \"maxNodesPerRay\": " << a.maxNodesPerRay << ",\n";
+	o << "    \"views\": [";
+	for (size_t i = 0; i < a.views.size(); i++) {
+		const BVHViewStats &v = a.views[i];
+		o << (i ? ",\n" : "\n") << "      { \"yaw\": " << num(v.yaw) << ", \"nodesPerRay\": " << num(v.nodesPerRay)
+		  << ", \"trianglesPerRay\": " << num(v.trianglesPerRay) << ", \"hitRate\": " << num(v.hitRate) << " }";
+	}
+	o << (a.views.empty() ? "]\n" : "\n    ]\n");
+	o << "  }\n";
+	o << "}\n";
+	return o.str();
+}
+
+// 分析并写出JSON文件（path为空时只输出到控制台），控制台同时输出主要指标
+BVHAnalysis BVHAnalyzeReport(const BVHTree &bvhTree, const Camera &camera, const std::string &name = "",
+							 const char *path = "BVHReport.json") {
+	BVHAnalysis a = AnalyzeBVH(bvhTree, camera, name);
+	std::string json = BVHAnalysisToJSON(a);
+	if (path && path[0]) {
+		std::ofstream file(path);
+		if (file) file << json;
+		else std::cout << "cannot write BVH report: " << path << std::endl;
+	}
+	else {
+		std::cout << json;
+	}
+	std::cout << "BVH report " << (name.empty() ? "" : name + " ") << "(" << a.splitMethod << "): SAH cost = " << a.sahCost
+			  << ", depth = " << a.maxDepth << ", leaves = " << a.leafNum << ", overlap = " << a.overlapWeighted
+			  << ", empty space = " << a.emptySpaceWeighted << ", nodes/ray = " << a.nodesPerRay
+			  << ", triangles/ray = " << a.trianglesPerRay << std::endl;
+	return a;
+}
+
+#endif
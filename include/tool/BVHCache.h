@@ -0,0 +1,453 @@
+#pragma once
+#ifndef __BVHCache_h__
+#define __BVHCache_h__
+
+#include <glm/glm.hpp>
+
+#include <tool/Shape.h>
+#include <tool/BVHTree.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// BVH磁盘缓存
+// 缓存文件保存展平后的NodeArray、MeshArray（以及压缩节点、SBVH引用表与索引格式的顶点和材质），启动时用mmap映射后
+// 直接交给glTexImage2D，不需要Assimp导入模型、构建BVH和重新打包三角形。
+// 文件头记录每个模型的内容哈希、变换矩阵和材质，以及构建参数与三角形跨度，任一项不同即视为失效。
+//
+// 文件布局：BVHCacheHeader | BVHCacheModel[modelNum] | 各数组（起始位置按64字节对齐）
+
+const char BVH_CACHE_MAGIC[4] = { 'B', 'V', 'H', 'C' };
+const uint32_t BVH_CACHE_VERSION = 6;
+
+// 64位FNV-1a哈希
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// 文件内容的哈希，文件不存在时返回0
+uint64_t hashFile(const std::string &path) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) return 0;
+	uint64_t hash = hashBytes(nullptr, 0);
+	std::vector<char> buffer(1 << 16);
+	while (in) {
+		in.read(buffer.data(), buffer.size());
+		hash = hashBytes(buffer.data(), (size_t)in.gcount(), hash);
+	}
+	return hash;
+}
+
+// 影响构建结果的参数（构建线程数不影响结果，不记录）。
+// treelet优化的时间上限不记录：超时提前结束的树不写入缓存（见SaveBVHCache），写入的树只由遍数与收敛条件决定
+struct BVHCacheBuildParams {
+	int32_t stride;
+	int32_t splitMethod;
+	int32_t maxPrimsInNode;
+	int32_t nBuckets;
+	float traversalCost;
+	float intersectCost;
+	int32_t leafPacketWidth;
+	float sbvhDuplicationBudget;
+	float sbvhAlpha;
+	int32_t mortonBits63;
+	int32_t hlbvhUpperSAH;
+	int32_t compactNodes;
+	int32_t optimizeTree;
+	int32_t treeletSize;
+	int32_t optimizePasses;
+};
+
+// 一个输入模型：源文件内容哈希、模型矩阵与材质
+struct BVHCacheModel {
+	uint64_t fileHash;
+	float transform[16];
+	float material[18]; // 顺序与MeshArray中三角形的材质部分相同
+};
+
+struct BVHCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t inputHash;   // 所有模型记录与构建参数的哈希，用于快速比较
+	uint64_t fileSize;
+	BVHCacheBuildParams params;
+	int32_t modelNum;
+	int32_t nodeNum, nodeNumX, nodeNumY;
+	int32_t meshNum, meshNumX, meshNumY;
+	int32_t compactNodeNum, compactNodeNumX, compactNodeNumY;
+	int32_t primRefNum, primRefNumX, primRefNumY;
+	int32_t skipNumX, skipNumY;
+	int32_t vertexNum, vertexNumX, vertexNumY;       // 索引格式（stride为IndexedMeshStride）时不为0
+	int32_t materialNum, materialNumX, materialNumY;
+	uint64_t nodeOffset, meshOffset, compactOffset, primRefOffset, skipOffset; // 各数组在文件中的字节偏移，0表示没有
+	uint64_t vertexOffset, materialOffset;
+};
+
+// 缓存键：按加载顺序记录场景中的每个模型，再记录构建参数
+class BVHCacheKey {
+public:
+	std::vector<BVHCacheModel> models;
+	BVHCacheBuildParams params;
+
+	BVHCacheKey() { memset(&params, 0, sizeof(params)); }
+
+	void addModel(const std::string &path, const glm::mat4 &transform, const Material &material) {
+		BVHCacheModel model;
+		memset(&model, 0, sizeof(model));
+		model.fileHash = hashFile(path);
+		memcpy(model.transform, &transform[0][0], sizeof(model.transform));
+		packMaterial(material, model.material);
+		models.push_back(model);
+	}
+
+	// 在BVHBuildTree之前设置好bvhTree的构建参数后调用
+	void setBuildParams(const BVHTree &bvhTree, int stride) {
+		params.stride = stride;
+		params.splitMethod = (int32_t)bvhTree.splitMethod;
+		params.maxPrimsInNode = bvhTree.maxPrimsInNode;
+		params.nBuckets = bvhTree.nBuckets;
+		params.traversalCost = bvhTree.traversalCost;
+		params.intersectCost = bvhTree.intersectCost;
+		params.leafPacketWidth = bvhTree.leafPacketWidth;
+		params.sbvhDuplicationBudget = bvhTree.sbvhDuplicationBudget;
+		params.sbvhAlpha = bvhTree.sbvhAlpha;
+		params.mortonBits63 = bvhTree.mortonBits63;
+		params.hlbvhUpperSAH = bvhTree.hlbvhUpperSAH;
+		params.compactNodes = bvhTree.compactNodes;
+		params.optimizeTree = bvhTree.optimizeTree;
+		params.treeletSize = bvhTree.treeletSize;
+		params.optimizePasses = bvhTree.optimizePasses;
+	}
+
+	uint64_t hash() const {
+		uint64_t h = hashBytes(&params, sizeof(params));
+		return models.empty() ? h : hashBytes(models.data(), models.size() * sizeof(BVHCacheModel), h);
+	}
+};
+
+// 把bvhTree的GPU数组写入缓存文件。先写临时文件再改名，写入中途失败不会留下损坏的缓存
+bool SaveBVHCache(const BVHTree &bvhTree, const BVHCacheKey &key, const std::string &path) {
+	if (bvhTree.optimizeTimeLimited) {
+		std::cout << "BVH cache not written: treelet optimization reached its time budget, "
+				  << "the tree depends on machine load (raise optimizeTimeBudget)" << std::endl;
+		return false;
+	}
+	auto align = [](uint64_t offset) { return (offset + 63) & ~uint64_t(63); };
+
+	BVHCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = BVH_CACHE_VERSION;
+	header.inputHash = key.hash();
+	header.params = key.params;
+	header.modelNum = (int32_t)key.models.size();
+	header.nodeNum = bvhTree.nodeNum; header.nodeNumX = bvhTree.nodeNumX; header.nodeNumY = bvhTree.nodeNumY;
+	header.meshNum = bvhTree.meshNum; header.meshNumX = bvhTree.meshNumX; header.meshNumY = bvhTree.meshNumY;
+	if (bvhTree.CompactNodeArray && bvhTree.compactNodeNum > 0) {
+		header.compactNodeNum = bvhTree.compactNodeNum;
+		header.compactNodeNumX = bvhTree.compactNodeNumX;
+		header.compactNodeNumY = bvhTree.compactNodeNumY;
+	}
+	header.primRefNum = bvhTree.primRefNum; header.primRefNumX = bvhTree.primRefNumX; header.primRefNumY = bvhTree.primRefNumY;
+	header.skipNumX = bvhTree.skipNumX; header.skipNumY = bvhTree.skipNumY;
+	if (bvhTree.meshStride == IndexedMeshStride) {
+		header.vertexNum = bvhTree.vertexNum; header.vertexNumX = bvhTree.vertexNumX; header.vertexNumY = bvhTree.vertexNumY;
+		header.materialNum = bvhTree.materialNum; header.materialNumX = bvhTree.materialNumX; header.materialNumY = bvhTree.materialNumY;
+	}
+
+	// 纹理按 X*Y 整体上传，保存包括末尾填充在内的完整数组
+	uint64_t nodeBytes = (uint64_t)header.nodeNumX * header.nodeNumY * sizeof(float);
+	uint64_t meshBytes = (uint64_t)header.meshNumX * header.meshNumY * sizeof(float);
+	uint64_t compactBytes = (uint64_t)header.compactNodeNumX * header.compactNodeNumY * 4 * sizeof(unsigned int);
+	uint64_t primRefBytes = header.primRefNum > 0 ? (uint64_t)header.primRefNumX * header.primRefNumY * sizeof(float) : 0;
+	uint64_t skipBytes = (uint64_t)header.skipNumX * header.skipNumY * sizeof(float);
+	uint64_t vertexBytes = (uint64_t)header.vertexNumX * header.vertexNumY * sizeof(float);
+	uint64_t materialBytes = (uint64_t)header.materialNumX * header.materialNumY * sizeof(float);
+
+	uint64_t offset = sizeof(BVHCacheHeader) + key.models.size() * sizeof(BVHCacheModel);
+	header.nodeOffset = offset = align(offset);
+	header.meshOffset = offset = align(offset + nodeBytes);
+	offset = align(offset + meshBytes);
+	if (compactBytes) { header.compactOffset = offset; offset = align(offset + compactBytes); }
+	if (primRefBytes) { header.primRefOffset = offset; offset = align(offset + primRefBytes); }
+	header.skipOffset = offset;
+	offset = align(offset + skipBytes);
+	if (vertexBytes) {
+		header.vertexOffset = offset; offset = align(offset + vertexBytes);
+		header.materialOffset = offset; offset = align(offset + materialBytes);
+	}
+	header.fileSize = offset;
+
+	std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			std::cout << "BVH cache: cannot write " << tmpPath << std::endl;
+			return false;
+		}
+		auto writeAt = [&](uint64_t pos, const void *data, uint64_t size) {
+			static const char zeros[64] = {};
+			uint64_t cur = (uint64_t)out.tellp();
+			if (pos > cur) out.write(zeros, pos - cur);
+			out.write((const char *)data, size);
+		};
+		writeAt(0, &header, sizeof(header));
+		if (!key.models.empty())
+			writeAt(sizeof(header), key.models.data(), key.models.size() * sizeof(BVHCacheModel));
+		writeAt(header.nodeOffset, bvhTree.NodeArray, nodeBytes);
+		writeAt(header.meshOffset, bvhTree.MeshArray, meshBytes);
+		if (compactBytes) writeAt(header.compactOffset, bvhTree.CompactNodeArray, compactBytes);
+		if (primRefBytes) writeAt(header.primRefOffset, bvhTree.PrimRefArray, primRefBytes);
+		writeAt(header.skipOffset, bvhTree.SkipArray, skipBytes);
+		if (vertexBytes) {
+			writeAt(header.vertexOffset, bvhTree.VertexArray, vertexBytes);
+			writeAt(header.materialOffset, bvhTree.MaterialArray, materialBytes);
+		}
+		writeAt(header.fileSize, nullptr, 0);
+		if (!out) {
+			std::cout << "BVH cache: write failed " << tmpPath << std::endl;
+			return false;
+		}
+	}
+	std::remove(path.c_str());
+	if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+		std::cout << "BVH cache: cannot rename " << tmpPath << std::endl;
+		return false;
+	}
+	std::cout << "BVH cache saved: " << path << " (" << header.fileSize / 1024.0 / 1024.0 << " MB)" << std::endl;
+	return true;
+}
+
+// 只读映射的缓存文件，数组指针在close之前有效
+class BVHCache {
+public:
+	const BVHCacheHeader *header = nullptr;
+	const float *NodeArray = nullptr;
+	const float *MeshArray = nullptr;
+	const unsigned int *CompactNodeArray = nullptr;
+	const float *PrimRefArray = nullptr;
+	const float *SkipArray = nullptr;
+	const float *VertexArray = nullptr;   // 索引格式才有，否则为nullptr
+	const float *MaterialArray = nullptr;
+
+	BVHCache() {}
+	~BVHCache() { close(); }
+	BVHCache(const BVHCache &) = delete;
+	BVHCache &operator=(const BVHCache &) = delete;
+
+	// 映射缓存文件并与key比较，文件不存在、格式不对或内容过期时返回false
+	bool open(const std::string &path, const BVHCacheKey &key) {
+		close();
+		if (!map(path)) return false;
+		if (!validate(key)) {
+			std::cout << "BVH cache: " << path << " is out of date, rebuilding" << std::endl;
+			close();
+			return false;
+		}
+		const char *base = (const char *)data;
+		NodeArray = (const float *)(base + header->nodeOffset);
+		MeshArray = (const float *)(base + header->meshOffset);
+		CompactNodeArray = header->compactOffset ? (const unsigned int *)(base + header->compactOffset) : nullptr;
+		PrimRefArray = header->primRefOffset ? (const float *)(base + header->primRefOffset) : nullptr;
+		SkipArray = (const float *)(base + header->skipOffset);
+		VertexArray = header->vertexOffset ? (const float *)(base + header->vertexOffset) : nullptr;
+		MaterialArray = header->materialOffset ? (const float *)(base + header->materialOffset) : nullptr;
+		std::cout << "BVH cache loaded: " << path << " (" << header->meshNum << " triangles, "
+				  << header->nodeNum << " nodes)" << std::endl;
+		return true;
+	}
+
+	void close() {
+		if (data) {
+#ifdef _WIN32
+			UnmapViewOfFile(data);
+#else
+			munmap(data, size);
+#endif
+		}
+#ifdef _WIN32
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#endif
+		data = nullptr;
+		size = 0;
+		header = nullptr;
+		NodeArray = MeshArray = PrimRefArray = SkipArray = VertexArray = MaterialArray = nullptr;
+		CompactNodeArray = nullptr;
+	}
+
+private:
+	void *data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+
+	bool map(const std::string &path) {
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(BVHCacheHeader)) { close(); return false; }
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping) { close(); return false; }
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!data) { close(); return false; }
+		size = (size_t)fileSize.QuadPart;
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BVHCacheHeader)) { ::close(fd); return false; }
+		void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); // 映射建立后文件描述符可以关闭
+		if (p == MAP_FAILED) return false;
+		data = p;
+		size = (size_t)st.st_size;
+#endif
+		header = (const BVHCacheHeader *)data;
+		return true;
+	}
+
+	bool validate(const BVHCacheKey &key) const {
+		const BVHCacheHeader &h = *header;
+		if (memcmp(h.magic, BVH_CACHE_MAGIC, sizeof(h.magic)) != 0 || h.version != BVH_CACHE_VERSION) return false;
+		if (h.fileSize != size || h.inputHash != key.hash()) return false;
+		if (memcmp(&h.params, &key.params, sizeof(h.params)) != 0) return false;
+		if (h.modelNum != (int32_t)key.models.size()) return false;
+		uint64_t modelBytes = key.models.size() * sizeof(BVHCacheModel);
+		if (sizeof(BVHCacheHeader) + modelBytes > size) return false;
+		if (modelBytes && memcmp((const char *)data + sizeof(BVHCacheHeader), key.models.data(), modelBytes) != 0) return false;
+		auto inside = [&](uint64_t offset, uint64_t bytes) { return offset + bytes <= size; };
+		if (!inside(h.nodeOffset, (uint64_t)h.nodeNumX * h.nodeNumY * sizeof(float))) return false;
+		if (!inside(h.meshOffset, (uint64_t)h.meshNumX * h.meshNumY * sizeof(float))) return false;
+		if (h.compactOffset && !inside(h.compactOffset, (uint64_t)h.compactNodeNumX * h.compactNodeNumY * 4 * sizeof(unsigned int))) return false;
+		if (h.primRefOffset && !inside(h.primRefOffset, (uint64_t)h.primRefNumX * h.primRefNumY * sizeof(float))) return false;
+		if (!inside(h.skipOffset, (uint64_t)h.skipNumX * h.skipNumY * sizeof(float))) return false;
+		if (h.vertexOffset && !inside(h.vertexOffset, (uint64_t)h.vertexNumX * h.vertexNumY * sizeof(float))) return false;
+		if (h.materialOffset && !inside(h.materialOffset, (uint64_t)h.materialNumX * h.materialNumY * sizeof(float))) return false;
+		if ((h.vertexOffset == 0) != (h.materialOffset == 0)) return false;
+		return true;
+	}
+};
+
+// 把索引格式的一个三角形（MeshArray中的4个float）展开为42跨度的格式，用于检查两种格式等价
+void DecodeIndexedTriangle(const float *mesh, const float *vertexArray, const float *materialArray, float *dst) {
+	for (int k = 0; k < 3; k++) {
+		const float *v = &vertexArray[(int)mesh[k] * IndexedVertexStride];
+		for (int a = 0; a < 3; a++) {
+			dst[k * 3 + a] = v[a];
+			dst[9 + k * 3 + a] = v[3 + a];
+		}
+		dst[18 + k * 2 + 0] = v[6];
+		dst[18 + k * 2 + 1] = v[7];
+	}
+	memcpy(dst + 24, &materialArray[(int)mesh[3] * MaterialStride], MaterialStride * sizeof(float));
+}
+
+// 索引格式测试：
+// 1. 同样的输入分别按42跨度与索引格式构建，索引格式逐三角形展开后与42跨度的MeshArray逐位相同；
+// 2. 注册可移动物体（objectCount > 0）后物体的顶点不与其他三角形共用，移动物体后两种格式仍然相同；
+// 3. 索引格式写入缓存再映射，各数组与内存中的逐位相同
+void IndexedMeshTest(const TriangleStore &prims, int objectFirst = 0, int objectCount = 0,
+					 const std::string &cachePath = "IndexedMeshTest.bvhcache")
+{
+	BVHTree full, indexed;
+	full.BVHBuildTree(prims, 42);
+	indexed.BVHBuildTree(prims, IndexedMeshStride);
+
+	auto compare = [&](const char *name, const float *mesh, const float *vertexArray, const float *materialArray) {
+		int mismatches = 0;
+		float decoded[42];
+		for (int i = 0; i < full.meshNum; i++) {
+			DecodeIndexedTriangle(&mesh[i * IndexedMeshStride], vertexArray, materialArray, decoded);
+			if (memcmp(decoded, &full.MeshArray[i * 42], sizeof(decoded)) != 0) mismatches++;
+		}
+		std::cout << name << ": " << full.meshNum << " triangles, mismatches = " << mismatches << std::endl;
+		return mismatches == 0;
+	};
+	bool ok = full.nodeNum == indexed.nodeNum
+		&& memcmp(full.NodeArray, indexed.NodeArray, sizeof(float) * full.nodeNum * 9) == 0;
+	std::cout << "same tree for both strides: " << (ok ? "yes" : "NO") << std::endl;
+	ok = compare("indexed decode", indexed.MeshArray, indexed.VertexArray, indexed.MaterialArray) && ok;
+
+	// 缓存往返
+	BVHCacheKey key;
+	key.setBuildParams(indexed, IndexedMeshStride);
+	BVHCache cache;
+	if (SaveBVHCache(indexed, key, cachePath) && cache.open(cachePath, key)) {
+		const BVHCacheHeader &h = *cache.header;
+		bool same = h.nodeNum == indexed.nodeNum && h.meshNum == indexed.meshNum
+			&& h.vertexNum == indexed.vertexNum && h.materialNum == indexed.materialNum
+			&& memcmp(cache.NodeArray, indexed.NodeArray, sizeof(float) * h.nodeNumX * h.nodeNumY) == 0
+			&& memcmp(cache.MeshArray, indexed.MeshArray, sizeof(float) * h.meshNumX * h.meshNumY) == 0
+			&& memcmp(cache.SkipArray, indexed.SkipArray, sizeof(float) * h.skipNumX * h.skipNumY) == 0
+			&& memcmp(cache.VertexArray, indexed.VertexArray, sizeof(float) * h.vertexNumX * h.vertexNumY) == 0
+			&& memcmp(cache.MaterialArray, indexed.MaterialArray, sizeof(float) * h.materialNumX * h.materialNumY) == 0;
+		std::cout << "cache round trip: " << (same ? "identical" : "DIFFERENT") << std::endl;
+		ok = compare("cached decode", cache.MeshArray, cache.VertexArray, cache.MaterialArray) && same && ok;
+		cache.close();
+	}
+	else {
+		std::cout << "cache round trip: cannot write or open " << cachePath << std::endl;
+		ok = false;
+	}
+	std::remove(cachePath.c_str());
+
+	if (objectCount > 0) {
+		int fullObject = full.addObject(objectFirst, objectCount);
+		int indexedObject = indexed.addObject(objectFirst, objectCount);
+		// 物体的三角形引用的顶点不应再被其他三角形引用
+		std::vector<char> inObject(indexed.meshNum, 0), vertexOwner(indexed.vertexNum, 0);
+		for (int i = 0; i < indexed.meshNum; i++)
+			inObject[i] = indexed.primitiveOrder[i] >= objectFirst && indexed.primitiveOrder[i] < objectFirst + objectCount;
+		int shared = 0;
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 0; i < indexed.meshNum; i++) {
+				if (inObject[i] != (pass == 0)) continue;
+				for (int k = 0; k < 3; k++) {
+					int v = (int)indexed.MeshArray[i * IndexedMeshStride + k];
+					if (pass == 0) vertexOwner[v] = 1;
+					else if (vertexOwner[v]) shared++;
+				}
+			}
+		}
+		std::cout << "object vertices shared with other triangles: " << shared << std::endl;
+		glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3(0.05f, 0.1f, -0.02f));
+		full.setObjectTransform(fullObject, transform);
+		indexed.setObjectTransform(indexedObject, transform);
+		ok = compare("indexed decode after moving the object", indexed.MeshArray, indexed.VertexArray, indexed.MaterialArray)
+			&& shared == 0 && ok;
+	}
+	std::cout << "IndexedMeshTest: " << (ok ? "passed" : "FAILED") << std::endl;
+}
+
+#endif
@@ -0,0 +1,462 @@
+#pragma once
+#ifndef __BVHInstance_h__
+#define __BVHInstance_h__
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <tool/Shape.h>
+#include <tool/BVHTree.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// 两级BVH（TLAS/BLAS）
+// 每个模型在物体空间中只构建一次底层BVH（BLAS），实例只保存变换矩阵和可选的覆盖材质；
+// 顶层BVH（TLAS）以实例的世界空间包围盒为基元。相交时在TLAS叶子处把光线变换到物体空间，
+// 再遍历对应的BLAS，因此三角形数据只存一份，显存与实例数量基本无关（小行星带、森林等场景）。
+//
+// GPU数据布局：
+//   NodeArray / MeshArray  所有BLAS依次拼接，格式与BVHTree相同（每节点9个float，每三角形42个float），
+//                          节点的childOffset已换算为拼接后的全局下标
+//   TlasNodeArray          TLAS节点，格式同NodeArray；叶子的nPrimitives为1，childOffset为实例下标
+//   InstanceArray          每个实例INSTANCE_STRIDE个float，见下
+
+// InstanceArray中每个实例的布局
+//   [0..11]   世界空间到物体空间的逆变换矩阵前三行（按行存放，每行4个float）
+//   [12]      BLAS根节点在NodeArray中的下标
+//   [13]      是否使用覆盖材质（0或1）
+//   [14..31]  覆盖材质，顺序与MeshArray中三角形的材质部分相同
+const int INSTANCE_STRIDE = 32;
+
+struct BVHInstance {
+	int blas = 0;                         // 模型（BLAS）编号
+	glm::mat4 transform = glm::mat4(1.0f); // 物体空间到世界空间的变换
+	bool overrideMaterial = false;        // 为true时用material代替三角形自身的材质
+	Material material;
+};
+
+class BVHScene {
+public:
+	std::vector<std::unique_ptr<BVHTree>> blas;
+	std::vector<BVHInstance> instances;
+
+	// BLAS构建参数
+	SplitMethod splitMethod = SplitMethod::SAH;
+	int maxPrimsInNode = 1;
+	int leafPacketWidth = 1;
+
+	// 拼接后的BLAS数据，格式与BVHTree::NodeArray/MeshArray相同
+	int nodeNum = 0;
+	int nodeNumX = 0, nodeNumY = 0;
+	std::vector<float> NodeArray;
+	int skipNumX = 0, skipNumY = 0;
+	std::vector<float> SkipArray;    // 无栈遍历的跳转链接，每个BLAS根节点为-1
+	int meshNum = 0;
+	int meshNumX = 0, meshNumY = 0;
+	std::vector<float> MeshArray;
+	int meshStride = 42;
+	std::vector<int> blasNodeOffset; // 第i个BLAS的根节点在NodeArray中的下标
+	std::vector<int> blasPrimOffset; // 第i个BLAS的第一个三角形在MeshArray中的下标
+	int blasMaxDepth = 0;            // 所有BLAS中最大的深度（见BVHTree::maxDepth）
+
+	// CPU使用的材质表（hitRecord::materialID的下标）：各BLAS的材质依次拼接，之后是每个覆盖材质的实例一项。
+	// GPU不需要，三角形的材质直接存在MeshArray中，覆盖材质存在InstanceArray中
+	std::vector<Material> materials;
+	std::vector<int> triangleMaterial; // 拼接后MeshArray中每个三角形的材质下标
+	std::vector<int> instanceMaterial; // 实例的覆盖材质下标，不覆盖为-1
+	int blasMaterialNum = 0;           // materials中属于BLAS的部分，之后为覆盖材质
+
+	// TLAS
+	int tlasNodeNum = 0;
+	int tlasNodeNumX = 0, tlasNodeNumY = 0;
+	std::vector<float> TlasNodeArray;
+	int tlasDepth = 0; // 中位数划分，深度为ceil(log2(instanceNum))，不会超过着色器的32项栈
+
+	// 实例数据
+	int instanceNum = 0;
+	int instanceNumX = 0, instanceNumY = 0;
+	std::vector<float> InstanceArray;
+
+	// 用物体空间中的三角形构建一个BLAS，返回其编号
+	// SBVH的三角形引用表无法直接拼接，BLAS使用SBVH时退化为SAH
+	int addMesh(TriangleStore prims) {
+		std::unique_ptr<BVHTree> tree(new BVHTree());
+		tree->splitMethod = (splitMethod == SplitMethod::SBVH) ? SplitMethod::SAH : splitMethod;
+		tree->maxPrimsInNode = maxPrimsInNode;
+		tree->leafPacketWidth = leafPacketWidth;
+		tree->BVHBuildTree(std::move(prims), meshStride);
+		blas.push_back(std::move(tree));
+		return (int)blas.size() - 1;
+	}
+
+	int addMesh(const std::vector<std::shared_ptr<Triangle>> &prims) {
+		return addMesh(MakeTriangleStore(prims));
+	}
+
+	int addInstance(int blasIndex, const glm::mat4 &transform) {
+		BVHInstance inst;
+		inst.blas = blasIndex;
+		inst.transform = transform;
+		instances.push_back(inst);
+		return (int)instances.size() - 1;
+	}
+
+	int addInstance(int blasIndex, const glm::mat4 &transform, const Material &material) {
+		int id = addInstance(blasIndex, transform);
+		instances[id].overrideMaterial = true;
+		instances[id].material = material;
+		return id;
+	}
+
+	// 实例的世界空间包围盒：BLAS根节点包围盒的8个角点变换后取并集
+	Bound3f instanceBound(int i) const {
+		const BVHTree &tree = *blas[instances[i].blas];
+		glm::vec3 pMin(tree.NodeArray[0], tree.NodeArray[1], tree.NodeArray[2]);
+		glm::vec3 pMax(tree.NodeArray[3], tree.NodeArray[4], tree.NodeArray[5]);
+		Bound3f bound;
+		for (int c = 0; c < 8; c++) {
+			glm::vec3 p((c & 1) ? pMax.x : pMin.x, (c & 2) ? pMax.y : pMin.y, (c & 4) ? pMax.z : pMin.z);
+			bound = Union(bound, glm::vec3(instances[i].transform * glm::vec4(p, 1.0f)));
+		}
+		return bound;
+	}
+
+	// 拼接BLAS并构建TLAS与实例数组。只修改实例变换时可以只调用buildTLAS
+	void build() {
+		buildBLASArrays();
+		buildTLAS();
+	}
+
+	// 把所有BLAS的节点和三角形拼接为一个数组，子节点与三角形偏移加上各自的基址
+	void buildBLASArrays() {
+		nodeNum = 0;
+		meshNum = 0;
+		blasMaxDepth = 0;
+		blasNodeOffset.resize(blas.size());
+		blasPrimOffset.resize(blas.size());
+		for (size_t b = 0; b < blas.size(); b++) {
+			blasNodeOffset[b] = nodeNum;
+			blasPrimOffset[b] = meshNum;
+			nodeNum += blas[b]->nodeNum;
+			meshNum += blas[b]->meshNum;
+			blasMaxDepth = std::max(blasMaxDepth, blas[b]->maxDepth);
+		}
+
+		nodeNumX = std::max(1, (int)ceilf(sqrtf((float)nodeNum * 9)));
+		nodeNumY = std::max(1, (nodeNum * 9 + nodeNumX - 1) / nodeNumX);
+		NodeArray.assign((size_t)nodeNumX * nodeNumY, 0.0f);
+		skipNumX = std::max(1, (int)ceilf(sqrtf((float)nodeNum)));
+		skipNumY = std::max(1, (nodeNum + skipNumX - 1) / skipNumX);
+		SkipArray.assign((size_t)skipNumX * skipNumY, -1.0f);
+		meshNumX = std::max(1, (int)ceilf(sqrtf((float)meshNum * meshStride)));
+		meshNumY = std::max(1, (meshNum * meshStride + meshNumX - 1) / meshNumX);
+		MeshArray.assign((size_t)meshNumX * meshNumY, 0.0f);
+
+		for (size_t b = 0; b < blas.size(); b++) {
+			const BVHTree &tree = *blas[b];
+			float *nodes = &NodeArray[(size_t)blasNodeOffset[b] * 9];
+			std::copy(tree.NodeArray, tree.NodeArray + tree.nodeNum * 9, nodes);
+			for (int n = 0; n < tree.nodeNum; n++) {
+				float *node = &nodes[n * 9];
+				node[8] += (node[6] > 0) ? blasPrimOffset[b] : blasNodeOffset[b];
+				float skip = tree.SkipArray[n];
+				SkipArray[blasNodeOffset[b] + n] = (skip < 0.0f) ? -1.0f : skip + blasNodeOffset[b];
+			}
+			std::copy(tree.MeshArray, tree.MeshArray + tree.meshNum * meshStride,
+					  &MeshArray[(size_t)blasPrimOffset[b] * meshStride]);
+		}
+
+		materials.clear();
+		triangleMaterial.resize(meshNum);
+		for (size_t b = 0; b < blas.size(); b++) {
+			const TriangleStore &prims = blas[b]->primitives;
+			int materialOffset = (int)materials.size();
+			materials.insert(materials.end(), prims.materials.begin(), prims.materials.end());
+			for (int i = 0; i < blas[b]->meshNum; i++)
+				triangleMaterial[blasPrimOffset[b] + i] = materialOffset + prims.materialIndex[i];
+		}
+		blasMaterialNum = (int)materials.size();
+		std::cout << "BLAS: " << blas.size() << " meshes, " << nodeNum << " nodes, "
+				  << meshNum << " triangles, max depth " << blasMaxDepth << std::endl;
+	}
+
+	// 按实例包围盒的中心点在最长轴上做中点划分构建TLAS，并生成实例数组
+	void buildTLAS() {
+		instanceNum = (int)instances.size();
+		std::vector<Bound3f> bounds(instanceNum);
+		std::vector<int> order(instanceNum);
+		for (int i = 0; i < instanceNum; i++) {
+			bounds[i] = instanceBound(i);
+			order[i] = i;
+		}
+
+		tlasNodeNum = 0;
+		int maxNodes = std::max(1, 2 * instanceNum - 1);
+		tlasNodeNumX = (int)ceilf(sqrtf((float)maxNodes * 9));
+		tlasNodeNumY = (maxNodes * 9 + tlasNodeNumX - 1) / tlasNodeNumX;
+		TlasNodeArray.assign((size_t)tlasNodeNumX * tlasNodeNumY, 0.0f);
+		if (instanceNum > 0) buildTLASNode(order, bounds, 0, instanceNum);
+		tlasDepth = BVHMaxDepth(TlasNodeArray.data(), tlasNodeNum);
+
+		instanceNumX = std::max(1, (int)ceilf(sqrtf((float)instanceNum * INSTANCE_STRIDE)));
+		instanceNumY = std::max(1, (instanceNum * INSTANCE_STRIDE + instanceNumX - 1) / instanceNumX);
+		InstanceArray.assign((size_t)instanceNumX * instanceNumY, 0.0f);
+		materials.resize(blasMaterialNum);
+		instanceMaterial.assign(instanceNum, -1);
+		for (int i = 0; i < instanceNum; i++) {
+			const BVHInstance &inst = instances[i];
+			float *dst = &InstanceArray[(size_t)i * INSTANCE_STRIDE];
+			glm::mat4 inv = glm::inverse(inst.transform);
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 4; c++)
+					dst[r * 4 + c] = inv[c][r];
+			dst[12] = (float)blasNodeOffset[inst.blas];
+			dst[13] = inst.overrideMaterial ? 1.0f : 0.0f;
+			packMaterial(inst.material, dst + 14);
+			if (inst.overrideMaterial) {
+				instanceMaterial[i] = (int)materials.size();
+				materials.push_back(inst.material);
+			}
+		}
+		std::cout << "TLAS: " << instanceNum << " instances, " << tlasNodeNum << " nodes, depth " << tlasDepth << std::endl;
+	}
+
+private:
+	// 深度优先写入TLAS节点，第一个子节点紧跟父节点，返回节点下标
+	int buildTLASNode(std::vector<int> &order, const std::vector<Bound3f> &bounds, int start, int end) {
+		int index = tlasNodeNum++;
+		float *node = &TlasNodeArray[(size_t)index * 9];
+		Bound3f bound, centroidBound;
+		for (int i = start; i < end; i++) {
+			bound = Union(bound, bounds[order[i]]);
+			centroidBound = Union(centroidBound, 0.5f * (bounds[order[i]].pMin + bounds[order[i]].pMax));
+		}
+		for (int a = 0; a < 3; a++) {
+			node[a] = bound.pMin[a];
+			node[3 + a] = bound.pMax[a];
+		}
+
+		if (end - start == 1) {
+			node[6] = 1.0f;
+			node[7] = 0.0f;
+			node[8] = (float)order[start];
+			return index;
+		}
+
+		int dim = centroidBound.MaximumExtent();
+		int mid = (start + end) / 2;
+		std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+			return bounds[a].pMin[dim] + bounds[a].pMax[dim] < bounds[b].pMin[dim] + bounds[b].pMax[dim];
+		});
+		buildTLASNode(order, bounds, start, mid);
+		int second = buildTLASNode(order, bounds, mid, end);
+		node = &TlasNodeArray[(size_t)index * 9];
+		node[6] = 0.0f;
+		node[7] = (float)dim;
+		node[8] = (float)second;
+		return index;
+	}
+};
+
+// 光线与包围盒的进入距离，不相交或进入距离超过tMax时返回-1
+float hitNodeBound(const float *node, const Ray &ray, const glm::vec3 &invDir, float tMax) {
+	float t0 = 0.0f, t1 = tMax;
+	for (int a = 0; a < 3; a++) {
+		float tNear = (node[a] - ray.origin[a]) * invDir[a];
+		float tFar = (node[3 + a] - ray.origin[a]) * invDir[a];
+		if (tNear > tFar) std::swap(tNear, tFar);
+		t0 = std::max(t0, tNear);
+		t1 = std::min(t1, tFar);
+	}
+	return (t0 <= t1) ? t0 : -1.0f;
+}
+
+// 在物体空间中遍历从root开始的BLAS，返回最近命中的三角形下标（未命中返回-1），并更新tMax与重心坐标uv
+int IntersectBLAS(const BVHScene &scene, int root, const Ray &ray, float &tMax, glm::vec2 &uv, BVHTraversalStats *stats = nullptr) {
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	WatertightRay wray = prepareWatertightRay(ray);
+	TraversalStack<int> nodesToVisit;
+	int current = root;
+	int hitIndex = -1;
+	while (true) {
+		if (stats) stats->nodesVisited++;
+		const float *node = &scene.NodeArray[(size_t)current * 9];
+		if (hitNodeBound(node, ray, invDir, tMax) >= 0.0f) {
+			int nPrimitives = (int)node[6];
+			if (nPrimitives > 0) {
+				for (int i = 0; i < nPrimitives; i++) {
+					int index = (int)node[8] + i;
+					const float *m = &scene.MeshArray[(size_t)index * scene.meshStride];
+					TriangleHit h = hitTriangleWatertight(glm::vec3(m[0], m[1], m[2]), glm::vec3(m[3], m[4], m[5]),
+						glm::vec3(m[6], m[7], m[8]), wray, tMax);
+					if (stats) stats->primitivesTested++;
+					if (h.hit) {
+						tMax = h.t;
+						hitIndex = index;
+						uv = glm::vec2(h.u, h.v);
+					}
+				}
+			}
+			else {
+				// 先访问光线方向上较近的子节点
+				bool dirIsNeg = invDir[(int)node[7]] < 0;
+				int first = current + 1, second = (int)node[8];
+				nodesToVisit.push(dirIsNeg ? first : second);
+				current = dirIsNeg ? second : first;
+				continue;
+			}
+		}
+		if (nodesToVisit.empty()) break;
+		current = nodesToVisit.pop();
+	}
+	return hitIndex;
+}
+
+// BLAS的遮挡查询，(0, tMax)内命中任意三角形即返回true
+bool OccludedBLAS(const BVHScene &scene, int root, const Ray &ray, float tMax, BVHTraversalStats *stats = nullptr) {
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	WatertightRay wray = prepareWatertightRay(ray);
+	TraversalStack<int> nodesToVisit;
+	int current = root;
+	while (true) {
+		if (stats) stats->nodesVisited++;
+		const float *node = &scene.NodeArray[(size_t)current * 9];
+		if (hitNodeBound(node, ray, invDir, tMax) >= 0.0f) {
+			int nPrimitives = (int)node[6];
+			if (nPrimitives == 0) {
+				nodesToVisit.push((int)node[8]);
+				current = current + 1;
+				continue;
+			}
+			for (int i = 0; i < nPrimitives; i++) {
+				const float *m = &scene.MeshArray[(size_t)((int)node[8] + i) * scene.meshStride];
+				if (stats) stats->primitivesTested++;
+				if (hitTriangleWatertight(glm::vec3(m[0], m[1], m[2]), glm::vec3(m[3], m[4], m[5]),
+					glm::vec3(m[6], m[7], m[8]), wray, tMax).hit) return true;
+			}
+		}
+		if (nodesToVisit.empty()) break;
+		current = nodesToVisit.pop();
+	}
+	return false;
+}
+
+// 两级BVH的遮挡查询，与着色器中的OccludedTLAS逻辑一致
+bool OccludedScene(const BVHScene &scene, const Ray &ray, float tMax, BVHTraversalStats *stats = nullptr) {
+	if (scene.instanceNum == 0) return false;
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	TraversalStack<int> nodesToVisit;
+	int current = 0;
+	if (stats) stats->rays++;
+	while (true) {
+		if (stats) stats->nodesVisited++;
+		const float *node = &scene.TlasNodeArray[(size_t)current * 9];
+		if (hitNodeBound(node, ray, invDir, tMax) >= 0.0f) {
+			if (node[6] == 0) {
+				nodesToVisit.push((int)node[8]);
+				current = current + 1;
+				continue;
+			}
+			const float *m = &scene.InstanceArray[(size_t)node[8] * INSTANCE_STRIDE];
+			Ray objRay;
+			for (int r = 0; r < 3; r++) {
+				glm::vec3 row(m[r * 4 + 0], m[r * 4 + 1], m[r * 4 + 2]);
+				objRay.origin[r] = glm::dot(row, ray.origin) + m[r * 4 + 3];
+				objRay.direction[r] = glm::dot(row, ray.direction);
+			}
+			if (OccludedBLAS(scene, (int)m[12], objRay, tMax, stats)) return true;
+		}
+		if (nodesToVisit.empty()) break;
+		current = nodesToVisit.pop();
+	}
+	return false;
+}
+
+// 两级BVH的最近交点查询，与着色器中的IntersectTLAS逻辑一致
+// 光线变换到物体空间时不归一化方向，两个空间中的t相同，可以共用同一个tMax
+bool IntersectScene(const BVHScene &scene, const Ray &ray, hitRecord &rec,
+					int *hitInstance = nullptr, int *hitPrimitive = nullptr, BVHTraversalStats *stats = nullptr) {
+	if (scene.instanceNum == 0) return false;
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	float tMax = std::numeric_limits<float>::max();
+	int instanceIndex = -1, triangleIndex = -1;
+	glm::vec2 hitUV(0.0f);
+	TraversalStack<int> nodesToVisit;
+	int current = 0;
+	if (stats) stats->rays++;
+	while (true) {
+		if (stats) stats->nodesVisited++;
+		const float *node = &scene.TlasNodeArray[(size_t)current * 9];
+		if (hitNodeBound(node, ray, invDir, tMax) >= 0.0f) {
+			if (node[6] > 0) {
+				int inst = (int)node[8];
+				const float *m = &scene.InstanceArray[(size_t)inst * INSTANCE_STRIDE];
+				Ray objRay;
+				for (int r = 0; r < 3; r++) {
+					glm::vec3 row(m[r * 4 + 0], m[r * 4 + 1], m[r * 4 + 2]);
+					objRay.origin[r] = glm::dot(row, ray.origin) + m[r * 4 + 3];
+					objRay.direction[r] = glm::dot(row, ray.direction);
+				}
+				int index = IntersectBLAS(scene, (int)m[12], objRay, tMax, hitUV, stats);
+				if (index >= 0) {
+					instanceIndex = inst;
+					triangleIndex = index;
+				}
+			}
+			else {
+				bool dirIsNeg = invDir[(int)node[7]] < 0;
+				int first = current + 1, second = (int)node[8];
+				nodesToVisit.push(dirIsNeg ? first : second);
+				current = dirIsNeg ? second : first;
+				continue;
+			}
+		}
+		if (nodesToVisit.empty()) break;
+		current = nodesToVisit.pop();
+	}
+
+	if (instanceIndex < 0) return false;
+	// 法线变换到世界空间：逆变换矩阵的转置
+	const float *m = &scene.InstanceArray[(size_t)instanceIndex * INSTANCE_STRIDE];
+	const float *v = &scene.MeshArray[(size_t)triangleIndex * scene.meshStride];
+	glm::vec3 n = glm::cross(glm::vec3(v[3], v[4], v[5]) - glm::vec3(v[0], v[1], v[2]),
+							 glm::vec3(v[6], v[7], v[8]) - glm::vec3(v[0], v[1], v[2]));
+	glm::vec3 worldNormal(0.0f);
+	for (int r = 0; r < 3; r++)
+		worldNormal += n[r] * glm::vec3(m[r * 4 + 0], m[r * 4 + 1], m[r * 4 + 2]);
+	rec.Pos = ray.origin + tMax * ray.direction;
+	rec.Normal = glm::normalize(worldNormal);
+	rec.t = tMax;
+	rec.uv = hitUV;
+	rec.primIndex = triangleIndex;
+	// materialID为scene.materials中的下标：实例的覆盖材质优先，否则为三角形自身的材质
+	rec.materialID = (scene.instanceMaterial[instanceIndex] >= 0) ? scene.instanceMaterial[instanceIndex]
+																   : scene.triangleMaterial[triangleIndex];
+	if (hitInstance) *hitInstance = instanceIndex;
+	if (hitPrimitive) *hitPrimitive = triangleIndex;
+	return true;
+}
+
+// 两级BVH的遮挡查询测试：相机光线的OccludedScene结果与IntersectScene一致，
+// 命中的光线tMax为最近交点距离的0.99倍时没有遮挡，1.01倍时有遮挡
+void BVHSceneOcclusionTest(const BVHScene &scene, const Camera &camera, int width = 120, int height = 80) {
+	int hits = 0, mismatches = 0, tMaxErrors = 0;
+	for (const Ray &cameraRay : CameraTestRays(camera, width, height)) {
+		hitRecord rec;
+		bool hit = IntersectScene(scene, cameraRay, rec);
+		if (OccludedScene(scene, cameraRay, std::numeric_limits<float>::max()) != hit) mismatches++;
+		if (!hit) continue;
+		hits++;
+		if (OccludedScene(scene, cameraRay, rec.t * 0.99f)) tMaxErrors++;
+		if (!OccludedScene(scene, cameraRay, rec.t * 1.01f)) tMaxErrors++;
+	}
+	std::cout << "Scene occlusion: " << hits << " / " << width * height << " rays hit, hit mismatches = " << mismatches
+			  << ", tMax errors = " << tMaxErrors << std::endl;
+}
+
+#endif
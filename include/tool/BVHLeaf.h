@@ -0,0 +1,324 @@
+#pragma once
+#ifndef __BVHLEAF_H__
+#define __BVHLEAF_H__
+
+#include <glm/glm.hpp>
+
+#include <tool/BVHTree.h>
+#include <tool/BVHWide.h> // BVH_WIDE_SSE与immintrin.h
+#include <tool/Camera.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+// 多三角形叶子的SoA存储与批量求交（CPU）
+// 叶子中的三角形在MeshArray中本来就是连续的，这里再按N个一组打包为TrianglePacket：
+// 三个顶点按分量分开存放，一次SIMD运算即可与N个三角形做水密求交（与hitTriangleWatertight逐位一致）。
+// 光线的坐标轴重排只与光线有关，按kx/ky/kz直接选取对应分量的数组即可。
+// 不足N个的槽位填充退化三角形（三个顶点重合，边函数全为0，永远不命中）
+
+template <int N>
+struct TrianglePacket {
+	float v0[3][N];
+	float v1[3][N];
+	float v2[3][N];
+	int index[N];   // 三角形在MeshArray中的下标，填充槽位为-1
+	int count;      // 有效三角形数量
+};
+
+// 标量版本，与SIMD版本结果一致，用于没有SSE的平台和对比测试
+template <int N>
+int IntersectTrianglePacketScalar(const TrianglePacket<N> &p, const WatertightRay &w, float tMax, float *tHit)
+{
+	int best = -1;
+	for (int i = 0; i < p.count; i++) {
+		TriangleHit h = hitTriangleWatertight(glm::vec3(p.v0[0][i], p.v0[1][i], p.v0[2][i]),
+											  glm::vec3(p.v1[0][i], p.v1[1][i], p.v1[2][i]),
+											  glm::vec3(p.v2[0][i], p.v2[1][i], p.v2[2][i]), w, tMax);
+		if (h.hit) {
+			tMax = h.t;
+			best = i;
+		}
+	}
+	*tHit = tMax;
+	return best;
+}
+
+// 光线与packet中的N个三角形求交，返回距离最近且小于tMax的槽位（未命中返回-1），tHit输出该距离。
+// 边函数恰好为0的槽位（光线正好穿过边或顶点）交给hitTriangleWatertight用double重新计算
+template <int N>
+int IntersectTrianglePacket(const TrianglePacket<N> &p, const WatertightRay &w, float tMax, float *tHit)
+{
+#ifdef BVH_WIDE_SSE
+	float t[N];
+	int mask = 0, exact = 0;
+	const float ox = w.origin[w.kx], oy = w.origin[w.ky], oz = w.origin[w.kz];
+#if defined(__AVX__)
+	if (N % 8 == 0) {
+		__m256 Sx = _mm256_set1_ps(w.Sx), Sy = _mm256_set1_ps(w.Sy), Sz = _mm256_set1_ps(w.Sz);
+		__m256 zero = _mm256_setzero_ps(), signBit = _mm256_set1_ps(-0.0f);
+		for (int g = 0; g < N; g += 8) {
+			// 相对起点的顶点坐标，剪切后的xy
+			__m256 Az = _mm256_sub_ps(_mm256_loadu_ps(&p.v0[w.kz][g]), _mm256_set1_ps(oz));
+			__m256 Bz = _mm256_sub_ps(_mm256_loadu_ps(&p.v1[w.kz][g]), _mm256_set1_ps(oz));
+			__m256 Cz = _mm256_sub_ps(_mm256_loadu_ps(&p.v2[w.kz][g]), _mm256_set1_ps(oz));
+			__m256 Ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(&p.v0[w.kx][g]), _mm256_set1_ps(ox)), _mm256_mul_ps(Sx, Az));
+			__m256 Ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(&p.v0[w.ky][g]), _mm256_set1_ps(oy)), _mm256_mul_ps(Sy, Az));
+			__m256 Bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(&p.v1[w.kx][g]), _mm256_set1_ps(ox)), _mm256_mul_ps(Sx, Bz));
+			__m256 By = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(&p.v1[w.ky][g]), _mm256_set1_ps(oy)), _mm256_mul_ps(Sy, Bz));
+			__m256 Cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(&p.v2[w.kx][g]), _mm256_set1_ps(ox)), _mm256_mul_ps(Sx, Cz));
+			__m256 Cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(&p.v2[w.ky][g]), _mm256_set1_ps(oy)), _mm256_mul_ps(Sy, Cz));
+			// 边函数
+			__m256 U = _mm256_sub_ps(_mm256_mul_ps(Cx, By), _mm256_mul_ps(Cy, Bx));
+			__m256 V = _mm256_sub_ps(_mm256_mul_ps(Ax, Cy), _mm256_mul_ps(Ay, Cx));
+			__m256 W = _mm256_sub_ps(_mm256_mul_ps(Bx, Ay), _mm256_mul_ps(By, Ax));
+			__m256 anyZero = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_EQ_OQ), _mm256_cmp_ps(V, zero, _CMP_EQ_OQ)),
+										  _mm256_cmp_ps(W, zero, _CMP_EQ_OQ));
+			__m256 anyNeg = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_LT_OQ), _mm256_cmp_ps(V, zero, _CMP_LT_OQ)),
+										 _mm256_cmp_ps(W, zero, _CMP_LT_OQ));
+			__m256 anyPos = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_GT_OQ), _mm256_cmp_ps(V, zero, _CMP_GT_OQ)),
+										 _mm256_cmp_ps(W, zero, _CMP_GT_OQ));
+			__m256 det = _mm256_add_ps(_mm256_add_ps(U, V), W);
+			__m256 T = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(U, _mm256_mul_ps(Sz, Az)), _mm256_mul_ps(V, _mm256_mul_ps(Sz, Bz))),
+									 _mm256_mul_ps(W, _mm256_mul_ps(Sz, Cz)));
+			// 乘以det的符号即翻转符号位
+			__m256 sign = _mm256_and_ps(det, signBit);
+			__m256 Ts = _mm256_xor_ps(T, sign);
+			__m256 ok = _mm256_andnot_ps(_mm256_and_ps(anyNeg, anyPos), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+			ok = _mm256_and_ps(ok, _mm256_cmp_ps(Ts, zero, _CMP_GT_OQ));
+			ok = _mm256_and_ps(ok, _mm256_cmp_ps(Ts, _mm256_xor_ps(_mm256_mul_ps(_mm256_set1_ps(tMax), det), sign), _CMP_LT_OQ));
+			_mm256_storeu_ps(&t[g], _mm256_mul_ps(T, _mm256_div_ps(_mm256_set1_ps(1.0f), det)));
+			mask |= _mm256_movemask_ps(ok) << g;
+			exact |= _mm256_movemask_ps(anyZero) << g;
+		}
+	}
+	else
+#endif
+	{
+		__m128 Sx = _mm_set1_ps(w.Sx), Sy = _mm_set1_ps(w.Sy), Sz = _mm_set1_ps(w.Sz);
+		__m128 zero = _mm_setzero_ps(), signBit = _mm_set1_ps(-0.0f);
+		for (int g = 0; g < N; g += 4) {
+			// 相对起点的顶点坐标，剪切后的xy
+			__m128 Az = _mm_sub_ps(_mm_loadu_ps(&p.v0[w.kz][g]), _mm_set1_ps(oz));
+			__m128 Bz = _mm_sub_ps(_mm_loadu_ps(&p.v1[w.kz][g]), _mm_set1_ps(oz));
+			__m128 Cz = _mm_sub_ps(_mm_loadu_ps(&p.v2[w.kz][g]), _mm_set1_ps(oz));
+			__m128 Ax = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v0[w.kx][g]), _mm_set1_ps(ox)), _mm_mul_ps(Sx, Az));
+			__m128 Ay = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v0[w.ky][g]), _mm_set1_ps(oy)), _mm_mul_ps(Sy, Az));
+			__m128 Bx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v1[w.kx][g]), _mm_set1_ps(ox)), _mm_mul_ps(Sx, Bz));
+			__m128 By = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v1[w.ky][g]), _mm_set1_ps(oy)), _mm_mul_ps(Sy, Bz));
+			__m128 Cx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v2[w.kx][g]), _mm_set1_ps(ox)), _mm_mul_ps(Sx, Cz));
+			__m128 Cy = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v2[w.ky][g]), _mm_set1_ps(oy)), _mm_mul_ps(Sy, Cz));
+			// 边函数
+			__m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx));
+			__m128 V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx));
+			__m128 W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
+			__m128 anyZero = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)), _mm_cmpeq_ps(W, zero));
+			__m128 anyNeg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+			__m128 anyPos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+			__m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+			__m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(Sz, Az)), _mm_mul_ps(V, _mm_mul_ps(Sz, Bz))),
+								  _mm_mul_ps(W, _mm_mul_ps(Sz, Cz)));
+			// 乘以det的符号即翻转符号位
+			__m128 sign = _mm_and_ps(det, signBit);
+			__m128 Ts = _mm_xor_ps(T, sign);
+			__m128 ok = _mm_andnot_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpneq_ps(det, zero));
+			ok = _mm_and_ps(ok, _mm_cmpgt_ps(Ts, zero));
+			ok = _mm_and_ps(ok, _mm_cmplt_ps(Ts, _mm_xor_ps(_mm_mul_ps(_mm_set1_ps(tMax), det), sign)));
+			_mm_storeu_ps(&t[g], _mm_mul_ps(T, _mm_div_ps(_mm_set1_ps(1.0f), det)));
+			mask |= _mm_movemask_ps(ok) << g;
+			exact |= _mm_movemask_ps(anyZero) << g;
+		}
+	}
+	// 填充槽位的边函数全为0、行列式为0，既不命中也不需要重新计算
+	exact &= (1 << p.count) - 1;
+	mask &= ~exact;
+	for (int m = exact; m; m &= m - 1) {
+		int i = 0;
+		while (!(m & (1 << i))) i++;
+		TriangleHit h = hitTriangleWatertight(glm::vec3(p.v0[0][i], p.v0[1][i], p.v0[2][i]),
+											  glm::vec3(p.v1[0][i], p.v1[1][i], p.v1[2][i]),
+											  glm::vec3(p.v2[0][i], p.v2[1][i], p.v2[2][i]), w, tMax);
+		if (h.hit) {
+			t[i] = h.t;
+			mask |= 1 << i;
+		}
+	}
+	// 在命中的槽位中取最近的一个
+	int best = -1;
+	while (mask) {
+		int i = 0;
+		while (!(mask & (1 << i))) i++;
+		mask &= mask - 1;
+		if (t[i] < tMax) {
+			tMax = t[i];
+			best = i;
+		}
+	}
+	*tHit = tMax;
+	return best;
+#else
+	return IntersectTrianglePacketScalar(p, w, tMax, tHit);
+#endif
+}
+
+// 二叉BVH叶子的packet索引：叶子节点i的三角形位于packets[first[i]]开始的count[i]个packet中
+template <int N>
+class BVHLeafPackets {
+public:
+	std::vector<TrianglePacket<N>> packets;
+	std::vector<int> first; // 按NodeArray中的节点下标索引，内部节点为-1
+	std::vector<int> count;
+
+	// 由已构建好的BVH生成（需在bvhTree.releaseAll()之前调用）
+	void Build(const BVHTree &bvhTree) {
+		packets.clear();
+		first.assign(bvhTree.nodeNum, -1);
+		count.assign(bvhTree.nodeNum, 0);
+		for (int n = 0; n < bvhTree.nodeNum; n++) {
+			const float *node = &bvhTree.NodeArray[n * 9];
+			int nPrimitives = (int)node[6];
+			if (nPrimitives == 0) continue;
+			first[n] = (int)packets.size();
+			count[n] = (nPrimitives + N - 1) / N;
+			for (int i = 0; i < nPrimitives; i += N) {
+				TrianglePacket<N> p;
+				p.count = std::min(N, nPrimitives - i);
+				for (int k = 0; k < N; k++) {
+					if (k < p.count) {
+						int index = bvhTree.primitiveIndex((int)node[8] + i + k);
+						const float *m = bvhTree.primitives.vertexData(index);
+						for (int a = 0; a < 3; a++) {
+							p.v0[a][k] = m[a];
+							p.v1[a][k] = m[3 + a];
+							p.v2[a][k] = m[6 + a];
+						}
+						p.index[k] = index;
+					}
+					else {
+						for (int a = 0; a < 3; a++) p.v0[a][k] = p.v1[a][k] = p.v2[a][k] = 0.0f;
+						p.index[k] = -1;
+					}
+				}
+				packets.push_back(p);
+			}
+		}
+	}
+
+	// 最近交点查询：先访问较近的子节点，入栈时记录进入距离，已找到更近交点时跳过。
+	// simd为false时叶子使用标量求交，用于比较
+	bool Intersect(const BVHTree &bvhTree, const Ray &ray, float *tHit, int *primIndex,
+				   BVHTraversalStats *stats = nullptr, bool simd = true) const
+	{
+		if (bvhTree.nodeNum == 0) return false;
+		glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+		WatertightRay wray = prepareWatertightRay(ray);
+		float tMax = std::numeric_limits<float>::max();
+		int hitIndex = -1;
+
+		auto hitBox = [&](int n) {
+			const float *node = &bvhTree.NodeArray[n * 9];
+			float t0 = 0.0f, t1 = tMax;
+			for (int a = 0; a < 3; a++) {
+				float tNear = (node[a] - ray.origin[a]) * invDir[a];
+				float tFar = (node[3 + a] - ray.origin[a]) * invDir[a];
+				if (tNear > tFar) std::swap(tNear, tFar);
+				t0 = std::max(t0, tNear);
+				t1 = std::min(t1, tFar);
+			}
+			return (t0 <= t1) ? t0 : -1.0f;
+		};
+
+		struct StackEntry { int node; float tNear; };
+		TraversalStack<StackEntry> stack;
+		int current = 0;
+		if (stats) stats->rays++;
+		if (hitBox(0) < 0.0f) return false;
+
+		while (true) {
+			if (stats) stats->nodesVisited++;
+			const float *node = &bvhTree.NodeArray[current * 9];
+			if (node[6] > 0) {
+				for (int k = first[current]; k < first[current] + count[current]; k++) {
+					const TrianglePacket<N> &p = packets[k];
+					float t;
+					int lane = simd ? IntersectTrianglePacket(p, wray, tMax, &t)
+									: IntersectTrianglePacketScalar(p, wray, tMax, &t);
+					if (stats) stats->primitivesTested += p.count;
+					if (lane >= 0) {
+						tMax = t;
+						hitIndex = p.index[lane];
+					}
+				}
+			}
+			else {
+				int child[2] = { current + 1, (int)node[8] };
+				float tNear[2] = { hitBox(child[0]), hitBox(child[1]) };
+				bool visit0 = tNear[0] >= 0.0f, visit1 = tNear[1] >= 0.0f;
+				if (visit0 && visit1) {
+					int nearChild = (tNear[1] < tNear[0]) ? 1 : 0;
+					stack.push({ child[1 - nearChild], tNear[1 - nearChild] });
+					current = child[nearChild];
+					continue;
+				}
+				if (visit0 || visit1) {
+					current = child[visit0 ? 0 : 1];
+					continue;
+				}
+			}
+			// 出栈，跳过比当前交点更远的节点
+			while (!stack.empty() && stack.top().tNear > tMax) stack.pop();
+			if (stack.empty()) break;
+			current = stack.pop().node;
+		}
+
+		if (hitIndex < 0) return false;
+		*tHit = tMax;
+		*primIndex = hitIndex;
+		return true;
+	}
+};
+
+// 叶子大小测试：对不同的maxPrimsInNode分别构建BVH，比较SAH代价、节点数与标量/SIMD叶子求交的速度
+void BVHLeafSizeTest(const TriangleStore &prims, const Camera &camera,
+					 SplitMethod method = SplitMethod::SAH, int width = 400, int height = 300)
+{
+	std::vector<Ray> rays = CameraTestRays(camera, width, height);
+
+	const int leafSizes[] = { 1, 2, 4, 8 };
+	for (int leafSize : leafSizes) {
+		BVHTree tree;
+		tree.splitMethod = method;
+		tree.maxPrimsInNode = leafSize;
+		tree.leafPacketWidth = std::min(leafSize, 4); // 与SSE及着色器vec4的批量宽度一致
+		tree.BVHBuildTree(prims, 42);
+		BVHLeafPackets<4> packets4;
+		BVHLeafPackets<8> packets8;
+		packets4.Build(tree);
+		packets8.Build(tree);
+
+		auto trace = [&](const char *name, auto &&intersect) {
+			BVHTraversalStats stats;
+			int hits = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (const Ray &r : rays) {
+				float t;
+				int prim;
+				hits += intersect(r, &t, &prim, &stats) ? 1 : 0;
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "  " << name << ": " << rays.size() / seconds / 1e6 << " Mrays/s, hits = " << hits
+					  << ", nodes/ray = " << (double)stats.nodesVisited / stats.rays
+					  << ", triangles/ray = " << (double)stats.primitivesTested / stats.rays << std::endl;
+		};
+		std::cout << "maxPrimsInNode = " << leafSize << ": nodes = " << tree.nodeNum
+				  << ", SAH cost = " << tree.computeSAHCost() << ", build time = " << tree.buildTime * 1000.0 << " ms" << std::endl;
+		trace("scalar  ", [&](const Ray &r, float *t, int *p, BVHTraversalStats *s) { return packets4.Intersect(tree, r, t, p, s, false); });
+		trace("packet4 ", [&](const Ray &r, float *t, int *p, BVHTraversalStats *s) { return packets4.Intersect(tree, r, t, p, s, true); });
+		trace("packet8 ", [&](const Ray &r, float *t, int *p, BVHTraversalStats *s) { return packets8.Intersect(tree, r, t, p, s, true); });
+	}
+}
+
+#endif
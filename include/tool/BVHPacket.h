@@ -0,0 +1,560 @@
+#pragma once
+#ifndef __BVHPACKET_H__
+#define __BVHPACKET_H__
+
+#include <glm/glm.hpp>
+
+#include <tool/BVHTree.h>
+#include <tool/BVHWide.h> // BVH_WIDE_SSE与immintrin.h
+#include <tool/BVHLeaf.h>
+#include <tool/Camera.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+
+// 光线包（ray packet）遍历：N条相干光线（相机主光线、烘焙光线）同时遍历二叉BVH（NodeArray），
+// 每个节点用SIMD一次测试全部光线。光线方向符号一致时先用包围光线包的区间（frustum）做一次测试，
+// 整个光线包都未命中时直接剔除子树。活跃光线数不超过fallbackRays时光线包已经发散，
+// 剩余光线各自单独遍历该子树。N为4的倍数（4、8、16），SSE每次处理4条光线
+
+template <int N>
+struct RayPacket {
+	float ox[N], oy[N], oz[N]; // 起点
+	float dx[N], dy[N], dz[N]; // 方向
+	float ix[N], iy[N], iz[N]; // 方向的倒数
+	float tMax[N];             // 当前最近交点距离，填充槽位为-1，不会命中任何包围盒
+	int primIndex[N];          // 命中的三角形在MeshArray中的下标，未命中为-1
+	int count = 0;             // 有效光线数量
+
+	// 水密求交的逐光线预计算（见WatertightRay）。sharedAxes的第g位表示第4g到4g+3条光线的坐标轴重排相同，
+	// 这时三角形顶点的分量对4条光线相同，可以用SIMD求交（相干光线几乎总是如此）
+	int kx[N], ky[N], kz[N];
+	float sx[N], sy[N], sz[N];
+	int sharedAxes = 0;
+
+	// 区间（frustum）测试所需的起点与方向倒数范围，方向符号不一致时不做区间测试
+	glm::vec3 oMin, oMax, iMin, iMax;
+	bool coherent = false;
+
+	void set(int i, const Ray &r) {
+		ox[i] = r.origin.x; oy[i] = r.origin.y; oz[i] = r.origin.z;
+		dx[i] = r.direction.x; dy[i] = r.direction.y; dz[i] = r.direction.z;
+		ix[i] = 1 / r.direction.x; iy[i] = 1 / r.direction.y; iz[i] = 1 / r.direction.z;
+		tMax[i] = std::numeric_limits<float>::max();
+		primIndex[i] = -1;
+		WatertightRay w = prepareWatertightRay(r);
+		kx[i] = w.kx; ky[i] = w.ky; kz[i] = w.kz;
+		sx[i] = w.Sx; sy[i] = w.Sy; sz[i] = w.Sz;
+	}
+
+	WatertightRay watertight(int i) const {
+		WatertightRay w;
+		w.origin = glm::vec3(ox[i], oy[i], oz[i]);
+		w.kx = kx[i]; w.ky = ky[i]; w.kz = kz[i];
+		w.Sx = sx[i]; w.Sy = sy[i]; w.Sz = sz[i];
+		return w;
+	}
+
+	// 由rays[first, first + n)生成光线包，n不超过N
+	void load(const Ray *rays, int n) {
+		count = n;
+		for (int i = 0; i < N; i++) {
+			set(i, rays[std::min(i, n - 1)]);
+			if (i >= n) tMax[i] = -1.0f;
+		}
+		oMin = oMax = glm::vec3(ox[0], oy[0], oz[0]);
+		iMin = iMax = glm::vec3(ix[0], iy[0], iz[0]);
+		coherent = true;
+		for (int i = 1; i < n; i++) {
+			glm::vec3 o(ox[i], oy[i], oz[i]), inv(ix[i], iy[i], iz[i]);
+			oMin = glm::min(oMin, o); oMax = glm::max(oMax, o);
+			iMin = glm::min(iMin, inv); iMax = glm::max(iMax, inv);
+		}
+		for (int a = 0; a < 3; a++)
+			if (!(iMin[a] > 0.0f || iMax[a] < 0.0f)) coherent = false;
+		sharedAxes = 0;
+		for (int g = 0; g < N; g += 4) {
+			bool shared = true;
+			for (int k = 1; k < 4; k++)
+				shared = shared && kx[g + k] == kx[g] && ky[g + k] == ky[g] && kz[g + k] == kz[g];
+			if (shared) sharedAxes |= 1 << (g / 4);
+		}
+	}
+};
+
+// 光线包遍历统计：nodesVisited按光线包计数，fallbackRays为发散后单独遍历的次数
+struct BVHPacketStats {
+	long long packets = 0;
+	long long rays = 0;
+	long long nodesVisited = 0;
+	long long frustumCulls = 0;
+	long long fallbackRays = 0;
+};
+
+// 单条光线（光线包的第lane条）与包围盒求交
+template <int N>
+bool hitPacketLane(const RayPacket<N> &p, int lane, const float *node) {
+	float o[3] = { p.ox[lane], p.oy[lane], p.oz[lane] };
+	float inv[3] = { p.ix[lane], p.iy[lane], p.iz[lane] };
+	float t0 = 0.0f, t1 = p.tMax[lane];
+	for (int a = 0; a < 3; a++) {
+		float tNear = (node[a] - o[a]) * inv[a];
+		float tFar = (node[3 + a] - o[a]) * inv[a];
+		if (tNear > tFar) std::swap(tNear, tFar);
+		t0 = std::max(t0, tNear);
+		t1 = std::min(t1, tFar);
+	}
+	return t0 <= t1;
+}
+
+// 光线包的区间测试：起点与方向倒数都取区间，得到所有光线进入/离开距离的保守范围，
+// 返回true表示整个光线包一定不与包围盒相交
+template <int N>
+bool packetMissesBox(const RayPacket<N> &p, const float *node) {
+	if (!p.coherent) return false;
+	float tEnter = 0.0f, tExit = std::numeric_limits<float>::max();
+	for (int a = 0; a < 3; a++) {
+		// 方向为正时从pMin进入、pMax离开，为负时相反
+		bool positive = p.iMin[a] > 0.0f;
+		float lo = positive ? node[a] : node[3 + a];
+		float hi = positive ? node[3 + a] : node[a];
+		float enter = positive ? std::min((lo - p.oMax[a]) * p.iMin[a], (lo - p.oMax[a]) * p.iMax[a])
+							   : std::min((lo - p.oMin[a]) * p.iMin[a], (lo - p.oMin[a]) * p.iMax[a]);
+		float exit = positive ? std::max((hi - p.oMin[a]) * p.iMin[a], (hi - p.oMin[a]) * p.iMax[a])
+							  : std::max((hi - p.oMax[a]) * p.iMin[a], (hi - p.oMax[a]) * p.iMax[a]);
+		tEnter = std::max(tEnter, enter);
+		tExit = std::min(tExit, exit);
+	}
+	return tEnter > tExit;
+}
+
+// 全部光线与包围盒求交，返回命中掩码（第i位对应第i条光线）
+template <int N>
+int hitPacketBox(const RayPacket<N> &p, const float *node) {
+	int mask = 0;
+#ifdef BVH_WIDE_SSE
+	__m128 bMin[3] = { _mm_set1_ps(node[0]), _mm_set1_ps(node[1]), _mm_set1_ps(node[2]) };
+	__m128 bMax[3] = { _mm_set1_ps(node[3]), _mm_set1_ps(node[4]), _mm_set1_ps(node[5]) };
+	const float *org[3] = { p.ox, p.oy, p.oz };
+	const float *inv[3] = { p.ix, p.iy, p.iz };
+	for (int g = 0; g < N; g += 4) {
+		__m128 tmin = _mm_setzero_ps();
+		__m128 tmax = _mm_loadu_ps(&p.tMax[g]);
+		for (int a = 0; a < 3; a++) {
+			__m128 o = _mm_loadu_ps(&org[a][g]);
+			__m128 id = _mm_loadu_ps(&inv[a][g]);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(bMin[a], o), id);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(bMax[a], o), id);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+		}
+		mask |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << g;
+	}
+#else
+	for (int i = 0; i < N; i++)
+		if (hitPacketLane(p, i, node)) mask |= 1 << i;
+#endif
+	return mask;
+}
+
+// 光线包中的一条光线与三角形做水密求交，命中时更新该光线的tMax与primIndex
+template <int N>
+void hitPacketTriangleLane(RayPacket<N> &p, int lane, const float *m, int index) {
+	TriangleHit h = hitTriangleWatertight(glm::vec3(m[0], m[1], m[2]), glm::vec3(m[3], m[4], m[5]),
+										  glm::vec3(m[6], m[7], m[8]), p.watertight(lane), p.tMax[lane]);
+	if (h.hit) {
+		p.tMax[lane] = h.t;
+		p.primIndex[lane] = index;
+	}
+}
+
+// 一个三角形与光线包中mask内的光线水密求交（与hitTriangleWatertight逐位一致），更新命中光线的tMax与primIndex。
+// 坐标轴重排不同的4条光线以及边函数恰好为0的光线逐条求交
+template <int N>
+void hitPacketTriangle(RayPacket<N> &p, int mask, const float *m, int index) {
+#ifdef BVH_WIDE_SSE
+	__m128 zero = _mm_setzero_ps(), signBit = _mm_set1_ps(-0.0f);
+	const float *org[3] = { p.ox, p.oy, p.oz };
+	for (int g = 0; g < N; g += 4) {
+		int groupMask = (mask >> g) & 15;
+		if (!groupMask) continue;
+		if (!(p.sharedAxes & (1 << (g / 4)))) {
+			for (int k = 0; k < 4; k++)
+				if (groupMask & (1 << k)) hitPacketTriangleLane(p, g + k, m, index);
+			continue;
+		}
+		int kx = p.kx[g], ky = p.ky[g], kz = p.kz[g];
+		__m128 Sx = _mm_loadu_ps(&p.sx[g]), Sy = _mm_loadu_ps(&p.sy[g]), Sz = _mm_loadu_ps(&p.sz[g]);
+		__m128 ox = _mm_loadu_ps(&org[kx][g]), oy = _mm_loadu_ps(&org[ky][g]), oz = _mm_loadu_ps(&org[kz][g]);
+		// 相对起点的顶点坐标，剪切后的xy
+		__m128 Az = _mm_sub_ps(_mm_set1_ps(m[kz]), oz);
+		__m128 Bz = _mm_sub_ps(_mm_set1_ps(m[3 + kz]), oz);
+		__m128 Cz = _mm_sub_ps(_mm_set1_ps(m[6 + kz]), oz);
+		__m128 Ax = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(m[kx]), ox), _mm_mul_ps(Sx, Az));
+		__m128 Ay = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(m[ky]), oy), _mm_mul_ps(Sy, Az));
+		__m128 Bx = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(m[3 + kx]), ox), _mm_mul_ps(Sx, Bz));
+		__m128 By = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(m[3 + ky]), oy), _mm_mul_ps(Sy, Bz));
+		__m128 Cx = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(m[6 + kx]), ox), _mm_mul_ps(Sx, Cz));
+		__m128 Cy = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(m[6 + ky]), oy), _mm_mul_ps(Sy, Cz));
+		// 边函数
+		__m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx));
+		__m128 V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx));
+		__m128 W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
+		__m128 anyZero = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)), _mm_cmpeq_ps(W, zero));
+		__m128 anyNeg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+		__m128 anyPos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+		__m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+		__m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(Sz, Az)), _mm_mul_ps(V, _mm_mul_ps(Sz, Bz))),
+							  _mm_mul_ps(W, _mm_mul_ps(Sz, Cz)));
+		// 乘以det的符号即翻转符号位
+		__m128 sign = _mm_and_ps(det, signBit);
+		__m128 Ts = _mm_xor_ps(T, sign);
+		__m128 ok = _mm_andnot_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpneq_ps(det, zero));
+		ok = _mm_and_ps(ok, _mm_cmpgt_ps(Ts, zero));
+		ok = _mm_and_ps(ok, _mm_cmplt_ps(Ts, _mm_xor_ps(_mm_mul_ps(_mm_loadu_ps(&p.tMax[g]), det), sign)));
+		int exact = _mm_movemask_ps(anyZero) & groupMask;
+		int hit = _mm_movemask_ps(ok) & groupMask & ~exact;
+		for (int k = 0; k < 4; k++)
+			if (exact & (1 << k)) hitPacketTriangleLane(p, g + k, m, index);
+		if (!hit) continue;
+		// 只更新mask中的光线，其余光线即使几何上命中也不改变
+		float tHit[4];
+		_mm_storeu_ps(tHit, _mm_mul_ps(T, _mm_div_ps(_mm_set1_ps(1.0f), det)));
+		for (int k = 0; k < 4; k++) {
+			if (!(hit & (1 << k))) continue;
+			p.tMax[g + k] = tHit[k];
+			p.primIndex[g + k] = index;
+		}
+	}
+#else
+	for (int i = 0; i < N; i++)
+		if (mask & (1 << i)) hitPacketTriangleLane(p, i, m, index);
+#endif
+}
+
+// 光线包中的一条光线单独遍历以root为根的子树（光线包发散后使用），先访问较近的子节点
+template <int N>
+void traversePacketLane(const BVHTree &bvhTree, RayPacket<N> &p, int lane, int root) {
+	TraversalStack<int> stack;
+	int current = root;
+	int laneMask = 1 << lane;
+	float dir[3] = { p.dx[lane], p.dy[lane], p.dz[lane] };
+	while (true) {
+		const float *node = &bvhTree.NodeArray[current * 9];
+		if (hitPacketLane(p, lane, node)) {
+			int nPrimitives = (int)node[6];
+			if (nPrimitives > 0) {
+				for (int i = (int)node[8]; i < (int)node[8] + nPrimitives; i++) {
+					int index = bvhTree.primitiveIndex(i);
+					hitPacketTriangle(p, laneMask, bvhTree.primitives.vertexData(index), index);
+				}
+			}
+			else {
+				bool dirIsNeg = dir[(int)node[7]] < 0.0f;
+				stack.push(dirIsNeg ? current + 1 : (int)node[8]);
+				current = dirIsNeg ? (int)node[8] : current + 1;
+				continue;
+			}
+		}
+		if (stack.empty()) break;
+		current = stack.pop();
+	}
+}
+
+// 光线包最近交点查询，结果写回p.tMax与p.primIndex。
+// 活跃光线数不超过fallbackRays时该子树中的剩余光线改为单独遍历（fallbackRays为0时始终按光线包遍历）
+template <int N>
+void IntersectPacket(const BVHTree &bvhTree, RayPacket<N> &p, int fallbackRays = 1, BVHPacketStats *stats = nullptr) {
+	if (bvhTree.nodeNum == 0 || p.count == 0) return;
+	if (stats) {
+		stats->packets++;
+		stats->rays += p.count;
+	}
+	TraversalStack<int> stack;
+	int current = 0;
+	while (true) {
+		const float *node = &bvhTree.NodeArray[current * 9];
+		if (stats) stats->nodesVisited++;
+		int mask = 0;
+		if (packetMissesBox(p, node)) {
+			if (stats) stats->frustumCulls++;
+		}
+		else {
+			mask = hitPacketBox(p, node);
+		}
+
+		int active = 0;
+		for (int m = mask; m; m &= m - 1) active++;
+		if (active > 0 && active <= fallbackRays) {
+			// 光线包已发散，剩余光线单独遍历该子树
+			for (int i = 0; i < N; i++)
+				if (mask & (1 << i)) traversePacketLane(bvhTree, p, i, current);
+			if (stats) stats->fallbackRays += active;
+		}
+		else if (active > 0) {
+			int nPrimitives = (int)node[6];
+			if (nPrimitives > 0) {
+				for (int i = (int)node[8]; i < (int)node[8] + nPrimitives; i++) {
+					int index = bvhTree.primitiveIndex(i);
+					hitPacketTriangle(p, mask, bvhTree.primitives.vertexData(index), index);
+				}
+			}
+			else {
+				// 按第一条活跃光线的方向决定子节点顺序
+				int lane = 0;
+				while (!(mask & (1 << lane))) lane++;
+				float d = ((int)node[7] == 0) ? p.dx[lane] : ((int)node[7] == 1) ? p.dy[lane] : p.dz[lane];
+				bool dirIsNeg = d < 0.0f;
+				stack.push(dirIsNeg ? current + 1 : (int)node[8]);
+				current = dirIsNeg ? (int)node[8] : current + 1;
+				continue;
+			}
+		}
+		if (stack.empty()) break;
+		current = stack.pop();
+	}
+}
+
+// rays为按行排列的width x height相机光线，每tile行 x (N / tile)列像素组成一个光线包遍历
+template <int N>
+void IntersectCameraPackets(const BVHTree &bvhTree, const std::vector<Ray> &rays, int width, int height, int tile,
+							std::vector<float> &tHit, std::vector<int> &primIndex,
+							int fallbackRays = 1, BVHPacketStats *stats = nullptr)
+{
+	tHit.assign(rays.size(), -1.0f);
+	primIndex.assign(rays.size(), -1);
+	RayPacket<N> p;
+	Ray tileRays[N];
+	int pixel[N];
+	int tileW = N / tile;
+	for (int y0 = 0; y0 < height; y0 += tile) {
+		for (int x0 = 0; x0 < width; x0 += tileW) {
+			int n = 0;
+			for (int y = y0; y < std::min(y0 + tile, height); y++) {
+				for (int x = x0; x < std::min(x0 + tileW, width); x++) {
+					pixel[n] = y * width + x;
+					tileRays[n] = rays[pixel[n]];
+					n++;
+				}
+			}
+			p.load(tileRays, n);
+			IntersectPacket(bvhTree, p, fallbackRays, stats);
+			for (int i = 0; i < n; i++) {
+				primIndex[pixel[i]] = p.primIndex[i];
+				if (p.primIndex[i] >= 0) tHit[pixel[i]] = p.tMax[i];
+			}
+		}
+	}
+}
+
+// 光线包与IntersectBVH的结果是否一致：命中与否、距离完全相同。
+// 距离相同而三角形不同（交点恰在共享边上，两侧三角形的t逐位相同）只可能是遍历顺序不同，单独计数
+struct PacketCompare {
+	int mismatches = 0;
+	int ties = 0;
+	void add(float t, int prim, float refT, int refPrim) {
+		if ((prim >= 0) != (refPrim >= 0) || (prim >= 0 && t != refT)) mismatches++;
+		else if (prim != refPrim) ties++;
+	}
+};
+
+// 随机光线包：每个光线包的起点在场景包围盒内随机选取，再对每条光线抖动originJitter（相对包围盒对角线），
+// 方向在随机轴附近按spread散开（spread较大时方向符号不一致，不做区间测试），检查结果与IntersectBVH一致
+void BVHPacketRandomTest(const BVHTree &bvhTree, int packets = 4000, unsigned seed = 1) {
+	if (bvhTree.nodeNum == 0) return;
+	glm::vec3 bMin(bvhTree.NodeArray[0], bvhTree.NodeArray[1], bvhTree.NodeArray[2]);
+	glm::vec3 bMax(bvhTree.NodeArray[3], bvhTree.NodeArray[4], bvhTree.NodeArray[5]);
+	float diagonal = glm::length(bMax - bMin);
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> U(0.0f, 1.0f);
+	auto random3 = [&]() { return glm::vec3(U(rng), U(rng), U(rng)); };
+
+	auto run = [&](const char *name, auto p, float originJitter, float spread) {
+		const int N = (int)(sizeof(p.tMax) / sizeof(float));
+		PacketCompare cmp;
+		int hits = 0;
+		Ray rays[N];
+		for (int k = 0; k < packets; k++) {
+			glm::vec3 origin = bMin + random3() * (bMax - bMin);
+			glm::vec3 axis = glm::normalize(random3() * 2.0f - 1.0f + glm::vec3(1e-6f));
+			int n = 1 + (int)(U(rng) * N) % N; // 也覆盖不满的光线包
+			for (int i = 0; i < n; i++) {
+				rays[i].origin = origin + (random3() * 2.0f - 1.0f) * (originJitter * diagonal);
+				rays[i].direction = glm::normalize(axis + (random3() * 2.0f - 1.0f) * spread);
+			}
+			p.load(rays, n);
+			IntersectPacket(bvhTree, p, 1);
+			for (int i = 0; i < n; i++) {
+				hitRecord rec;
+				bool hit = IntersectBVH(bvhTree, rays[i], rec);
+				hits += hit ? 1 : 0;
+				cmp.add(p.tMax[i], p.primIndex[i], hit ? rec.t : -1.0f, hit ? rec.primIndex : -1);
+			}
+		}
+		std::cout << name << " jitter = " << originJitter << ", spread = " << spread << ": hits = " << hits
+				  << ", mismatches = " << cmp.mismatches << ", ties = " << cmp.ties << std::endl;
+	};
+	const float jitters[] = { 0.0f, 0.01f, 0.1f };
+	const float spreads[] = { 0.01f, 0.1f, 1.0f };
+	for (float jitter : jitters) {
+		for (float spread : spreads) {
+			run("random packet 4 ", RayPacket<4>(), jitter, spread);
+			run("random packet 8 ", RayPacket<8>(), jitter, spread);
+			run("random packet 16", RayPacket<16>(), jitter, spread);
+		}
+	}
+}
+
+// 比较单条光线（IntersectBVH）与4/8/16条光线包的主光线吞吐量，并检查结果是否与IntersectBVH一致
+void BVHPacketTest(const BVHTree &bvhTree, const Camera &camera, int width = 400, int height = 300) {
+	std::vector<Ray> rays = CameraTestRays(camera, width, height);
+
+	std::vector<float> refT(rays.size(), -1.0f);
+	std::vector<int> refPrim(rays.size(), -1);
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rays.size(); i++) {
+		hitRecord rec;
+		if (IntersectBVH(bvhTree, rays[i], rec)) {
+			refT[i] = rec.t;
+			refPrim[i] = rec.primIndex;
+		}
+	}
+	double singleSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "single rays (IntersectBVH): " << rays.size() / singleSeconds / 1e6 << " Mrays/s" << std::endl;
+
+	auto report = [&](const char *name, auto &&trace) {
+		std::vector<float> tHit;
+		std::vector<int> primIndex;
+		BVHPacketStats stats;
+		auto start = std::chrono::steady_clock::now();
+		trace(tHit, primIndex, &stats);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		PacketCompare cmp;
+		for (size_t i = 0; i < rays.size(); i++) cmp.add(tHit[i], primIndex[i], refT[i], refPrim[i]);
+		std::cout << name << ": " << rays.size() / seconds / 1e6 << " Mrays/s (x" << singleSeconds / seconds
+				  << "), nodes/packet = " << (double)stats.nodesVisited / stats.packets
+				  << ", frustum culls/packet = " << (double)stats.frustumCulls / stats.packets
+				  << ", fallback rays = " << 100.0 * stats.fallbackRays / stats.rays << "%"
+				  << ", mismatches = " << cmp.mismatches << ", ties = " << cmp.ties << std::endl;
+	};
+	report("packet 4 (2x2)", [&](std::vector<float> &t, std::vector<int> &p, BVHPacketStats *s) {
+		IntersectCameraPackets<4>(bvhTree, rays, width, height, 2, t, p, 1, s); });
+	report("packet 8 (4x2)", [&](std::vector<float> &t, std::vector<int> &p, BVHPacketStats *s) {
+		IntersectCameraPackets<8>(bvhTree, rays, width, height, 2, t, p, 1, s); });
+	report("packet 16 (4x4)", [&](std::vector<float> &t, std::vector<int> &p, BVHPacketStats *s) {
+		IntersectCameraPackets<16>(bvhTree, rays, width, height, 4, t, p, 2, s); });
+
+	BVHPacketRandomTest(bvhTree);
+}
+
+// 水密性测试：顶点经过抖动的倾斜网格，光线瞄准相邻三角形的共享边，任何一种CPU求交都不应漏过（穿过缝隙）。
+// 同时检查叶子批量求交与光线包遍历的结果与IntersectBVH一致
+void WatertightEdgeTest(int gridSize = 64, int raysPerCell = 8) {
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> U(0.0f, 1.0f);
+	const int G = gridSize;
+	std::vector<glm::vec3> P((G + 1) * (G + 1));
+	for (int j = 0; j <= G; j++) {
+		for (int i = 0; i <= G; i++) {
+			float jx = (i > 0 && i < G) ? (U(rng) - 0.5f) * 0.4f : 0.0f;
+			float jy = (j > 0 && j < G) ? (U(rng) - 0.5f) * 0.4f : 0.0f;
+			glm::vec3 p((i + jx) / G * 555.0f - 277.0f, (j + jy) / G * 555.0f - 277.0f, 0.0f);
+			// 倾斜平面，使坐标不能精确表示
+			P[j * (G + 1) + i] = glm::vec3(p.x, p.y * 0.8f, p.y * 0.6f + 0.37f * p.x);
+		}
+	}
+	std::vector<std::shared_ptr<Triangle>> triangles;
+	auto addTriangle = [&](const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+		auto t = std::make_shared<Triangle>();
+		t->v0 = a; t->v1 = b; t->v2 = c;
+		t->n0 = t->n1 = t->n2 = glm::normalize(glm::cross(b - a, c - a));
+		triangles.push_back(t);
+	};
+	for (int j = 0; j < G; j++) {
+		for (int i = 0; i < G; i++) {
+			glm::vec3 a = P[j * (G + 1) + i], b = P[j * (G + 1) + i + 1];
+			glm::vec3 c = P[(j + 1) * (G + 1) + i], d = P[(j + 1) * (G + 1) + i + 1];
+			addTriangle(a, b, d);
+			addTriangle(a, d, c);
+		}
+	}
+	BVHTree bvhTree;
+	bvhTree.maxPrimsInNode = 4;
+	bvhTree.BVHBuildTree(triangles, 42);
+	BVHLeafPackets<4> packets4;
+	BVHLeafPackets<8> packets8;
+	packets4.Build(bvhTree);
+	packets8.Build(bvhTree);
+
+	// 光线瞄准对角线（同一格子的两个三角形）或下方的横边（相邻两行的三角形）上的随机点
+	std::vector<Ray> rays;
+	glm::vec3 eye(13.1f, -21.7f, 800.3f);
+	for (int j = 0; j < G; j++) {
+		for (int i = 0; i < G; i++) {
+			for (int s = 0; s < raysPerCell; s++) {
+				glm::vec3 a = P[j * (G + 1) + i], b = P[j * (G + 1) + i + 1], d = P[(j + 1) * (G + 1) + i + 1];
+				float f = U(rng);
+				glm::vec3 target = ((s & 1) || j == 0) ? a + f * (d - a) : a + f * (b - a);
+				Ray r;
+				r.origin = eye + glm::vec3(U(rng), U(rng), U(rng)) * 50.0f;
+				r.direction = glm::normalize(target - r.origin);
+				rays.push_back(r);
+			}
+		}
+	}
+
+	std::vector<float> refT(rays.size(), -1.0f);
+	std::vector<int> refPrim(rays.size(), -1);
+	for (size_t i = 0; i < rays.size(); i++) {
+		hitRecord rec;
+		if (IntersectBVH(bvhTree, rays[i], rec)) {
+			refT[i] = rec.t;
+			refPrim[i] = rec.primIndex;
+		}
+	}
+	auto report = [&](const char *name, const std::vector<float> &t, const std::vector<int> &prim) {
+		int leaks = 0, mismatches = 0;
+		for (size_t i = 0; i < rays.size(); i++) {
+			if (prim[i] < 0) leaks++;
+			if (prim[i] != refPrim[i] || t[i] != refT[i]) mismatches++;
+		}
+		std::cout << name << ": leaks = " << leaks << "/" << rays.size()
+				  << ", mismatches with IntersectBVH = " << mismatches << std::endl;
+	};
+	report("IntersectBVH      ", refT, refPrim);
+	auto leaf = [&](const char *name, auto &packets, bool simd) {
+		std::vector<float> t(rays.size(), -1.0f);
+		std::vector<int> prim(rays.size(), -1);
+		for (size_t i = 0; i < rays.size(); i++)
+			if (!packets.Intersect(bvhTree, rays[i], &t[i], &prim[i], nullptr, simd)) t[i] = -1.0f;
+		report(name, t, prim);
+	};
+	leaf("leaf scalar       ", packets4, false);
+	leaf("leaf packet4      ", packets4, true);
+	leaf("leaf packet8      ", packets8, true);
+	auto packet = [&](const char *name, auto p, int fallbackRays) {
+		const int N = (int)(sizeof(p.tMax) / sizeof(float));
+		std::vector<float> t(rays.size(), -1.0f);
+		std::vector<int> prim(rays.size(), -1);
+		for (size_t first = 0; first < rays.size(); first += N) {
+			int n = (int)std::min((size_t)N, rays.size() - first);
+			p.load(&rays[first], n);
+			IntersectPacket(bvhTree, p, fallbackRays);
+			for (int i = 0; i < n; i++) {
+				prim[first + i] = p.primIndex[i];
+				if (p.primIndex[i] >= 0) t[first + i] = p.tMax[i];
+			}
+		}
+		report(name, t, prim);
+	};
+	packet("ray packet 4      ", RayPacket<4>(), 1);
+	packet("ray packet 8      ", RayPacket<8>(), 1);
+	packet("ray packet 16     ", RayPacket<16>(), 0);
+}
+
+#endif
@@ -7,14 +7,24 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <tool/Shape.h>
+#include <tool/TriangleStore.h>
 #include <tool/Camera.h>
 
+#include <tool/Parallel.h>
+
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <limits>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 #include <iostream>
 
-int totalPrimitives = 0;
+std::atomic<int> totalPrimitives(0);
 
 // 基本数据结构
 
@@ -22,6 +32,7 @@ struct BVHNode {
 	BVHNode * children[2];
 	int splitAxis, firstPrimOffset, nPrimitives;
 	Bound3f bound;
+	float sahCost; // 子树的SAH代价（未归一化），仅构建后优化时使用
 	// 初始化为叶节点
 	void InitLeaf(int first, int n, const Bound3f &b) {
 		firstPrimOffset = first;
@@ -68,11 +79,167 @@ struct BVHPrimitiveInfo {
 	glm::vec3 centroid;
 };
 
+// SAH分桶信息
 struct BucketInfo {
 	int count = 0;
 	Bound3f bounds;
 };
+const int MaxBuckets = 32;
+
+// 索引格式的三角形跨度：MeshArray中每个三角形只存三个顶点下标与材质编号，
+// 顶点与材质分别存入VertexArray与MaterialArray（见BVHTree::packIndexedMesh）
+const int IndexedMeshStride = 4;
+const int IndexedVertexStride = 8; // 位置3、法线3、纹理坐标2
+const int MaterialStride = 18;     // 与packMaterial一致
+
+// 展平的二叉BVH（每节点9个float，深度优先顺序）的最大深度（根节点为0）。
+// 先访问近的子节点、远的子节点入栈的遍历中，栈内元素数不超过该深度
+int BVHMaxDepth(const float *nodes, int nodeNum) {
+	if (nodeNum == 0) return 0;
+	std::vector<int> depth(nodeNum, 0);
+	int maxDepth = 0;
+	for (int n = 0; n < nodeNum; n++) {
+		maxDepth = std::max(maxDepth, depth[n]);
+		if (nodes[n * 9 + 6] > 0) continue;
+		depth[n + 1] = depth[(int)nodes[n * 9 + 8]] = depth[n] + 1;
+	}
+	return maxDepth;
+}
+
+// CPU遍历栈：前InlineSize项放在栈上的定长数组中，超出后转存到堆上，任何深度的树都不会丢弃节点。
+// 正常的树深度远小于InlineSize，不会发生堆分配
+template <typename T, int InlineSize = 64>
+struct TraversalStack {
+	T local[InlineSize];
+	std::vector<T> overflow;
+	int size = 0;
+
+	bool empty() const { return size == 0; }
+	void push(const T &v) {
+		if (size < InlineSize) local[size] = v;
+		else overflow.push_back(v);
+		size++;
+	}
+	T &top() { return size > InlineSize ? overflow.back() : local[size - 1]; }
+	T pop() {
+		size--;
+		if (size < InlineSize) return local[size];
+		T v = overflow.back();
+		overflow.pop_back();
+		return v;
+	}
+};
 
+// BVH划分方法
+enum class SplitMethod {
+	EqualCounts, // 按质心中位数划分（原有方式）
+	SAH,         // 表面积启发式（Surface Area Heuristic）分桶划分
+	HLBVH,       // 基于Morton码的线性BVH（LBVH），顶层treelet可选SAH聚合
+	SBVH         // 空间划分BVH：SAH对象划分与空间划分（裁剪三角形、允许重复引用）取代价较低者
+};
+
+// SBVH划分结果
+struct SBVHSplit {
+	float cost = std::numeric_limits<float>::infinity();
+	int axis = 0;
+	float position = 0.0f;      // 空间划分平面位置
+	int bucket = 0;             // 对象划分：质心分桶[0, bucket]在左侧
+	float centroidMin = 0.0f, centroidMax = 0.0f; // 对象划分：分桶所用的质心范围
+	Bound3f leftBound, rightBound;
+	int leftCount = 0, rightCount = 0;
+};
+
+// LBVH：质心量化后的Morton码
+struct MortonPrimitive {
+	int primitiveIndex;
+	uint64_t mortonCode;
+};
+
+// 把x的低10位每位之间插入两个0（30位Morton码，每轴10位）
+inline uint32_t LeftShift3(uint32_t x) {
+	if (x == (1 << 10)) --x;
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// 把x的低21位每位之间插入两个0（63位Morton码，每轴21位）
+inline uint64_t LeftShift3_64(uint64_t x) {
+	if (x == (1ull << 21)) --x;
+	x = (x | (x << 32)) & 0x1F00000000FFFFull;
+	x = (x | (x << 16)) & 0x1F0000FF0000FFull;
+	x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+	x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+// v的各分量已缩放到[0, 2^bitsPerAxis]，第i位属于第i % 3个轴
+inline uint64_t EncodeMorton3(const glm::vec3 &v, bool bits63) {
+	if (bits63)
+		return (LeftShift3_64((uint64_t)v.z) << 2) | (LeftShift3_64((uint64_t)v.y) << 1) | LeftShift3_64((uint64_t)v.x);
+	return ((uint64_t)LeftShift3((uint32_t)v.z) << 2) | ((uint64_t)LeftShift3((uint32_t)v.y) << 1) | LeftShift3((uint32_t)v.x);
+}
+
+// 按mortonCode的低nBits位做LSD基数排序，每轮8位，各线程分段统计直方图后并行分发
+void RadixSort(std::vector<MortonPrimitive> *v, int nBits, int nThreads) {
+	const int bitsPerPass = 8;
+	const int nBuckets = 1 << bitsPerPass;
+	const int bitMask = nBuckets - 1;
+	int n = (int)v->size();
+	nThreads = std::max(1, std::min(nThreads, n));
+	int chunk = (n + nThreads - 1) / nThreads;
+	std::vector<MortonPrimitive> tempVector(n);
+	std::vector<int> histogram(nThreads * nBuckets), offsets(nThreads * nBuckets);
+
+	for (int pass = 0; pass * bitsPerPass < nBits; ++pass) {
+		int lowBit = pass * bitsPerPass;
+		std::vector<MortonPrimitive> &in = (pass & 1) ? tempVector : *v;
+		std::vector<MortonPrimitive> &out = (pass & 1) ? *v : tempVector;
+
+		// 各段分别统计每个桶的数量
+		std::fill(histogram.begin(), histogram.end(), 0);
+		ParallelFor(0, nThreads, nThreads, [&](int t0, int t1, int) {
+			for (int t = t0; t < t1; t++)
+				for (int i = t * chunk; i < std::min(n, (t + 1) * chunk); ++i)
+					histogram[t * nBuckets + ((in[i].mortonCode >> lowBit) & bitMask)]++;
+		});
+		// 按 (桶, 段) 的顺序计算写入起点，保证排序稳定
+		int sum = 0;
+		for (int b = 0; b < nBuckets; ++b)
+			for (int t = 0; t < nThreads; ++t) {
+				offsets[t * nBuckets + b] = sum;
+				sum += histogram[t * nBuckets + b];
+			}
+		ParallelFor(0, nThreads, nThreads, [&](int t0, int t1, int) {
+			for (int t = t0; t < t1; t++) {
+				int *off = &offsets[t * nBuckets];
+				for (int i = t * chunk; i < std::min(n, (t + 1) * chunk); ++i)
+					out[off[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+			}
+		});
+	}
+	// 轮数为奇数时结果在tempVector中
+	int nPasses = (nBits + bitsPerPass - 1) / bitsPerPass;
+	if (nPasses & 1) std::swap(*v, tempVector);
+}
+
+
+// 构建内存统计
+struct BVHBuildStats {
+	size_t allocations = 0;  // 本次构建中缓冲区的（重新）分配次数
+	size_t currentBytes = 0; // 当前持有的缓冲区大小
+	size_t peakBytes = 0;    // 历次构建中的峰值
+};
+
+// 可移动的物体：构建输入中[first, first + count)的三角形，保存添加时的顶点与法线作为初始姿态
+struct BVHObject {
+	int first, count;
+	std::vector<glm::vec3> restVertices;
+	std::vector<glm::vec3> restNormals;
+};
 
 // 构建BVH树
 
@@ -80,210 +247,361 @@ class BVHTree {
 public:
 	int nodeNum;
 	int nodeNumX, nodeNumY;
-	float *NodeArray;
+	float *NodeArray = nullptr;
 
-	LinearBVHNode *nodes = nullptr;
-	std::vector<std::shared_ptr<Triangle>> primitives;
+	TriangleStore primitives; // 构建后按叶子顺序排列，与MeshArray中的三角形一一对应
 
 	int meshNum;
 	int meshNumX, meshNumY;
-	float *MeshArray;
+	float *MeshArray = nullptr;
+
+	int meshStride = 42; // 每个三角形在MeshArray中占用的float数
+
+	// 索引格式（meshStride为IndexedMeshStride时生成）：共享的顶点与材质只存一份。
+	// 下标以float保存，顶点数不能超过2^24
+	int vertexNum = 0;
+	int vertexNumX = 0, vertexNumY = 0;
+	float *VertexArray = nullptr;
+	int materialNum = 0;
+	int materialNumX = 0, materialNumY = 0;
+	float *MaterialArray = nullptr;
 
 	int maxPrimsInNode = 1; // 控制叶子节点最大三角形数量的参数
 
+	// SBVH参数
+	float sbvhDuplicationBudget = 0.3f; // 允许新增的三角形引用数（占三角形总数的比例）
+	float sbvhAlpha = 1e-5f;            // 对象划分两子节点重叠面积/根节点面积超过该值才尝试空间划分
+
+	// SBVH中同一个三角形可以出现在多个叶子中：叶子的childOffset指向PrimRefArray，
+	// 其中保存三角形在MeshArray中的索引，三角形数据本身只存一份。primRefNum为0时没有间接索引
+	int primRefNum = 0;
+	int primRefNumX, primRefNumY;
+	float *PrimRefArray = nullptr;
+
+	// 无栈遍历的跳转链接（skip/rope）：SkipArray[i]为节点i的子树之后按深度优先顺序的下一个节点，
+	// 即节点i未命中或为叶子时接着访问的节点，-1表示遍历结束。展平时由buildSkipLinks生成，refit不改变拓扑，无需更新
+	int skipNumX, skipNumY;
+	float *SkipArray = nullptr;
+
+	// 展平后的最大深度（见BVHMaxDepth）。着色器的遍历栈为32项，超过时溢出的光线改用无栈遍历
+	int maxDepth = 0;
+
+	// 叶子中第ref个引用对应的三角形索引
+	int primitiveIndex(int ref) const {
+		return primRefNum > 0 ? (int)PrimRefArray[ref] : ref;
+	}
+
+	// 动态物体refit
+	float refitRebuildThreshold = 1.5f; // refit后SAH代价超过构建时的该倍数则建议重建
+	float builtSAHCost = 0.0f;          // 构建完成时的SAH代价（未归一化）
+	std::vector<int> primitiveOrder;    // primitives[i]在构建输入中的下标
+	std::vector<BVHObject> objects;
+	// 修改后需要重新上传的区间（数组元素下标，左闭右开），由updateTextures上传后清空
+	std::vector<std::pair<int, int>> dirtyNodeRanges, dirtyMeshRanges, dirtyCompactRanges, dirtyVertexRanges;
+	bool needsFullUpload = false;       // 重新构建后纹理尺寸和内容都可能变化，需要整体上传
+
+	// 压缩节点格式（GPU使用，见buildCompactNodes），每个texel 4个uint
+	bool compactNodes = false; // 构建后是否同时生成压缩节点
+	int compactNodeNum = 0;
+	int compactNodeNumX = 0, compactNodeNumY = 0; // 纹理尺寸（texel）
+	unsigned int *CompactNodeArray = nullptr;
+
+	// 划分方法及SAH参数
+	SplitMethod splitMethod = SplitMethod::EqualCounts;
+	int nBuckets = 12;            // SAH分桶数量（不超过MaxBuckets）
+	float traversalCost = 0.125f; // 遍历一个内部节点的相对代价
+	float intersectCost = 1.0f;   // 与一个三角形求交的相对代价
+	int leafPacketWidth = 1;      // 叶子中一次求交的三角形数（SIMD/vec4批量求交时为4或8），叶子代价按批数计算
+
+	// 含n个三角形的叶子的求交代价
+	float leafCost(int n) const {
+		return intersectCost * ((n + leafPacketWidth - 1) / std::max(1, leafPacketWidth));
+	}
+
+	// 并行构建参数
+	int nThreads = 0;                  // 构建线程数，0表示使用全部CPU核心
+	int parallelThreshold = 4096;      // 子树基元数超过该值时作为独立任务构建
+	int parallelReduceThreshold = 65536; // 基元数超过该值时并行计算包围盒与分桶
+	double buildTime = 0.0;            // 上一次构建耗时（秒）
+
+	// HLBVH参数
+	bool mortonBits63 = false;  // true: 63位Morton码（每轴21位），false: 30位（每轴10位）
+	bool hlbvhUpperSAH = true;  // 顶层treelet使用SAH聚合，否则继续按Morton码位划分
+
+	// 构建后优化：treelet重构（Karras & Aila 2013），只改变树的拓扑，叶子与三角形顺序不变，
+	// 展平后的节点格式不变。场景静态、需要渲染大量帧时用更长的构建时间换取更快的遍历
+	bool optimizeTree = false;        // 构建后是否进行treelet重构
+	int treeletSize = 7;              // 每个treelet的叶子数（3~8），越大效果越好，单个treelet耗时约按3^n增长
+	int optimizePasses = 3;           // 最多优化遍数，一遍的改进低于0.1%时提前结束
+	double optimizeTimeBudget = 2.0;  // 优化时间上限（秒），超时后保留已完成的改进
+	float sahCostBeforeOptimize = 0.0f, sahCostAfterOptimize = 0.0f; // 以根节点表面积归一化
+	double optimizeTime = 0.0;
+	bool optimizeTimeLimited = false; // 上次优化因时间上限提前结束：结果取决于机器负载，不可复现
+
+	// 构建内存统计（只统计BVHTree自身持有的缓冲区）
+	BVHBuildStats buildStats;
+
 	BVHTree() {}
+	~BVHTree() { releaseAll(); }
+	BVHTree(const BVHTree &) = delete;
+	BVHTree &operator=(const BVHTree &) = delete;
 
+	// 释放所有数据，包括跨构建复用的节点池与临时缓冲区
 	void releaseAll() {
 		delete[] NodeArray; NodeArray = nullptr;
 		delete[] MeshArray; MeshArray = nullptr;
+		delete[] VertexArray; VertexArray = nullptr;
+		delete[] MaterialArray; MaterialArray = nullptr;
+		vertexArrayCapacity = 0;
+		materialArrayCapacity = 0;
+		vertexNum = 0;
+		materialNum = 0;
+		delete[] CompactNodeArray; CompactNodeArray = nullptr;
+		delete[] PrimRefArray; PrimRefArray = nullptr;
+		delete[] SkipArray; SkipArray = nullptr;
+		skipArrayCapacity = 0;
+		primRefArrayCapacity = 0;
+		primRefNum = 0;
+		std::vector<int>().swap(sbvhRefs);
+		std::vector<int>().swap(primitiveOrder);
+		std::vector<int>().swap(rebuildOrder);
+		std::vector<int>().swap(primitiveSlot);
+		std::vector<char>().swap(movedSlots);
+		std::vector<unsigned int>().swap(compactScratch);
+		std::vector<BVHObject>().swap(objects);
+		clearDirty();
+		nodeArrayCapacity = 0;
+		meshArrayCapacity = 0;
+		compactArrayCapacity = 0;
+		std::vector<int>().swap(compactIndex);
+		std::vector<BVHNode>().swap(nodePool);
+		std::vector<BVHPrimitiveInfo>().swap(primitiveInfo);
+		orderedPrims = TriangleStore();
+		nodePoolUsed = 0;
 		nodeNum = 0;
+		maxDepth = 0;
 		meshNum = 0;
+		compactNodeNum = 0;
+	}
+
+	// 旧接口：shared_ptr<Triangle>数组先转换为TriangleStore
+	void BVHBuildTree(const std::vector<std::shared_ptr<Triangle>> &p, int stride = 42) {
+		BVHBuildTree(MakeTriangleStore(p), stride);
 	}
 
 	// 构建BVH树
-	void BVHBuildTree(std::vector<std::shared_ptr<Triangle>> p, int stride = 42) {
+	// 节点从nodePool中分配，展平后整体回收；NodeArray/MeshArray等缓冲区在多次构建之间复用，
+	// 只在容量不足时重新分配，因此反复重建时内存保持不变
+	void BVHBuildTree(TriangleStore p, int stride = 42) {
 		// 1. 数据准备阶段
 		primitives = std::move(p); // 转移三角形数据所有权
 		if (primitives.empty()) return;
 
+		auto buildStart = std::chrono::steady_clock::now();
+		int threadCount = GetThreadCount(nThreads);
+		nBuckets = std::max(2, std::min(nBuckets, MaxBuckets));
+		buildStats.allocations = 0;
+
 		// Initialize primitives
 		// 2. 创建基元信息数组（包含包围盒和质心）
-		std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-		for (size_t i = 0; i < primitives.size(); ++i)
-			primitiveInfo[i] = { i, getTriangleBound(*primitives[i])};
+		int nPrims = (int)primitives.size();
+		reserveTracked(primitiveInfo, nPrims);
+		primitiveInfo.resize(nPrims);
+		ParallelFor(0, nPrims, threadCount, [&](int s, int e, int) {
+			for (int i = s; i < e; ++i)
+				primitiveInfo[i] = { (size_t)i, primitives.bound(i)};
+		});
+
+		// 二叉树最多有 2N-1 个节点，一次性准备好节点池（SBVH按引用数上限计算）
+		int maxRefs = nPrims;
+		if (splitMethod == SplitMethod::SBVH)
+			maxRefs += (int)(nPrims * std::max(0.0f, sbvhDuplicationBudget));
+		if ((int)nodePool.size() < 2 * maxRefs - 1) {
+			buildStats.allocations++;
+			nodePool.resize(2 * maxRefs - 1);
+		}
+		nodePoolUsed = 0;
 
 		// Build BVH tree
 		// 3. 递归构建BVH树
+		// 叶节点的基元按深度优先顺序连续存放，位置与其在primitiveInfo中的区间一致，
+		// 因此各子树可以并行写入primitiveOrder，结果与单线程构建完全相同
 		int totalNodes = 0;
-		std::vector<std::shared_ptr<Triangle>> orderedPrims;
-		orderedPrims.reserve(primitives.size());
+		reserveTracked(primitiveOrder, nPrims);
+		primitiveOrder.resize(nPrims);
 
 		BVHNode *root;
-		root = recursiveBuild(primitiveInfo, 0, primitives.size(),
-			&totalNodes, orderedPrims);
+		if (splitMethod == SplitMethod::HLBVH)
+			root = HLBVHBuild(primitiveInfo, &totalNodes, threadCount);
+		else if (splitMethod == SplitMethod::SBVH)
+			root = SBVHBuild(primitiveInfo, &totalNodes, maxRefs);
+		else
+			root = recursiveBuild(primitiveInfo, 0, nPrims,
+				&totalNodes, threadCount);
+		optimizeTimeLimited = false;
+		if (optimizeTree) optimizeBVHTree(root);
+		updatePeakMemory();
 		
 		// 4. 数据重组
-		primitives.swap(orderedPrims); // 用排序后的三角形替换原始数据
-		primitiveInfo.resize(0); // 释放临时内存
+		// 按primitiveOrder整体搬运一次，orderedPrims的容量留给下次构建
+		orderedPrims.gather(primitives, primitiveOrder);
+		std::swap(primitives, orderedPrims);
+		primitiveInfo.clear();
+		// rebuild的输入是上次构建后的顺序，换算回最初的输入，已注册物体的区间保持有效
+		if (!rebuildOrder.empty()) {
+			for (int &o : primitiveOrder) o = rebuildOrder[o];
+			rebuildOrder.clear();
+		}
 
-		// 5. 展平BVH树为线性结构（便于GPU访问）
+		// 5. 展平BVH树为线性结构（便于GPU访问），直接写入NodeArray
 		// Compute representation of depth-first traversal of BVH tree
 		nodeNum = totalNodes;
-		nodes = new LinearBVHNode[totalNodes];
+		int nodeNumSize = nodeNum * (9);
+		float Node_x_f = sqrtf(nodeNumSize);
+		nodeNumX = ceilf(Node_x_f);
+		nodeNumY = ceilf((float)nodeNumSize / (float)nodeNumX);
+		std::cout << "nodeNumX = " << nodeNumX << " nodeNumY = " << nodeNumY << std::endl;
+		ensureArray(&NodeArray, &nodeArrayCapacity, nodeNumX * nodeNumY);
+		skipNumX = ceilf(sqrtf((float)nodeNum));
+		skipNumY = (nodeNum + skipNumX - 1) / skipNumX;
+		ensureArray(&SkipArray, &skipArrayCapacity, skipNumX * skipNumY);
+
 		int offset = 0;
 		flattenBVHTree(root, &offset);
+		buildSkipLinks();
+		maxDepth = BVHMaxDepth(NodeArray, nodeNum);
+		nodePoolUsed = 0; // 展平后树节点不再需要，整体回收
+		if (compactNodes) buildCompactNodes();
+
+		// SBVH的三角形引用表
+		primRefNum = (splitMethod == SplitMethod::SBVH) ? (int)sbvhRefs.size() : 0;
+		if (primRefNum > 0) {
+			primRefNumX = ceilf(sqrtf((float)primRefNum));
+			primRefNumY = (primRefNum + primRefNumX - 1) / primRefNumX;
+			ensureArray(&PrimRefArray, &primRefArrayCapacity, primRefNumX * primRefNumY);
+			for (int i = 0; i < primRefNum; i++) PrimRefArray[i] = (float)sbvhRefs[i];
+			std::cout << "SBVH references = " << primRefNum << " (" << nPrims << " triangles, +"
+					  << 100.0f * (primRefNum - nPrims) / nPrims << "%)" << std::endl;
+		}
 
 		// 6. 准备网格数据纹理
 		meshNum = primitives.size();
 		// int stride_t = 9 + 9 + 6 + 3 + 1;
 		// int stride_t = 9 + 9 + 6;
 		int stride_t = stride; // 每个三角形在纹理中的存储跨度
+		meshStride = stride;
 		int meshNumSize = meshNum * stride_t;
 		float mesh_x_f = sqrtf(meshNumSize);
 		meshNumX = ceilf(mesh_x_f);
 		meshNumY = ceilf((float)meshNumSize / (float)meshNumX);
 		std::cout << "meshNumX = " << meshNumX << " meshNumY = " << meshNumY << std::endl;
 
-		// 7. 准备BVH节点数据纹理
-		MeshArray = new float[(meshNumX * meshNumY) * stride_t];
+		// 7. 准备网格数据纹理
+		ensureArray(&MeshArray, &meshArrayCapacity, meshNumX * meshNumY);
 		// 顶点赋值
-		for (int i = 0; i < meshNum; i++) {
-			MeshArray[i * stride_t + 0] = primitives[i]->v0.x;
-			MeshArray[i * stride_t + 1] = primitives[i]->v0.y;
-			MeshArray[i * stride_t + 2] = primitives[i]->v0.z;
-			MeshArray[i * stride_t + 3] = primitives[i]->v1.x;
-			MeshArray[i * stride_t + 4] = primitives[i]->v1.y;
-			MeshArray[i * stride_t + 5] = primitives[i]->v1.z;
-			MeshArray[i * stride_t + 6] = primitives[i]->v2.x;
-			MeshArray[i * stride_t + 7] = primitives[i]->v2.y;
-			MeshArray[i * stride_t + 8] = primitives[i]->v2.z;
-
-			MeshArray[i * stride_t + 9] = primitives[i]->n0.x;
-			MeshArray[i * stride_t + 10] = primitives[i]->n0.y;
-			MeshArray[i * stride_t + 11] = primitives[i]->n0.z;
-			MeshArray[i * stride_t + 12] = primitives[i]->n1.x;
-			MeshArray[i * stride_t + 13] = primitives[i]->n1.y;
-			MeshArray[i * stride_t + 14] = primitives[i]->n1.z;
-			MeshArray[i * stride_t + 15] = primitives[i]->n2.x;
-			MeshArray[i * stride_t + 16] = primitives[i]->n2.y;
-			MeshArray[i * stride_t + 17] = primitives[i]->n2.z;
-
-			MeshArray[i * stride_t + 18] = primitives[i]->u0.x;
-			MeshArray[i * stride_t + 19] = primitives[i]->u0.y;
-			MeshArray[i * stride_t + 20] = primitives[i]->u1.x;
-			MeshArray[i * stride_t + 21] = primitives[i]->u1.y;
-			MeshArray[i * stride_t + 22] = primitives[i]->u2.x;
-			MeshArray[i * stride_t + 23] = primitives[i]->u2.y;
-
-			MeshArray[i * stride_t + 24] = primitives[i]->material.emissive.x;
-			MeshArray[i * stride_t + 25] = primitives[i]->material.emissive.y;
-			MeshArray[i * stride_t + 26] = primitives[i]->material.emissive.z;
-
-			MeshArray[i * stride_t + 27] = primitives[i]->material.baseColor.x;
-			MeshArray[i * stride_t + 28] = primitives[i]->material.baseColor.y;
-			MeshArray[i * stride_t + 29] = primitives[i]->material.baseColor.z;
-
-			MeshArray[i * stride_t + 30] = primitives[i]->material.subsurface;
-			MeshArray[i * stride_t + 31] = primitives[i]->material.metallic;
-			MeshArray[i * stride_t + 32] = primitives[i]->material.specular;
-			MeshArray[i * stride_t + 33] = primitives[i]->material.specularTint;
-			MeshArray[i * stride_t + 34] = primitives[i]->material.roughness;
-			MeshArray[i * stride_t + 35] = primitives[i]->material.anisotropic;
-			MeshArray[i * stride_t + 36] = primitives[i]->material.sheen;
-			MeshArray[i * stride_t + 37] = primitives[i]->material.sheenTint;
-			MeshArray[i * stride_t + 38] = primitives[i]->material.clearcoat;
-			MeshArray[i * stride_t + 39] = primitives[i]->material.clearcoatGloss;
-			MeshArray[i * stride_t + 40] = primitives[i]->material.IOR;
-			MeshArray[i * stride_t + 41] = primitives[i]->material.transmission;
+		if (stride_t == IndexedMeshStride) {
+			packIndexedMesh();
 		}
+		else {
+			ParallelFor(0, meshNum, threadCount, [&](int s, int e, int) {
+			for (int i = s; i < e; i++)
+				primitives.pack(i, &MeshArray[i * stride_t], stride_t); // 24跨度的格式只包含顶点、法线和纹理坐标
+			});
+			vertexNum = materialNum = 0;
+		}
+		std::cout << "mesh texture memory = " << meshTextureBytes() / (1024.0 * 1024.0) << " MB ("
+				  << (double)meshTextureBytes() / meshNum << " bytes/triangle)" << std::endl;
 
-		int nodeNumSize = nodeNum * (9);
-		float Node_x_f = sqrtf(nodeNumSize);
-		nodeNumX = ceilf(Node_x_f);
-		nodeNumY = ceilf((float)nodeNumSize / (float)nodeNumX);
-		std::cout << "nodeNumX = " << nodeNumX << " nodeNumY = " << nodeNumY << std::endl;
-
-		NodeArray = new float[(nodeNumX * nodeNumY)];
-		for (int i = 0; i < nodeNum; i++) {
-			NodeArray[i * (9) + 0] = nodes[i].pMin.x;
-			NodeArray[i * (9) + 1] = nodes[i].pMin.y;
-			NodeArray[i * (9) + 2] = nodes[i].pMin.z;
-			NodeArray[i * (9) + 3] = nodes[i].pMax.x;
-			NodeArray[i * (9) + 4] = nodes[i].pMax.y;
-			NodeArray[i * (9) + 5] = nodes[i].pMax.z;
-
-			//std::cout << nodes[i].pMin.x << " " << nodes[i].pMin.y << " " << nodes[i].pMin.z << " " <<	nodes[i].pMax.x << " " << nodes[i].pMax.y << " " << nodes[i].pMax.z << " " << std::endl;
+		// refit所需的状态
+		reserveTracked(primitiveSlot, nPrims);
+		updatePrimitiveSlots();
+		movedSlots.assign(meshNum, 0);
+		builtSAHCost = computeSAHCost(false);
+		clearDirty();
+		needsFullUpload = true;
 
-			NodeArray[i * (9) + 6] = nodes[i].nPrimitives;
-			NodeArray[i * (9) + 7] = nodes[i].axis;
-			NodeArray[i * (9) + 8] = nodes[i].childOffset;
-		}
+		updatePeakMemory();
 
-		// 8. 清理临时节点数据
-		delete[] nodes;
-		nodes = nullptr;
+		buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+		std::cout << "BVH build time = " << buildTime * 1000.0 << " ms (" << threadCount << " threads)" << std::endl;
+		std::cout << "BVH memory = " << buildStats.currentBytes / (1024.0 * 1024.0) << " MB, peak = "
+				  << buildStats.peakBytes / (1024.0 * 1024.0) << " MB, allocations = " << buildStats.allocations << std::endl;
 
 	}
 
 	// 递归构建BVH树
+	// threadBudget为该子树可使用的线程数，大于1时左子树作为独立任务并行构建
 	BVHNode *recursiveBuild(std::vector<BVHPrimitiveInfo> &primitiveInfo,
 							int start, int end, int *totalNodes,
-							std::vector<std::shared_ptr<Triangle>> &orderedPrims) 
+							int threadBudget = 1) 
 	{
-		BVHNode* node = new BVHNode;
+		BVHNode* node = allocNode();
 		(*totalNodes)++;
-		// 计算BVH节点中所有基元的边界
-		Bound3f bounds;
-		for (int i = start; i < end; ++i)
-			bounds = Union(bounds, primitiveInfo[i].bound);
-
 		int nPrimitives = end - start;
+		// 顶层节点基元数量多，包围盒的归约并行计算
+		int reduceThreads = (nPrimitives > parallelReduceThreshold) ? threadBudget : 1;
+
+		// 计算BVH节点中所有基元的边界
+		Bound3f bounds, centroidBounds;
+		computeBounds(primitiveInfo, start, end, reduceThreads, &bounds, &centroidBounds);
 		
-		// 当前硬编码为1个三角形就停止划分
-		if (nPrimitives == maxPrimsInNode) {
+		// 只剩一个三角形，或不超过maxPrimsInNode时直接建叶节点；
+		// SAH在partitionSAH中比较叶节点与划分的代价后再决定
+		if (nPrimitives == 1 || (nPrimitives <= maxPrimsInNode && splitMethod != SplitMethod::SAH)) {
 			// 构建叶节点
-			int firstPrimOffset = orderedPrims.size();
-			for (int i = start; i < end; ++i) {
-				int primNum = primitiveInfo[i].primitiveNumber;
-				orderedPrims.push_back(primitives[primNum]);
-			}
-			node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+			initLeafNode(node, primitiveInfo, start, end, bounds);
 			return node;
 		}
 		else {
 			// 首先计算基元的边界，选择用于划分的维度
-			Bound3f centroidBounds;
-			for (int i = start; i < end; ++i)
-				centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
 			int dim = centroidBounds.MaximumExtent();
 
 			// 把基元划分到两个子集，构建子节点
 			if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
 				// 构建叶节点
-				int firstPrimOffset = orderedPrims.size();
-				for (int i = start; i < end; ++i) {
-					int primNum = primitiveInfo[i].primitiveNumber;
-					orderedPrims.push_back(primitives[primNum]);
-				}
-				node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+				initLeafNode(node, primitiveInfo, start, end, bounds);
 				return node;
 			}
 			else {
 				// 基于split方法将基元划分为两部分
 				int mid = ((start + end) / 2);
 
-				std::nth_element(&primitiveInfo[start], 
-								 &primitiveInfo[mid],
-					             &primitiveInfo[end - 1] + 1,
-					[dim](const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b)
-					{
-						return a.centroid[dim] < b.centroid[dim];
+				if (splitMethod == SplitMethod::SAH && (nPrimitives > 2 || maxPrimsInNode > 1)) {
+					// 按SAH代价寻找划分位置，若不划分更划算则直接构建叶节点
+					if (!partitionSAH(primitiveInfo, start, end, dim, bounds, centroidBounds, &mid, reduceThreads)) {
+						initLeafNode(node, primitiveInfo, start, end, bounds);
+						return node;
 					}
-				);
+				}
+				else {
+					// 基元较少时SAH收益很小，与中位数划分一致
+					std::nth_element(&primitiveInfo[start], 
+									 &primitiveInfo[mid],
+									 &primitiveInfo[end - 1] + 1,
+						[dim](const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b)
+						{
+							return a.centroid[dim] < b.centroid[dim];
+						}
+					);
+				}
 
 				// 递归构建子节点
-				BVHNode* left = recursiveBuild(primitiveInfo, start, mid, totalNodes, orderedPrims);
-				BVHNode* right = recursiveBuild(primitiveInfo, mid, end, totalNodes, orderedPrims);
+				BVHNode *left, *right;
+				if (threadBudget > 1 && nPrimitives > parallelThreshold) {
+					// 左右子树互不相交，左子树交给新线程，右子树在当前线程构建
+					int leftBudget = threadBudget / 2;
+					int leftNodes = 0;
+					auto leftTask = std::async(std::launch::async, [&]() {
+						return recursiveBuild(primitiveInfo, start, mid, &leftNodes, leftBudget);
+					});
+					right = recursiveBuild(primitiveInfo, mid, end, totalNodes, threadBudget - leftBudget);
+					left = leftTask.get();
+					*totalNodes += leftNodes;
+				}
+				else {
+					left = recursiveBuild(primitiveInfo, start, mid, totalNodes);
+					right = recursiveBuild(primitiveInfo, mid, end, totalNodes);
+				}
 				node->InitInterior(dim, left, right);
 
 				return node;
@@ -291,96 +609,1525 @@ public:
 		}
 	}
 
+	// 计算[start, end)内基元的包围盒与质心包围盒，nThreadsReduce > 1时分段并行归约
+	void computeBounds(const std::vector<BVHPrimitiveInfo> &primitiveInfo,
+					   int start, int end, int nThreadsReduce,
+					   Bound3f *bounds, Bound3f *centroidBounds)
+	{
+		if (nThreadsReduce <= 1) {
+			for (int i = start; i < end; ++i) {
+				*bounds = Union(*bounds, primitiveInfo[i].bound);
+				*centroidBounds = Union(*centroidBounds, primitiveInfo[i].centroid);
+			}
+			return;
+		}
+		std::vector<Bound3f> partBounds(nThreadsReduce), partCentroids(nThreadsReduce);
+		ParallelFor(start, end, nThreadsReduce, [&](int s, int e, int t) {
+			Bound3f b, c;
+			for (int i = s; i < e; ++i) {
+				b = Union(b, primitiveInfo[i].bound);
+				c = Union(c, primitiveInfo[i].centroid);
+			}
+			partBounds[t] = b;
+			partCentroids[t] = c;
+		});
+		for (int t = 0; t < nThreadsReduce; t++) {
+			*bounds = Union(*bounds, partBounds[t]);
+			*centroidBounds = Union(*centroidBounds, partCentroids[t]);
+		}
+	}
+
+	// 记录[start, end)内基元在构建输入中的下标，并初始化为叶节点
+	void initLeafNode(BVHNode *node, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
+					  int start, int end, const Bound3f &bounds)
+	{
+		for (int i = start; i < end; ++i) {
+			int primNum = primitiveInfo[i].primitiveNumber;
+			primitiveOrder[i] = primNum;
+		}
+		node->InitLeaf(start, end - start, bounds);
+	}
+
+	// SAH分桶划分：把质心沿dim轴分入nBuckets个桶，计算每个桶边界处划分的代价
+	// cost = traversalCost + intersectCost * (N_A * S_A + N_B * S_B) / S
+	// 返回false表示建叶节点的代价更低（且基元数不超过maxPrimsInNode）
+	bool partitionSAH(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+					  int start, int end, int dim,
+					  const Bound3f &bounds, const Bound3f &centroidBounds, int *mid,
+					  int nThreadsReduce = 1)
+	{
+		int nPrimitives = end - start;
+		auto bucketIndex = [&](const BVHPrimitiveInfo &pi) {
+			int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
+			if (b == nBuckets) b = nBuckets - 1;
+			return b;
+		};
+		// 分桶数组放在栈上，避免每个节点一次堆分配
+		BucketInfo buckets[MaxBuckets];
+		if (nThreadsReduce <= 1) {
+			for (int i = start; i < end; ++i) {
+				int b = bucketIndex(primitiveInfo[i]);
+				buckets[b].count++;
+				buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bound);
+			}
+		}
+		else {
+			// 每个线程统计各自的分桶，最后合并
+			std::vector<std::vector<BucketInfo>> partBuckets(nThreadsReduce, std::vector<BucketInfo>(nBuckets));
+			ParallelFor(start, end, nThreadsReduce, [&](int s, int e, int t) {
+				std::vector<BucketInfo> &pb = partBuckets[t];
+				for (int i = s; i < e; ++i) {
+					int b = bucketIndex(primitiveInfo[i]);
+					pb[b].count++;
+					pb[b].bounds = Union(pb[b].bounds, primitiveInfo[i].bound);
+				}
+			});
+			for (int t = 0; t < nThreadsReduce; t++) {
+				for (int b = 0; b < nBuckets; b++) {
+					buckets[b].count += partBuckets[t][b].count;
+					buckets[b].bounds = Union(buckets[b].bounds, partBuckets[t][b].bounds);
+				}
+			}
+		}
+
+		// 从右向左累计，得到每个划分位置右侧的数量和包围盒
+		int countAbove[MaxBuckets] = {};
+		float areaAbove[MaxBuckets] = {};
+		Bound3f b1;
+		int count1 = 0;
+		for (int i = nBuckets - 1; i > 0; --i) {
+			b1 = Union(b1, buckets[i].bounds);
+			count1 += buckets[i].count;
+			countAbove[i - 1] = count1;
+			areaAbove[i - 1] = count1 > 0 ? b1.SurfaceArea() : 0.0f;
+		}
+
+		// 从左向右累计，计算在第i个桶之后划分的代价
+		float invArea = 1.0f / bounds.SurfaceArea();
+		float minCost = std::numeric_limits<float>::max();
+		int minCostSplitBucket = 0;
+		Bound3f b0;
+		int count0 = 0;
+		for (int i = 0; i < nBuckets - 1; ++i) {
+			b0 = Union(b0, buckets[i].bounds);
+			count0 += buckets[i].count;
+			float areaBelow = count0 > 0 ? b0.SurfaceArea() : 0.0f;
+			float cost = traversalCost +
+				intersectCost * (count0 * areaBelow + countAbove[i] * areaAbove[i]) * invArea;
+			if (cost < minCost) {
+				minCost = cost;
+				minCostSplitBucket = i;
+			}
+		}
+
+		// 不划分时的代价：与节点内所有三角形求交
+		if (nPrimitives <= maxPrimsInNode && minCost >= leafCost(nPrimitives))
+			return false;
+
+		BVHPrimitiveInfo *pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+			[&](const BVHPrimitiveInfo &pi) { return bucketIndex(pi) <= minCostSplitBucket; });
+		*mid = pmid - &primitiveInfo[0];
+		return true;
+	}
+
+	// HLBVH构建：质心量化为Morton码并基数排序，按高12位划分treelet，
+	// 各treelet按Morton码位并行生成子树，最后在treelet根节点之上构建顶层
+	BVHNode *HLBVHBuild(const std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
+						int threadCount)
+	{
+		int n = (int)primitiveInfo.size();
+		int nBits = mortonBits63 ? 63 : 30;
+		float mortonScale = mortonBits63 ? (float)(1 << 21) : (float)(1 << 10);
+
+		// 1. 计算质心包围盒并生成Morton码
+		Bound3f bounds, centroidBounds;
+		computeBounds(primitiveInfo, 0, n, threadCount, &bounds, &centroidBounds);
+		std::vector<MortonPrimitive> mortonPrims(n);
+		ParallelFor(0, n, threadCount, [&](int s, int e, int) {
+			for (int i = s; i < e; ++i) {
+				glm::vec3 centroidOffset = centroidBounds.Offset(primitiveInfo[i].centroid);
+				mortonPrims[i].primitiveIndex = primitiveInfo[i].primitiveNumber;
+				mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * mortonScale, mortonBits63);
+			}
+		});
+
+		// 2. 基数排序
+		RadixSort(&mortonPrims, nBits, threadCount);
+
+		// 3. 按Morton码高12位划分treelet
+		const int treeletBits = 12;
+		int firstBitIndex = nBits - 1 - treeletBits;
+		uint64_t mask = ((1ull << treeletBits) - 1) << (nBits - treeletBits);
+		std::vector<int> treeletStart;
+		for (int start = 0, end = 1; end <= n; ++end) {
+			if (end == n || ((mortonPrims[start].mortonCode & mask) != (mortonPrims[end].mortonCode & mask))) {
+				treeletStart.push_back(start);
+				start = end;
+			}
+		}
+		treeletStart.push_back(n);
+		int nTreelets = (int)treeletStart.size() - 1;
+
+		// 4. 并行生成各treelet
+		std::vector<BVHNode *> treeletRoots(nTreelets);
+		std::vector<int> treeletNodes(nTreelets, 0);
+		ParallelFor(0, nTreelets, threadCount, [&](int s, int e, int) {
+			for (int i = s; i < e; ++i)
+				treeletRoots[i] = emitLBVH(primitiveInfo, mortonPrims, treeletStart[i], treeletStart[i + 1],
+										   &treeletNodes[i], firstBitIndex);
+		});
+		for (int i = 0; i < nTreelets; ++i)
+			*totalNodes += treeletNodes[i];
+
+		// 5. 构建顶层
+		if (hlbvhUpperSAH)
+			return buildUpperSAH(treeletRoots, 0, nTreelets, totalNodes);
+		std::vector<uint64_t> treeletCodes(nTreelets);
+		for (int i = 0; i < nTreelets; ++i)
+			treeletCodes[i] = mortonPrims[treeletStart[i]].mortonCode & mask;
+		return buildUpperMorton(treeletRoots, treeletCodes, 0, nTreelets, totalNodes, nBits - 1);
+	}
+
+	// 按Morton码第bitIndex位把已排序的[start, end)划分为两部分，递归生成LBVH子树
+	// 叶节点的基元下标写入primitiveOrder中与排序后位置相同的区间
+	BVHNode *emitLBVH(const std::vector<BVHPrimitiveInfo> &primitiveInfo,
+					  const std::vector<MortonPrimitive> &mortonPrims,
+					  int start, int end, int *totalNodes,
+					  int bitIndex)
+	{
+		int nPrimitives = end - start;
+		if (bitIndex == -1 || nPrimitives <= maxPrimsInNode) {
+			// 构建叶节点
+			BVHNode *node = allocNode();
+			(*totalNodes)++;
+			Bound3f bounds;
+			for (int i = start; i < end; ++i) {
+				int primitiveIndex = mortonPrims[i].primitiveIndex;
+				primitiveOrder[i] = primitiveIndex;
+				bounds = Union(bounds, primitiveInfo[primitiveIndex].bound);
+			}
+			node->InitLeaf(start, nPrimitives, bounds);
+			return node;
+		}
+
+		uint64_t mask = 1ull << bitIndex;
+		// 该位全部相同则继续检查下一位
+		if ((mortonPrims[start].mortonCode & mask) == (mortonPrims[end - 1].mortonCode & mask))
+			return emitLBVH(primitiveInfo, mortonPrims, start, end, totalNodes, bitIndex - 1);
+
+		// 二分查找该位由0变1的位置
+		int searchStart = start, searchEnd = end - 1;
+		while (searchStart + 1 != searchEnd) {
+			int mid = (searchStart + searchEnd) / 2;
+			if ((mortonPrims[searchStart].mortonCode & mask) == (mortonPrims[mid].mortonCode & mask))
+				searchStart = mid;
+			else
+				searchEnd = mid;
+		}
+		int splitOffset = searchEnd;
+
+		BVHNode *node = allocNode();
+		(*totalNodes)++;
+		BVHNode *left = emitLBVH(primitiveInfo, mortonPrims, start, splitOffset, totalNodes, bitIndex - 1);
+		BVHNode *right = emitLBVH(primitiveInfo, mortonPrims, splitOffset, end, totalNodes, bitIndex - 1);
+		node->InitInterior(bitIndex % 3, left, right);
+		return node;
+	}
+
+	// 在treelet根节点之上按SAH聚合构建顶层
+	BVHNode *buildUpperSAH(std::vector<BVHNode *> &treeletRoots, int start, int end, int *totalNodes) {
+		int nNodes = end - start;
+		if (nNodes == 1) return treeletRoots[start];
+
+		BVHNode *node = allocNode();
+		(*totalNodes)++;
+
+		Bound3f bounds, centroidBounds;
+		for (int i = start; i < end; ++i) {
+			bounds = Union(bounds, treeletRoots[i]->bound);
+			centroidBounds = Union(centroidBounds,
+				0.5f * (treeletRoots[i]->bound.pMin + treeletRoots[i]->bound.pMax));
+		}
+		int dim = centroidBounds.MaximumExtent();
+		auto centroid = [&](const BVHNode *nd) { return 0.5f * (nd->bound.pMin[dim] + nd->bound.pMax[dim]); };
+
+		int mid = (start + end) / 2;
+		if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+			// 质心重合，无法按位置划分，直接对半分
+		}
+		else {
+			auto bucketIndex = [&](const BVHNode *nd) {
+				int b = nBuckets * ((centroid(nd) - centroidBounds.pMin[dim]) /
+									(centroidBounds.pMax[dim] - centroidBounds.pMin[dim]));
+				if (b == nBuckets) b = nBuckets - 1;
+				return b;
+			};
+			BucketInfo buckets[MaxBuckets];
+			for (int i = start; i < end; ++i) {
+				int b = bucketIndex(treeletRoots[i]);
+				buckets[b].count++;
+				buckets[b].bounds = Union(buckets[b].bounds, treeletRoots[i]->bound);
+			}
+
+			float minCost = std::numeric_limits<float>::max();
+			int minCostSplitBucket = 0;
+			for (int i = 0; i < nBuckets - 1; ++i) {
+				Bound3f b0, b1;
+				int count0 = 0, count1 = 0;
+				for (int j = 0; j <= i; ++j) {
+					b0 = Union(b0, buckets[j].bounds);
+					count0 += buckets[j].count;
+				}
+				for (int j = i + 1; j < nBuckets; ++j) {
+					b1 = Union(b1, buckets[j].bounds);
+					count1 += buckets[j].count;
+				}
+				float cost = traversalCost + intersectCost *
+					((count0 > 0 ? count0 * b0.SurfaceArea() : 0.0f) +
+					 (count1 > 0 ? count1 * b1.SurfaceArea() : 0.0f)) / bounds.SurfaceArea();
+				if (cost < minCost) {
+					minCost = cost;
+					minCostSplitBucket = i;
+				}
+			}
+			BVHNode **pmid = std::partition(&treeletRoots[start], &treeletRoots[end - 1] + 1,
+				[&](const BVHNode *nd) { return bucketIndex(nd) <= minCostSplitBucket; });
+			mid = pmid - &treeletRoots[0];
+		}
+
+		node->InitInterior(dim,
+			buildUpperSAH(treeletRoots, start, mid, totalNodes),
+			buildUpperSAH(treeletRoots, mid, end, totalNodes));
+		return node;
+	}
+
+	// 不使用SAH时，顶层继续按treelet的Morton码前缀逐位划分
+	BVHNode *buildUpperMorton(std::vector<BVHNode *> &treeletRoots, const std::vector<uint64_t> &codes,
+							  int start, int end, int *totalNodes, int bitIndex)
+	{
+		if (end - start == 1) return treeletRoots[start];
+		uint64_t mask = 1ull << bitIndex;
+		if ((codes[start] & mask) == (codes[end - 1] & mask))
+			return buildUpperMorton(treeletRoots, codes, start, end, totalNodes, bitIndex - 1);
+		int mid = start + 1;
+		while ((codes[mid] & mask) == (codes[start] & mask)) ++mid;
+
+		BVHNode *node = allocNode();
+		(*totalNodes)++;
+		node->InitInterior(bitIndex % 3,
+			buildUpperMorton(treeletRoots, codes, start, mid, totalNodes, bitIndex - 1),
+			buildUpperMorton(treeletRoots, codes, mid, end, totalNodes, bitIndex - 1));
+		return node;
+	}
+
+	// SBVH构建（单线程）：每个节点分别寻找对象划分与空间划分，取SAH代价较低者。
+	// 空间划分按平面裁剪跨越平面的三角形，同一三角形的引用进入两个子节点，
+	// 引用总数不超过maxRefs（由sbvhDuplicationBudget决定），超出后只做对象划分
+	BVHNode *SBVHBuild(const std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
+					   int maxRefs)
+	{
+		int nPrims = (int)primitiveInfo.size();
+		sbvhRefs.clear();
+		reserveTracked(sbvhRefs, maxRefs);
+		sbvhMaxRefs = maxRefs;
+		sbvhRefTotal = nPrims;
+
+		std::vector<BVHPrimitiveInfo> refs(primitiveInfo.begin(), primitiveInfo.end());
+		Bound3f bounds;
+		for (const BVHPrimitiveInfo &ref : refs) bounds = Union(bounds, ref.bound);
+		sbvhRootArea = bounds.SurfaceArea();
+		BVHNode *root = SBVHRecursiveBuild(refs, bounds, totalNodes);
+
+		// 三角形按第一次被引用的顺序排列，MeshArray中每个三角形只存一份，
+		// sbvhRefs改为保存三角形在排序后primitives中的索引
+		std::vector<int> newIndex(nPrims, -1);
+		int next = 0;
+		for (int &r : sbvhRefs) {
+			if (newIndex[r] < 0) {
+				newIndex[r] = next;
+				primitiveOrder[next++] = r;
+			}
+			r = newIndex[r];
+		}
+		// 理论上每个三角形至少有一个引用，这里保证primitiveOrder完整
+		for (int i = 0; i < nPrims; i++) {
+			if (newIndex[i] >= 0) continue;
+			primitiveOrder[next++] = i;
+		}
+		return root;
+	}
+
+	BVHNode *SBVHRecursiveBuild(std::vector<BVHPrimitiveInfo> &refs, const Bound3f &bounds, int *totalNodes) {
+		BVHNode *node = allocNode();
+		(*totalNodes)++;
+		int nRefs = (int)refs.size();
+		if (nRefs == 1) {
+			SBVHInitLeaf(node, refs, bounds);
+			return node;
+		}
+
+		// 1. 对象划分
+		SBVHSplit objectSplit = findObjectSplit(refs, bounds);
+
+		// 2. 对象划分的两个子节点重叠明显、且复制预算未用完时尝试空间划分
+		SBVHSplit spatialSplit;
+		if (sbvhRefTotal < sbvhMaxRefs && objectSplit.cost < std::numeric_limits<float>::infinity()) {
+			Bound3f overlap = Intersect(objectSplit.leftBound, objectSplit.rightBound);
+			if (!overlap.IsEmpty() && overlap.SurfaceArea() > sbvhAlpha * sbvhRootArea)
+				spatialSplit = findSpatialSplit(refs, bounds);
+		}
+		else if (sbvhRefTotal < sbvhMaxRefs) {
+			// 质心全部重合，只能尝试空间划分
+			spatialSplit = findSpatialSplit(refs, bounds);
+		}
+
+		// 引用数不超过maxPrimsInNode且两种划分都不比叶子划算时构建叶节点
+		if (nRefs <= maxPrimsInNode && std::min(objectSplit.cost, spatialSplit.cost) >= leafCost(nRefs)) {
+			SBVHInitLeaf(node, refs, bounds);
+			return node;
+		}
+
+		std::vector<BVHPrimitiveInfo> left, right;
+		int axis = 0;
+		if (spatialSplit.cost < objectSplit.cost) {
+			performSpatialSplit(refs, spatialSplit, &left, &right);
+			axis = spatialSplit.axis;
+		}
+		if (left.empty() || right.empty()) {
+			if (objectSplit.cost == std::numeric_limits<float>::infinity()) {
+				// 无法划分，构建叶节点
+				SBVHInitLeaf(node, refs, bounds);
+				return node;
+			}
+			left.clear();
+			right.clear();
+			for (const BVHPrimitiveInfo &ref : refs)
+				(objectBucket(ref, objectSplit) <= objectSplit.bucket ? left : right).push_back(ref);
+			axis = objectSplit.axis;
+			if (left.empty() || right.empty()) {
+				SBVHInitLeaf(node, refs, bounds);
+				return node;
+			}
+		}
+		std::vector<BVHPrimitiveInfo>().swap(refs);
+
+		Bound3f leftBound, rightBound;
+		for (const BVHPrimitiveInfo &ref : left) leftBound = Union(leftBound, ref.bound);
+		for (const BVHPrimitiveInfo &ref : right) rightBound = Union(rightBound, ref.bound);
+		BVHNode *c0 = SBVHRecursiveBuild(left, leftBound, totalNodes);
+		BVHNode *c1 = SBVHRecursiveBuild(right, rightBound, totalNodes);
+		node->InitInterior(axis, c0, c1);
+		return node;
+	}
+
+	void SBVHInitLeaf(BVHNode *node, const std::vector<BVHPrimitiveInfo> &refs, const Bound3f &bounds) {
+		node->InitLeaf((int)sbvhRefs.size(), (int)refs.size(), bounds);
+		for (const BVHPrimitiveInfo &ref : refs) sbvhRefs.push_back((int)ref.primitiveNumber);
+	}
+
+	// 对象划分中引用所在的质心分桶
+	int objectBucket(const BVHPrimitiveInfo &ref, const SBVHSplit &split) const {
+		return std::min(nBuckets - 1, (int)(nBuckets * (ref.centroid[split.axis] - split.centroidMin) /
+											(split.centroidMax - split.centroidMin)));
+	}
+
+	// 三个轴上按质心分桶的SAH对象划分
+	SBVHSplit findObjectSplit(const std::vector<BVHPrimitiveInfo> &refs, const Bound3f &bounds) const {
+		SBVHSplit best;
+		Bound3f centroidBounds;
+		for (const BVHPrimitiveInfo &ref : refs) centroidBounds = Union(centroidBounds, ref.centroid);
+		float invArea = 1.0f / bounds.SurfaceArea();
+
+		for (int dim = 0; dim < 3; dim++) {
+			float cMin = centroidBounds.pMin[dim], cMax = centroidBounds.pMax[dim];
+			if (cMax <= cMin) continue;
+			SBVHSplit candidate;
+			candidate.axis = dim;
+			candidate.centroidMin = cMin;
+			candidate.centroidMax = cMax;
+			BucketInfo buckets[MaxBuckets];
+			for (const BVHPrimitiveInfo &ref : refs) {
+				int b = objectBucket(ref, candidate);
+				buckets[b].count++;
+				buckets[b].bounds = Union(buckets[b].bounds, ref.bound);
+			}
+			int countAbove[MaxBuckets] = {};
+			Bound3f boundAbove[MaxBuckets];
+			Bound3f b1;
+			int count1 = 0;
+			for (int i = nBuckets - 1; i > 0; i--) {
+				b1 = Union(b1, buckets[i].bounds);
+				count1 += buckets[i].count;
+				countAbove[i - 1] = count1;
+				boundAbove[i - 1] = b1;
+			}
+			Bound3f b0;
+			int count0 = 0;
+			for (int i = 0; i < nBuckets - 1; i++) {
+				b0 = Union(b0, buckets[i].bounds);
+				count0 += buckets[i].count;
+				if (count0 == 0 || countAbove[i] == 0) continue;
+				float cost = traversalCost + intersectCost *
+					(count0 * b0.SurfaceArea() + countAbove[i] * boundAbove[i].SurfaceArea()) * invArea;
+				if (cost < best.cost) {
+					best = candidate;
+					best.cost = cost;
+					best.bucket = i;
+					best.leftBound = b0;
+					best.rightBound = boundAbove[i];
+					best.leftCount = count0;
+					best.rightCount = countAbove[i];
+				}
+			}
+		}
+		return best;
+	}
+
+	// 三角形（限制在ref.bound内的部分）被axis轴上position处的平面分为两部分，返回两部分的包围盒
+	void splitReference(const BVHPrimitiveInfo &ref, int axis, float position, Bound3f *left, Bound3f *right) const {
+		const glm::vec3 *v = primitives.vertices(ref.primitiveNumber);
+		*left = Bound3f();
+		*right = Bound3f();
+		for (int i = 0; i < 3; i++) {
+			const glm::vec3 &v0 = v[i];
+			const glm::vec3 &v1 = v[(i + 1) % 3];
+			if (v0[axis] <= position) *left = Union(*left, v0);
+			if (v0[axis] >= position) *right = Union(*right, v0);
+			// 边跨过平面时，交点同时属于两侧
+			if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position)) {
+				glm::vec3 p = v0 + (v1 - v0) * ((position - v0[axis]) / (v1[axis] - v0[axis]));
+				p[axis] = position;
+				*left = Union(*left, p);
+				*right = Union(*right, p);
+			}
+		}
+		*left = Intersect(*left, ref.bound);
+		*right = Intersect(*right, ref.bound);
+	}
+
+	// 三个轴上等宽分箱的空间划分：每个引用被逐个分箱平面裁剪，
+	// 进入/离开计数分别记在首尾分箱，左右子节点的引用数由此求得
+	SBVHSplit findSpatialSplit(const std::vector<BVHPrimitiveInfo> &refs, const Bound3f &bounds) const {
+		SBVHSplit best;
+		float invArea = 1.0f / bounds.SurfaceArea();
+		for (int dim = 0; dim < 3; dim++) {
+			float origin = bounds.pMin[dim];
+			float binWidth = (bounds.pMax[dim] - origin) / nBuckets;
+			if (binWidth <= 0.0f) continue;
+			Bound3f binBounds[MaxBuckets];
+			int entry[MaxBuckets] = {}, exit[MaxBuckets] = {};
+			auto binIndex = [&](float x) {
+				return std::max(0, std::min(nBuckets - 1, (int)((x - origin) / binWidth)));
+			};
+
+			for (const BVHPrimitiveInfo &ref : refs) {
+				int first = binIndex(ref.bound.pMin[dim]);
+				int last = std::max(first, binIndex(ref.bound.pMax[dim]));
+				BVHPrimitiveInfo cur = ref;
+				for (int b = first; b < last; b++) {
+					Bound3f l, r;
+					splitReference(cur, dim, origin + binWidth * (b + 1), &l, &r);
+					binBounds[b] = Union(binBounds[b], l);
+					cur.bound = r;
+				}
+				binBounds[last] = Union(binBounds[last], cur.bound);
+				entry[first]++;
+				exit[last]++;
+			}
+
+			int countAbove[MaxBuckets] = {};
+			Bound3f boundAbove[MaxBuckets];
+			Bound3f b1;
+			int count1 = 0;
+			for (int i = nBuckets - 1; i > 0; i--) {
+				b1 = Union(b1, binBounds[i]);
+				count1 += exit[i];
+				countAbove[i - 1] = count1;
+				boundAbove[i - 1] = b1;
+			}
+			Bound3f b0;
+			int count0 = 0;
+			for (int i = 0; i < nBuckets - 1; i++) {
+				b0 = Union(b0, binBounds[i]);
+				count0 += entry[i];
+				if (count0 == 0 || countAbove[i] == 0 || b0.IsEmpty() || boundAbove[i].IsEmpty()) continue;
+				float cost = traversalCost + intersectCost *
+					(count0 * b0.SurfaceArea() + countAbove[i] * boundAbove[i].SurfaceArea()) * invArea;
+				if (cost < best.cost) {
+					best.cost = cost;
+					best.axis = dim;
+					best.position = origin + binWidth * (i + 1);
+					best.leftBound = b0;
+					best.rightBound = boundAbove[i];
+					best.leftCount = count0;
+					best.rightCount = countAbove[i];
+				}
+			}
+		}
+		return best;
+	}
+
+	// 按空间划分平面分配引用。跨越平面的引用比较三种方案的SAH代价（裁剪后两侧都放、
+	// 整个放左侧、整个放右侧，即reference unsplitting），复制预算用完时只允许后两种
+	void performSpatialSplit(const std::vector<BVHPrimitiveInfo> &refs, const SBVHSplit &split,
+							 std::vector<BVHPrimitiveInfo> *left, std::vector<BVHPrimitiveInfo> *right)
+	{
+		int axis = split.axis;
+		float position = split.position;
+		Bound3f leftBound = split.leftBound, rightBound = split.rightBound;
+		int leftCount = split.leftCount, rightCount = split.rightCount;
+		for (const BVHPrimitiveInfo &ref : refs) {
+			if (ref.bound.pMax[axis] <= position) {
+				left->push_back(ref);
+				continue;
+			}
+			if (ref.bound.pMin[axis] >= position) {
+				right->push_back(ref);
+				continue;
+			}
+			Bound3f l, r;
+			splitReference(ref, axis, position, &l, &r);
+			float costSplit = leftBound.SurfaceArea() * leftCount + rightBound.SurfaceArea() * rightCount;
+			float costLeft = Union(leftBound, ref.bound).SurfaceArea() * leftCount + rightBound.SurfaceArea() * (rightCount - 1);
+			float costRight = leftBound.SurfaceArea() * (leftCount - 1) + Union(rightBound, ref.bound).SurfaceArea() * rightCount;
+			bool canSplit = sbvhRefTotal < sbvhMaxRefs && !l.IsEmpty() && !r.IsEmpty();
+			if (canSplit && costSplit < costLeft && costSplit < costRight) {
+				BVHPrimitiveInfo lr(ref.primitiveNumber, l), rr(ref.primitiveNumber, r);
+				left->push_back(lr);
+				right->push_back(rr);
+				sbvhRefTotal++;
+			}
+			else if (costLeft < costRight || r.IsEmpty()) {
+				left->push_back(ref);
+				leftBound = Union(leftBound, ref.bound);
+				rightCount--;
+			}
+			else {
+				right->push_back(ref);
+				rightBound = Union(rightBound, ref.bound);
+				leftCount--;
+			}
+		}
+	}
+
+	// 注册一个可移动物体：first/count为该物体在构建输入（传给BVHBuildTree的数组）中的三角形区间，
+	// 例如在getTextureWithTransform前后记录primitives.size()。返回物体编号。
+	// 索引格式会重新打包，使物体不与其他三角形共用顶点；顶点数可能变化，之后由updateTextures整体重新上传
+	int addObject(int first, int count) {
+		BVHObject obj;
+		obj.first = first;
+		obj.count = count;
+		obj.restVertices.resize(count * 3);
+		obj.restNormals.resize(count * 3);
+		for (int k = 0; k < count; k++) {
+			int slot = primitiveSlot[first + k];
+			for (int j = 0; j < 3; j++) {
+				obj.restVertices[k * 3 + j] = primitives.positions[slot * 3 + j];
+				obj.restNormals[k * 3 + j] = primitives.normals[slot * 3 + j];
+			}
+		}
+		objects.push_back(std::move(obj));
+		if (meshStride == IndexedMeshStride) {
+			packIndexedMesh();
+			needsFullUpload = true;
+		}
+		return (int)objects.size() - 1;
+	}
+
+	// 对物体的初始姿态施加变换（世界空间），更新三角形与MeshArray中的顶点和法线，之后需调用refit
+	void setObjectTransform(int id, const glm::mat4 &transform) {
+		const BVHObject &obj = objects[id];
+		glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+		for (int k = 0; k < obj.count; k++) {
+			int slot = primitiveSlot[obj.first + k];
+			glm::vec3 *v = &primitives.positions[slot * 3];
+			glm::vec3 *n = &primitives.normals[slot * 3];
+			for (int j = 0; j < 3; j++) {
+				v[j] = glm::vec3(transform * glm::vec4(obj.restVertices[k * 3 + j], 1.0f));
+				n[j] = normalMatrix * obj.restNormals[k * 3 + j];
+			}
+
+			movedSlots[slot] = 1;
+			if (meshStride == IndexedMeshStride) {
+				// 物体的顶点只在物体内部共用（见packIndexedMesh），被物体的多个三角形重复写入，结果相同
+				for (int j = 0; j < 3; j++) {
+					int vertex = (int)MeshArray[slot * meshStride + j];
+					float *m = &VertexArray[vertex * IndexedVertexStride];
+					m[0] = v[j].x; m[1] = v[j].y; m[2] = v[j].z;
+					m[3] = n[j].x; m[4] = n[j].y; m[5] = n[j].z;
+					addDirtyRange(dirtyVertexRanges, vertex * IndexedVertexStride, vertex * IndexedVertexStride + 6, IndexedVertexStride);
+				}
+				continue;
+			}
+			float *m = &MeshArray[slot * meshStride];
+			for (int j = 0; j < 3; j++) {
+				m[j * 3 + 0] = v[j].x; m[j * 3 + 1] = v[j].y; m[j * 3 + 2] = v[j].z;
+				m[9 + j * 3 + 0] = n[j].x; m[9 + j * 3 + 1] = n[j].y; m[9 + j * 3 + 2] = n[j].z;
+			}
+			addDirtyRange(dirtyMeshRanges, slot * meshStride, slot * meshStride + 18, meshStride - 18);
+		}
+	}
+
+	// 自底向上重新计算包含移动三角形的节点包围盒，树结构不变。
+	// 深度优先顺序中子节点的下标总是大于父节点，因此逆序遍历一次即可。
+	// 包围盒有变化的节点记入dirtyNodeRanges（压缩节点重新编码后记入dirtyCompactRanges）。
+	// 返回true表示树的质量（SAH代价）下降超过refitRebuildThreshold，建议调用rebuild
+	bool refit() {
+		if (!NodeArray || nodeNum == 0) return false;
+		for (int i = nodeNum - 1; i >= 0; i--) {
+			float *node = &NodeArray[i * 9];
+			int n = (int)node[6];
+			Bound3f b;
+			if (n > 0) {
+				bool moved = false;
+				for (int p = 0; p < n && !moved; p++)
+					moved = movedSlots[primitiveIndex((int)node[8] + p)] != 0;
+				if (!moved) continue;
+				// SBVH的裁剪包围盒不再有效，使用完整的三角形包围盒
+				for (int p = 0; p < n; p++)
+					b = Union(b, primitives.bound(primitiveIndex((int)node[8] + p)));
+			}
+			else {
+				const float *c0 = &NodeArray[(i + 1) * 9];
+				const float *c1 = &NodeArray[(int)node[8] * 9];
+				b = Union(Bound3f(glm::vec3(c0[0], c0[1], c0[2]), glm::vec3(c0[3], c0[4], c0[5])),
+						  Bound3f(glm::vec3(c1[0], c1[1], c1[2]), glm::vec3(c1[3], c1[4], c1[5])));
+			}
+			const float nb[6] = { b.pMin.x, b.pMin.y, b.pMin.z, b.pMax.x, b.pMax.y, b.pMax.z };
+			if (memcmp(node, nb, sizeof(nb)) == 0) continue;
+			memcpy(node, nb, sizeof(nb));
+			addDirtyRange(dirtyNodeRanges, i * 9, i * 9 + 6, 3);
+		}
+		std::fill(movedSlots.begin(), movedSlots.end(), 0);
+
+		// 压缩节点相对父节点量化，重新编码后逐texel比较找出变化的部分
+		if (CompactNodeArray) {
+			int size = compactNodeNumX * compactNodeNumY * 4;
+			compactScratch.assign(CompactNodeArray, CompactNodeArray + size);
+			buildCompactNodes();
+			for (int t = 0; t < size; t += 4)
+				if (memcmp(&compactScratch[t], &CompactNodeArray[t], 4 * sizeof(unsigned int)) != 0)
+					addDirtyRange(dirtyCompactRanges, t, t + 4);
+		}
+		return computeSAHCost(false) > builtSAHCost * refitRebuildThreshold;
+	}
+
+	// 以当前三角形位置重新构建，已注册的物体继续有效
+	void rebuild() {
+		rebuildOrder = primitiveOrder;
+		BVHBuildTree(primitives, meshStride);
+	}
+
+	void clearDirty() {
+		dirtyNodeRanges.clear();
+		dirtyMeshRanges.clear();
+		dirtyCompactRanges.clear();
+		dirtyVertexRanges.clear();
+	}
+
+	// 索引格式打包：按位置、法线、纹理坐标与材质完全相同去重顶点（同一模型中Mesh的索引在变换后仍然一致），
+	// MeshArray中每个三角形写入三个顶点下标与材质编号。已注册物体（addObject）的编号也参与去重：
+	// 物体与其他三角形（例如与立方体底面重合的地面）即使顶点完全相同也不共用，setObjectTransform只移动物体自己的顶点
+	void packIndexedMesh() {
+		struct VertexKey {
+			uint32_t w[10];
+			bool operator==(const VertexKey &o) const { return memcmp(w, o.w, sizeof(w)) == 0; }
+		};
+		struct VertexKeyHash {
+			size_t operator()(const VertexKey &k) const {
+				uint64_t h = 14695981039346656037ull;
+				for (uint32_t x : k.w) h = (h ^ x) * 1099511628211ull;
+				return (size_t)h;
+			}
+		};
+		// 构建输入中每个三角形所属的物体，-1为不属于任何物体
+		std::vector<int> inputObject(objects.empty() ? 0 : primitiveOrder.size(), -1);
+		for (int o = 0; o < (int)objects.size(); o++)
+			std::fill(inputObject.begin() + objects[o].first, inputObject.begin() + objects[o].first + objects[o].count, o);
+		std::unordered_map<VertexKey, int, VertexKeyHash> vertexIndex;
+		vertexIndex.reserve(meshNum * 3 / 2);
+		std::vector<float> vertices;
+		vertices.reserve((size_t)meshNum * IndexedVertexStride);
+		for (int i = 0; i < meshNum; i++) {
+			for (int k = 0; k < 3; k++) {
+				const glm::vec3 &p = primitives.positions[i * 3 + k];
+				const glm::vec3 &n = primitives.normals[i * 3 + k];
+				const glm::vec2 &uv = primitives.uvs[i * 3 + k];
+				const float v[IndexedVertexStride] = { p.x, p.y, p.z, n.x, n.y, n.z, uv.x, uv.y };
+				VertexKey key;
+				memcpy(key.w, v, sizeof(v));
+				key.w[8] = (uint32_t)primitives.materialIndex[i];
+				key.w[9] = (uint32_t)(objects.empty() ? -1 : inputObject[primitiveOrder[i]]);
+				auto it = vertexIndex.emplace(key, (int)(vertices.size() / IndexedVertexStride));
+				if (it.second) vertices.insert(vertices.end(), v, v + IndexedVertexStride);
+				MeshArray[i * IndexedMeshStride + k] = (float)it.first->second;
+			}
+			MeshArray[i * IndexedMeshStride + 3] = (float)primitives.materialIndex[i];
+		}
+
+		vertexNum = (int)(vertices.size() / IndexedVertexStride);
+		if (vertexNum > (1 << 24))
+			std::cout << "warning: " << vertexNum << " vertices, indices above 2^24 are not exact as float" << std::endl;
+		vertexNumX = std::max(1, (int)ceilf(sqrtf((float)vertexNum * IndexedVertexStride)));
+		vertexNumY = std::max(1, (vertexNum * IndexedVertexStride + vertexNumX - 1) / vertexNumX);
+		ensureArray(&VertexArray, &vertexArrayCapacity, vertexNumX * vertexNumY);
+		std::copy(vertices.begin(), vertices.end(), VertexArray);
+
+		materialNum = (int)primitives.materials.size();
+		materialNumX = std::max(1, (int)ceilf(sqrtf((float)materialNum * MaterialStride)));
+		materialNumY = std::max(1, (materialNum * MaterialStride + materialNumX - 1) / materialNumX);
+		ensureArray(&MaterialArray, &materialArrayCapacity, materialNumX * materialNumY);
+		for (int m = 0; m < materialNum; m++)
+			packMaterial(primitives.materials[m], &MaterialArray[m * MaterialStride]);
+		std::cout << "indexed mesh: " << meshNum << " triangles, " << vertexNum << " vertices, "
+				  << materialNum << " materials" << std::endl;
+	}
+
+	// 三角形相关纹理（texMesh，以及索引格式的顶点与材质纹理）的字节数
+	size_t meshTextureBytes() const {
+		size_t texels = (size_t)meshNumX * meshNumY;
+		if (meshStride == IndexedMeshStride)
+			texels += (size_t)vertexNumX * vertexNumY + (size_t)materialNumX * materialNumY;
+		return texels * sizeof(float);
+	}
+
+	// 计算展平后BVH树的SAH代价（以根节点表面积归一化），用于比较不同构建参数
+	// normalize为false时不除以根节点表面积（refit时根节点也会变化，用未归一化的代价衡量包围盒膨胀）
+	float computeSAHCost(bool normalize = true) const {
+		if (!NodeArray || nodeNum == 0) return 0.0f;
+		auto nodeArea = [&](int i) {
+			Bound3f b(glm::vec3(NodeArray[i * 9 + 0], NodeArray[i * 9 + 1], NodeArray[i * 9 + 2]),
+					  glm::vec3(NodeArray[i * 9 + 3], NodeArray[i * 9 + 4], NodeArray[i * 9 + 5]));
+			return b.SurfaceArea();
+		};
+		float rootArea = normalize ? nodeArea(0) : 1.0f;
+		if (rootArea <= 0.0f) return 0.0f;
+		float cost = 0.0f;
+		for (int i = 0; i < nodeNum; i++) {
+			int n = (int)NodeArray[i * 9 + 6];
+			float c = (n > 0) ? leafCost(n) : traversalCost;
+			cost += c * nodeArea(i) / rootArea;
+		}
+		return cost;
+	}
+
 	int flattenBVHTree(BVHNode *node, int *offset) {
-		LinearBVHNode *linearNode = &nodes[*offset];
-		setBound(*linearNode, node->bound);
 		int myOffset = (*offset)++;
+		float *linearNode = &NodeArray[myOffset * 9];
+		linearNode[0] = node->bound.pMin.x;
+		linearNode[1] = node->bound.pMin.y;
+		linearNode[2] = node->bound.pMin.z;
+		linearNode[3] = node->bound.pMax.x;
+		linearNode[4] = node->bound.pMax.y;
+		linearNode[5] = node->bound.pMax.z;
 		if (node->nPrimitives > 0) {
-			linearNode->childOffset = node->firstPrimOffset;
-			linearNode->nPrimitives = node->nPrimitives;
+			linearNode[6] = node->nPrimitives;
+			linearNode[7] = 0;
+			linearNode[8] = node->firstPrimOffset;
 		}
 		else {
 			// Create interior flattened BVH node
-			linearNode->axis = node->splitAxis;
-			linearNode->nPrimitives = 0;
+			linearNode[6] = 0;
+			linearNode[7] = node->splitAxis;
 			flattenBVHTree(node->children[0], offset);
-			linearNode->childOffset = flattenBVHTree(node->children[1], offset);
+			linearNode[8] = flattenBVHTree(node->children[1], offset);
 		}
 		return myOffset;
 	}
 
+	// 展平后生成跳转链接：深度优先顺序中父节点在子节点之前，一遍即可完成。
+	// 第一个子节点跳到第二个子节点，第二个子节点继承父节点的跳转目标
+	void buildSkipLinks() {
+		if (nodeNum == 0) return;
+		SkipArray[0] = -1;
+		for (int i = 0; i < nodeNum; i++) {
+			if (NodeArray[i * 9 + 6] > 0) continue;
+			int second = (int)NodeArray[i * 9 + 8];
+			SkipArray[i + 1] = (float)second;
+			SkipArray[second] = SkipArray[i];
+		}
+	}
+
+	// 由NodeArray生成压缩节点CompactNodeArray（GL_RGBA32UI纹理）
+	// 每个压缩节点对应一个二叉内部节点，同时保存两个子节点的包围盒，叶子子节点直接记录三角形区间，
+	// 因此节点数约为二叉节点的一半。子节点包围盒相对当前节点的包围盒最小点（origin）量化为8位，
+	// 每轴缩放为2的整数次幂：p = origin + q * 2^e，乘法没有舍入误差，CPU与GPU解码结果一致；
+	// 量化时向外取整，解码后的包围盒只会比原包围盒大，不会漏掉相交。
+	// 布局：texel 0 = 根节点包围盒最小点（float位）与节点数；压缩节点k占texel 1+2k和2+2k：
+	//   uint[0..2] 子节点0最小点、子节点0最大点、子节点1最小点的量化值（低24位）+ x/y/z轴指数（高8位）
+	//   uint[3]    子节点1最大点的量化值
+	//   uint[4..7] 子节点0索引、子节点0三角形数量、子节点1索引、子节点1三角形数量
+	//              （数量为0表示内部节点，索引为压缩节点索引；数量为-1表示空）
+	void buildCompactNodes() {
+		if (!NodeArray || nodeNum == 0) return;
+
+		// 二叉内部节点按深度优先顺序编号，即为压缩节点索引，叶子为-1
+		reserveTracked(compactIndex, nodeNum);
+		compactIndex.resize(nodeNum);
+		int n = 0;
+		for (int i = 0; i < nodeNum; i++)
+			compactIndex[i] = (NodeArray[i * 9 + 6] > 0) ? -1 : n++;
+		compactNodeNum = std::max(n, 1);
+
+		int texels = 1 + 2 * compactNodeNum;
+		compactNodeNumX = (int)ceilf(sqrtf((float)texels));
+		compactNodeNumY = (texels + compactNodeNumX - 1) / compactNodeNumX;
+		ensureArray(&CompactNodeArray, &compactArrayCapacity, compactNodeNumX * compactNodeNumY * 4);
+
+		glm::vec3 rootMin(NodeArray[0], NodeArray[1], NodeArray[2]);
+		for (int a = 0; a < 3; a++) memcpy(&CompactNodeArray[a], &rootMin[a], sizeof(float));
+		CompactNodeArray[3] = compactNodeNum;
+
+		// 整棵树只有一个叶子：生成只有一个子节点的压缩节点
+		if (compactIndex[0] < 0) {
+			int child[2] = { 0, -1 };
+			encodeCompactNode(0, rootMin, child, nullptr);
+			updatePeakMemory();
+			return;
+		}
+
+		struct Item { int node; glm::vec3 origin; };
+		std::vector<Item> stack;
+		stack.push_back({ 0, rootMin });
+		while (!stack.empty()) {
+			Item item = stack.back();
+			stack.pop_back();
+			int child[2] = { item.node + 1, (int)NodeArray[item.node * 9 + 8] };
+			glm::vec3 childOrigin[2];
+			encodeCompactNode(compactIndex[item.node], item.origin, child, childOrigin);
+			for (int k = 0; k < 2; k++)
+				if (compactIndex[child[k]] >= 0) stack.push_back({ child[k], childOrigin[k] });
+		}
+		updatePeakMemory();
+	}
+
+	// treelet重构：以每个内部节点为根，反复展开表面积最大的叶子得到最多treeletSize个叶子的treelet，
+	// 用动态规划求出这些叶子的最优二叉组合，代价更低时复用treelet的内部节点重新连接。
+	// 自底向上处理，每遍之后重复直到收敛、达到遍数或超出时间上限
+	void optimizeBVHTree(BVHNode *root) {
+		if (root->nPrimitives > 0) return;
+		auto start = std::chrono::steady_clock::now();
+		optimizeDeadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(optimizeTimeBudget));
+		optimizeTimedOut = false;
+		int n = std::max(3, std::min(treeletSize, 8));
+
+		float rootArea = root->bound.SurfaceArea();
+		float before = initNodeCost(root);
+		int passes = 0;
+		while (passes < optimizePasses && !optimizeTimedOut) {
+			float prev = root->sahCost;
+			optimizeSubtree(root, n);
+			passes++;
+			if (root->sahCost > prev * (1.0f - 1e-3f)) break;
+		}
+
+		optimizeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		optimizeTimeLimited = optimizeTimedOut;
+		sahCostBeforeOptimize = (rootArea > 0.0f) ? before / rootArea : 0.0f;
+		sahCostAfterOptimize = (rootArea > 0.0f) ? root->sahCost / rootArea : 0.0f;
+		std::cout << "BVH optimize: SAH cost " << sahCostBeforeOptimize << " -> " << sahCostAfterOptimize
+				  << " (" << ((sahCostBeforeOptimize > 0.0f) ? 100.0f * (sahCostAfterOptimize - sahCostBeforeOptimize) / sahCostBeforeOptimize : 0.0f) << "%), "
+				  << passes << " passes, treelet " << n << ", " << optimizeTime * 1000.0 << " ms"
+				  << (optimizeTimedOut ? " (time budget reached)" : "") << std::endl;
+	}
+
+	// 从节点池中分配一个节点（多线程安全）
+	BVHNode *allocNode() {
+		return &nodePool[nodePoolUsed.fetch_add(1)];
+	}
+
+private:
+	// 跨构建复用的缓冲区
+	std::vector<BVHNode> nodePool;
+	std::atomic<int> nodePoolUsed{0};
+	std::vector<BVHPrimitiveInfo> primitiveInfo;
+	TriangleStore orderedPrims; // 构建后按新顺序搬运三角形的目标，与primitives交替使用
+	std::vector<int> compactIndex;
+	std::vector<unsigned int> compactScratch;
+	std::vector<int> primitiveSlot; // primitiveOrder的逆映射：构建输入下标 -> primitives中的位置
+	std::vector<int> rebuildOrder;  // rebuild时构建输入在最初输入中的下标，构建中与primitiveOrder合并
+	std::vector<char> movedSlots;   // 自上次refit以来移动过的三角形
+	int nodeArrayCapacity = 0, meshArrayCapacity = 0, compactArrayCapacity = 0, primRefArrayCapacity = 0, skipArrayCapacity = 0;
+	int vertexArrayCapacity = 0, materialArrayCapacity = 0;
+
+	// treelet重构状态
+	std::chrono::steady_clock::time_point optimizeDeadline;
+	bool optimizeTimedOut = false;
+	int optimizeCounter = 0;
+
+	// 计算并记录每个节点的子树SAH代价，与computeSAHCost(false)的定义一致
+	float initNodeCost(BVHNode *node) {
+		float area = node->bound.SurfaceArea();
+		if (node->nPrimitives > 0)
+			node->sahCost = leafCost(node->nPrimitives) * area;
+		else
+			node->sahCost = traversalCost * area + initNodeCost(node->children[0]) + initNodeCost(node->children[1]);
+		return node->sahCost;
+	}
+
+	// 后序遍历：先优化子树，再以当前节点为根重构treelet
+	void optimizeSubtree(BVHNode *node, int n) {
+		if (node->nPrimitives > 0 || optimizeTimedOut) return;
+		optimizeSubtree(node->children[0], n);
+		optimizeSubtree(node->children[1], n);
+		// 子树变化后更新当前节点的代价（包围盒不变）
+		node->sahCost = traversalCost * node->bound.SurfaceArea()
+			+ node->children[0]->sahCost + node->children[1]->sahCost;
+		if ((++optimizeCounter & 255) == 0 && std::chrono::steady_clock::now() > optimizeDeadline) {
+			optimizeTimedOut = true;
+			return;
+		}
+		restructureTreelet(node, n);
+	}
+
+	struct Treelet {
+		BVHNode *leaves[8];
+		BVHNode *internals[8];
+		Bound3f bounds[256];  // 叶子子集的包围盒
+		float cost[256];      // 叶子子集组成最优子树的代价
+		unsigned char split[256]; // 最优划分中包含最低位叶子的一侧
+		int nLeaves, nextInternal;
+	};
+
+	void restructureTreelet(BVHNode *root, int n) {
+		Treelet t;
+		t.leaves[0] = root->children[0];
+		t.leaves[1] = root->children[1];
+		t.internals[0] = root;
+		t.nLeaves = 2;
+		int nInternals = 1;
+		// 展开表面积最大的内部节点
+		while (t.nLeaves < n) {
+			int best = -1;
+			float bestArea = -1.0f;
+			for (int i = 0; i < t.nLeaves; i++) {
+				if (t.leaves[i]->nPrimitives > 0) continue;
+				float area = t.leaves[i]->bound.SurfaceArea();
+				if (area > bestArea) { bestArea = area; best = i; }
+			}
+			if (best < 0) break;
+			BVHNode *expand = t.leaves[best];
+			t.internals[nInternals++] = expand;
+			t.leaves[best] = expand->children[0];
+			t.leaves[t.nLeaves++] = expand->children[1];
+		}
+		if (t.nLeaves < 3) return;
+
+		// 按子集编号递增计算，真子集的编号总是更小
+		int full = (1 << t.nLeaves) - 1;
+		for (int s = 1; s <= full; s++) {
+			int low = s & -s;
+			if (s == low) {
+				int i = 0;
+				while ((1 << i) != low) i++;
+				t.bounds[s] = t.leaves[i]->bound;
+				t.cost[s] = t.leaves[i]->sahCost;
+				continue;
+			}
+			t.bounds[s] = Union(t.bounds[s ^ low], t.bounds[low]);
+			float bestCost = std::numeric_limits<float>::max();
+			int bestSplit = low;
+			// 只枚举包含最低位叶子的一侧，避免对称划分重复计算
+			for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+				if (!(p & low)) continue;
+				float c = t.cost[p] + t.cost[s ^ p];
+				if (c < bestCost) { bestCost = c; bestSplit = p; }
+			}
+			t.cost[s] = traversalCost * t.bounds[s].SurfaceArea() + bestCost;
+			t.split[s] = (unsigned char)bestSplit;
+		}
+
+		if (t.cost[full] >= root->sahCost * (1.0f - 1e-5f)) return;
+		t.nextInternal = 1;
+		emitTreelet(t, full, root);
+	}
+
+	// 按最优划分重新连接treelet，根节点保持不变，其余内部节点按顺序复用
+	BVHNode *emitTreelet(Treelet &t, int s, BVHNode *root) {
+		if ((s & (s - 1)) == 0) {
+			int i = 0;
+			while ((1 << i) != s) i++;
+			return t.leaves[i];
+		}
+		BVHNode *node = (s == (1 << t.nLeaves) - 1) ? root : t.internals[t.nextInternal++];
+		BVHNode *c0 = emitTreelet(t, t.split[s], root);
+		BVHNode *c1 = emitTreelet(t, s ^ t.split[s], root);
+		// 分割轴取两个子节点中心相距最远的轴，第一个子节点在该轴上位于较小一侧，保证遍历时的远近顺序
+		glm::vec3 d = (c1->bound.pMin + c1->bound.pMax) - (c0->bound.pMin + c0->bound.pMax);
+		int axis = 0;
+		if (std::abs(d.y) > std::abs(d[axis])) axis = 1;
+		if (std::abs(d.z) > std::abs(d[axis])) axis = 2;
+		if (d[axis] < 0.0f) std::swap(c0, c1);
+		node->InitInterior(axis, c0, c1);
+		node->sahCost = t.cost[s];
+		return node;
+	}
+
+	// SBVH构建状态
+	std::vector<int> sbvhRefs; // 叶子中的三角形引用，按深度优先顺序
+	int sbvhRefTotal = 0, sbvhMaxRefs = 0;
+	float sbvhRootArea = 0.0f;
+
+	// 容量不足时才重新分配数组，并把使用的部分清零
+	template <typename T>
+	void ensureArray(T **array, int *capacity, int size) {
+		if (*capacity < size) {
+			delete[] *array;
+			*array = new T[size];
+			*capacity = size;
+			buildStats.allocations++;
+		}
+		memset(*array, 0, sizeof(T) * size);
+	}
+
+	// 写入一个压缩节点，child为两个子节点的二叉节点索引（-1表示空），
+	// childOrigin返回子节点解码后的包围盒最小点，作为其子节点的量化原点
+	void encodeCompactNode(int slot, const glm::vec3 &origin, const int child[2], glm::vec3 childOrigin[2]) {
+		glm::vec3 pMax(std::numeric_limits<float>::lowest());
+		for (int k = 0; k < 2; k++)
+			if (child[k] >= 0)
+				pMax = glm::max(pMax, glm::vec3(NodeArray[child[k] * 9 + 3], NodeArray[child[k] * 9 + 4], NodeArray[child[k] * 9 + 5]));
+
+		unsigned int q[2][2][3]; // [子节点][最小点/最大点][轴]
+		unsigned int exponent[3];
+		for (int a = 0; a < 3; a++) {
+			// 取最小的e使 origin + 255 * 2^e 覆盖两个子节点
+			float extent = pMax[a] - origin[a];
+			int e = (extent > 0.0f) ? (int)ceilf(log2f(extent / 255.0f)) : -126;
+			e = std::max(e, -126);
+			while (e < 127 && origin[a] + 255.0f * ldexpf(1.0f, e) < pMax[a]) e++;
+			float scale = ldexpf(1.0f, e);
+			exponent[a] = (unsigned int)(e + 127);
+
+			for (int k = 0; k < 2; k++) {
+				if (child[k] < 0) {
+					q[k][0][a] = 255;
+					q[k][1][a] = 0;
+					continue;
+				}
+				float lo = NodeArray[child[k] * 9 + a];
+				float hi = NodeArray[child[k] * 9 + 3 + a];
+				int qLo = std::max(0, std::min(255, (int)floorf((lo - origin[a]) / scale)));
+				while (qLo > 0 && origin[a] + qLo * scale > lo) qLo--;
+				int qHi = std::max(0, std::min(255, (int)ceilf((hi - origin[a]) / scale)));
+				while (qHi < 255 && origin[a] + qHi * scale < hi) qHi++;
+				q[k][0][a] = qLo;
+				q[k][1][a] = qHi;
+				if (childOrigin) childOrigin[k][a] = origin[a] + qLo * scale;
+			}
+		}
+
+		unsigned int *dst = &CompactNodeArray[(1 + 2 * slot) * 4];
+		auto pack = [](const unsigned int v[3]) { return v[0] | (v[1] << 8) | (v[2] << 16); };
+		dst[0] = pack(q[0][0]) | (exponent[0] << 24);
+		dst[1] = pack(q[0][1]) | (exponent[1] << 24);
+		dst[2] = pack(q[1][0]) | (exponent[2] << 24);
+		dst[3] = pack(q[1][1]);
+		for (int k = 0; k < 2; k++) {
+			int c = child[k];
+			if (c < 0) {
+				dst[4 + 2 * k] = 0;
+				dst[5 + 2 * k] = 0xFFFFFFFFu;
+			}
+			else if (compactIndex[c] < 0) {
+				dst[4 + 2 * k] = (unsigned int)NodeArray[c * 9 + 8];
+				dst[5 + 2 * k] = (unsigned int)NodeArray[c * 9 + 6];
+			}
+			else {
+				dst[4 + 2 * k] = compactIndex[c];
+				dst[5 + 2 * k] = 0;
+			}
+		}
+	}
+
+	void updatePrimitiveSlots() {
+		primitiveSlot.resize(primitiveOrder.size());
+		for (int i = 0; i < (int)primitiveOrder.size(); i++) primitiveSlot[primitiveOrder[i]] = i;
+	}
+
+	// 记录脏区间，与上一个区间的间隔不超过maxGap时合并
+	static void addDirtyRange(std::vector<std::pair<int, int>> &ranges, int begin, int end, int maxGap = 0) {
+		if (!ranges.empty() && begin <= ranges.back().second + maxGap && end + maxGap >= ranges.back().first) {
+			ranges.back().first = std::min(ranges.back().first, begin);
+			ranges.back().second = std::max(ranges.back().second, end);
+			return;
+		}
+		ranges.push_back({ begin, end });
+	}
+
+	template <typename T>
+	void reserveTracked(std::vector<T> &v, size_t n) {
+		if (v.capacity() < n) {
+			v.reserve(n);
+			buildStats.allocations++;
+		}
+	}
+
+	void updatePeakMemory() {
+		buildStats.currentBytes = sizeof(float) * ((size_t)nodeArrayCapacity + meshArrayCapacity + compactArrayCapacity + primRefArrayCapacity + skipArrayCapacity
+				+ vertexArrayCapacity + materialArrayCapacity)
+			+ sizeof(int) * (compactIndex.capacity() + sbvhRefs.capacity() + primitiveOrder.capacity() + primitiveSlot.capacity())
+			+ sizeof(BVHNode) * nodePool.capacity()
+			+ sizeof(BVHPrimitiveInfo) * primitiveInfo.capacity()
+			+ orderedPrims.memoryBytes() + primitives.memoryBytes();
+		buildStats.peakBytes = std::max(buildStats.peakBytes, buildStats.currentBytes);
+	}
+
 };
 
+// 并行构建测试：依次使用1, 2, 4, ..., maxThreads个线程构建，
+// 输出构建耗时和相对单线程的加速比，并检查NodeArray/MeshArray与单线程结果逐字节一致
+void BVHBuildBenchmark(const TriangleStore &prims, int stride = 42,
+					   SplitMethod method = SplitMethod::SAH, int maxThreads = 0)
+{
+	maxThreads = GetThreadCount(maxThreads);
+	BVHTree reference;
+	reference.splitMethod = method;
+	reference.nThreads = 1;
+	reference.BVHBuildTree(prims, stride);
+	double serialTime = reference.buildTime;
+
+	std::cout << "threads  time(ms)  speedup  identical" << std::endl;
+	for (int n = 1; ; n = std::min(n * 2, maxThreads)) {
+		BVHTree tree;
+		tree.splitMethod = method;
+		tree.nThreads = n;
+		tree.BVHBuildTree(prims, stride);
+		bool identical = tree.nodeNum == reference.nodeNum && tree.meshNum == reference.meshNum
+			&& memcmp(tree.NodeArray, reference.NodeArray, sizeof(float) * tree.nodeNumX * tree.nodeNumY) == 0
+			&& memcmp(tree.MeshArray, reference.MeshArray, sizeof(float) * tree.meshNum * stride) == 0;
+		std::cout << n << "  " << tree.buildTime * 1000.0 << "  " << serialTime / tree.buildTime
+				  << "  " << (identical ? "yes" : "NO") << std::endl;
+		tree.releaseAll();
+		if (n == maxThreads) break;
+	}
+	reference.releaseAll();
+}
+
 struct hitRecord {
 	glm::vec3 Pos;
-	glm::vec3 Normal;
+	glm::vec3 Normal;            // 几何法线，由三角形顶点环绕方向决定，不随光线翻转
+	float t = -1.0f;             // 交点距离
+	glm::vec2 uv = glm::vec2(0); // 重心坐标，交点 = (1-u-v)*v0 + u*v1 + v*v2，可用于插值法线与纹理坐标
+	int primIndex = -1;          // 三角形在MeshArray（primitives）中的下标
+	int materialID = -1;         // primitives.materials中的下标（IntersectScene为scene.materials中的下标）
 };
-bool IntersectBVH(const BVHTree& bvhTree, const Ray &ray, hitRecord& rec) {
-	// if (!bvhTree.nodes) return false;
-	bool hit = false;
+
+// 由最近交点填写hitRecord，法线与材质只在遍历结束后读取一次
+void setHitRecord(const BVHTree& bvhTree, const Ray &ray, float t, int primIndex, const glm::vec2 &uv, hitRecord &rec) {
+	const glm::vec3 *v = bvhTree.primitives.vertices(primIndex);
+	rec.Pos = ray.origin + t * ray.direction;
+	rec.Normal = glm::normalize(glm::cross(v[1] - v[0], v[2] - v[0]));
+	rec.t = t;
+	rec.uv = uv;
+	rec.primIndex = primIndex;
+	rec.materialID = bvhTree.primitives.materialIndex[primIndex];
+}
+
+// 遍历统计，用于比较不同划分方法下每条光线的遍历代价
+struct BVHTraversalStats {
+	long long rays = 0;
+	long long nodesVisited = 0;
+	long long primitivesTested = 0;
+};
+
+// 相机主光线：(x, y)为屏幕上的归一化坐标，(0, 0)为左下角、(1, 1)为右上角，与着色器中的主光线相同
+Ray CameraRay(const Camera &camera, float x, float y) {
+	Ray ray;
+	ray.origin = camera.Position;
+	ray.direction = glm::normalize(camera.LeftBottomCorner
+		+ (x * 2.0f * camera.halfW) * camera.Right
+		+ (y * 2.0f * camera.halfH) * camera.Up);
+	return ray;
+}
+
+// 测试用的width x height条相机光线，rays[j * width + i]穿过像素(i, j)的左下角，j = 0为最下面一行
+std::vector<Ray> CameraTestRays(const Camera &camera, int width, int height) {
+	std::vector<Ray> rays(width * height);
+	for (int j = 0; j < height; j++)
+		for (int i = 0; i < width; i++)
+			rays[j * width + i] = CameraRay(camera, (float)i / (float)width, (float)j / (float)height);
+	return rays;
+}
+
+// 最近交点查询：命中三角形后立即缩小tMax，内部节点同时测试两个子包围盒，先访问进入距离较近的子节点，
+// 较远的子节点连同进入距离入栈，出栈时跳过比当前交点更远的节点。stats->nodesVisited统计包围盒测试次数
+bool IntersectBVH(const BVHTree& bvhTree, const Ray &ray, hitRecord& rec, BVHTraversalStats *stats = nullptr) {
+	if (bvhTree.nodeNum == 0) return false;
 
 	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
-	int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
-	// Follow ray through BVH nodes to find primitive intersections
-	int toVisitOffset = 0, currentNodeIndex = 0;
-	int nodesToVisit[64];
-	while (true) {
-		int offset1 = currentNodeIndex * (9);
-		LinearBVHNode node;
-		node.pMin = glm::vec3(bvhTree.NodeArray[offset1 + 0], bvhTree.NodeArray[offset1 + 1], bvhTree.NodeArray[offset1 + 2]);
-		node.pMax = glm::vec3(bvhTree.NodeArray[offset1 + 3], bvhTree.NodeArray[offset1 + 4], bvhTree.NodeArray[offset1 + 5]);
-		node.nPrimitives = bvhTree.NodeArray[offset1 + 6];
-		node.axis = bvhTree.NodeArray[offset1 + 7];
-		node.childOffset = bvhTree.NodeArray[offset1 + 8];
-
-		// Ray 与 BVH的交点
-		Bound3f bound;
-		getBound(node, bound);
-		if (IntersectBound(bound, ray, invDir, dirIsNeg)) {
-			if (node.nPrimitives > 0) {
-				// Ray 与 叶节点的交点
-				for (int i = 0; i < node.nPrimitives; ++i) {
-					int offset = (node.childOffset + i) * (9 + 9 + 6);
-					Triangle tri; 
-					tri.v0 = glm::vec3(bvhTree.MeshArray[offset + 0], bvhTree.MeshArray[offset + 1], bvhTree.MeshArray[offset + 2]);
-					tri.v1 = glm::vec3(bvhTree.MeshArray[offset + 3], bvhTree.MeshArray[offset + 4], bvhTree.MeshArray[offset + 5]);
-					tri.v2 = glm::vec3(bvhTree.MeshArray[offset + 6], bvhTree.MeshArray[offset + 7], bvhTree.MeshArray[offset + 8]);
-					float t = hitTriangle(tri, ray);
-					if (t > 0.0f) hit = true; 
+	WatertightRay wray = prepareWatertightRay(ray);
+	float tMax = std::numeric_limits<float>::max();
+	int hitIndex = -1;
+	glm::vec2 hitUV(0.0f);
+	if (stats) stats->rays++;
+
+	// 返回进入距离，不相交或比当前交点更远时返回-1
+	auto hitBox = [&](int index) {
+		if (stats) stats->nodesVisited++;
+		const float *node = &bvhTree.NodeArray[index * 9];
+		float t0 = 0.0f, t1 = tMax;
+		for (int a = 0; a < 3; a++) {
+			float tNear = (node[a] - ray.origin[a]) * invDir[a];
+			float tFar = (node[3 + a] - ray.origin[a]) * invDir[a];
+			if (tNear > tFar) std::swap(tNear, tFar);
+			t0 = std::max(t0, tNear);
+			t1 = std::min(t1, tFar);
+		}
+		return (t0 <= t1) ? t0 : -1.0f;
+	};
+
+	struct StackEntry { int node; float tNear; };
+	TraversalStack<StackEntry> stack;
+	int current = (hitBox(0) >= 0.0f) ? 0 : -1;
+	while (current >= 0) {
+		const float *node = &bvhTree.NodeArray[current * 9];
+		int nPrimitives = (int)node[6];
+		if (nPrimitives > 0) {
+			for (int p = (int)node[8]; p < (int)node[8] + nPrimitives; p++) {
+				const glm::vec3 *v = bvhTree.primitives.vertices(bvhTree.primitiveIndex(p));
+				TriangleHit h = hitTriangleWatertight(v[0], v[1], v[2], wray, tMax);
+				if (stats) stats->primitivesTested++;
+				if (h.hit) {
+					tMax = h.t;
+					hitIndex = bvhTree.primitiveIndex(p);
+					hitUV = glm::vec2(h.u, h.v);
 				}
-				if (toVisitOffset == 0) break;
-				currentNodeIndex = nodesToVisit[--toVisitOffset];
 			}
-			else {
-				// 把 BVH node 放入 _nodesToVisit_ stack, advance to near
-				if (dirIsNeg[int(node.axis)]) {
-					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-					currentNodeIndex = node.childOffset;
-				}
-				else {
-					nodesToVisit[toVisitOffset++] = node.childOffset;
-					currentNodeIndex = currentNodeIndex + 1;
+		}
+		else {
+			int first = current + 1, second = (int)node[8];
+			float t0 = hitBox(first), t1 = hitBox(second);
+			if (t0 >= 0.0f && t1 >= 0.0f) {
+				bool secondNear = t1 < t0;
+				stack.push({ secondNear ? first : second, secondNear ? t0 : t1 });
+				current = secondNear ? second : first;
+				continue;
+			}
+			if (t0 >= 0.0f || t1 >= 0.0f) {
+				current = (t0 >= 0.0f) ? first : second;
+				continue;
+			}
+		}
+		// 出栈，跳过比当前交点更远的节点
+		current = -1;
+		while (!stack.empty()) {
+			StackEntry entry = stack.pop();
+			if (entry.tNear <= tMax) {
+				current = entry.node;
+				break;
+			}
+		}
+	}
+
+	if (hitIndex < 0) return false;
+	setHitRecord(bvhTree, ray, tMax, hitIndex, hitUV, rec);
+	return true;
+}
+
+// 解码压缩节点中第k个分量（0..2）的8位量化值
+float decodeCompactQuant(unsigned int bits, int k) {
+	return (float)((bits >> (8 * k)) & 255u);
+}
+
+// 解码轴指数：高8位为IEEE单精度的指数域，直接拼成2^e
+float decodeCompactScale(unsigned int bits) {
+	unsigned int f = (bits >> 24) << 23;
+	float scale;
+	memcpy(&scale, &f, sizeof(float));
+	return scale;
+}
+
+// 使用压缩节点（CompactNodeArray）的最近交点查询，与着色器中的IntersectCompactBVH逻辑一致：
+// 每次访问一个压缩节点同时测试两个子包围盒，先访问较近的子节点，
+// 入栈时记录进入距离，已找到更近交点时跳过。stats->nodesVisited统计的是压缩节点数
+bool IntersectCompactBVH(const BVHTree& bvhTree, const Ray &ray, hitRecord& rec, BVHTraversalStats *stats = nullptr) {
+	const unsigned int *nodes = bvhTree.CompactNodeArray;
+	if (!nodes || bvhTree.compactNodeNum == 0) return false;
+
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	WatertightRay wray = prepareWatertightRay(ray);
+	float tMax = std::numeric_limits<float>::max();
+	int hitIndex = -1;
+	glm::vec2 hitUV(0.0f);
+
+	glm::vec3 origin;
+	for (int a = 0; a < 3; a++) memcpy(&origin[a], &nodes[a], sizeof(float));
+
+	struct StackEntry { int node; glm::vec3 origin; float tNear; };
+	TraversalStack<StackEntry> stack;
+	int current = 0;
+	if (stats) stats->rays++;
+
+	auto hitBox = [&](const glm::vec3 &lo, const glm::vec3 &hi) {
+		float t0 = 0.0f, t1 = tMax;
+		for (int a = 0; a < 3; a++) {
+			float tNear = (lo[a] - ray.origin[a]) * invDir[a];
+			float tFar = (hi[a] - ray.origin[a]) * invDir[a];
+			if (tNear > tFar) std::swap(tNear, tFar);
+			t0 = std::max(t0, tNear);
+			t1 = std::min(t1, tFar);
+		}
+		return (t0 <= t1) ? t0 : -1.0f;
+	};
+
+	while (true) {
+		if (stats) stats->nodesVisited++;
+		const unsigned int *a = &nodes[(1 + 2 * current) * 4];
+		const unsigned int *b = a + 4;
+		glm::vec3 scale(decodeCompactScale(a[0]), decodeCompactScale(a[1]), decodeCompactScale(a[2]));
+		glm::vec3 lo[2], hi[2];
+		float tNear[2];
+		for (int k = 0; k < 2; k++) {
+			for (int c = 0; c < 3; c++) {
+				lo[k][c] = origin[c] + decodeCompactQuant(a[2 * k], c) * scale[c];
+				hi[k][c] = origin[c] + decodeCompactQuant(a[2 * k + 1], c) * scale[c];
+			}
+			int count = (int)b[2 * k + 1];
+			tNear[k] = (count < 0) ? -1.0f : hitBox(lo[k], hi[k]);
+			// 叶子子节点直接求交
+			if (tNear[k] >= 0.0f && count > 0) {
+				for (int p = (int)b[2 * k]; p < (int)b[2 * k] + count; p++) {
+					const glm::vec3 *v = bvhTree.primitives.vertices(bvhTree.primitiveIndex(p));
+					TriangleHit h = hitTriangleWatertight(v[0], v[1], v[2], wray, tMax);
+					if (stats) stats->primitivesTested++;
+					if (h.hit) {
+						tMax = h.t;
+						hitIndex = bvhTree.primitiveIndex(p);
+						hitUV = glm::vec2(h.u, h.v);
+					}
 				}
+				tNear[k] = -1.0f;
 			}
 		}
-		else {
-			if (toVisitOffset == 0) break;
-			currentNodeIndex = nodesToVisit[--toVisitOffset];
+
+		bool visit0 = tNear[0] >= 0.0f && tNear[0] <= tMax;
+		bool visit1 = tNear[1] >= 0.0f && tNear[1] <= tMax;
+		if (visit0 && visit1) {
+			int nearChild = (tNear[1] < tNear[0]) ? 1 : 0;
+			int farChild = 1 - nearChild;
+			stack.push({ (int)b[2 * farChild], lo[farChild], tNear[farChild] });
+			current = (int)b[2 * nearChild];
+			origin = lo[nearChild];
+			continue;
+		}
+		if (visit0 || visit1) {
+			int k = visit0 ? 0 : 1;
+			current = (int)b[2 * k];
+			origin = lo[k];
+			continue;
 		}
+		// 出栈，跳过比当前交点更远的节点
+		while (!stack.empty() && stack.top().tNear > tMax) stack.pop();
+		if (stack.empty()) break;
+		StackEntry entry = stack.pop();
+		current = entry.node;
+		origin = entry.origin;
 	}
-	return hit;
+
+	if (hitIndex < 0) return false;
+	setHitRecord(bvhTree, ray, tMax, hitIndex, hitUV, rec);
+	return true;
 }
 
+// 使用SkipArray的无栈最近交点查询，与着色器中的IntersectStacklessBVH逻辑一致：
+// 命中内部节点时进入第一个子节点，未命中或处理完叶子时沿跳转链接前进，不需要栈，也没有深度限制。
+// 访问顺序固定为深度优先顺序，不能按光线方向先访问近的子节点
+bool IntersectStacklessBVH(const BVHTree& bvhTree, const Ray &ray, hitRecord& rec, BVHTraversalStats *stats = nullptr) {
+	if (!bvhTree.SkipArray || bvhTree.nodeNum == 0) return false;
+
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	WatertightRay wray = prepareWatertightRay(ray);
+	float tMax = std::numeric_limits<float>::max();
+	int hitIndex = -1;
+	glm::vec2 hitUV(0.0f);
+	if (stats) stats->rays++;
+
+	int current = 0;
+	while (current >= 0) {
+		if (stats) stats->nodesVisited++;
+		const float *node = &bvhTree.NodeArray[current * 9];
+		float t0 = 0.0f, t1 = tMax;
+		for (int a = 0; a < 3; a++) {
+			float tNear = (node[a] - ray.origin[a]) * invDir[a];
+			float tFar = (node[3 + a] - ray.origin[a]) * invDir[a];
+			if (tNear > tFar) std::swap(tNear, tFar);
+			t0 = std::max(t0, tNear);
+			t1 = std::min(t1, tFar);
+		}
+		if (t0 > t1) {
+			current = (int)bvhTree.SkipArray[current];
+			continue;
+		}
+		int nPrimitives = (int)node[6];
+		if (nPrimitives == 0) {
+			current = current + 1;
+			continue;
+		}
+		for (int p = (int)node[8]; p < (int)node[8] + nPrimitives; p++) {
+			const glm::vec3 *v = bvhTree.primitives.vertices(bvhTree.primitiveIndex(p));
+			TriangleHit h = hitTriangleWatertight(v[0], v[1], v[2], wray, tMax);
+			if (stats) stats->primitivesTested++;
+			if (h.hit) {
+				tMax = h.t;
+				hitIndex = bvhTree.primitiveIndex(p);
+				hitUV = glm::vec2(h.u, h.v);
+			}
+		}
+		current = (int)bvhTree.SkipArray[current];
+	}
+
+	if (hitIndex < 0) return false;
+	setHitRecord(bvhTree, ray, tMax, hitIndex, hitUV, rec);
+	return true;
+}
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION // include之前必须定义
 #include <tool/stb_image_write.h>>
 
 
+// 遮挡查询（阴影光线）：只判断(0, tMax)内是否有任意三角形，找到第一个就返回。
+// 只读取顶点位置，不计算法线与材质；子节点不按距离排序，任意顺序都可以提前结束
+bool OccludedBVH(const BVHTree& bvhTree, const Ray &ray, float tMax, BVHTraversalStats *stats = nullptr) {
+	if (bvhTree.nodeNum == 0) return false;
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	WatertightRay wray = prepareWatertightRay(ray);
+	TraversalStack<int> nodesToVisit;
+	int current = 0;
+	if (stats) stats->rays++;
+	while (true) {
+		if (stats) stats->nodesVisited++;
+		const float *node = &bvhTree.NodeArray[current * 9];
+		float t0 = 0.0f, t1 = tMax;
+		for (int a = 0; a < 3; a++) {
+			float tNear = (node[a] - ray.origin[a]) * invDir[a];
+			float tFar = (node[3 + a] - ray.origin[a]) * invDir[a];
+			if (tNear > tFar) std::swap(tNear, tFar);
+			t0 = std::max(t0, tNear);
+			t1 = std::min(t1, tFar);
+		}
+		if (t0 <= t1) {
+			int nPrimitives = (int)node[6];
+			if (nPrimitives == 0) {
+				nodesToVisit.push((int)node[8]);
+				current = current + 1;
+				continue;
+			}
+			for (int p = (int)node[8]; p < (int)node[8] + nPrimitives; p++) {
+				const glm::vec3 *v = bvhTree.primitives.vertices(bvhTree.primitiveIndex(p));
+				if (stats) stats->primitivesTested++;
+				if (hitTriangleWatertight(v[0], v[1], v[2], wray, tMax).hit) return true;
+			}
+		}
+		if (nodesToVisit.empty()) break;
+		current = nodesToVisit.pop();
+	}
+	return false;
+}
+
 void BVHTest(const BVHTree& bvhTree, const Camera& camera) {
 
-	Ray cameraRay;
-	cameraRay.origin = camera.Position;
-	
 	int width = 120, height = 80;
 	unsigned char * data = new unsigned char[width * height * 4];
 
@@ -388,11 +2135,7 @@ void BVHTest(const BVHTree& bvhTree, const Camera& camera) {
 		 for (int i = 0; i < width; i++) {
 			float x = (float)i / (float)width;
 			float y = (float)j / (float)height;
-			cameraRay.direction = 
-				normalize(camera.LeftBottomCorner
-				 		+ (x * 2.0f * camera.halfW) * camera.Right
-				  		+ (y * 2.0f * camera.halfH) * camera.Up
-				  );
+			Ray cameraRay = CameraRay(camera, x, y);
 			
 			hitRecord rec;
 			if (IntersectBVH(bvhTree, cameraRay, rec)) 
@@ -413,6 +2156,83 @@ void BVHTest(const BVHTree& bvhTree, const Camera& camera) {
 	delete[] data;
 }
 
+// 下面几项检查共用的参考结果：与BVHTest相同的相机光线及其IntersectBVH最近交点，只计算一次。
+// 同时输出SAH代价与每条光线的遍历代价
+struct BVHTestReference {
+	std::vector<Ray> rays;
+	std::vector<hitRecord> hits; // 未命中的光线rec.t < 0
+	BVHTraversalStats stats;
+};
+
+BVHTestReference BVHTestReferencePass(const BVHTree& bvhTree, const Camera& camera, int width = 120, int height = 80) {
+	BVHTestReference ref;
+	ref.rays = CameraTestRays(camera, width, height);
+	ref.hits.resize(ref.rays.size());
+	for (size_t i = 0; i < ref.rays.size(); i++)
+		IntersectBVH(bvhTree, ref.rays[i], ref.hits[i], &ref.stats);
+	std::cout << "BVH SAH cost = " << bvhTree.computeSAHCost()
+			  << ", nodes/ray = " << (double)ref.stats.nodesVisited / ref.stats.rays
+			  << ", triangles/ray = " << (double)ref.stats.primitivesTested / ref.stats.rays << std::endl;
+	return ref;
+}
+
+// 压缩节点与原格式的比较：节点内存与每条光线的节点纹理读取次数
+// 原格式每个节点9次R32F读取，压缩格式每个节点2次RGBA32UI读取
+void BVHCompactTest(const BVHTree& bvhTree, const BVHTestReference& ref) {
+	if (!bvhTree.CompactNodeArray) return;
+	BVHTraversalStats compactStats;
+	int mismatches = 0;
+	for (size_t i = 0; i < ref.rays.size(); i++) {
+		hitRecord rec;
+		bool hit = IntersectCompactBVH(bvhTree, ref.rays[i], rec, &compactStats);
+		if (hit != (ref.hits[i].t >= 0.0f)) mismatches++;
+	}
+	std::cout << "BVH node memory: binary " << bvhTree.nodeNum * 9 * sizeof(float) / 1024.0 << " KB ("
+			  << bvhTree.nodeNum << " nodes), compact "
+			  << (1 + 2 * bvhTree.compactNodeNum) * 4 * sizeof(unsigned int) / 1024.0 << " KB ("
+			  << bvhTree.compactNodeNum << " nodes)" << std::endl;
+	std::cout << "BVH node fetches/ray: binary " << 9.0 * ref.stats.nodesVisited / ref.stats.rays
+			  << ", compact " << 2.0 * compactStats.nodesVisited / compactStats.rays
+			  << " (compact nodes/ray = " << (double)compactStats.nodesVisited / compactStats.rays
+			  << ", triangles/ray = " << (double)compactStats.primitivesTested / compactStats.rays
+			  << ", hit mismatches = " << mismatches << ")" << std::endl;
+}
+
+// 无栈遍历：树深度（bvhTree.maxDepth）超过着色器栈大小（32）时，着色器的有栈遍历也改用它
+void BVHStacklessTest(const BVHTree& bvhTree, const BVHTestReference& ref) {
+	if (!bvhTree.SkipArray) return;
+	BVHTraversalStats stacklessStats;
+	int mismatches = 0;
+	for (size_t i = 0; i < ref.rays.size(); i++) {
+		hitRecord rec;
+		bool hit = IntersectStacklessBVH(bvhTree, ref.rays[i], rec, &stacklessStats);
+		if (hit != (ref.hits[i].t >= 0.0f)) mismatches++;
+	}
+	std::cout << "BVH depth = " << bvhTree.maxDepth << ", stackless nodes/ray = "
+			  << (double)stacklessStats.nodesVisited / stacklessStats.rays
+			  << ", triangles/ray = " << (double)stacklessStats.primitivesTested / stacklessStats.rays
+			  << ", hit mismatches = " << mismatches << std::endl;
+}
+
+// 遮挡查询：同样的光线，找到任意交点即返回，与最近交点查询的结果应一致。
+// 命中的光线再检查tMax：tMax为最近交点距离的0.99倍时没有遮挡，1.01倍时有遮挡
+void BVHOcclusionTest(const BVHTree& bvhTree, const BVHTestReference& ref) {
+	BVHTraversalStats occlusionStats;
+	int mismatches = 0, tMaxErrors = 0;
+	for (size_t i = 0; i < ref.rays.size(); i++) {
+		const Ray &ray = ref.rays[i];
+		float t = ref.hits[i].t;
+		bool hit = OccludedBVH(bvhTree, ray, std::numeric_limits<float>::max(), &occlusionStats);
+		if (hit != (t >= 0.0f)) mismatches++;
+		if (t < 0.0f) continue;
+		if (OccludedBVH(bvhTree, ray, t * 0.99f)) tMaxErrors++;
+		if (!OccludedBVH(bvhTree, ray, t * 1.01f)) tMaxErrors++;
+	}
+	std::cout << "BVH occlusion nodes/ray = " << (double)occlusionStats.nodesVisited / occlusionStats.rays
+			  << ", triangles/ray = " << (double)occlusionStats.primitivesTested / occlusionStats.rays
+			  << ", hit mismatches = " << mismatches << ", tMax errors = " << tMaxErrors << std::endl;
+}
+
 
 #endif
 
@@ -0,0 +1,316 @@
+#pragma once
+#ifndef __BVHWIDE_H__
+#define __BVHWIDE_H__
+
+#include <glm/glm.hpp>
+
+#include <tool/BVHTree.h>
+#include <tool/Camera.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64)
+#include <immintrin.h>
+#define BVH_WIDE_SSE 1
+#endif
+
+// 多叉BVH（BVH4 / BVH8）：由二叉BVH的NodeArray折叠而来，仅用于CPU端遍历
+// （烘焙、验证渲染、拾取），GPU纹理仍使用二叉格式。
+// 每个节点以SoA形式保存N个子节点的包围盒，一次SIMD slab测试即可检测全部子节点。
+
+template <int N>
+struct WideBVHNode {
+	float bMin[3][N]; // 子节点包围盒最小点，按轴分开存放
+	float bMax[3][N]; // 子节点包围盒最大点
+	int child[N];     // count == 0：子节点索引；count > 0：三角形起始索引
+	int count[N];     // 叶子三角形数量，0 为内部节点，-1 为空槽
+};
+
+// 一次测试节点的N个子包围盒，返回命中掩码，tNear输出各子节点的进入距离
+template <int N>
+int IntersectWideBounds(const WideBVHNode<N> &node, const glm::vec3 &org, const glm::vec3 &invDir,
+						float tMax, float *tNear)
+{
+	int mask = 0;
+#ifdef BVH_WIDE_SSE
+#if defined(__AVX__)
+	if (N % 8 == 0) {
+		for (int g = 0; g < N; g += 8) {
+			__m256 tmin = _mm256_setzero_ps();
+			__m256 tmax = _mm256_set1_ps(tMax);
+			for (int a = 0; a < 3; a++) {
+				__m256 o = _mm256_set1_ps(org[a]);
+				__m256 inv = _mm256_set1_ps(invDir[a]);
+				__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&node.bMin[a][g]), o), inv);
+				__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&node.bMax[a][g]), o), inv);
+				tmin = _mm256_max_ps(tmin, _mm256_min_ps(t0, t1));
+				tmax = _mm256_min_ps(tmax, _mm256_max_ps(t0, t1));
+			}
+			_mm256_storeu_ps(&tNear[g], tmin);
+			mask |= _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)) << g;
+		}
+		return mask;
+	}
+#endif
+	for (int g = 0; g < N; g += 4) {
+		__m128 tmin = _mm_setzero_ps();
+		__m128 tmax = _mm_set1_ps(tMax);
+		for (int a = 0; a < 3; a++) {
+			__m128 o = _mm_set1_ps(org[a]);
+			__m128 inv = _mm_set1_ps(invDir[a]);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bMin[a][g]), o), inv);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bMax[a][g]), o), inv);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+		}
+		_mm_storeu_ps(&tNear[g], tmin);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << g;
+	}
+#else
+	// 无SSE时的标量实现
+	for (int i = 0; i < N; i++) {
+		float tmin = 0.0f, tmax = tMax;
+		for (int a = 0; a < 3; a++) {
+			float t0 = (node.bMin[a][i] - org[a]) * invDir[a];
+			float t1 = (node.bMax[a][i] - org[a]) * invDir[a];
+			tmin = std::max(tmin, std::min(t0, t1));
+			tmax = std::min(tmax, std::max(t0, t1));
+		}
+		tNear[i] = tmin;
+		if (tmin <= tmax) mask |= 1 << i;
+	}
+#endif
+	return mask;
+}
+
+template <int N>
+class WideBVH {
+public:
+	std::vector<WideBVHNode<N>> nodes;
+	std::vector<glm::vec3> triVertices; // 叶子引用的三角形顶点，每个引用3个
+	std::vector<int> triIndices;        // 引用对应的三角形在MeshArray中的索引（SBVH中可重复）
+
+	// 从已构建好的二叉BVH折叠为N叉BVH（需在bvhTree.releaseAll()之前调用）
+	void Build(const BVHTree &bvhTree) {
+		nodes.clear();
+		int refNum = bvhTree.primRefNum > 0 ? bvhTree.primRefNum : bvhTree.meshNum;
+		triVertices.resize(refNum * 3);
+		triIndices.resize(refNum);
+		for (int i = 0; i < refNum; i++) {
+			triIndices[i] = bvhTree.primitiveIndex(i);
+			const float *m = bvhTree.primitives.vertexData(triIndices[i]);
+			triVertices[i * 3 + 0] = glm::vec3(m[0], m[1], m[2]);
+			triVertices[i * 3 + 1] = glm::vec3(m[3], m[4], m[5]);
+			triVertices[i * 3 + 2] = glm::vec3(m[6], m[7], m[8]);
+		}
+		if (bvhTree.nodeNum == 0) return;
+		nodes.reserve(bvhTree.nodeNum / (N - 1) + 1);
+		collapse(bvhTree, 0);
+	}
+
+	// 最近交点查询，返回是否命中，tHit为交点距离，primIndex为三角形在MeshArray中的索引
+	bool Intersect(const Ray &ray, float *tHit, int *primIndex, BVHTraversalStats *stats = nullptr) const {
+		if (nodes.empty()) return false;
+		glm::vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+		WatertightRay wray = prepareWatertightRay(ray);
+		float tMax = std::numeric_limits<float>::max();
+		bool hit = false;
+
+		struct StackEntry { int node; float tNear; };
+		// 每层最多入栈N-1个兄弟节点，栈深度不超过(N-1)*树深度，更深的树溢出到堆上
+		TraversalStack<StackEntry, 64 * N> stack;
+		stack.push({ 0, 0.0f });
+		if (stats) stats->rays++;
+
+		while (!stack.empty()) {
+			StackEntry entry = stack.pop();
+			// 已找到更近的交点，跳过更远的节点
+			if (entry.tNear > tMax) continue;
+			const WideBVHNode<N> &node = nodes[entry.node];
+			if (stats) stats->nodesVisited++;
+
+			float tNear[N];
+			int mask = IntersectWideBounds<N>(node, ray.origin, invDir, tMax, tNear);
+
+			// 命中的子节点按距离由远到近入栈，使最近的先出栈
+			int order[N], nHit = 0;
+			for (int i = 0; i < N; i++) {
+				if (!(mask & (1 << i)) || node.count[i] < 0) continue;
+				int j = nHit++;
+				while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+					order[j] = order[j - 1];
+					j--;
+				}
+				order[j] = i;
+			}
+			for (int k = 0; k < nHit; k++) {
+				int i = order[k];
+				if (node.count[i] == 0) {
+					stack.push({ node.child[i], tNear[i] });
+					continue;
+				}
+				// 叶子：直接求交，可以尽早缩小tMax
+				for (int p = node.child[i]; p < node.child[i] + node.count[i]; p++) {
+					TriangleHit h = hitTriangleWatertight(triVertices[p * 3 + 0], triVertices[p * 3 + 1],
+						triVertices[p * 3 + 2], wray, tMax);
+					if (stats) stats->primitivesTested++;
+					if (h.hit) {
+						tMax = h.t;
+						hit = true;
+						if (primIndex) *primIndex = triIndices[p];
+					}
+				}
+			}
+		}
+		if (hit && tHit) *tHit = tMax;
+		return hit;
+	}
+
+private:
+	// 读取二叉节点
+	static void readNode(const BVHTree &bvhTree, int index, Bound3f *bound, int *nPrimitives, int *childOffset) {
+		const float *n = &bvhTree.NodeArray[index * 9];
+		bound->pMin = glm::vec3(n[0], n[1], n[2]);
+		bound->pMax = glm::vec3(n[3], n[4], n[5]);
+		*nPrimitives = (int)n[6];
+		*childOffset = (int)n[8];
+	}
+
+	// 以二叉节点binaryIndex为根生成一个N叉节点：反复展开表面积最大的内部子节点，
+	// 直到凑满N个子节点或全部为叶子，返回新节点索引
+	int collapse(const BVHTree &bvhTree, int binaryIndex) {
+		struct Entry { int index; Bound3f bound; int nPrimitives; int childOffset; };
+		Entry entries[N];
+		int nEntries = 0;
+
+		Entry root;
+		root.index = binaryIndex;
+		readNode(bvhTree, binaryIndex, &root.bound, &root.nPrimitives, &root.childOffset);
+		if (root.nPrimitives > 0) {
+			// 整棵树只有一个叶子
+			entries[nEntries++] = root;
+		}
+		else {
+			int children[2] = { binaryIndex + 1, root.childOffset };
+			for (int c = 0; c < 2; c++) {
+				Entry &e = entries[nEntries++];
+				e.index = children[c];
+				readNode(bvhTree, e.index, &e.bound, &e.nPrimitives, &e.childOffset);
+			}
+			while (nEntries < N) {
+				int best = -1;
+				float bestArea = -1.0f;
+				for (int i = 0; i < nEntries; i++) {
+					if (entries[i].nPrimitives == 0 && entries[i].bound.SurfaceArea() > bestArea) {
+						bestArea = entries[i].bound.SurfaceArea();
+						best = i;
+					}
+				}
+				if (best < 0) break;
+				Entry parent = entries[best];
+				Entry &left = entries[best];
+				Entry &right = entries[nEntries++];
+				left.index = parent.index + 1;
+				right.index = parent.childOffset;
+				readNode(bvhTree, left.index, &left.bound, &left.nPrimitives, &left.childOffset);
+				readNode(bvhTree, right.index, &right.bound, &right.nPrimitives, &right.childOffset);
+			}
+		}
+
+		int myIndex = (int)nodes.size();
+		nodes.emplace_back();
+		for (int i = 0; i < N; i++) {
+			if (i < nEntries) {
+				for (int a = 0; a < 3; a++) {
+					nodes[myIndex].bMin[a][i] = entries[i].bound.pMin[a];
+					nodes[myIndex].bMax[a][i] = entries[i].bound.pMax[a];
+				}
+			}
+			else {
+				// 空槽：包围盒取反，slab测试永远不命中
+				for (int a = 0; a < 3; a++) {
+					nodes[myIndex].bMin[a][i] = std::numeric_limits<float>::max();
+					nodes[myIndex].bMax[a][i] = std::numeric_limits<float>::lowest();
+				}
+				nodes[myIndex].child[i] = 0;
+				nodes[myIndex].count[i] = -1;
+			}
+		}
+		for (int i = 0; i < nEntries; i++) {
+			if (entries[i].nPrimitives > 0) {
+				nodes[myIndex].child[i] = entries[i].childOffset;
+				nodes[myIndex].count[i] = entries[i].nPrimitives;
+			}
+			else {
+				// nodes可能扩容，不能持有引用
+				int childIndex = collapse(bvhTree, entries[i].index);
+				nodes[myIndex].child[i] = childIndex;
+				nodes[myIndex].count[i] = 0;
+			}
+		}
+		return myIndex;
+	}
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+
+// 比较二叉BVH与BVH4/BVH8在CPU上的遍历速度（每秒光线数）
+// 三者都是最近交点查询（按进入距离排序子节点，用当前交点距离剪枝），BVH2为IntersectBVH。
+// 每种结构重复repeats遍取最快的一遍；BVH4/BVH8的交点距离应与BVH2相同，不同时计入mismatches，
+// 距离相同而三角形不同（光线恰好穿过共享边，两个三角形都命中）计入ties。
+// nodes/ray：BVH2为包围盒测试次数（每个内部节点两次），BVH4/BVH8为访问的节点数（每个节点一次SIMD测试N个子包围盒）
+// 康奈尔盒+兔子+龙（约17万三角形，单核，叶子大小1或4）上BVH4与BVH8都比BVH2快约1.3~1.6倍，开启AVX时相近
+void BVHWideTest(const BVHTree &bvhTree, const Camera &camera, int width = 400, int height = 300, int repeats = 5) {
+	BVH4 bvh4;
+	BVH8 bvh8;
+	bvh4.Build(bvhTree);
+	bvh8.Build(bvhTree);
+
+	std::vector<Ray> rays = CameraTestRays(camera, width, height);
+
+	// BVH2的交点作为参考
+	std::vector<float> refT(rays.size(), -1.0f);
+	std::vector<int> refPrim(rays.size(), -1);
+	auto report = [&](const char *name, bool reference, auto &&trace) {
+		BVHTraversalStats stats;
+		int hits = 0, mismatches = 0, ties = 0;
+		double best = std::numeric_limits<double>::max();
+		for (int k = 0; k < std::max(1, repeats); k++) {
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < rays.size(); i++) {
+				float t = -1.0f;
+				int prim = -1;
+				bool hit = trace(rays[i], &t, &prim, k == 0 ? &stats : nullptr);
+				if (k > 0) continue;
+				hits += hit ? 1 : 0;
+				if (reference) {
+					refT[i] = t;
+					refPrim[i] = prim;
+				}
+				else if (t != refT[i]) mismatches++;
+				else if (prim != refPrim[i]) ties++;
+			}
+			best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+		std::cout << name << ": " << rays.size() / best / 1e6 << " Mrays/s, hits = " << hits
+				  << ", nodes/ray = " << (double)stats.nodesVisited / stats.rays;
+		if (!reference) std::cout << ", mismatches = " << mismatches << ", ties = " << ties;
+		std::cout << std::endl;
+	};
+	report("BVH2", true, [&](const Ray &r, float *t, int *p, BVHTraversalStats *s) {
+		hitRecord rec;
+		if (!IntersectBVH(bvhTree, r, rec, s)) return false;
+		*t = rec.t;
+		*p = rec.primIndex;
+		return true;
+	});
+	report("BVH4", false, [&](const Ray &r, float *t, int *p, BVHTraversalStats *s) { return bvh4.Intersect(r, t, p, s); });
+	report("BVH8", false, [&](const Ray &r, float *t, int *p, BVHTraversalStats *s) { return bvh8.Intersect(r, t, p, s); });
+}
+
+#endif
@@ -0,0 +1,646 @@
+#pragma once
+#ifndef __CPUPATHTRACER_H__
+#define __CPUPATHTRACER_H__
+
+#include <glm/glm.hpp>
+
+#include <tool/BVHTree.h>
+#include <tool/BVHInstance.h>
+#include <tool/Camera.h>
+#include <tool/Parallel.h>
+#include <tool/RandomUtils.h>
+#include <tool/Sampler.h>
+#include <tool/TileScheduler.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// CPU参考路径追踪器：直接使用bvhTree的NodeArray与primitives，或两级BVH（BVHScene）的TLAS/BLAS数据，
+// 材质按transmission区分：-1 光源，0 漫反射，1 金属，2 折射。
+// 估计量逐项移植自着色器（RayTracerFragmentShader.glsl）的main()与shading()：相机光线的像素内偏移、
+// 只在第一个交点做的直接光照（均匀选择一个光源三角形，阴影光线从光源射向着色点，单面发光）、
+// sample_/eval_/pdf_（余弦加权漫反射、GGX金属、菲涅尔混合的折射）与间接光照循环中的俄罗斯轮盘，
+// 随机数的槽位与rand()的维度也与着色器相同，同一种子、同一采样器下CPU的第s个采样与GPU的第s个采样使用相同的随机数。
+// 着色器中直接光照的L_i为写死的常数，等于main.cpp中光源材质的emissive，这里使用光源三角形的emissive。
+// 用途：GPU结果的收敛参考（见ImageCompareReport）、采样器与自适应采样的收敛对比，以及每个CPU核心的光线吞吐量基准。
+// 图像按tile分多遍渲染，由TileScheduler在各线程间调度（见TileScheduler.h）。
+// 自适应采样：每个像素记录截断到[0,1]后亮度的一阶、二阶矩，均值的误差估计（见relativeError）低于noiseThreshold、
+// 且tile内3x3邻域的像素都满足时停止采样，tile内全部像素收敛后不再入队，剩余时间用于噪声大的区域。
+
+// CPU渲染参数
+struct CPURenderSettings {
+	int width = 400;
+	int height = 300;                // 宽高比应与camera的ScreenRatio一致
+	int samplesPerPixel = 64;        // 自适应采样时为每个像素的上限
+	int maxDepth = 60;               // 同着色器shading()中的循环上限
+	int russianRouletteDepth = 3;    // 超过该深度后按russianRoulette的概率继续
+	float russianRoulette = 0.8f;    // 同着色器中的P_RR
+	float lightScale = 0.3f;         // 发光强度系数，取值同着色器中的restrain
+	float rayEpsilon = 0.001f;       // 次级光线与阴影光线起点的偏移，同着色器
+	float pngGamma = 1.0f;           // PNG输出的伽马，1.0时与屏幕着色器一致（直接截断到[0,1]）
+	int nThreads = 0;                // 0表示使用全部CPU核心
+	int tileSize = 16;
+	int samplesPerPass = 4;          // 每个tile每遍的采样数，完成一遍后重新入队
+	TileOrder tileOrder = TileOrder::Hilbert;
+	std::string previewPath;         // 不为空时渲染过程中每隔previewInterval秒保存一次PNG预览
+	double previewInterval = 2.0;
+	bool adaptive = false;           // 自适应采样
+	float noiseThreshold = 0.03f;    // 收敛阈值，见relativeError
+	int minSamplesPerPixel = 16;     // 估计方差前至少需要的采样数
+	unsigned int seed = 0;           // 随机数种子，与着色器中的randSeed相同时两边的随机数序列相同
+	SamplerType sampler = SamplerType::Random; // 采样器，与着色器中的samplerType对应，Sobol需要显式选择
+	// 不为0时按着色器的方式累积：每帧samplesPerFrame个采样（着色器main()中的N）取平均，与历史结果按1/帧数混合后截断到[0,1]，
+	// 结果与GPU帧缓冲中的图像可直接比较（见ImageCompareReport）。samplesPerPixel应为它的整数倍
+	int samplesPerFrame = 0;
+};
+
+// 渲染统计：光线数量按求交查询计数，阴影光线为OccludedBVH查询
+struct CPURenderStats {
+	int nThreads = 0;
+	double seconds = 0.0;
+	long long cameraRays = 0;
+	long long bounceRays = 0;
+	long long shadowRays = 0;
+	int tiles = 0, passes = 0;
+	std::vector<TileThreadStats> threads; // 每个线程的执行时间、任务数与窃取数
+	std::vector<double> utilization;      // 每个线程执行任务的时间 / 总耗时
+	int pixels = 0;
+	int convergedPixels = 0;              // 自适应采样时在samplesPerPixel之前收敛的像素数
+
+	double samplesPerPixel() const { return pixels > 0 ? (double)cameraRays / pixels : 0.0; }
+
+	long long rays() const { return cameraRays + bounceRays + shadowRays; }
+	double raysPerSecond() const { return seconds > 0.0 ? rays() / seconds : 0.0; }
+	double raysPerSecondPerCore() const { return nThreads > 0 ? raysPerSecond() / nThreads : 0.0; }
+};
+
+class CPUPathTracer {
+public:
+	int width = 0, height = 0;
+	std::vector<glm::vec3> image; // 线性辐射亮度，按行从上到下排列
+	TileFramebuffer framebuffer;  // 渲染过程中已完成的tile，其他线程可随时调用framebuffer.Snapshot读取
+
+	// 收集发光三角形（transmission为-1且emissive不为0）作为直接光照的光源
+	CPUPathTracer(const BVHTree &bvhTree) : bvhTree(&bvhTree) {
+		const TriangleStore &prims = bvhTree.primitives;
+		for (size_t i = 0; i < prims.size(); i++)
+			addLight(prims.vertices(i), prims.material(i));
+	}
+
+	// 两级BVH：每个实例的发光三角形变换到世界空间后作为光源，覆盖材质优先于三角形自身的材质
+	// scene需要已经调用过build()
+	CPUPathTracer(const BVHScene &scene) : scene(&scene) {
+		for (int i = 0; i < scene.instanceNum; i++) {
+			const BVHInstance &inst = scene.instances[i];
+			int first = scene.blasPrimOffset[inst.blas];
+			for (int k = 0; k < scene.blas[inst.blas]->meshNum; k++) {
+				int materialID = (scene.instanceMaterial[i] >= 0) ? scene.instanceMaterial[i]
+																	: scene.triangleMaterial[first + k];
+				const float *m = &scene.MeshArray[(size_t)(first + k) * scene.meshStride];
+				glm::vec3 v[3];
+				for (int c = 0; c < 3; c++)
+					v[c] = glm::vec3(inst.transform * glm::vec4(m[c * 3], m[c * 3 + 1], m[c * 3 + 2], 1.0f));
+				addLight(v, scene.materials[materialID]);
+			}
+		}
+	}
+
+	// 使用与着色器triLight相同的光源三角形（每个三角形3个顶点），顺序相同时每个采样选中的光源也相同
+	void setLights(const std::vector<glm::vec3> &vertices, const glm::vec3 &emissive) {
+		lightVertices.clear();
+		lightEmissive.clear();
+		Material m;
+		m.transmission = -1.0f;
+		m.emissive = emissive;
+		for (size_t i = 0; i + 2 < vertices.size(); i += 3)
+			addLight(&vertices[i], m);
+	}
+
+	CPURenderStats Render(const Camera &camera, const CPURenderSettings &settings) {
+		width = settings.width;
+		height = settings.height;
+		int samplesPerPass = std::max(1, std::min(settings.samplesPerPass, settings.samplesPerPixel));
+		TileScheduler scheduler(MakeTiles(width, height, std::max(1, settings.tileSize), settings.tileOrder),
+								(settings.samplesPerPixel + samplesPerPass - 1) / samplesPerPass, settings.nThreads);
+		framebuffer.Init(width, height, scheduler.tiles);
+		size_t pixels = (size_t)width * height;
+		accum.assign(pixels, glm::vec3(0.0f));
+		frameAccum.assign(settings.samplesPerFrame > 0 ? pixels : 0, glm::vec3(0.0f));
+		lumSum.assign(pixels, 0.0f);
+		lumSumSq.assign(pixels, 0.0f);
+		sampleCount.assign(pixels, 0);
+		pixelActive.assign(pixels, 1);
+
+		std::vector<CPURenderStats> threadRays(scheduler.nThreads);
+		std::vector<std::vector<glm::vec3>> tileBuffers(scheduler.nThreads);
+		std::vector<std::vector<float>> tileErrors(scheduler.nThreads);
+
+		// 渲染tile的一遍：每个未收敛的像素再采样samplesPerPass次，累加后发布平均值，返回tile是否还需要下一遍
+		auto renderTile = [&](const TileTask &task, int t) {
+			const Tile &r = scheduler.tiles[task.tile];
+			int tileW = r.x1 - r.x0;
+			std::vector<glm::vec3> &buffer = tileBuffers[t];
+			buffer.resize(r.pixelCount());
+			for (int row = r.y0; row < r.y1; row++) {
+				int j = height - 1 - row; // 图像第row行对应屏幕纵坐标j（自下而上）
+				for (int i = r.x0; i < r.x1; i++) {
+					size_t p = (size_t)row * width + i;
+					glm::vec3 &sum = accum[p];
+					int s0 = sampleCount[p];
+					int s1 = pixelActive[p] ? std::min(settings.samplesPerPixel, s0 + samplesPerPass) : s0;
+					for (int s = s0; s < s1; s++) {
+						PathSampler sampler(settings.sampler, j * width + i, s, settings.seed);
+						// 同着色器：像素中心加上[-0.25, 0.25]像素的偏移
+						glm::vec2 jitter = sampler.get2D(CameraSlot()) - 0.5f;
+						float x = (i + 0.5f) / width + jitter.x * (1.0f / width) * 0.5f;
+						float y = (j + 0.5f) / height + jitter.y * (1.0f / height) * 0.5f;
+						glm::vec3 L = Li(CameraRay(camera, x, y), sampler, settings, threadRays[t]);
+						if (settings.samplesPerFrame > 0) {
+							frameAccum[p] += L;
+							if ((s + 1) % settings.samplesPerFrame == 0) {
+								float blendWeight = (float)settings.samplesPerFrame / (s + 1);
+								sum = glm::clamp(glm::mix(sum, frameAccum[p] / (float)settings.samplesPerFrame, blendWeight), 0.0f, 1.0f);
+								frameAccum[p] = glm::vec3(0.0f);
+							}
+						}
+						else sum += L;
+						float lum = glm::clamp(glm::dot(L, glm::vec3(0.2126f, 0.7152f, 0.0722f)), 0.0f, 1.0f);
+						lumSum[p] += lum;
+						lumSumSq[p] += lum * lum;
+					}
+					sampleCount[p] = s1;
+					if (settings.samplesPerFrame > 0) buffer[(row - r.y0) * tileW + (i - r.x0)] = sum;
+					else buffer[(row - r.y0) * tileW + (i - r.x0)] = s1 > 0 ? sum / (float)s1 : glm::vec3(0.0f);
+				}
+			}
+			framebuffer.Publish(task.tile, buffer.data());
+			if (!settings.adaptive) return true;
+
+			// 各像素的相对误差，采样数不足时视为未收敛
+			std::vector<float> &error = tileErrors[t];
+			error.resize(r.pixelCount());
+			for (int row = r.y0; row < r.y1; row++) {
+				for (int i = r.x0; i < r.x1; i++) {
+					size_t p = (size_t)row * width + i;
+					error[(row - r.y0) * tileW + (i - r.x0)] =
+						sampleCount[p] < std::max(2, settings.minSamplesPerPixel) ? INFINITY
+						: relativeError(lumSum[p], lumSumSq[p], sampleCount[p]);
+				}
+			}
+			// 3x3邻域（限于tile内）中有未收敛的像素时继续采样，避免孤立像素因方差估计偏小而过早停止
+			bool more = false;
+			for (int y = 0; y < r.y1 - r.y0; y++) {
+				for (int x = 0; x < tileW; x++) {
+					size_t p = (size_t)(r.y0 + y) * width + (r.x0 + x);
+					float e = 0.0f;
+					for (int dy = std::max(0, y - 1); dy <= std::min(r.y1 - r.y0 - 1, y + 1); dy++)
+						for (int dx = std::max(0, x - 1); dx <= std::min(tileW - 1, x + 1); dx++)
+							e = std::max(e, error[dy * tileW + dx]);
+					pixelActive[p] = e > settings.noiseThreshold && sampleCount[p] < settings.samplesPerPixel;
+					more = more || pixelActive[p];
+				}
+			}
+			return more;
+		};
+
+		std::vector<glm::vec3> preview;
+		auto savePreview = [&]() {
+			framebuffer.Snapshot(preview);
+			WriteRadiancePNG(settings.previewPath, width, height, preview, settings.pngGamma);
+		};
+		if (settings.previewPath.empty()) scheduler.Run(renderTile);
+		else scheduler.Run(renderTile, settings.previewInterval, savePreview);
+		framebuffer.Snapshot(image);
+
+		CPURenderStats stats;
+		stats.nThreads = scheduler.nThreads;
+		stats.seconds = scheduler.seconds;
+		stats.tiles = (int)scheduler.tiles.size();
+		stats.passes = scheduler.passes;
+		stats.threads = scheduler.threadStats;
+		stats.pixels = (int)pixels;
+		for (size_t p = 0; p < pixels; p++)
+			if (sampleCount[p] < settings.samplesPerPixel) stats.convergedPixels++;
+		for (int t = 0; t < scheduler.nThreads; t++) {
+			stats.cameraRays += threadRays[t].cameraRays;
+			stats.bounceRays += threadRays[t].bounceRays;
+			stats.shadowRays += threadRays[t].shadowRays;
+			stats.utilization.push_back(scheduler.utilization(t));
+		}
+		return stats;
+	}
+
+	// Radiance HDR，保存未截断的线性结果
+	bool WriteHDR(const std::string &path) const {
+		return stbi_write_hdr(path.c_str(), width, height, 3, &image[0].x) != 0;
+	}
+
+	bool WritePNG(const std::string &path, float gamma = 1.0f) const {
+		return WriteRadiancePNG(path, width, height, image, gamma);
+	}
+
+	// 截断到[0,1]后按gamma编码的8位PNG
+	static bool WriteRadiancePNG(const std::string &path, int width, int height,
+								 const std::vector<glm::vec3> &pixels, float gamma = 1.0f) {
+		std::vector<unsigned char> data((size_t)width * height * 3);
+		for (size_t p = 0; p < pixels.size(); p++) {
+			for (int c = 0; c < 3; c++) {
+				float v = glm::clamp(pixels[p][c], 0.0f, 1.0f);
+				if (gamma != 1.0f) v = std::pow(v, 1.0f / gamma);
+				data[p * 3 + c] = (unsigned char)(v * 255.0f + 0.5f);
+			}
+		}
+		return stbi_write_png(path.c_str(), width, height, 3, data.data(), 3 * width) != 0;
+	}
+
+private:
+	const BVHTree *bvhTree = nullptr; // 两者只有一个不为空
+	const BVHScene *scene = nullptr;
+	std::vector<glm::vec3> lightVertices; // 发光三角形的世界空间顶点，每个三角形3个
+	std::vector<glm::vec3> lightEmissive;
+	std::vector<glm::vec3> accum;    // 每个像素的辐射亮度累加值，同一tile只由一个线程写入；samplesPerFrame不为0时为按帧混合的结果
+	std::vector<glm::vec3> frameAccum; // samplesPerFrame不为0时当前帧的累加值
+	std::vector<float> lumSum, lumSumSq; // 截断到[0,1]的亮度及其平方的累加值
+	std::vector<int> sampleCount;
+	std::vector<char> pixelActive;   // 自适应采样中尚未收敛的像素
+
+	static constexpr float PI = 3.1415926f; // 同着色器
+	static constexpr float EPSILON = 0.00001f;
+
+	void addLight(const glm::vec3 *v, const Material &m) {
+		if (m.transmission > -0.5f || m.emissive == glm::vec3(0.0f)) return;
+		if (glm::length(glm::cross(v[1] - v[0], v[2] - v[0])) <= 0.0f) return;
+		lightVertices.insert(lightVertices.end(), v, v + 3);
+		lightEmissive.push_back(m.emissive);
+	}
+
+	bool intersect(const Ray &ray, hitRecord &rec) const {
+		return scene ? IntersectScene(*scene, ray, rec) : IntersectBVH(*bvhTree, ray, rec);
+	}
+
+	bool occluded(const Ray &ray, float tMax) const {
+		return scene ? OccludedScene(*scene, ray, tMax) : OccludedBVH(*bvhTree, ray, tMax);
+	}
+
+	// rec.materialID对单级BVH是primitives.materials的下标，对两级BVH是scene.materials的下标
+	const Material &material(const hitRecord &rec) const {
+		return scene ? scene->materials[rec.materialID] : bvhTree->primitives.materials[rec.materialID];
+	}
+
+	// n个采样均值的误差估计：标准误差除以sqrt(均值)，介于绝对误差与相对误差之间，
+	// 暗部不会因均值很小而难以收敛，亮部也不会过早停止。康奈尔盒中比绝对误差或相对误差都更省采样
+	static float relativeError(float sum, float sumSq, int n) {
+		float mean = sum / n;
+		float variance = std::max(sumSq / n - mean * mean, 0.0f) * n / (n - 1);
+		return std::sqrt(variance / n) / std::sqrt(mean + 0.0001f);
+	}
+
+	// 交点处着色需要的数据，同着色器中的rec：法线翻转到入射一侧，viewDir指向光线来的方向
+	struct ShadingPoint {
+		glm::vec3 Pos;
+		glm::vec3 Normal;
+		glm::vec3 viewDir;
+		const Material *material;
+		int transmission; // 同着色器中int类型的material.transmission
+	};
+
+	ShadingPoint shadingPoint(const Ray &ray, const hitRecord &rec) const {
+		ShadingPoint sp;
+		sp.Pos = rec.Pos;
+		sp.Normal = glm::dot(rec.Normal, -ray.direction) > 0.0f ? rec.Normal : -rec.Normal;
+		sp.viewDir = -ray.direction;
+		sp.material = &material(rec);
+		sp.transmission = (int)sp.material->transmission;
+		return sp;
+	}
+
+	// 着色器中sample_的结果
+	struct SampleDir {
+		glm::vec3 reflectDir = glm::vec3(0.0f);
+		glm::vec3 refractDir = glm::vec3(0.0f);
+	};
+
+	// 着色器中eval_的结果
+	struct BRDFResult {
+		glm::vec3 fr_reflect = glm::vec3(0.0f);
+		glm::vec3 fr_refract = glm::vec3(0.0f);
+	};
+
+	// 切线空间向量转换到世界空间（同着色器中的toWorld）
+	static glm::vec3 toWorld(const glm::vec3 &v, const glm::vec3 &N) {
+		glm::vec3 helper = std::abs(N.x) > 0.999f ? glm::vec3(0, 0, 1) : glm::vec3(1, 0, 0);
+		glm::vec3 tangent = glm::normalize(glm::cross(N, helper));
+		glm::vec3 bitangent = glm::normalize(glm::cross(N, tangent));
+		return v.x * tangent + v.y * bitangent + v.z * N;
+	}
+
+	// 法线半球内的方向（同着色器中的random_in_unit_hemisphere）。
+	// 三个分量依次取随机数，与GLSL中vec3(rand(), rand(), rand())从左到右的求值顺序相同
+	static glm::vec3 randomInHemisphere(const glm::vec3 &N, PixelRandom &rng) {
+		glm::vec3 p;
+		do {
+			float x = rng.next();
+			float y = rng.next();
+			float z = rng.next();
+			p = glm::normalize(2.0f * glm::vec3(x, y, z) - 1.0f);
+		} while (glm::dot(p, N) < 0.0f);
+		return p;
+	}
+
+	// 同着色器中的calculateReflect：I从表面指向外侧，镜面反射方向加上roughness倍的半球扰动
+	static glm::vec3 calculateReflect(const glm::vec3 &I, const glm::vec3 &N, float roughness, PixelRandom &rng) {
+		glm::vec3 baseReflect = -I + 2.0f * glm::dot(I, N) * N;
+		if (roughness > 0.0f) return glm::normalize(baseReflect + roughness * randomInHemisphere(N, rng));
+		return glm::normalize(baseReflect);
+	}
+
+	// 同着色器中的calculateRefract，全内反射时返回零向量
+	static glm::vec3 calculateRefract(const glm::vec3 &I, const glm::vec3 &N, float ior) {
+		float cosi = glm::clamp(glm::dot(I, N), -1.0f, 1.0f);
+		float etai = 1.0f, etat = ior;
+		glm::vec3 n = N;
+		if (cosi > 0.0f) {
+			std::swap(etai, etat);
+			n = -N;
+		}
+		float eta = etai / etat;
+		float k = 1.0f - eta * eta * (1.0f - cosi * cosi);
+		return k < 0.0f ? glm::vec3(0.0f) : eta * I + (eta * cosi - std::sqrt(k)) * n;
+	}
+
+	// 同着色器中的sample_，u为本次反弹SlotBSDF槽位的二维采样
+	static SampleDir sampleDirection(const glm::vec3 &wo, const glm::vec3 &N, const Material &material, int transmission,
+									 const glm::vec2 &u, PixelRandom &rng) {
+		SampleDir result;
+		if (transmission == 0) { // 余弦加权半球采样
+			float phi = 2.0f * PI * u.x;
+			float z = std::sqrt(1.0f - u.y);
+			float r = std::sqrt(u.y);
+			result.reflectDir = toWorld(glm::vec3(r * std::cos(phi), r * std::sin(phi), z), N);
+		}
+		else if (transmission == 1) {
+			result.reflectDir = calculateReflect(wo, N, material.roughness, rng);
+		}
+		else if (transmission == 2) {
+			glm::vec3 V = glm::normalize(wo);
+			float eta = glm::dot(N, V) > 0.0f ? 1.0f / material.IOR : material.IOR;
+			result.reflectDir = calculateReflect(V, N, material.roughness, rng);
+			result.refractDir = calculateRefract(V, N, eta);
+		}
+		return result;
+	}
+
+	static float DistributionGGX(const glm::vec3 &N, const glm::vec3 &H, float a) {
+		float a2 = a * a;
+		float NdotH = std::max(glm::dot(N, H), 0.0f);
+		float denom = NdotH * NdotH * (a2 - 1.0f) + 1.0f;
+		return a2 / (PI * denom * denom);
+	}
+
+	static float GeometrySchlickGGX(float NdotV, float k) {
+		return NdotV / (NdotV * (1.0f - k) + k);
+	}
+
+	// 同着色器中的pdf_
+	static float pdfDirection(const glm::vec3 &wi, const glm::vec3 &N, int transmission) {
+		if (glm::dot(wi, N) <= EPSILON) return 0.0f;
+		return transmission == 0 ? 0.5f / PI : 1.0f;
+	}
+
+	// 同着色器中金属与折射材质共用的Cook-Torrance反射项
+	static glm::vec3 cookTorrance(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &N, const Material &material) {
+		glm::vec3 V = glm::normalize(-wo);
+		glm::vec3 L = wi;
+		glm::vec3 H = glm::normalize(V + L);
+		float NdotV = std::max(glm::dot(N, V), EPSILON);
+		float NdotL = std::max(glm::dot(N, L), EPSILON);
+		float VdotH = std::max(glm::dot(V, H), EPSILON);
+		float roughness = material.roughness * material.roughness;
+		float D = DistributionGGX(N, H, roughness);
+		float G = GeometrySchlickGGX(NdotV, roughness) * GeometrySchlickGGX(NdotL, roughness);
+		glm::vec3 F0 = glm::mix(glm::vec3(0.04f), material.baseColor, material.metallic);
+		glm::vec3 F = F0 + (1.0f - F0) * std::pow(1.0f - VdotH, 5.0f);
+		glm::vec3 specular = D * G * F / std::max(4.0f * NdotV * NdotL, 0.001f);
+		glm::vec3 kD = (1.0f - F) * (1.0f - material.metallic);
+		return kD * material.baseColor / PI + specular;
+	}
+
+	// 同着色器中的eval_：wi为入射方向，wo为出射方向
+	static BRDFResult evalBRDF(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &N, const Material &material,
+							   int transmission) {
+		BRDFResult f_r;
+		if (transmission == 0) {
+			if (glm::dot(N, wo) > EPSILON) f_r.fr_reflect = material.baseColor / PI;
+		}
+		else if (transmission == 1) {
+			if (glm::dot(N, wo) > EPSILON) f_r.fr_reflect = cookTorrance(wi, wo, N, material);
+		}
+		else if (transmission == 2) {
+			glm::vec3 V = glm::normalize(-wo);
+			float eta = glm::dot(N, V) > 0.0f ? 1.0f / material.IOR : material.IOR;
+			f_r.fr_reflect = cookTorrance(wi, wo, N, material);
+			if (glm::length(glm::refract(-V, N, eta)) >= EPSILON) {
+				glm::vec3 H = glm::normalize(V + wi);
+				glm::vec3 F0 = glm::mix(glm::vec3(0.04f), material.baseColor, material.metallic);
+				glm::vec3 F = F0 + (1.0f - F0) * std::pow(1.0f - std::max(glm::dot(V, H), EPSILON), 5.0f);
+				f_r.fr_refract = material.baseColor * (1.0f - F) * (1.0f / (eta * eta));
+			}
+		}
+		return f_r;
+	}
+
+	// 非偏振菲涅尔反射率（同着色器中的fresnel）：I为光线方向，N为几何法线，dot(I, N) > 0时光线从内部射出
+	static float fresnel(const glm::vec3 &I, const glm::vec3 &N, float ior) {
+		float cosi = glm::clamp(glm::dot(I, N), -1.0f, 1.0f);
+		float etai = 1.0f, etat = ior;
+		if (cosi > 0.0f) std::swap(etai, etat);
+		float sint = etai / etat * std::sqrt(std::max(1.0f - cosi * cosi, 0.0f));
+		if (sint >= 1.0f) return 1.0f;
+		float cost = std::sqrt(std::max(1.0f - sint * sint, 0.0f));
+		cosi = std::abs(cosi);
+		float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+		float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+		return (Rs * Rs + Rp * Rp) * 0.5f;
+	}
+
+	// 第一个交点的直接光照（同着色器shading()的直接光照部分）：均匀选择一个光源三角形，
+	// 阴影光线从光源上的点射向着色点，光源只向法线一侧发光
+	glm::vec3 directLight(const ShadingPoint &sp, const CPURenderSettings &settings, const PathSampler &sampler,
+						  CPURenderStats &stats) const {
+		int lightTriCount = (int)lightEmissive.size();
+		if (lightTriCount == 0 || sp.transmission == -1) return glm::vec3(0.0f);
+		int lightIndex = (int)(sampler.get1D(BounceSlot(0, SlotLightSelect)) * lightTriCount);
+		lightIndex = glm::clamp(lightIndex, 0, lightTriCount - 1);
+		const glm::vec3 *v = &lightVertices[(size_t)lightIndex * 3];
+		glm::vec3 lightNormal = glm::normalize(glm::cross(v[1] - v[0], v[2] - v[0]));
+
+		glm::vec2 uLight = sampler.get2D(BounceSlot(0, SlotLightPoint));
+		float u = uLight.x;
+		float w = uLight.y * (1.0f - u);
+		glm::vec3 lightPoint = v[0] + u * (v[1] - v[0]) + w * (v[2] - v[0]);
+
+		float dist = glm::length(sp.Pos - lightPoint);
+		Ray shadowRay;
+		shadowRay.origin = lightPoint + lightNormal * settings.rayEpsilon;
+		shadowRay.direction = glm::normalize(sp.Pos - lightPoint);
+		stats.shadowRays++;
+		// 着色器中为dist - 0.0013，着色点本身在tMax之外
+		if (occluded(shadowRay, dist - 1.3f * settings.rayEpsilon)) return glm::vec3(0.0f);
+
+		float cosTheta = std::max(glm::dot(sp.Normal, -shadowRay.direction), 0.0f);
+		float cosThetaPrime = std::max(glm::dot(lightNormal, shadowRay.direction), 0.0f);
+		float geometryTerm = cosTheta * cosThetaPrime / (dist * dist);
+		float area = 0.5f * glm::length(glm::cross(v[1] - v[0], v[2] - v[0]));
+		float pdfLight = 1.0f / (area * lightTriCount);
+		BRDFResult f_r = evalBRDF(-shadowRay.direction, sp.viewDir, sp.Normal, *sp.material, sp.transmission);
+		return (lightEmissive[lightIndex] * settings.lightScale) * f_r.fr_reflect * geometryTerm / pdfLight;
+	}
+
+	// 沿一条相机光线追踪完整路径，返回辐射亮度（同着色器main()中的一次采样与shading()）
+	// 第depth次反弹的随机数取自BounceSlot(depth, ...)，维度分配与路径分支无关
+	glm::vec3 Li(const Ray &cameraRay, PathSampler &sampler, const CPURenderSettings &settings, CPURenderStats &stats) const {
+		stats.cameraRays++;
+		hitRecord rec;
+		if (!intersect(cameraRay, rec)) return glm::vec3(0.0f); // 背景为黑色
+		ShadingPoint sp = shadingPoint(cameraRay, rec);
+
+		glm::vec3 L_dir = directLight(sp, settings, sampler, stats);
+		glm::vec3 L_indir(0.0f);
+		glm::vec3 throughput(1.0f);
+		float P_RR = settings.russianRoulette;
+		for (int depth = 0; depth < settings.maxDepth; depth++) {
+			if (depth > settings.russianRouletteDepth && sampler.get1D(BounceSlot(depth, SlotRussianRoulette)) > P_RR) break;
+
+			const Material &material = *sp.material;
+			if (sp.transmission == -1) { // 命中光源
+				L_indir = throughput * (material.emissive * settings.lightScale * std::abs(glm::dot(sp.viewDir, sp.Normal)));
+				break;
+			}
+
+			SampleDir sampleResult = sampleDirection(sp.viewDir, sp.Normal, material, sp.transmission,
+													 sampler.get2D(BounceSlot(depth, SlotBSDF)), sampler.random);
+			glm::vec3 dirNext = sampleResult.reflectDir;
+			BRDFResult f_r = evalBRDF(dirNext, sp.viewDir, sp.Normal, material, sp.transmission);
+			float cosine = glm::clamp(glm::dot(dirNext, sp.Normal), -1.0f, 1.0f);
+			float pdf = pdfDirection(dirNext, sp.Normal, sp.transmission);
+
+			if (sp.transmission == 0) { // 漫反射
+				throughput = throughput * (f_r.fr_reflect * cosine) / (pdf * P_RR);
+			}
+			else if (sp.transmission == 1) { // 金属
+				throughput = throughput * (f_r.fr_reflect * cosine) / pdf;
+			}
+			else if (sp.transmission == 2) { // 折射：按P_RR的概率选择折射方向，反射与折射按菲涅尔反射率混合
+				if (sampleResult.refractDir != glm::vec3(0.0f) && sampler.get1D(BounceSlot(depth, SlotLobe)) <= P_RR) {
+					dirNext = sampleResult.refractDir;
+					cosine = std::abs(glm::dot(dirNext, sp.Normal));
+				}
+				float kr = fresnel(-sp.viewDir, sp.Normal, material.IOR);
+				glm::vec3 combined = f_r.fr_reflect * kr + f_r.fr_refract * (1.0f - kr);
+				throughput = throughput * (combined * cosine) / (pdf * P_RR);
+			}
+
+			// 折射材质的起点偏移到新方向一侧
+			Ray rayNext;
+			glm::vec3 offsetDir = sp.Normal;
+			if (sp.transmission == 2 && glm::dot(dirNext, sp.Normal) <= 0.0f) offsetDir = -sp.Normal;
+			rayNext.origin = sp.Pos + offsetDir * settings.rayEpsilon;
+			rayNext.direction = dirNext;
+			stats.bounceRays++;
+			if (!intersect(rayNext, rec)) break;
+			sp = shadingPoint(rayNext, rec);
+		}
+		return L_dir + L_indir;
+	}
+};
+
+// 渲染参考图像并输出path.hdr与path.png，打印耗时与每个核心的光线吞吐量
+CPURenderStats CPURenderReport(CPUPathTracer &tracer, const Camera &camera,
+							   const CPURenderSettings &settings, const std::string &path) {
+	CPURenderStats stats = tracer.Render(camera, settings);
+	tracer.WriteHDR(path + ".hdr");
+	tracer.WritePNG(path + ".png", settings.pngGamma);
+
+	std::cout << "CPU path tracer: " << settings.width << "x" << settings.height << ", "
+			  << settings.samplesPerPixel << " spp ("
+			  << (settings.sampler == SamplerType::Sobol ? "Sobol" : "random") << " sampler), " << stats.nThreads << " threads, "
+			  << stats.seconds << " s" << std::endl;
+	std::cout << "CPU rays: camera " << stats.cameraRays << ", bounce " << stats.bounceRays
+			  << ", shadow " << stats.shadowRays << ", " << stats.raysPerSecond() / 1e6 << " Mrays/s, "
+			  << stats.raysPerSecondPerCore() / 1e6 << " Mrays/s per core" << std::endl;
+	std::cout << "CPU tiles: " << stats.tiles << " x " << stats.passes << " passes" << std::endl;
+	if (settings.adaptive)
+		std::cout << "CPU adaptive sampling: " << stats.samplesPerPixel() << " spp on average, "
+				  << 100.0 * stats.convergedPixels / stats.pixels << "% pixels converged before "
+				  << settings.samplesPerPixel << " spp (noise threshold " << settings.noiseThreshold << ")" << std::endl;
+	for (int t = 0; t < stats.nThreads; t++)
+		std::cout << "  thread " << t << ": utilization " << stats.utilization[t] * 100.0 << "%, tasks "
+				  << stats.threads[t].tasks << ", stolen " << stats.threads[t].stolen << std::endl;
+	return stats;
+}
+
+CPURenderStats CPURenderReport(const BVHTree &bvhTree, const Camera &camera,
+							   const CPURenderSettings &settings = CPURenderSettings(),
+							   const std::string &path = "CPUReference") {
+	CPUPathTracer tracer(bvhTree);
+	return CPURenderReport(tracer, camera, settings, path);
+}
+
+// 两级BVH场景（instancedScene）的参考图像
+CPURenderStats CPURenderReport(const BVHScene &scene, const Camera &camera,
+							   const CPURenderSettings &settings = CPURenderSettings(),
+							   const std::string &path = "CPUReference") {
+	CPUPathTracer tracer(scene);
+	return CPURenderReport(tracer, camera, settings, path);
+}
+
+// 比较结果：误差按通道计算，bias为test - reference的平均值
+struct ImageCompareResult {
+	double meanAbsError = 0.0;  // 逐像素
+	double bias = 0.0;
+	double maxBlockError = 0.0; // blockSize x blockSize块平均后的最大差异
+	bool pass = false;
+};
+
+// 检查GPU读回的图像（test）与CPU参考图像（reference）是否收敛到同一结果，两者按行从上到下、宽高相同。
+// 着色器每帧累积后截断到[0,1]，两边先截断再比较；按块平均消除大部分两边各自的随机噪声，
+// 剩下的主要是估计量的系统差异，最大块差异不超过tolerance时通过
+ImageCompareResult ImageCompareReport(const std::vector<glm::vec3> &reference, const std::vector<glm::vec3> &test,
+									  int width, int height, int blockSize = 8, double tolerance = 0.01) {
+	ImageCompareResult result;
+	if (reference.size() != (size_t)width * height || test.size() != reference.size()) {
+		std::cout << "Image compare: size mismatch (" << reference.size() << " vs " << test.size() << " pixels)" << std::endl;
+		return result;
+	}
+	for (int by = 0; by < height; by += blockSize) {
+		for (int bx = 0; bx < width; bx += blockSize) {
+			glm::dvec3 blockDiff(0.0);
+			int n = 0;
+			for (int y = by; y < std::min(by + blockSize, height); y++) {
+				for (int x = bx; x < std::min(bx + blockSize, width); x++, n++) {
+					size_t p = (size_t)y * width + x;
+					glm::dvec3 d = glm::dvec3(glm::clamp(test[p], 0.0f, 1.0f)) - glm::dvec3(glm::clamp(reference[p], 0.0f, 1.0f));
+					blockDiff += d;
+					result.meanAbsError += std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+					result.bias += d.x + d.y + d.z;
+				}
+			}
+			blockDiff /= (double)n;
+			result.maxBlockError = std::max(result.maxBlockError,
+											std::max(std::abs(blockDiff.x), std::max(std::abs(blockDiff.y), std::abs(blockDiff.z))));
+		}
+	}
+	result.meanAbsError /= 3.0 * width * height;
+	result.bias /= 3.0 * width * height;
+	result.pass = result.maxBlockError <= tolerance;
+	std::cout << "Image compare (" << width << "x" << height << ", " << blockSize << "x" << blockSize << " blocks): mean abs "
+			  << result.meanAbsError << ", bias " << result.bias << ", max block " << result.maxBlockError
+			  << (result.pass ? " <= " : " > ") << tolerance << (result.pass ? " PASS" : " FAIL") << std::endl;
+	return result;
+}
+
+#endif
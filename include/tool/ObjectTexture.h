@@ -9,14 +9,28 @@
 #include <tool/Mesh.h>
 #include <tool/Shader.h>
 #include <tool/BVHTree.h>
+#include <tool/BVHInstance.h>
+#include <tool/BVHCache.h>
+#include <tool/TriangleStore.h>
 
+#include <algorithm>
 #include <cmath>
+#include <iostream>
 #include <vector>
 
 class ObjectTexture {
 public:
 	GLuint ID_meshTex;
 	GLuint ID_bvhNodeTex;
+	GLuint ID_bvhCompactTex = 0; // 压缩BVH节点（bvhTree.compactNodes为true时生成）
+	GLuint ID_primRefTex = 0;    // SBVH三角形引用表
+	GLuint ID_bvhSkipTex = 0;    // 无栈遍历的跳转链接（定义STACKLESS_BVH或有栈遍历的栈放满时使用）
+	GLuint ID_vertexTex = 0;     // 索引格式的顶点与材质（着色器中定义INDEXED_MESH时使用）
+	GLuint ID_materialTex = 0;
+	int primRefNum = 0;
+	GLuint ID_tlasNodeTex = 0;   // 两级BVH的顶层节点（generateSceneTextures生成）
+	GLuint ID_instanceTex = 0;   // 实例变换与覆盖材质
+	int instanceNum = 0;
 	int meshNum, meshFaceNum;
 
 	void setTex(Shader &shader) {
@@ -35,6 +49,44 @@ public:
 
 		shader.setInt("texMesh", 1);
 		shader.setInt("texBvhNode", 2);
+
+		if (ID_bvhCompactTex) {
+			glActiveTexture(GL_TEXTURE0 + 3);
+			glBindTexture(GL_TEXTURE_2D, ID_bvhCompactTex);
+			shader.setInt("texBvhCompact", 3);
+		}
+
+		shader.setInt("primRefNum", primRefNum);
+		if (ID_primRefTex) {
+			glActiveTexture(GL_TEXTURE0 + 4);
+			glBindTexture(GL_TEXTURE_2D, ID_primRefTex);
+			shader.setInt("texPrimRef", 4);
+		}
+
+		if (ID_bvhSkipTex) {
+			glActiveTexture(GL_TEXTURE0 + 7);
+			glBindTexture(GL_TEXTURE_2D, ID_bvhSkipTex);
+			shader.setInt("texBvhSkip", 7);
+		}
+
+		if (ID_vertexTex) {
+			glActiveTexture(GL_TEXTURE0 + 8);
+			glBindTexture(GL_TEXTURE_2D, ID_vertexTex);
+			shader.setInt("texVertex", 8);
+			glActiveTexture(GL_TEXTURE0 + 9);
+			glBindTexture(GL_TEXTURE_2D, ID_materialTex);
+			shader.setInt("texMaterial", 9);
+		}
+
+		shader.setInt("instanceNum", instanceNum);
+		if (ID_tlasNodeTex) {
+			glActiveTexture(GL_TEXTURE0 + 5);
+			glBindTexture(GL_TEXTURE_2D, ID_tlasNodeTex);
+			shader.setInt("texTlasNode", 5);
+			glActiveTexture(GL_TEXTURE0 + 6);
+			glBindTexture(GL_TEXTURE_2D, ID_instanceTex);
+			shader.setInt("texInstance", 6);
+		}
 	}
 
 };
@@ -77,10 +129,19 @@ void getTexture(const std::vector<Mesh> & data,
 }
 
 
+// 模型矩阵，顺序：旋转 -> 缩放 -> 平移（与getTextureWithTransform一致）
+glm::mat4 getModelMatrix(glm::vec3 position, float scale, float rotateAngle, glm::vec3 rotateAxis) {
+	glm::mat4 modelMatrix = glm::mat4(1.0f);
+	modelMatrix = glm::translate(modelMatrix, position);
+	modelMatrix = glm::scale(modelMatrix, glm::vec3(scale));
+	modelMatrix = glm::rotate(modelMatrix, glm::radians(rotateAngle), rotateAxis);
+	return modelMatrix;
+}
+
 void getTextureWithTransform(const std::vector<Mesh> & data, 
 							Shader& shader, 
 							ObjectTexture& objTex, 
-							std::vector<std::shared_ptr<Triangle>>& primitives, 
+							TriangleStore& primitives, 
 							BVHTree& bvhTree, 
 							glm::vec3 position = glm::vec3(0.0f),
 							float scale = 1.0f,
@@ -104,50 +165,131 @@ void getTextureWithTransform(const std::vector<Mesh> & data,
 	objTex.meshFaceNum = dataSize_f / 3;
 	
 	// 构建模型矩阵（顺序：旋转 -> 缩放 -> 平移）
-    glm::mat4 modelMatrix = glm::mat4(1.0f);
-    modelMatrix = glm::translate(modelMatrix, position);
-    modelMatrix = glm::scale(modelMatrix, glm::vec3(scale));
-    modelMatrix = glm::rotate(modelMatrix, glm::radians(rotateAngle), rotateAxis);
+    glm::mat4 modelMatrix = getModelMatrix(position, scale, rotateAngle, rotateAxis);
 	glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
 
+	// 一次预留全部空间，整个模型只分配一次
+	primitives.reserve(primitives.size() + dataSize_f / 3);
+	int materialIndex = primitives.addMaterial(material);
     for (int i = 0; i < data.size(); i++) {
         for (int j = 0; j < data[i].indices.size() / 3; j++) {
-            std::shared_ptr<Triangle> tri = std::make_shared<Triangle>();
-            
-            // 应用完整模型变换
-            glm::vec4 v0 = modelMatrix * glm::vec4(data[i].vertices[data[i].indices[j*3+0]].Position, 1.0f);
-            glm::vec4 v1 = modelMatrix * glm::vec4(data[i].vertices[data[i].indices[j*3+1]].Position, 1.0f);
-            glm::vec4 v2 = modelMatrix * glm::vec4(data[i].vertices[data[i].indices[j*3+2]].Position, 1.0f);
-            
-            tri->v0 = glm::vec3(v0);
-            tri->v1 = glm::vec3(v1);
-            tri->v2 = glm::vec3(v2);
-
-			glm::vec3 n0 = normalMatrix * glm::vec3(data[i].vertices[data[i].indices[j*3+0]].Normal);
-			glm::vec3 n1 = normalMatrix * glm::vec3(data[i].vertices[data[i].indices[j*3+1]].Normal);
-			glm::vec3 n2 = normalMatrix * glm::vec3(data[i].vertices[data[i].indices[j*3+2]].Normal);
-			
-			tri->n0 = n0;
-			tri->n1 = n1;
-			tri->n2 = n2;
-
-			glm::vec2 u0 = glm::vec2(data[i].vertices[data[i].indices[j*3+0]].TexCoords);
-			glm::vec2 u1 = glm::vec2(data[i].vertices[data[i].indices[j*3+1]].TexCoords);
-			glm::vec2 u2 = glm::vec2(data[i].vertices[data[i].indices[j*3+2]].TexCoords);	
-			
-			tri->u0 = u0;
-			tri->u1 = u1;
-			tri->u2 = u2;
-
-			tri->material = material;
-
-            primitives.push_back(tri);
+			glm::vec3 v[3], n[3];
+			glm::vec2 uv[3];
+			for (int k = 0; k < 3; k++) {
+				const Vertex &vertex = data[i].vertices[data[i].indices[j * 3 + k]];
+				// 应用完整模型变换
+				v[k] = glm::vec3(modelMatrix * glm::vec4(vertex.Position, 1.0f));
+				n[k] = normalMatrix * vertex.Normal;
+				uv[k] = vertex.TexCoords;
+			}
+			primitives.addTriangle(v, n, uv, materialIndex);
         }
     }
 	std::cout << "primitives.size():" << primitives.size() << std::endl;
 
 }
 
+// 旧接口：每个三角形一个shared_ptr<Triangle>
+void getTextureWithTransform(const std::vector<Mesh> & data, 
+							Shader& shader, 
+							ObjectTexture& objTex, 
+							std::vector<std::shared_ptr<Triangle>>& primitives, 
+							BVHTree& bvhTree, 
+							glm::vec3 position = glm::vec3(0.0f),
+							float scale = 1.0f,
+							float rotateAngle = 0.0f,
+							glm::vec3 rotateAxis = glm::vec3(0.0f, 1.0f, 0.0f), // 默认绕Y轴旋转
+							Material material = Material()
+							) 
+{
+	TriangleStore store;
+	getTextureWithTransform(data, shader, objTex, store, bvhTree, position, scale, rotateAngle, rotateAxis, material);
+	primitives.reserve(primitives.size() + store.size());
+	for (size_t i = 0; i < store.size(); i++)
+		primitives.push_back(std::make_shared<Triangle>(store.triangle(i)));
+}
+
+// 模型在物体空间中的三角形（不做任何变换），用于BVHScene::addMesh构建BLAS
+TriangleStore getMeshTriangles(const std::vector<Mesh> & data, Material material = Material())
+{
+	TriangleStore primitives;
+	size_t count = 0;
+	for (size_t i = 0; i < data.size(); i++) count += data[i].indices.size() / 3;
+	primitives.reserve(count);
+	int materialIndex = primitives.addMaterial(material);
+	for (size_t i = 0; i < data.size(); i++) {
+		for (size_t j = 0; j < data[i].indices.size() / 3; j++) {
+			glm::vec3 v[3], n[3];
+			glm::vec2 uv[3];
+			for (int k = 0; k < 3; k++) {
+				const Vertex &vertex = data[i].vertices[data[i].indices[j * 3 + k]];
+				v[k] = vertex.Position;
+				n[k] = vertex.Normal;
+				uv[k] = vertex.TexCoords;
+			}
+			primitives.addTriangle(v, n, uv, materialIndex);
+		}
+	}
+	std::cout << "primitives.size():" << primitives.size() << std::endl;
+	return primitives;
+}
+
+// 着色器中遍历栈的项数。BLAS与单级BVH超过该深度时，栈放满的光线改用texBvhSkip无栈遍历，结果不变但较慢；
+// TLAS没有无栈遍历，按中位数划分时深度为ceil(log2(instanceNum))，不会超过
+const int ShaderStackSize = 32;
+
+void reportShaderStackDepth(const char *name, int depth) {
+	if (depth > ShaderStackSize)
+		std::cout << name << " depth " << depth << " exceeds the shader stack (" << ShaderStackSize
+				  << "), overflowing rays fall back to stackless traversal" << std::endl;
+}
+
+// 创建单通道浮点数据纹理（最近邻采样）
+GLuint createFloatTexture(int width, int height, const float *data) {
+	GLuint tex;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, data);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return tex;
+}
+
+// 两级BVH：拼接后的BLAS使用原来的texMesh/texBvhNode，TLAS与实例数组使用纹理单元5、6
+void generateSceneTextures(ObjectTexture& objTex, BVHScene& scene, Shader& shader) {
+	shader.use();
+	reportShaderStackDepth("BLAS", scene.blasMaxDepth);
+	if (scene.tlasDepth > ShaderStackSize)
+		std::cout << "ERROR::TLAS depth " << scene.tlasDepth << " exceeds the shader stack (" << ShaderStackSize << ")" << std::endl;
+
+	objTex.meshNum = scene.meshNum;
+	objTex.meshFaceNum = scene.meshNum;
+	objTex.ID_meshTex = createFloatTexture(scene.meshNumX, scene.meshNumY, scene.MeshArray.data());
+	objTex.ID_bvhNodeTex = createFloatTexture(scene.nodeNumX, scene.nodeNumY, scene.NodeArray.data());
+	objTex.ID_bvhSkipTex = createFloatTexture(scene.skipNumX, scene.skipNumY, scene.SkipArray.data());
+	objTex.ID_tlasNodeTex = createFloatTexture(scene.tlasNodeNumX, scene.tlasNodeNumY, scene.TlasNodeArray.data());
+	objTex.ID_instanceTex = createFloatTexture(scene.instanceNumX, scene.instanceNumY, scene.InstanceArray.data());
+	objTex.instanceNum = scene.instanceNum;
+
+	shader.setInt("texMesh", 1);
+	shader.setInt("texBvhNode", 2);
+	shader.setInt("texTlasNode", 5);
+	shader.setInt("texInstance", 6);
+	shader.setInt("texBvhSkip", 7);
+	shader.setInt("instanceNum", scene.instanceNum);
+}
+
+// 只修改了实例变换（scene.buildTLAS之后），重新上传TLAS与实例纹理，BLAS纹理不变
+void updateSceneTextures(ObjectTexture& objTex, BVHScene& scene) {
+	glDeleteTextures(1, &objTex.ID_tlasNodeTex);
+	glDeleteTextures(1, &objTex.ID_instanceTex);
+	objTex.ID_tlasNodeTex = createFloatTexture(scene.tlasNodeNumX, scene.tlasNodeNumY, scene.TlasNodeArray.data());
+	objTex.ID_instanceTex = createFloatTexture(scene.instanceNumX, scene.instanceNumY, scene.InstanceArray.data());
+	objTex.instanceNum = scene.instanceNum;
+}
+
 void generateTextures(ObjectTexture& objTex, BVHTree& bvhTree, Shader& shader) {
 	
 		// 绑定到纹理中
@@ -175,10 +317,148 @@ void generateTextures(ObjectTexture& objTex, BVHTree& bvhTree, Shader& shader) {
 	// 绑定纹理
 	shader.setInt("texBvhNode", 2);
 
+	// 压缩BVH节点，整数纹理必须使用最近邻采样，着色器中用texelFetch读取
+	if (bvhTree.CompactNodeArray) {
+		glGenTextures(1, &objTex.ID_bvhCompactTex);
+		glBindTexture(GL_TEXTURE_2D, objTex.ID_bvhCompactTex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32UI, bvhTree.compactNodeNumX, bvhTree.compactNodeNumY, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, bvhTree.CompactNodeArray);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		shader.setInt("texBvhCompact", 3);
+	}
+
+	// SBVH三角形引用表
+	objTex.primRefNum = bvhTree.primRefNum;
+	shader.setInt("primRefNum", bvhTree.primRefNum);
+	if (bvhTree.primRefNum > 0) {
+		glGenTextures(1, &objTex.ID_primRefTex);
+		glBindTexture(GL_TEXTURE_2D, objTex.ID_primRefTex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, bvhTree.primRefNumX, bvhTree.primRefNumY, 0, GL_RED, GL_FLOAT, bvhTree.PrimRefArray);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		shader.setInt("texPrimRef", 4);
+	}
+
+	// 无栈遍历的跳转链接
+	reportShaderStackDepth("BVH", bvhTree.maxDepth);
+	objTex.ID_bvhSkipTex = createFloatTexture(bvhTree.skipNumX, bvhTree.skipNumY, bvhTree.SkipArray);
+	shader.setInt("texBvhSkip", 7);
+
+	// 索引格式：texMesh中为顶点下标与材质编号，顶点和材质单独存放
+	if (bvhTree.meshStride == IndexedMeshStride) {
+		objTex.ID_vertexTex = createFloatTexture(bvhTree.vertexNumX, bvhTree.vertexNumY, bvhTree.VertexArray);
+		objTex.ID_materialTex = createFloatTexture(bvhTree.materialNumX, bvhTree.materialNumY, bvhTree.MaterialArray);
+		shader.setInt("texVertex", 8);
+		shader.setInt("texMaterial", 9);
+	}
+
+	bvhTree.needsFullUpload = false;
+	bvhTree.clearDirty();
+
 	// 删除数组
 	// 等测试完再删除
 }
 
+// 从映射的缓存文件直接上传纹理，不需要构建BVH
+void generateTextures(ObjectTexture& objTex, const BVHCache& cache, Shader& shader) {
+	shader.use();
+	const BVHCacheHeader &h = *cache.header;
+
+	objTex.meshNum = h.meshNum;
+	objTex.meshFaceNum = h.meshNum;
+	objTex.ID_meshTex = createFloatTexture(h.meshNumX, h.meshNumY, cache.MeshArray);
+	objTex.ID_bvhNodeTex = createFloatTexture(h.nodeNumX, h.nodeNumY, cache.NodeArray);
+	shader.setInt("texMesh", 1);
+	shader.setInt("texBvhNode", 2);
+
+	if (cache.CompactNodeArray) {
+		glGenTextures(1, &objTex.ID_bvhCompactTex);
+		glBindTexture(GL_TEXTURE_2D, objTex.ID_bvhCompactTex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32UI, h.compactNodeNumX, h.compactNodeNumY, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, cache.CompactNodeArray);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		shader.setInt("texBvhCompact", 3);
+	}
+
+	objTex.primRefNum = cache.PrimRefArray ? h.primRefNum : 0;
+	shader.setInt("primRefNum", objTex.primRefNum);
+	if (cache.PrimRefArray) {
+		objTex.ID_primRefTex = createFloatTexture(h.primRefNumX, h.primRefNumY, cache.PrimRefArray);
+		shader.setInt("texPrimRef", 4);
+	}
+
+	reportShaderStackDepth("BVH", BVHMaxDepth(cache.NodeArray, h.nodeNum));
+	objTex.ID_bvhSkipTex = createFloatTexture(h.skipNumX, h.skipNumY, cache.SkipArray);
+	shader.setInt("texBvhSkip", 7);
+
+	if (cache.VertexArray) {
+		objTex.ID_vertexTex = createFloatTexture(h.vertexNumX, h.vertexNumY, cache.VertexArray);
+		objTex.ID_materialTex = createFloatTexture(h.materialNumX, h.materialNumY, cache.MaterialArray);
+		shader.setInt("texVertex", 8);
+		shader.setInt("texMaterial", 9);
+	}
+}
+
+// 把数组中[begin, end)区间（元素下标）所在的纹理行重新上传，components为每个texel的元素数
+void uploadDirtyRows(GLuint tex, int width, int components, GLenum format, GLenum type, const void *data, size_t elementSize,
+					 const std::vector<std::pair<int, int>> &ranges)
+{
+	if (ranges.empty()) return;
+	// 按行合并，减少glTexSubImage2D调用次数
+	std::vector<std::pair<int, int>> rows;
+	for (const auto &r : ranges) {
+		int rowBegin = r.first / components / width;
+		int rowEnd = (r.second - 1) / components / width + 1;
+		rows.push_back({ rowBegin, rowEnd });
+	}
+	std::sort(rows.begin(), rows.end());
+	glBindTexture(GL_TEXTURE_2D, tex);
+	int i = 0;
+	while (i < (int)rows.size()) {
+		int rowBegin = rows[i].first, rowEnd = rows[i].second;
+		while (++i < (int)rows.size() && rows[i].first <= rowEnd) rowEnd = std::max(rowEnd, rows[i].second);
+		const char *src = (const char *)data + (size_t)rowBegin * width * components * elementSize;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, rowBegin, width, rowEnd - rowBegin, format, type, src);
+	}
+}
+
+// refit后只上传变化的节点与三角形所在的纹理行；rebuild后纹理尺寸可能变化，重新生成全部纹理
+void updateTextures(ObjectTexture& objTex, BVHTree& bvhTree, Shader& shader) {
+	if (bvhTree.needsFullUpload) {
+		glDeleteTextures(1, &objTex.ID_meshTex);
+		glDeleteTextures(1, &objTex.ID_bvhNodeTex);
+		if (objTex.ID_bvhCompactTex) glDeleteTextures(1, &objTex.ID_bvhCompactTex);
+		if (objTex.ID_primRefTex) glDeleteTextures(1, &objTex.ID_primRefTex);
+		if (objTex.ID_bvhSkipTex) glDeleteTextures(1, &objTex.ID_bvhSkipTex);
+		if (objTex.ID_vertexTex) glDeleteTextures(1, &objTex.ID_vertexTex);
+		if (objTex.ID_materialTex) glDeleteTextures(1, &objTex.ID_materialTex);
+		objTex.ID_bvhCompactTex = 0;
+		objTex.ID_primRefTex = 0;
+		objTex.ID_bvhSkipTex = 0;
+		objTex.ID_vertexTex = 0;
+		objTex.ID_materialTex = 0;
+		generateTextures(objTex, bvhTree, shader);
+		return;
+	}
+	uploadDirtyRows(objTex.ID_meshTex, bvhTree.meshNumX, 1, GL_RED, GL_FLOAT,
+					bvhTree.MeshArray, sizeof(float), bvhTree.dirtyMeshRanges);
+	if (objTex.ID_vertexTex)
+		uploadDirtyRows(objTex.ID_vertexTex, bvhTree.vertexNumX, 1, GL_RED, GL_FLOAT,
+						bvhTree.VertexArray, sizeof(float), bvhTree.dirtyVertexRanges);
+	uploadDirtyRows(objTex.ID_bvhNodeTex, bvhTree.nodeNumX, 1, GL_RED, GL_FLOAT,
+					bvhTree.NodeArray, sizeof(float), bvhTree.dirtyNodeRanges);
+	if (objTex.ID_bvhCompactTex)
+		uploadDirtyRows(objTex.ID_bvhCompactTex, bvhTree.compactNodeNumX, 4, GL_RGBA_INTEGER, GL_UNSIGNED_INT,
+						bvhTree.CompactNodeArray, sizeof(unsigned int), bvhTree.dirtyCompactRanges);
+	bvhTree.clearDirty();
+}
+
 
 
 #endif
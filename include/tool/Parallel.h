@@ -0,0 +1,44 @@
+#pragma once
+#ifndef __Parallel_h__
+#define __Parallel_h__
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// 获取实际使用的线程数，requested <= 0 时使用全部CPU核心
+int GetThreadCount(int requested = 0) {
+	if (requested > 0) return requested;
+	int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+// 将[begin, end)均分为nThreads段并行执行func(start, end, threadIndex)
+// 段数为1时直接在当前线程执行，不创建线程
+void ParallelFor(int begin, int end, int nThreads,
+				 const std::function<void(int, int, int)> &func)
+{
+	int count = end - begin;
+	if (count <= 0) return;
+	nThreads = std::max(1, std::min(nThreads, count));
+	if (nThreads == 1) {
+		func(begin, end, 0);
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	threads.reserve(nThreads - 1);
+	int chunk = (count + nThreads - 1) / nThreads;
+	for (int t = 1; t < nThreads; t++) {
+		int s = begin + t * chunk;
+		int e = std::min(end, s + chunk);
+		if (s >= e) break;
+		threads.emplace_back(func, s, e, t);
+	}
+	// 第0段由当前线程完成
+	func(begin, std::min(end, begin + chunk), 0);
+	for (auto &th : threads) th.join();
+}
+
+#endif
@@ -2,19 +2,54 @@
 #ifndef __Tool_h__
 #define __Tool_h__
 
-#include <time.h>
-#include <stdlib.h>
+#include <atomic>
+#include <cstdint>
+
+// 基于计数器的随机数：随机数只由 (像素, 采样序号, 维度) 决定，不保存任何状态。
+// 多线程渲染时各线程之间没有共享状态，同一参数下的渲染结果逐位相同，便于调试和回归比较。
+// 着色器（RayTracerFragmentShader.glsl）中的pcgHash/randomKey/randomFloat与这里逐位一致。
+
+// PCG哈希（Jarzynski & Olano, "Hash Functions for GPU Rendering", 2020），32位输入输出的双射
+inline uint32_t PCGHash(uint32_t v) {
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// 由像素下标、采样序号和全局种子得到一条采样路径的键
+inline uint32_t RandomKey(uint32_t pixel, uint32_t sample, uint32_t seed = 0) {
+	return PCGHash(pixel ^ PCGHash(sample ^ PCGHash(seed)));
+}
+
+// 第dimension维的[0, 1)均匀随机数，取高24位，转换为float时没有舍入，着色器中得到相同的值
+inline float RandomFloat(uint32_t key, uint32_t dimension) {
+	return (PCGHash(key ^ PCGHash(dimension)) >> 8) * (1.0f / 16777216.0f);
+}
+
+// 一条采样路径上的随机数序列：每次next()使用下一个维度
+struct PixelRandom {
+	uint32_t key;
+	uint32_t dimension = 0;
+
+	PixelRandom(uint32_t pixel, uint32_t sample, uint32_t seed = 0) : key(RandomKey(pixel, sample, seed)) {}
+
+	float next() { return RandomFloat(key, dimension++); }
+};
+
+// 旧接口：全局计数器代替srand(time(NULL))/rand()，线程安全，同一种子下序列可复现
+std::atomic<uint32_t> cpuRandomSeed(0);
+std::atomic<uint32_t> cpuRandomCounter(0);
 
 // 初始化CPU随机数生成器
-void CPURandomInit() {
-	srand(time(NULL));
+void CPURandomInit(uint32_t seed = 0) {
+	cpuRandomSeed = PCGHash(seed);
+	cpuRandomCounter = 0;
 }
 
 // 获取CPU随机数
 float GetCPURandom() {
-	return (float)rand() / (RAND_MAX + 1.0);
+	return RandomFloat(cpuRandomSeed, cpuRandomCounter++);
 }
 
 
 #endif
-
@@ -4,18 +4,29 @@
 
 #include <tool/ScreenFBO.h>
 
+#include <glm/glm.hpp>
+
+#include <algorithm>
 #include <iostream>
+#include <vector>
 
 using namespace std;
 
 // 双缓冲帧缓存管理机制
 class RenderBuffer {
 public:
+	int momentUnit = 10; // 亮度矩的纹理单元，避开ObjectTexture使用的1~9
+
 	// 初始化，创建了两个帧缓冲对象，创建两个相同尺寸的FBO（帧缓冲对象）
-	void Init(int SCR_WIDTH, int SCR_HEIGHT) {
-		fbo[0].configuration(SCR_WIDTH, SCR_HEIGHT);
-		fbo[1].configuration(SCR_WIDTH, SCR_HEIGHT);
+	// 自适应采样：alpha通道保存收敛标记，internalFormat使用GL_RGBA32F；moments为true时每个FBO增加亮度矩附件，
+	// 历史帧的亮度矩绑定到纹理单元momentUnit
+	void Init(int SCR_WIDTH, int SCR_HEIGHT, GLenum internalFormat = GL_RGB, bool moments = false) {
+		fbo[0].configuration(SCR_WIDTH, SCR_HEIGHT, internalFormat, moments);
+		fbo[1].configuration(SCR_WIDTH, SCR_HEIGHT, internalFormat, moments);
+		hasMoments = moments;
 		currentIndex = 0;
+		width = SCR_WIDTH;
+		height = SCR_HEIGHT;
 	}
 
 	// 设置当前帧的帧缓冲对象
@@ -31,6 +42,7 @@ public:
 		
 		fbo[curIndex].Bind(); // 绑定当前帧的帧缓冲对象
 		fbo[histIndex].BindAsTexture(); // 绑定历史帧的纹理
+		if (hasMoments) fbo[histIndex].BindMomentsAsTexture(momentUnit); // 历史帧的亮度矩
 	}
 	
 	// 将当前活跃FBO绑定为纹理
@@ -40,6 +52,33 @@ public:
 		fbo[curIndex].BindAsTexture(); // 绑定当前帧的纹理
 	}
 
+	// 当前帧中已收敛像素的比例：自适应采样时着色器对已收敛的像素写入负的alpha（需要GL_RGBA32F格式）
+	// 读回整帧数据，不宜每帧调用
+	float convergedFraction(int LoopNum) {
+		int curIndex = (LoopNum % 2 == 0 ? 1 : 0);
+		std::vector<float> pixels((size_t)width * height * 4);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo[curIndex].framebuffer);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, pixels.data());
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		size_t converged = 0;
+		for (size_t i = 3; i < pixels.size(); i += 4)
+			if (pixels[i] < 0.0f) converged++;
+		return (float)converged / ((size_t)width * height);
+	}
+
+	// 读回当前帧的颜色，按行从上到下排列（与CPUPathTracer::image相同），用于与CPU参考图像比较
+	void readColor(int LoopNum, std::vector<glm::vec3> &pixels) {
+		int curIndex = (LoopNum % 2 == 0 ? 1 : 0);
+		std::vector<glm::vec3> rows((size_t)width * height);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo[curIndex].framebuffer);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_FLOAT, rows.data());
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		pixels.resize(rows.size());
+		for (int y = 0; y < height; y++)
+			std::copy(rows.begin() + (size_t)(height - 1 - y) * width, rows.begin() + (size_t)(height - y) * width,
+					  pixels.begin() + (size_t)y * width);
+	}
+
 	// 解绑帧缓冲
 	void unBind() {
 		glBindFramebuffer(GL_FRAMEBUFFER, 0); // 直接解绑到默认帧缓冲
@@ -53,6 +92,8 @@ public:
 private:
 	// 用于渲染当前帧的索引
 	int currentIndex;
+	int width = 0, height = 0;
+	bool hasMoments = false;
 	ScreenFBO fbo[2]; // 创建了2个ScreenFBO类的实例，在栈内存中连续分配了2个ScreenFBO对象
 };
 
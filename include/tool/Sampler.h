@@ -0,0 +1,116 @@
+#pragma once
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <glm/glm.hpp>
+
+#include <tool/RandomUtils.h>
+
+#include <cstdint>
+
+// 路径采样器：按固定的维度分配取得采样值，可在独立随机数与低差异序列之间切换。
+// 低差异序列为逐维填充（padding）的二维Owen扰乱Sobol序列（Burley, "Practical Hash-based Owen Scrambling", 2020）：
+// 每个槽位（slot）是一个二维Sobol点，按(像素, 槽位)得到的种子做嵌套均匀扰乱，采样序号也先经过扰乱打乱顺序，
+// 因此不同像素、不同槽位之间互不相关，而同一像素同一槽位的前2^k个采样是分层良好的(0, 2)点集。
+// 一条路径上每次反弹的槽位固定（见SampleSlot），分支不同的路径不会错用其他用途的维度。
+// 次数不固定的随机数（如拒绝采样）使用random，不占用槽位。
+// 着色器（RayTracerFragmentShader.glsl）中的sample1D/sample2D与这里逐位一致。
+
+enum class SamplerType {
+	Random, // 独立随机数
+	Sobol   // Owen扰乱的Sobol序列
+};
+
+// 每次反弹使用的槽位
+enum SampleSlot {
+	SlotLightSelect = 0, // 选择光源三角形（一维）
+	SlotLightPoint,      // 光源上的点（二维）
+	SlotBSDF,            // 反射方向（二维）
+	SlotLobe,            // 折射材质选择反射或折射（一维）
+	SlotRussianRoulette, // 俄罗斯轮盘（一维）
+	SlotsPerBounce
+};
+
+// 槽位0为像素内的偏移，之后每次反弹SlotsPerBounce个
+inline uint32_t CameraSlot() { return 0u; }
+inline uint32_t BounceSlot(int depth, SampleSlot slot) { return 1u + (uint32_t)depth * SlotsPerBounce + slot; }
+
+// random使用的维度从这里开始，与槽位的维度不重叠
+const uint32_t RandomFreeDimension = 1u << 16;
+
+inline uint32_t ReverseBits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Laine-Karras置换：只由低位影响高位，反转位序后即为对二进制小数的嵌套均匀扰乱（Owen扰乱）
+inline uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+inline uint32_t NestedUniformScramble(uint32_t x, uint32_t seed) {
+	return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+}
+
+// Sobol序列第二维（本原多项式x + 1），第一维即ReverseBits(index)
+inline uint32_t SobolSecondDimension(uint32_t index) {
+	uint32_t x = 0u;
+	for (uint32_t v = 1u << 31; index != 0u; index >>= 1, v ^= v >> 1)
+		if (index & 1u) x ^= v;
+	return x;
+}
+
+// 32位定点数转换为[0, 1)，取高24位，与RandomFloat相同
+inline float UintToFloat(uint32_t x) {
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// 第index个Owen扰乱Sobol点的第一维，与SobolOwen2D(index, seed).x相同
+inline float SobolOwen1D(uint32_t index, uint32_t seed) {
+	index = NestedUniformScramble(index, seed);
+	return UintToFloat(NestedUniformScramble(ReverseBits(index), PCGHash(seed ^ 0x1u)));
+}
+
+// 第index个二维Owen扰乱Sobol点，seed区分像素与槽位
+inline glm::vec2 SobolOwen2D(uint32_t index, uint32_t seed) {
+	index = NestedUniformScramble(index, seed);
+	uint32_t x = NestedUniformScramble(ReverseBits(index), PCGHash(seed ^ 0x1u));
+	uint32_t y = NestedUniformScramble(SobolSecondDimension(index), PCGHash(seed ^ 0x2u));
+	return glm::vec2(UintToFloat(x), UintToFloat(y));
+}
+
+class PathSampler {
+public:
+	SamplerType type;
+	uint32_t sample;
+	uint32_t pixelKey;  // Sobol：同一像素的所有采样共用，与采样序号无关
+	uint32_t sampleKey; // Random：每个采样一个
+	PixelRandom random; // 次数不固定的随机数
+
+	PathSampler(SamplerType type, uint32_t pixel, uint32_t sample, uint32_t seed = 0)
+		: type(type), sample(sample), pixelKey(PCGHash(pixel ^ PCGHash(seed))),
+		  sampleKey(RandomKey(pixel, sample, seed)), random(pixel, sample, seed) {
+		random.dimension = RandomFreeDimension;
+	}
+
+	glm::vec2 get2D(uint32_t slot) const {
+		if (type == SamplerType::Sobol) return SobolOwen2D(sample, PCGHash(pixelKey ^ PCGHash(slot)));
+		return glm::vec2(RandomFloat(sampleKey, 2u * slot), RandomFloat(sampleKey, 2u * slot + 1u));
+	}
+
+	// 一维采样取二维点的第一维，Owen扰乱后同样是分层良好的序列
+	float get1D(uint32_t slot) const {
+		if (type == SamplerType::Sobol) return SobolOwen1D(sample, PCGHash(pixelKey ^ PCGHash(slot)));
+		return RandomFloat(sampleKey, 2u * slot);
+	}
+};
+
+#endif
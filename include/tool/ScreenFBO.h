@@ -18,10 +18,13 @@ public:
 	unsigned int framebuffer; // 自定义帧缓冲
 	// 颜色附件纹理
 	unsigned int textureColorbuffer; // 颜色纹理附件
+	unsigned int textureMomentbuffer = 0; // 可选的第二个颜色附件（亮度矩），没有时为0
 	// 深度和模板附件的renderbuffer object
 	unsigned int rbo; // 渲染缓冲对象
 
-	void configuration(int SCR_WIDTH, int SCR_HEIGHT) {
+	// internalFormat为颜色纹理的内部格式，需要保存浮点数据（如自适应采样的收敛标记）时使用GL_RGBA32F
+	// moments为true时增加GL_RG32F的第二个颜色附件，对应片段着色器location 1的输出（自适应采样的亮度一阶、二阶矩）
+	void configuration(int SCR_WIDTH, int SCR_HEIGHT, GLenum internalFormat = GL_RGB, bool moments = false) {
 		// 1. 创建帧缓冲对象
 		glGenFramebuffers(1, &framebuffer); // 创建帧缓冲
 		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer); // 绑定自定义帧缓冲
@@ -31,7 +34,7 @@ public:
 		glGenTextures(1, &textureColorbuffer); // 生成纹理
 		glBindTexture(GL_TEXTURE_2D, textureColorbuffer); // 绑定纹理
 		// 设置纹理参数(大小与屏幕相同)
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, NULL); // 设置纹理数据
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, NULL); // 设置纹理数据
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // 设置纹理过滤，GL_LINEAR表示线性过滤，GL_TEXTURE_MIN_FILTER表示缩小过滤
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); // 设置纹理过滤，GL_LINEAR表示线性过滤，GL_TEXTURE_MAG_FILTER表示放大过滤
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); // 设置纹理环绕方式
@@ -45,6 +48,20 @@ public:
 			textureColorbuffer,      // 要附加的纹理对象
 			0                        // Mipmap级别
 		);
+
+		// 亮度矩附件：只用texelFetch读取，不需要线性过滤
+		if (moments) {
+			glGenTextures(1, &textureMomentbuffer);
+			glBindTexture(GL_TEXTURE_2D, textureMomentbuffer);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, SCR_WIDTH, SCR_HEIGHT, 0, GL_RG, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, textureMomentbuffer, 0);
+			GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+			glDrawBuffers(2, drawBuffers);
+		}
 		
 		// 4. 创建渲染缓冲对象(用于深度和模板测试)
 		glGenRenderbuffers(1, &rbo); // 生成渲染缓冲
@@ -90,12 +107,20 @@ public:
 		glBindTexture(GL_TEXTURE_2D, textureColorbuffer);
 	}
 
+	// 亮度矩附件绑定到纹理单元unit
+	void BindMomentsAsTexture(int unit) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, textureMomentbuffer);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
 	// 删除帧缓冲
 	void Delete() {
 		// 删除
 		unBind(); // 解绑帧缓冲
 		glDeleteFramebuffers(1, &framebuffer); // 删除帧缓冲
 		glDeleteTextures(1, &textureColorbuffer); // 删除颜色纹理
+		if (textureMomentbuffer) glDeleteTextures(1, &textureMomentbuffer);
 	}
 
 };
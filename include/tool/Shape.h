@@ -6,6 +6,9 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <algorithm>
+#include <limits>
+
 struct Material {
     glm::vec3 emissive = glm::vec3(0.0f, 0.0f, 0.0f);  // 作为光源时的发光颜色
     glm::vec3 baseColor = glm::vec3(0, 0, 0);
@@ -23,6 +26,24 @@ struct Material {
     float transmission = 0.0; // 暂时设置为材质属性 {-1: 灯光, 0: 漫反射, 1: 金属, 2: 折射}
 };
 
+// 按MeshArray中三角形材质部分的顺序写入18个float
+void packMaterial(const Material &m, float *dst) {
+	dst[0] = m.emissive.x; dst[1] = m.emissive.y; dst[2] = m.emissive.z;
+	dst[3] = m.baseColor.x; dst[4] = m.baseColor.y; dst[5] = m.baseColor.z;
+	dst[6] = m.subsurface;
+	dst[7] = m.metallic;
+	dst[8] = m.specular;
+	dst[9] = m.specularTint;
+	dst[10] = m.roughness;
+	dst[11] = m.anisotropic;
+	dst[12] = m.sheen;
+	dst[13] = m.sheenTint;
+	dst[14] = m.clearcoat;
+	dst[15] = m.clearcoatGloss;
+	dst[16] = m.IOR;
+	dst[17] = m.transmission;
+}
+
 class Triangle {
 public:
 	glm::vec3 v0, v1, v2;
@@ -74,6 +95,11 @@ struct Bound3f {
 		return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
 	}
 
+	// 未包含任何点（默认构造或两个包围盒不相交）
+	bool IsEmpty() const {
+		return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z;
+	}
+
 };
 
 glm::vec3 getBoundp(const Bound3f& bound, const int i) {
@@ -135,6 +161,15 @@ Bound3f Union(const Bound3f &b, const glm::vec3 &p) {
 	return ret;
 }
 
+// 两个包围盒的交集，不相交时返回空包围盒
+Bound3f Intersect(const Bound3f &b1, const Bound3f &b2) {
+	Bound3f ret;
+	ret.pMin = Max(b1.pMin, b2.pMin);
+	ret.pMax = Min(b1.pMax, b2.pMax);
+	if (ret.IsEmpty()) return Bound3f();
+	return ret;
+}
+
 Bound3f getTriangleBound(const Triangle& tri) {
 	Bound3f triBound = Union(Bound3f(tri.v0, tri.v1), tri.v2);
 	//std::cout << triBound.pMin.x << " " << triBound.pMin.y << " " << triBound.pMin.z << " " << triBound.pMax.x << " " << triBound.pMax.y << " " << triBound.pMax.z << " " << std::endl;
@@ -142,42 +177,90 @@ Bound3f getTriangleBound(const Triangle& tri) {
 }
 
 
+// 水密（watertight）三角形求交，Woop, Benthin, Wald 2013
+// 旧的hitTriangle先求平面交点再做三次叉乘判断内外，相邻三角形对同一条边的判断各自独立舍入，
+// 光线正好打在共享边上时可能两边都判为未命中（Cornell Box接缝处的漏光），之后还要从t中减去一个经验值防自交。
+// 这里把光线变换到自己的坐标系：以方向绝对值最大的分量为z轴，剪切使光线变为沿+z的单位光线，
+// 三角形顶点经过同样的变换后只需在xy平面上做三个二维边函数。共享边的两个顶点在两个三角形中
+// 变换结果完全相同，边函数只差一个符号，因此不会出现裂缝。
+// 变换只与光线有关，每条光线预计算一次（WatertightRay），每个三角形只需读取三个顶点
+
+struct WatertightRay {
+	glm::vec3 origin;
+	int kx, ky, kz;   // 坐标轴的重排，kz为方向绝对值最大的分量
+	float Sx, Sy, Sz; // 剪切系数
+};
+
+WatertightRay prepareWatertightRay(const Ray &r) {
+	WatertightRay w;
+	w.origin = r.origin;
+	glm::vec3 a = glm::abs(r.direction);
+	w.kz = (a.x > a.y) ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+	w.kx = (w.kz + 1) % 3;
+	w.ky = (w.kx + 1) % 3;
+	// 保持三角形的环绕方向不变
+	if (r.direction[w.kz] < 0.0f) std::swap(w.kx, w.ky);
+	w.Sx = r.direction[w.kx] / r.direction[w.kz];
+	w.Sy = r.direction[w.ky] / r.direction[w.kz];
+	w.Sz = 1.0f / r.direction[w.kz];
+	return w;
+}
+
+// 求交结果：距离t与重心坐标，交点 = (1-u-v)*p0 + u*p1 + v*p2
+struct TriangleHit {
+	bool hit = false;
+	float t = -1.0f;
+	float u = 0.0f, v = 0.0f;
+};
+
+// 只接受 0 < t < tMax 的交点。不再减去经验值，防自交由调用者沿法线偏移起点完成
+TriangleHit hitTriangleWatertight(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2,
+	const WatertightRay &w, float tMax = std::numeric_limits<float>::max()) {
+	TriangleHit h;
+	// glm的operator[]是switch，这里按下标直接访问分量
+	const glm::vec3 a = p0 - w.origin, b = p1 - w.origin, c = p2 - w.origin;
+	const float *A = &a.x, *B = &b.x, *C = &c.x;
+
+	// 剪切后的顶点xy坐标
+	const float Ax = A[w.kx] - w.Sx * A[w.kz], Ay = A[w.ky] - w.Sy * A[w.kz];
+	const float Bx = B[w.kx] - w.Sx * B[w.kz], By = B[w.ky] - w.Sy * B[w.kz];
+	const float Cx = C[w.kx] - w.Sx * C[w.kz], Cy = C[w.ky] - w.Sy * C[w.kz];
+
+	// 边函数（未归一化的重心坐标）
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+
+	// 恰好为0时float的结果不可靠，改用double重新计算
+	if (U == 0.0f || V == 0.0f || W == 0.0f) {
+		U = (float)((double)Cx * (double)By - (double)Cy * (double)Bx);
+		V = (float)((double)Ax * (double)Cy - (double)Ay * (double)Cx);
+		W = (float)((double)Bx * (double)Ay - (double)By * (double)Ax);
+	}
+
+	// 正反面都接受：三个边函数同号（允许为0）才在三角形内
+	if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) return h;
+	const float det = U + V + W;
+	if (det == 0.0f) return h;
+
+	// 先用未除以det的距离判断范围，只有命中时才做除法
+	const float Az = w.Sz * A[w.kz], Bz = w.Sz * B[w.kz], Cz = w.Sz * C[w.kz];
+	const float T = U * Az + V * Bz + W * Cz;
+	const float sign = det < 0.0f ? -1.0f : 1.0f;
+	if (T * sign <= 0.0f || T * sign >= tMax * det * sign) return h;
+
+	const float rcpDet = 1.0f / det;
+	h.hit = true;
+	h.t = T * rcpDet;
+	h.u = V * rcpDet;
+	h.v = W * rcpDet;
+	return h;
+}
+
 // 返回值：射线到三角形交点的距离（未命中返回-1）
 float hitTriangle(const Triangle& tri, const Ray& r) {
-    // 计算三角形平面法向量
-    glm::vec3 A = tri.v1 - tri.v0;
-    glm::vec3 B = tri.v2 - tri.v0;
-    glm::vec3 N = normalize(cross(A, B));
-    
-    // 检测射线与平面平行情况
-    if (dot(N, r.direction) == 0) return -1.0;
-    
-    // 计算交点参数t（平面方程：N·P + D = 0）
-    float D = -dot(N, tri.v0);
-    float t = -(dot(N, r.origin) + D) / dot(N, r.direction);
-    if (t < 0) return -1.0; // 交点在射线起点后方
-    
-    // 计算三维交点坐标
-    glm::vec3 pHit = r.origin + t * r.direction;
-    
-    // 使用三次叉乘法验证交点是否在三角形内
-    // 检查边v0->v1
-    glm::vec3 edge0 = tri.v1 - tri.v0;
-    glm::vec3 C0 = pHit - tri.v0;
-    if (dot(N, cross(edge0, C0)) < 0) return -1.0;
-    
-    // 检查边v1->v2
-    glm::vec3 edge1 = tri.v2 - tri.v1;
-    glm::vec3 C1 = pHit - tri.v1;
-    if (dot(N, cross(edge1, C1)) < 0) return -1.0;
-    
-    // 检查边v2->v0
-    glm::vec3 edge2 = tri.v0 - tri.v2;
-    glm::vec3 C2 = pHit - tri.v2;
-    if (glm::dot(N, cross(edge2, C2)) < 0) return -1.0;
-    
-    // 返回有效距离（减去微小值避免自相交）
-    return t - 0.00001;
+	TriangleHit h = hitTriangleWatertight(tri.v0, tri.v1, tri.v2, prepareWatertightRay(r));
+	return h.hit ? h.t : -1.0f;
 }
 
 #endif
@@ -0,0 +1,281 @@
+#pragma once
+#ifndef __TILESCHEDULER_H__
+#define __TILESCHEDULER_H__
+
+#include <glm/glm.hpp>
+
+#include <tool/Parallel.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// CPU渲染的tile调度：图像划分为tile，每个tile分多遍（pass）渲染，每遍完成后把下一遍重新放回队列，
+// 任务函数返回false时（例如自适应采样下tile已收敛）该tile提前结束。
+// 每个线程一个双端队列，初始时按tile顺序（螺旋或Hilbert曲线）连续分段分配，线程从自己队列的头部取任务，
+// 重新入队的下一遍放在尾部；自己的队列为空时从其他线程队列的尾部窃取。
+// 按行静态划分时，玻璃、焦散等代价高的区域会让个别线程拖到最后，窃取使所有线程一直有工作直到全部完成。
+
+enum class TileOrder {
+	Scanline, // 逐行
+	Spiral,   // 从图像中心向外螺旋，预览时中心区域最先收敛
+	Hilbert   // Hilbert曲线，相邻任务在图像上相邻，缓存局部性最好
+};
+
+// 图像中的矩形区域[x0, x1) x [y0, y1)，y为图像行号（自上而下）
+struct Tile {
+	int x0, y0, x1, y1;
+	int pixelCount() const { return (x1 - x0) * (y1 - y0); }
+};
+
+// Hilbert曲线上第d个点的坐标（n为2的幂）
+void HilbertD2XY(int n, int d, int &x, int &y) {
+	x = y = 0;
+	for (int s = 1; s < n; s *= 2) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+// 划分tile并按order排列
+std::vector<Tile> MakeTiles(int width, int height, int tileSize, TileOrder order) {
+	int tilesX = (width + tileSize - 1) / tileSize;
+	int tilesY = (height + tileSize - 1) / tileSize;
+	std::vector<Tile> tiles;
+	tiles.reserve(tilesX * tilesY);
+	auto add = [&](int tx, int ty) {
+		tiles.push_back({ tx * tileSize, ty * tileSize,
+						  std::min(width, (tx + 1) * tileSize), std::min(height, (ty + 1) * tileSize) });
+	};
+
+	if (order == TileOrder::Hilbert) {
+		int n = 1;
+		while (n < tilesX || n < tilesY) n *= 2;
+		for (int d = 0; d < n * n; d++) {
+			int tx, ty;
+			HilbertD2XY(n, d, tx, ty);
+			if (tx < tilesX && ty < tilesY) add(tx, ty);
+		}
+	}
+	else if (order == TileOrder::Spiral) {
+		// 从中心tile出发，按右、下、左、上的方向走，每两次转向步长加1，跳过图像外的位置
+		int tx = (tilesX - 1) / 2, ty = (tilesY - 1) / 2;
+		const int dx[4] = { 1, 0, -1, 0 }, dy[4] = { 0, 1, 0, -1 };
+		add(tx, ty);
+		for (int step = 1, dir = 0; (int)tiles.size() < tilesX * tilesY; dir = (dir + 1) % 4) {
+			for (int k = 0; k < step; k++) {
+				tx += dx[dir];
+				ty += dy[dir];
+				if (tx >= 0 && tx < tilesX && ty >= 0 && ty < tilesY) add(tx, ty);
+			}
+			if (dir % 2 == 1) step++;
+		}
+	}
+	else {
+		for (int ty = 0; ty < tilesY; ty++)
+			for (int tx = 0; tx < tilesX; tx++) add(tx, ty);
+	}
+	return tiles;
+}
+
+// 一个任务：tile的第pass遍
+struct TileTask {
+	int tile;
+	int pass;
+};
+
+// 每个线程的统计
+struct TileThreadStats {
+	double busySeconds = 0.0; // 执行任务的时间
+	int tasks = 0;
+	int stolen = 0;           // 从其他线程队列窃取的任务数
+};
+
+class TileScheduler {
+public:
+	std::vector<Tile> tiles;
+	int passes = 1;
+	int nThreads = 1;
+	double seconds = 0.0; // 上一次Run的总耗时
+	std::vector<TileThreadStats> threadStats;
+
+	TileScheduler(std::vector<Tile> tiles, int passes, int nThreads = 0)
+		: tiles(std::move(tiles)), passes(std::max(1, passes)), nThreads(GetThreadCount(nThreads)) {}
+
+	// 线程利用率：执行任务的时间 / 总耗时
+	double utilization(int thread) const {
+		return seconds > 0.0 ? threadStats[thread].busySeconds / seconds : 0.0;
+	}
+
+	// 在nThreads个工作线程上执行全部任务，func(task, threadIndex)返回该tile是否还需要下一遍。
+	// 同一个tile的下一遍只在上一遍完成后入队，因此一个tile不会被两个线程同时处理，tile内的数据不需要加锁。
+	// 调用线程不参与渲染，每隔monitorInterval秒调用一次monitor（例如保存预览），结束前再调用一次
+	void Run(const std::function<bool(const TileTask &, int)> &func,
+			 double monitorInterval = 0.0, const std::function<void()> &monitor = nullptr) {
+		threadStats.assign(nThreads, TileThreadStats());
+		queues.clear();
+		for (int t = 0; t < nThreads; t++) queues.emplace_back(new WorkQueue());
+		// 按tile顺序连续分段，每个线程处理曲线上相邻的一段
+		int count = (int)tiles.size();
+		for (int i = 0; i < count; i++)
+			queues[(long long)i * nThreads / count]->tasks.push_back({ i, 0 });
+		remaining = count;
+
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (int t = 0; t < nThreads; t++) threads.emplace_back(&TileScheduler::worker, this, std::cref(func), t);
+		if (monitor) {
+			auto interval = std::chrono::duration<double>(monitorInterval > 0.0 ? monitorInterval : 1.0);
+			auto last = std::chrono::steady_clock::now();
+			while (remaining.load() > 0) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				if (std::chrono::steady_clock::now() - last >= interval) {
+					monitor();
+					last = std::chrono::steady_clock::now();
+				}
+			}
+		}
+		for (auto &th : threads) th.join();
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (monitor) monitor();
+	}
+
+private:
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<TileTask> tasks;
+	};
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::atomic<long long> remaining{ 0 }; // 尚未完成全部各遍的tile数
+
+	bool popLocal(int t, TileTask &task) {
+		WorkQueue &q = *queues[t];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tasks.empty()) return false;
+		task = q.tasks.front();
+		q.tasks.pop_front();
+		return true;
+	}
+
+	bool steal(int t, TileTask &task) {
+		for (int k = 1; k < nThreads; k++) {
+			WorkQueue &q = *queues[(t + k) % nThreads];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (q.tasks.empty()) continue;
+			task = q.tasks.back();
+			q.tasks.pop_back();
+			return true;
+		}
+		return false;
+	}
+
+	void worker(const std::function<bool(const TileTask &, int)> &func, int t) {
+		TileThreadStats &stats = threadStats[t];
+		while (true) {
+			TileTask task;
+			bool found = popLocal(t, task);
+			if (!found && steal(t, task)) {
+				found = true;
+				stats.stolen++;
+			}
+			if (!found) {
+				// 队列都为空但还有任务在执行，它们完成后可能重新入队下一遍
+				if (remaining.load() == 0) break;
+				std::this_thread::yield();
+				continue;
+			}
+			auto start = std::chrono::steady_clock::now();
+			bool more = func(task, t);
+			stats.busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			stats.tasks++;
+			if (more && task.pass + 1 < passes) {
+				WorkQueue &q = *queues[t];
+				std::lock_guard<std::mutex> lock(q.mutex);
+				q.tasks.push_back({ task.tile, task.pass + 1 });
+			}
+			else remaining--;
+		}
+	}
+};
+
+// 按tile无锁发布的帧缓冲：每个tile一个序列号（seqlock），写入时为奇数，写完后加1变为偶数。
+// 同一个tile只有一个写入者（见TileScheduler::Run），读取方在任何时刻都可以调用Snapshot，
+// 读取前后序列号不同或为奇数时重新读取该tile，得到的每个tile都是某一遍完成后的完整结果。
+// 像素分量用relaxed原子读写（x86上与普通读写相同），读写重叠时不构成数据竞争
+class TileFramebuffer {
+public:
+	int width = 0, height = 0;
+	std::vector<Tile> tiles;
+
+	void Init(int w, int h, const std::vector<Tile> &t) {
+		width = w;
+		height = h;
+		tiles = t;
+		pixels.reset(new std::atomic<float>[(size_t)w * h * 3]);
+		for (size_t i = 0; i < (size_t)w * h * 3; i++) pixels[i].store(0.0f, std::memory_order_relaxed);
+		versions.reset(new std::atomic<unsigned int>[tiles.size()]);
+		for (size_t i = 0; i < tiles.size(); i++) versions[i].store(0);
+	}
+
+	// 写入一个tile，src按tile内的行排列
+	void Publish(int tile, const glm::vec3 *src) {
+		const Tile &r = tiles[tile];
+		unsigned int v = versions[tile].load(std::memory_order_relaxed);
+		versions[tile].store(v + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (int y = r.y0; y < r.y1; y++) {
+			for (int x = r.x0; x < r.x1; x++) {
+				const glm::vec3 &c = *src++;
+				std::atomic<float> *dst = &pixels[((size_t)y * width + x) * 3];
+				for (int k = 0; k < 3; k++) dst[k].store(c[k], std::memory_order_relaxed);
+			}
+		}
+		versions[tile].store(v + 2, std::memory_order_release);
+	}
+
+	// 复制当前已发布的整幅图像（按行自上而下）
+	void Snapshot(std::vector<glm::vec3> &out) const {
+		out.resize((size_t)width * height);
+		for (size_t i = 0; i < tiles.size(); i++) {
+			const Tile &r = tiles[i];
+			while (true) {
+				unsigned int v0 = versions[i].load(std::memory_order_acquire);
+				if (v0 & 1u) {
+					std::this_thread::yield();
+					continue;
+				}
+				for (int y = r.y0; y < r.y1; y++) {
+					for (int x = r.x0; x < r.x1; x++) {
+						const std::atomic<float> *src = &pixels[((size_t)y * width + x) * 3];
+						glm::vec3 &c = out[(size_t)y * width + x];
+						for (int k = 0; k < 3; k++) c[k] = src[k].load(std::memory_order_relaxed);
+					}
+				}
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (versions[i].load(std::memory_order_relaxed) == v0) break;
+			}
+		}
+	}
+
+private:
+	std::unique_ptr<std::atomic<float>[]> pixels;
+	std::unique_ptr<std::atomic<unsigned int>[]> versions;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#pragma once
+#ifndef __TRIANGLESTORE_H__
+#define __TRIANGLESTORE_H__
+
+#include <glm/glm.hpp>
+
+#include <tool/Shape.h>
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "TriangleStore::vertexData要求glm::vec3紧密排列");
+
+// 结构数组（SoA）形式的三角形集合
+// 每个三角形一次make_shared<Triangle>时，百万级场景需要上百万次小块分配，每个三角形还各带一份完整的Material
+// 和引用计数块，构建与打包MeshArray时都要经过指针间接访问。这里把顶点、法线、纹理坐标分别放在连续数组中
+// （第i个三角形占[3i, 3i+2]），材质只存一份，三角形只保存材质下标。
+// 构建时只对下标排序，最后按新顺序整体搬运一次（gather）
+
+class TriangleStore {
+public:
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec2> uvs;
+	std::vector<int> materialIndex; // 每个三角形一个，指向materials
+	std::vector<Material> materials;
+
+	size_t size() const { return materialIndex.size(); }
+	bool empty() const { return materialIndex.empty(); }
+
+	void clear() {
+		positions.clear();
+		normals.clear();
+		uvs.clear();
+		materialIndex.clear();
+		materials.clear();
+	}
+
+	void reserve(size_t n) {
+		positions.reserve(n * 3);
+		normals.reserve(n * 3);
+		uvs.reserve(n * 3);
+		materialIndex.reserve(n);
+	}
+
+	// 返回材质下标，与已有材质完全相同时复用（材质数量很少，线性查找即可）
+	int addMaterial(const Material &m) {
+		for (size_t i = 0; i < materials.size(); i++)
+			if (memcmp(&materials[i], &m, sizeof(Material)) == 0) return (int)i;
+		materials.push_back(m);
+		return (int)materials.size() - 1;
+	}
+
+	void addTriangle(const glm::vec3 v[3], const glm::vec3 n[3], const glm::vec2 uv[3], int material) {
+		for (int k = 0; k < 3; k++) {
+			positions.push_back(v[k]);
+			normals.push_back(n[k]);
+			uvs.push_back(uv[k]);
+		}
+		materialIndex.push_back(material);
+	}
+
+	void push_back(const Triangle &tri) {
+		const glm::vec3 v[3] = { tri.v0, tri.v1, tri.v2 };
+		const glm::vec3 n[3] = { tri.n0, tri.n1, tri.n2 };
+		const glm::vec2 uv[3] = { tri.u0, tri.u1, tri.u2 };
+		addTriangle(v, n, uv, addMaterial(tri.material));
+	}
+
+	// 追加另一个集合中的全部三角形，材质下标重新映射
+	void append(const TriangleStore &other) {
+		std::vector<int> remap(other.materials.size());
+		for (size_t m = 0; m < other.materials.size(); m++) remap[m] = addMaterial(other.materials[m]);
+		positions.insert(positions.end(), other.positions.begin(), other.positions.end());
+		normals.insert(normals.end(), other.normals.begin(), other.normals.end());
+		uvs.insert(uvs.end(), other.uvs.begin(), other.uvs.end());
+		for (int m : other.materialIndex) materialIndex.push_back(remap[m]);
+	}
+
+	// 第i个三角形的三个顶点
+	const glm::vec3 *vertices(size_t i) const { return &positions[i * 3]; }
+	// 同上，9个连续的float，排列与MeshArray中三角形的前9个float相同，CPU求交直接读取这里
+	const float *vertexData(size_t i) const { return &positions[i * 3].x; }
+	const Material &material(size_t i) const { return materials[materialIndex[i]]; }
+
+	Bound3f bound(size_t i) const {
+		const glm::vec3 *v = vertices(i);
+		return Union(Bound3f(v[0], v[1]), v[2]);
+	}
+
+	Triangle triangle(size_t i) const {
+		Triangle tri;
+		tri.v0 = positions[i * 3 + 0]; tri.v1 = positions[i * 3 + 1]; tri.v2 = positions[i * 3 + 2];
+		tri.n0 = normals[i * 3 + 0];   tri.n1 = normals[i * 3 + 1];   tri.n2 = normals[i * 3 + 2];
+		tri.u0 = uvs[i * 3 + 0];       tri.u1 = uvs[i * 3 + 1];       tri.u2 = uvs[i * 3 + 2];
+		tri.material = material(i);
+		return tri;
+	}
+
+	// 按order重排：this[i] = src[order[i]]，材质表直接共用
+	void gather(const TriangleStore &src, const std::vector<int> &order) {
+		size_t n = order.size();
+		positions.resize(n * 3);
+		normals.resize(n * 3);
+		uvs.resize(n * 3);
+		materialIndex.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			size_t s = order[i];
+			for (int k = 0; k < 3; k++) {
+				positions[i * 3 + k] = src.positions[s * 3 + k];
+				normals[i * 3 + k] = src.normals[s * 3 + k];
+				uvs[i * 3 + k] = src.uvs[s * 3 + k];
+			}
+			materialIndex[i] = src.materialIndex[s];
+		}
+		materials = src.materials;
+	}
+
+	// 按MeshArray的格式写入第i个三角形：顶点9、法线9、纹理坐标6，stride不小于42时再写18个材质float
+	void pack(size_t i, float *dst, int stride) const {
+		for (int k = 0; k < 3; k++) {
+			const glm::vec3 &v = positions[i * 3 + k];
+			const glm::vec3 &n = normals[i * 3 + k];
+			const glm::vec2 &uv = uvs[i * 3 + k];
+			dst[k * 3 + 0] = v.x; dst[k * 3 + 1] = v.y; dst[k * 3 + 2] = v.z;
+			dst[9 + k * 3 + 0] = n.x; dst[9 + k * 3 + 1] = n.y; dst[9 + k * 3 + 2] = n.z;
+			dst[18 + k * 2 + 0] = uv.x; dst[18 + k * 2 + 1] = uv.y;
+		}
+		if (stride >= 42) packMaterial(material(i), dst + 24);
+	}
+
+	// 已分配的内存（按容量计算）
+	size_t memoryBytes() const {
+		return sizeof(glm::vec3) * (positions.capacity() + normals.capacity())
+			+ sizeof(glm::vec2) * uvs.capacity()
+			+ sizeof(int) * materialIndex.capacity()
+			+ sizeof(Material) * materials.capacity();
+	}
+};
+
+// 旧接口的适配：由shared_ptr<Triangle>数组生成TriangleStore
+TriangleStore MakeTriangleStore(const std::vector<std::shared_ptr<Triangle>> &prims) {
+	TriangleStore store;
+	store.reserve(prims.size());
+	for (const std::shared_ptr<Triangle> &tri : prims) store.push_back(*tri);
+	return store;
+}
+
+// n个三角形使用shared_ptr<Triangle>数组时占用的内存估计：指针数组，加上每个三角形一次make_shared分配
+// （三角形本身、引用计数控制块，以及分配器的块头与16字节对齐，后两项为典型64位实现的估计值）
+size_t TriangleListMemoryBytes(size_t n) {
+	size_t block = sizeof(Triangle) + 16;
+	block = (block + 8 + 15) / 16 * 16;
+	return (sizeof(std::shared_ptr<Triangle>) + block) * n;
+}
+
+// 输出加载耗时与三角形数据占用的内存，并与shared_ptr<Triangle>数组的估计值比较
+void TriangleStoreReport(const TriangleStore &store, double loadTime) {
+	size_t n = store.size();
+	size_t soaBytes = store.memoryBytes();
+	size_t listBytes = TriangleListMemoryBytes(n);
+	std::cout << "triangles = " << n << ", materials = " << store.materials.size()
+			  << ", load time = " << loadTime * 1000.0 << " ms" << std::endl;
+	std::cout << "triangle memory = " << soaBytes / (1024.0 * 1024.0) << " MB (SoA, "
+			  << (n ? (double)soaBytes / n : 0.0) << " bytes/triangle), shared_ptr<Triangle> estimate = "
+			  << listBytes / (1024.0 * 1024.0) << " MB (" << n << " allocations)" << std::endl;
+}
+
+#endif
@@ -15,6 +15,13 @@
 #include <tool/Camera.h> // 这个就是对应Camera.h文件
 #include <tool/TimeRecorder.h> // 这个就是对应Camera.h文件
 #include <tool/BVHTree.h>
+#include <tool/BVHWide.h>
+#include <tool/BVHInstance.h>
+#include <tool/BVHCache.h>
+#include <tool/BVHLeaf.h>
+#include <tool/BVHPacket.h>
+#include <tool/BVHAnalyzer.h>
+#include <tool/CPUPathTracer.h>
 #include <tool/ObjectTexture.h>
 #include <tool/gui.h>
 
@@ -24,6 +31,7 @@
 
 
 #include <iostream>
+#include <string>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
@@ -56,10 +64,12 @@ BVHTree bvhTree;
 
 ObjectTexture ObjTex;
 
-std::vector<std::shared_ptr<Triangle>> primitives;
+// 场景三角形（SoA存储，见TriangleStore.h），构建时移交给bvhTree
+TriangleStore primitives;
 
 // RayTracerShader 纹理序号：
 // 纹理0：Framebuffer
+// 纹理10：Framebuffer的亮度矩（自适应采样）
 // 纹理1：MeshVertex
 // 纹理2：MeshFaceIndex
 
@@ -132,9 +142,6 @@ int main()
 	RT_Screen screen;
 	screen.InitScreenBind();
 
-	// 生成屏幕FrameBuffer
-	screenBuffer.Init(SCR_WIDTH, SCR_HEIGHT);
-
 	// 光源的面积是13650
     Material light;
     light.transmission = -1.0f;
@@ -183,38 +190,135 @@ int main()
 	// getTexture(box.meshes, RayTracerShader, ObjTex, primitives, bvhTree, 0.2, glm::vec3(0.7, 0.0, 0.0));
 
 	// 加载CornellBox
-	Model tallbox("../static/model/cornellbox/tallbox.obj");
-	getTextureWithTransform(tallbox.meshes, RayTracerShader, ObjTex, primitives, bvhTree, 
-							glm::vec3(0.0f, 0.0f, 0.0f), 0.001f, 180.0f, glm::vec3(0.0f, 1.0f, 0.0f),
-							metal_white); 
-	Model shortbox("../static/model/cornellbox/shortbox.obj");
-	getTextureWithTransform(shortbox.meshes, RayTracerShader, ObjTex, primitives, bvhTree, 
-							glm::vec3(0.0f, 0.0f, 0.0f), 0.001f, 180.0f, glm::vec3(0.0f, 1.0f, 0.0f),
-							white); 
-	
-	// Model bunny("../static/model/bunny/bunny.obj");
-	// getTextureWithTransform(bunny.meshes, RayTracerShader, ObjTex, primitives, bvhTree, 
-	// 						glm::vec3(-0.16f, 0.15f, -0.25f), 1.0f, 0.0f, glm::vec3(0.0f, 1.0f, 0.0f),
-	// 						metal_yellow); 
-	
-	Model floor("../static/model/cornellbox/floor.obj");
-	getTextureWithTransform(floor.meshes, RayTracerShader, ObjTex, primitives, bvhTree, 
-							glm::vec3(0.0f, 0.0f, 0.0f), 0.001f, 180.0f, glm::vec3(0.0f, 1.0f, 0.0f),
-							white); // 白色
-	Model right("../static/model/cornellbox/right.obj");
-	getTextureWithTransform(right.meshes, RayTracerShader, ObjTex, primitives, bvhTree, 
-							glm::vec3(0.0f, 0.0f, 0.0f), 0.001f, 180.0f, glm::vec3(0.0f, 1.0f, 0.0f),
-							green); // 绿色
-	Model left("../static/model/cornellbox/left.obj");
-	getTextureWithTransform(left.meshes, RayTracerShader, ObjTex, primitives, bvhTree, 
-							glm::vec3(0.0f, 0.0f, 0.0f), 0.001f, 180.0f, glm::vec3(0.0f, 1.0f, 0.0f),
-							red); // 红色
+	// 场景中的模型：路径、变换与材质。所有模型的三角形依次加入primitives
+	struct SceneModel {
+		std::string path;
+		glm::vec3 position;
+		float scale;
+		float rotateAngle;
+		Material material;
+	};
+	std::vector<SceneModel> sceneModels = {
+		{ "../static/model/cornellbox/tallbox.obj", glm::vec3(0.0f), 0.001f, 180.0f, metal_white },
+		{ "../static/model/cornellbox/shortbox.obj", glm::vec3(0.0f), 0.001f, 180.0f, white },
+		// { "../static/model/bunny/bunny.obj", glm::vec3(-0.16f, 0.15f, -0.25f), 1.0f, 0.0f, metal_yellow },
+		{ "../static/model/cornellbox/floor.obj", glm::vec3(0.0f), 0.001f, 180.0f, white },  // 白色
+		{ "../static/model/cornellbox/right.obj", glm::vec3(0.0f), 0.001f, 180.0f, green },  // 绿色
+		{ "../static/model/cornellbox/left.obj", glm::vec3(0.0f), 0.001f, 180.0f, red },     // 红色
+		{ "../static/model/cornellbox/light.obj", glm::vec3(0.0f), 0.001f, 180.0f, light },
+	};
+
+	// 物体动画：为true时高盒子（sceneModels[0]）每帧绕自身中心旋转，BVH用refit更新（不重新构建）
+	bool animateTallBox = false;
+	// 两级BVH（实例化）：为true时整个康奈尔盒作为一个BLAS，岩石模型只构建一次BLAS，
+	// 再以不同的变换和材质实例化为一圈小行星带，岩石的三角形只上传一份
+	bool instancedScene = false;
+	// CPU与GPU一致性检查：大于0时先用CPUPathTracer渲染gpuCompareFrames帧（每帧10个采样，同着色器main()中的N）的参考图像，
+	// GPU累积到同样的帧数后读回并比较（见ImageCompareReport）。只支持静态的单级BVH，需要CPU端的BVH数据，不使用缓存。
+	// 比较完成前不要移动相机或切换采样器
+	int gpuCompareFrames = 0; // 例如64
+
+	// 构建BVH树
+	// 划分方法：SplitMethod::EqualCounts（中位数划分）、SplitMethod::SAH（表面积启发式）
+	// 或 SplitMethod::HLBVH（Morton码线性BVH，构建最快，适合百万级三角形或逐帧重建）
+	// 或 SplitMethod::SBVH（空间划分，适合墙面等大三角形与细长三角形，构建较慢）
+	// SBVH允许新增的三角形引用比例：bvhTree.sbvhDuplicationBudget = 0.3f;
+	bvhTree.splitMethod = SplitMethod::SAH;
+	// 构建线程数，0表示使用全部CPU核心
+	bvhTree.nThreads = 0;
+	// 同时生成压缩节点（8位量化包围盒），需与着色器中的COMPACT_BVH宏一致
+	bvhTree.compactNodes = true;
+	// 构建后treelet重构优化：静态场景可以用更长的构建时间换取更低的SAH代价
+	// treeletSize越大效果越好，optimizeTimeBudget限制优化时间（秒）；因超时提前结束的树不写入BVH缓存
+	bvhTree.optimizeTree = true;
+	bvhTree.treeletSize = 7;
+	bvhTree.optimizeTimeBudget = 2.0;
+	// 叶子最多4个三角形：着色器中叶子每4个三角形用vec4一次求交，SAH按批数计算叶子代价。
+	// 兔子模型上叶子大小4的CPU批量求交比1快约30%，节点数减少约70%（见BVHLeafSizeTest）
+	bvhTree.maxPrimsInNode = 4;
+	bvhTree.leafPacketWidth = 4;
+	// 三角形数据格式：42为每个三角形完整的顶点、法线、uv与材质；IndexedMeshStride为索引格式，
+	// 共享顶点与材质只存一份，纹理约小3~5倍，需在着色器中定义INDEXED_MESH
+	int meshStride = 42;
+
+	// BVH磁盘缓存：模型文件内容、变换、材质、构建参数和三角形跨度都记录在缓存中，
+	// 任一项变化时自动重新构建。命中时跳过模型导入与BVH构建，直接映射文件上传纹理。
+	// 动画和实例化需要CPU端的三角形数据，不使用缓存
+	bool useBVHCache = !animateTallBox && !instancedScene && gpuCompareFrames == 0;
+	std::string bvhCachePath = "cornellbox.bvhcache";
+	BVHCacheKey bvhCacheKey;
+	for (const SceneModel &m : sceneModels)
+		bvhCacheKey.addModel(m.path, getModelMatrix(m.position, m.scale, m.rotateAngle, glm::vec3(0.0f, 1.0f, 0.0f)), m.material);
+	bvhCacheKey.setBuildParams(bvhTree, meshStride);
+	BVHCache bvhCache;
+	bool bvhCacheHit = useBVHCache && bvhCache.open(bvhCachePath, bvhCacheKey);
+
+	int tallboxFirst = 0, tallboxCount = 0;
+	glm::vec3 tallboxCenter(0.0f);
+	int tallboxObject = -1;
+	if (bvhCacheHit) {
+		generateTextures(ObjTex, bvhCache, RayTracerShader);
+		bvhCache.close(); // 纹理已上传，释放映射
+	}
+	else {
+		auto loadStart = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < sceneModels.size(); i++) {
+			const SceneModel &m = sceneModels[i];
+			Model model(m.path);
+			int first = primitives.size();
+			getTextureWithTransform(model.meshes, RayTracerShader, ObjTex, primitives, bvhTree,
+									m.position, m.scale, m.rotateAngle, glm::vec3(0.0f, 1.0f, 0.0f),
+									m.material);
+			if (i == 0) {
+				tallboxFirst = first;
+				tallboxCount = primitives.size() - first;
+			}
+		}
+		TriangleStoreReport(primitives, std::chrono::duration<double>(std::chrono::steady_clock::now() - loadStart).count());
+		for (int i = tallboxFirst; i < tallboxFirst + tallboxCount; i++) {
+			const glm::vec3 *v = primitives.vertices(i);
+			tallboxCenter += (v[0] + v[1] + v[2]) / (3.0f * tallboxCount);
+		}
 
+		// 并行构建测试：输出不同线程数下的构建耗时与加速比
+		// BVHBuildBenchmark(primitives, meshStride, SplitMethod::SAH);
+		// 三角形数据移交给bvhTree，之后按叶子顺序保存在bvhTree.primitives中
+		bvhTree.BVHBuildTree(std::move(primitives), meshStride);
+		if (useBVHCache) SaveBVHCache(bvhTree, bvhCacheKey, bvhCachePath);
+		// 动画需要保留BVH数据用于refit。索引格式注册物体时会重新打包顶点，在生成纹理之前注册避免再上传一次
+		if (animateTallBox)
+			tallboxObject = bvhTree.addObject(tallboxFirst, tallboxCount);
+
+		generateTextures(ObjTex, bvhTree, RayTracerShader);
+
+		//测试BVH树
+		BVHTest(bvhTree, cam);
+		// 与BVHTest相同的相机光线，IntersectBVH的参考结果只计算一次，供压缩节点、无栈遍历与遮挡查询比较
+		BVHTestReference bvhReference = BVHTestReferencePass(bvhTree, cam);
+		BVHCompactTest(bvhTree, bvhReference);
+		BVHStacklessTest(bvhTree, bvhReference);
+		BVHOcclusionTest(bvhTree, bvhReference);
+		// 比较二叉BVH与BVH4/BVH8的CPU遍历速度
+		// BVHWideTest(bvhTree, cam);
+		// 比较不同叶子大小下的SAH代价与标量/SIMD叶子求交速度
+		// BVHLeafSizeTest(bvhTree.primitives, cam);
+		// 比较单条光线与4/8/16条光线包的主光线遍历速度
+		// BVHPacketTest(bvhTree, cam);
+		// 索引格式展开后与42跨度逐位相同、缓存往返后数组不变
+		// IndexedMeshTest(bvhTree.primitives);
+		// BVH质量分析（SAH代价、深度/叶子直方图、重叠、空白空间、相机扫描下的遍历代价），输出JSON
+		// BVHAnalyzeReport(bvhTree, cam, "cornellbox_bunny", "BVHReport.json");
+		// CPU参考路径追踪（全部CPU核心，不需要GPU），输出CPUReference.hdr/.png与每个核心的光线吞吐量
+		// 只包含单级BVH中的康奈尔盒，instancedScene为true时使用下面两级BVH的版本
+		// CPURenderSettings cpuSettings; cpuSettings.width = SCR_WIDTH; cpuSettings.height = SCR_HEIGHT;
+		// cpuSettings.previewPath = "CPUPreview.png"; // 渲染过程中定期保存已完成tile的预览
+		// cpuSettings.adaptive = true; cpuSettings.samplesPerPixel = 512; // 自适应采样，已收敛的像素提前停止
+		// cpuSettings.sampler = SamplerType::Sobol; // 默认为独立随机数，改为Owen扰乱的Sobol序列用于比较收敛速度
+		// CPURenderReport(bvhTree, cam, cpuSettings, "CPUReference");
+	}
+
+	// 光源三角形单独读取（模型很小，缓存命中时也需要）
 	Model areaLight("../static/model/cornellbox/light.obj");
-	glm::vec3 lightEmissive = 8.0f * glm::vec3(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * glm::vec3 (0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f * glm::vec3(0.737f+0.642f,0.737f+0.159f,0.737f);
-	getTextureWithTransform(areaLight.meshes, RayTracerShader, ObjTex, primitives, bvhTree,
-							glm::vec3(0.0f, 0.0f, 0.0f), 0.001f, 180.0f, glm::vec3(0.0f, 1.0f, 0.0f),
-							light);
 	// 对光源位置进行变换，以获取变换后的三角形位置
 	glm::mat4 modelMatrix = glm::mat4(1.0f);
     modelMatrix = glm::translate(modelMatrix, glm::vec3(0.0f, 0.0f, 0.0f));
@@ -233,14 +337,75 @@ int main()
 		}
 	}
 
-	// 构建BVH树
-	bvhTree.BVHBuildTree(primitives, 42);
+	if (instancedScene) {
+		BVHScene scene;
+		scene.splitMethod = SplitMethod::SAH;
+		scene.maxPrimsInNode = bvhTree.maxPrimsInNode;
+		scene.leafPacketWidth = bvhTree.leafPacketWidth;
+		int boxMesh = scene.addMesh(bvhTree.primitives);
+		scene.addInstance(boxMesh, glm::mat4(1.0f));
+		Model rock("../static/model/rock/rock.obj");
+		int rockMesh = scene.addMesh(getMeshTriangles(rock.meshes, white));
+		int rockNum = 64;
+		for (int i = 0; i < rockNum; i++) {
+			float angle = 2.0f * 3.1415926f * i / rockNum;
+			glm::mat4 m = glm::mat4(1.0f);
+			m = glm::translate(m, glm::vec3(-0.278f + 0.18f * cos(angle), 0.35f + 0.02f * sin(5.0f * angle), -0.28f + 0.18f * sin(angle)));
+			m = glm::rotate(m, 7.0f * angle, glm::normalize(glm::vec3(sin(angle), 1.0f, cos(3.0f * angle))));
+			m = glm::scale(m, glm::vec3(0.008f + 0.004f * sin(3.0f * angle)));
+			scene.addInstance(rockMesh, m, (i % 2) ? metal_yellow : orange);
+		}
+		scene.build();
+		// 两级BVH遮挡查询测试：OccludedScene与IntersectScene的结果一致，并检查tMax边界
+		// BVHSceneOcclusionTest(scene, cam);
+		glDeleteTextures(1, &ObjTex.ID_meshTex);
+		glDeleteTextures(1, &ObjTex.ID_bvhNodeTex);
+		generateSceneTextures(ObjTex, scene, RayTracerShader);
+		// 包含全部实例的CPU参考路径追踪（求交与阴影光线使用IntersectScene/OccludedScene）
+		// CPURenderSettings cpuSettings; cpuSettings.width = SCR_WIDTH; cpuSettings.height = SCR_HEIGHT;
+		// CPURenderReport(scene, cam, cpuSettings, "CPUReferenceInstanced");
+		animateTallBox = false; // refit只作用于单层BVH
+	}
+
+	// 着色器随机数种子：随机数由(像素, 采样序号, 维度)决定，同一种子、同一视角下每次运行的结果逐位相同，
+	// 与cpuSettings.seed相同时与CPU参考渲染使用相同的随机数序列
+	int randSeed = 0;
+	// 采样器：SamplerType::Random为独立随机数（默认），SamplerType::Sobol为Owen扰乱的Sobol序列，与cpuSettings.sampler对应
+	// 运行时按T键切换，切换后重新开始累积
+	SamplerType samplerType = SamplerType::Random;
+	bool samplerKeyDown = false;
+
+	// CPU参考图像：与着色器相同的光源三角形、随机数种子与采样器，按着色器的方式逐帧累积
+	std::vector<glm::vec3> cpuReference;
+	if (gpuCompareFrames > 0 && !instancedScene && !animateTallBox) {
+		CPURenderSettings cpuSettings;
+		cpuSettings.width = SCR_WIDTH;
+		cpuSettings.height = SCR_HEIGHT;
+		cpuSettings.samplesPerFrame = 10;
+		cpuSettings.samplesPerPixel = gpuCompareFrames * cpuSettings.samplesPerFrame;
+		cpuSettings.seed = randSeed;
+		cpuSettings.sampler = samplerType;
+		CPUPathTracer tracer(bvhTree);
+		tracer.setLights(transformedLightVertices, light.emissive);
+		CPURenderReport(tracer, cam, cpuSettings, "CPUReference");
+		cpuReference = tracer.image;
+	}
+
+	if (!animateTallBox) bvhTree.releaseAll();
+
+	// 自适应采样：误差估计（标准误差 / sqrt(均值)）低于noiseThreshold的像素（3x3邻域都满足）在着色器中直接输出历史结果，
+	// 不再追踪光线；每32帧读回一次收敛比例，达到convergedStopFraction后停止渲染，相机移动后重新开始。
+	// noiseThreshold为0时关闭
+	float noiseThreshold = 0.0f; // 例如0.03
+	int adaptiveMinFrames = 16;
+	float convergedStopFraction = 0.999f;
+	bool sampleConverged = false;
 
-    generateTextures(ObjTex, bvhTree, RayTracerShader);
+	// 生成屏幕FrameBuffer：默认为GL_RGB单附件。自适应采样时为浮点RGBA（alpha通道保存收敛标记），
+	// 并增加保存亮度一阶、二阶矩的第二个附件；CPU与GPU比较时需要浮点格式，8位格式累积到一定帧数后不再变化
+	bool floatScreenBuffer = noiseThreshold > 0.0f || gpuCompareFrames > 0;
+	screenBuffer.Init(SCR_WIDTH, SCR_HEIGHT, floatScreenBuffer ? GL_RGBA32F : GL_RGB, noiseThreshold > 0.0f);
 
-	//测试BVH树
-	BVHTest(bvhTree, cam);
-	bvhTree.releaseAll();
 
 	// 渲染大循环
 	while (!glfwWindowShouldClose(window))
@@ -251,11 +416,37 @@ int main()
 		// 输入
 		processInput(window);
 
+		// T键切换采样器（按下时触发一次），不同采样器的帧不能混合累积
+		bool samplerKey = glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS;
+		if (samplerKey && !samplerKeyDown) {
+			samplerType = (samplerType == SamplerType::Sobol) ? SamplerType::Random : SamplerType::Sobol;
+			cam.LoopNum = 0;
+			std::cout << "Sampler: " << (samplerType == SamplerType::Sobol ? "Sobol" : "random") << std::endl;
+		}
+		samplerKeyDown = samplerKey;
+
+		// 物体动画：更新三角形位置，refit包围盒，只上传变化的纹理行
+		if (animateTallBox) {
+			glm::mat4 transform = glm::translate(glm::mat4(1.0f), tallboxCenter);
+			transform = glm::rotate(transform, (float)glfwGetTime() * 0.5f, glm::vec3(0.0f, 1.0f, 0.0f));
+			transform = glm::translate(transform, -tallboxCenter);
+			bvhTree.setObjectTransform(tallboxObject, transform);
+			// 包围盒膨胀过多时重新构建
+			if (bvhTree.refit()) bvhTree.rebuild();
+			updateTextures(ObjTex, bvhTree, RayTracerShader);
+			// 场景变化，重新开始累积
+			cam.LoopNum = 0;
+		}
+
+		// 相机移动或场景变化后LoopNum归零，重新开始累积
+		if (cam.LoopNum == 0) sampleConverged = false;
+		bool traceFrame = !sampleConverged;
+
 		// 渲染循环加1
-		cam.LoopIncrease();
+		if (traceFrame) cam.LoopIncrease();
 
 		// 光线追踪渲染当前帧
-		{
+		if (traceFrame) {
 			// 绑定到当前帧缓冲区
 			screenBuffer.setCurrentBuffer(cam.LoopNum);
 
@@ -277,9 +468,13 @@ int main()
 			RayTracerShader.setFloat("camera.halfW", cam.halfW);
 			RayTracerShader.setVec3("camera.leftbottom", cam.LeftBottomCorner);
 			RayTracerShader.setInt("camera.LoopNum", cam.LoopNum);
+			RayTracerShader.setInt("historyMoments", screenBuffer.momentUnit);
+			RayTracerShader.setFloat("noiseThreshold", noiseThreshold);
+			RayTracerShader.setInt("adaptiveMinFrames", adaptiveMinFrames);
 
-			// 随机数初值赋值
-			RayTracerShader.setFloat("randOrigin", 874264.0f * (GetCPURandom() + 1.0f));
+			// 随机数种子
+			RayTracerShader.setInt("randSeed", randSeed);
+			RayTracerShader.setInt("samplerType", (int)samplerType);
 
 			// 球物体赋值
 			RayTracerShader.setFloat("sphere[0].radius", 0.5);
@@ -322,6 +517,18 @@ int main()
 
 			// 渲染FrameBuffer
 			screen.DrawScreen();
+
+			if (cam.LoopNum == gpuCompareFrames && !cpuReference.empty()) {
+				std::vector<glm::vec3> gpuImage;
+				screenBuffer.readColor(cam.LoopNum, gpuImage);
+				ImageCompareReport(cpuReference, gpuImage, SCR_WIDTH, SCR_HEIGHT);
+			}
+
+			if (noiseThreshold > 0.0f && cam.LoopNum % 32 == 0) {
+				float converged = screenBuffer.convergedFraction(cam.LoopNum);
+				sampleConverged = converged >= convergedStopFraction;
+				std::cout << "Frame " << cam.LoopNum << ": " << converged * 100.0f << "% pixels converged" << std::endl;
+			}
 		}
 
 		// 渲染到默认Buffer上
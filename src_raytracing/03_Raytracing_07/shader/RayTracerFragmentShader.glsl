@@ -1,5 +1,6 @@
 #version 330 core
-out vec4 FragColor;
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec2 FragMoments; // 自适应采样的亮度矩，见historyMoments
 
 in vec2 TexCoords;
 
@@ -9,6 +10,14 @@ in vec2 TexCoords;
 #define SIZE_TRIANGLE 12
 #define RussianRoulette 0.8
 #define EPSILON 0.00001
+// 使用压缩BVH节点（texBvhCompact），注释掉则使用原9个float的节点格式（texBvhNode）
+#define COMPACT_BVH
+// 无栈遍历（texBvhNode + texBvhSkip跳转链接），不使用nodesToVisit栈，没有树深度限制，
+// 寄存器占用更少；定义后优先于COMPACT_BVH，BLAS遍历也使用无栈方式
+// #define STACKLESS_BVH
+// 索引格式的三角形数据（bvhTree.BVHBuildTree(primitives, IndexedMeshStride)）：共享顶点与材质只存一份，
+// 需与main.cpp中的meshStride一致；两级BVH（instanceNum > 0）只支持42个float的格式
+// #define INDEXED_MESH
 
 uniform int screenWidth;
 uniform int screenHeight;
@@ -42,9 +51,42 @@ struct Ray {
 	float hitMin;
 };
 
-uniform float randOrigin;
-uint wseed;
+// 水密三角形求交的逐光线预计算（见hitTriangleWatertight）
+struct WatertightRay {
+	ivec3 k;  // 坐标轴重排，k.z为方向绝对值最大的分量
+	vec3 org; // 按k重排后的光线起点
+	vec3 S;   // 剪切系数 (dx/dz, dy/dz, 1/dz)
+};
+
+// 三角形求交结果，交点 = (1-uv.x-uv.y)*p0 + uv.x*p1 + uv.y*p2
+struct TriangleHit {
+	bool hit;
+	float t;
+	vec2 uv;
+};
+
+// 基于计数器的随机数，键为(像素, 采样序号, 维度)，与RandomUtils.h中的PixelRandom逐位一致
+uniform int randSeed; // 随机数种子，默认0，与CPURenderSettings::seed相同时两边的随机数序列相同
+uint rngKey;
+uint rngDimension;
 float rand(void);
+void beginSample(uint pixel, int index);
+
+// 路径采样器，与Sampler.h中的PathSampler逐位一致：0为独立随机数（默认），1为Owen扰乱的Sobol序列。
+// 随机数按槽位取得，槽位0为像素内偏移，之后每次反弹SLOTS_PER_BOUNCE个；次数不固定的随机数（拒绝采样）仍使用rand()
+uniform int samplerType;
+#define SLOT_LIGHT_SELECT 0
+#define SLOT_LIGHT_POINT 1
+#define SLOT_BSDF 2
+#define SLOT_LOBE 3
+#define SLOT_RUSSIAN_ROULETTE 4
+#define SLOTS_PER_BOUNCE 5
+#define RANDOM_FREE_DIMENSION 65536u // rand()使用的维度从这里开始，与槽位的维度不重叠
+uint samplePixelKey;
+uint sampleIndex;
+vec2 sample2D(uint slot);
+float sample1D(uint slot);
+uint bounceSlot(int depth, int slot);
 
 struct Bound3f {
 	vec3 pMin, pMax;
@@ -93,8 +135,24 @@ uniform Triangle triLight[2];
 
 uniform sampler2D texMesh;
 uniform int meshNum;
+// 索引格式：texMesh中每个三角形4个float（三个顶点下标与材质编号），
+// texVertex中每个顶点8个float（位置、法线、纹理坐标），texMaterial中每个材质18个float
+uniform sampler2D texVertex;
+uniform sampler2D texMaterial;
 uniform sampler2D texBvhNode;
 uniform int bvhNodeNum;
+uniform usampler2D texBvhCompact;
+// SBVH三角形引用表：叶子中第i个引用对应的三角形索引，primRefNum为0时不使用
+uniform sampler2D texPrimRef;
+uniform int primRefNum;
+// 无栈遍历的跳转链接：节点子树之后按深度优先顺序的下一个节点，-1表示结束
+uniform sampler2D texBvhSkip;
+// 两级BVH（见BVHInstance.h）：instanceNum大于0时texBvhNode/texMesh中为拼接后的BLAS，
+// texTlasNode为实例的顶层BVH，texInstance中每个实例INSTANCE_STRIDE个float
+#define INSTANCE_STRIDE 32
+uniform sampler2D texTlasNode;
+uniform sampler2D texInstance;
+uniform int instanceNum;
 
 struct hitRecord {
 	bool isHit;
@@ -106,6 +164,10 @@ struct hitRecord {
 	int triangleIndex;
 	float triangleArea;
 	Material material; 
+	vec2 uv;        // 重心坐标，交点 = (1-u-v)*p0 + u*p1 + v*p2
+	// texMaterial中的材质下标。只有INDEXED_MESH时存在材质表；42跨度的三角形与实例的覆盖材质没有材质表，为-1。
+	// 着色只使用material，它在所有格式下都已填写
+	int materialID;
 };
 hitRecord rec;
 
@@ -117,46 +179,102 @@ bool hitWorld(Ray r);
 vec3 shading(Ray r);
 vec3 getTriangleNormal(Triangle tri);
 Triangle getTriangle(int index);
+int getPrimitiveIndex(int ref);
+WatertightRay prepareWatertightRay(Ray r);
+bool intersectLeaf(int first, int count, WatertightRay wray, inout float hitMin, inout int hitIndex, inout vec2 hitUV);
 bool IntersectBound(Bound3f bounds, Ray ray, vec3 invDir, bool dirIsNeg[3]);
 
 
 // 在Camera结构体后添加以下声明
 bool IntersectBVH(Ray ray);
+bool IntersectCompactBVH(Ray ray);
+bool IntersectStacklessBVH(Ray ray);
+bool IntersectTLAS(Ray ray);
+bool OccludedBVH(Ray ray, float tMax);
 vec3 shade(hitRecord hit_obj, vec3 wo);
 
 
 // 采样历史帧的纹理采样器
 uniform sampler2D historyTexture;
 
+// 自适应采样：historyMoments（GL_RG32F）保存每帧结果截断到[0,1]后的亮度及其平方的累积平均，
+// 两个矩来自同一个量，由此估计累积均值的误差（显示用的historyTexture.rgb先平均再截断，不能作为一阶矩）；
+// 3x3邻域都低于noiseThreshold时像素收敛，直接输出历史结果并把historyTexture的alpha置为-1，
+// 之后的帧不再追踪光线。noiseThreshold为0时关闭（默认）
+uniform sampler2D historyMoments;
+uniform float noiseThreshold;
+uniform int adaptiveMinFrames; // 累积帧数达到该值后才开始判断收敛
+
+float luminance(vec3 c) {
+	return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// 已累积n帧的像素均值的误差估计：标准误差除以sqrt(均值)，与CPUPathTracer中的relativeError相同
+// m为截断亮度的一阶、二阶矩
+float relativeError(vec2 m, float n) {
+	float mean = m.x;
+	float variance = max(m.y - mean * mean, 0.0) * n / (n - 1.0);
+	return sqrt(variance / n) / sqrt(mean + 0.0001);
+}
+
+bool pixelConverged() {
+	if (noiseThreshold <= 0.0 || camera.LoopNum <= max(adaptiveMinFrames, 2)) return false;
+	ivec2 size = textureSize(historyTexture, 0);
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	if (texelFetch(historyTexture, pixel, 0).a < 0.0) return true; // 之前已收敛
+	float n = float(camera.LoopNum - 1);
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			ivec2 q = clamp(pixel + ivec2(dx, dy), ivec2(0), size - 1);
+			if (texelFetch(historyTexture, q, 0).a >= 0.0 && relativeError(texelFetch(historyMoments, q, 0).rg, n) > noiseThreshold)
+				return false;
+		}
+	}
+	return true;
+}
+
 void main() {
-	wseed = uint(randOrigin * float(6.95857) * (TexCoords.x * TexCoords.y));
+	// 已收敛的像素跳过全部光线追踪
+	if (pixelConverged()) {
+		FragColor = vec4(texelFetch(historyTexture, ivec2(gl_FragCoord.xy), 0).rgb, -1.0);
+		FragMoments = texelFetch(historyMoments, ivec2(gl_FragCoord.xy), 0).rg;
+		return;
+	}
+
 	//if (distance(TexCoords, vec2(0.5, 0.5)) < 0.4)
 	//	FragColor = vec4(rand(), rand(), rand(), 1.0);
 	//else
 	//	FragColor = vec4(0.0, 0.0, 0.0, 1.0);
 
 	// 获取历史帧信息
-	vec3 hist = texture(historyTexture, TexCoords).rgb;
+	vec4 histData = texture(historyTexture, TexCoords);
+	vec3 hist = histData.rgb;
 
-	// 添加亚像素随机偏移
-    vec2 jitter = vec2(rand(), rand()) - 0.5; // [-0.5, 0.5]范围随机偏移
-    float jitterScale = 0.5; // 控制扰动强度，可根据需要调整
-    // 计算扰动后的UV坐标
 	vec2 texSize = textureSize(historyTexture, 0); // 获取二维纹理的尺寸
-    vec2 sampleUV = TexCoords + jitter * (1.0 / texSize) * jitterScale;
-    
-	Ray cameraRay;
-	cameraRay.origin = camera.camPos;
-	cameraRay.direction = normalize(
-			camera.leftbottom 
-			+ (sampleUV.x * 2.0 * camera.halfW) * camera.right 
-			+ (sampleUV.y * 2.0 * camera.halfH) * camera.up);
-	cameraRay.hitMin = 100000.0;
+	// 像素下标自下而上按行排列，与CPUPathTracer相同
+	uint pixel = uint(gl_FragCoord.y) * uint(texSize.x) + uint(gl_FragCoord.x);
 
 	vec3 curColor = vec3(0.0, 0.0, 0.0);
 	int N = 10;
 	for (int i = 0; i < N; i++) 
 	{
+		// 每个采样一条独立的随机数序列，采样序号在各帧之间连续
+		beginSample(pixel, (camera.LoopNum - 1) * N + i);
+
+		// 添加亚像素随机偏移（每个采样一次）
+		vec2 jitter = sample2D(0u) - 0.5; // [-0.5, 0.5]范围随机偏移
+		float jitterScale = 0.5; // 控制扰动强度，可根据需要调整
+		// 计算扰动后的UV坐标
+		vec2 sampleUV = TexCoords + jitter * (1.0 / texSize) * jitterScale;
+
+		Ray cameraRay;
+		cameraRay.origin = camera.camPos;
+		cameraRay.direction = normalize(
+				camera.leftbottom 
+				+ (sampleUV.x * 2.0 * camera.halfW) * camera.right 
+				+ (sampleUV.y * 2.0 * camera.halfH) * camera.up);
+		cameraRay.hitMin = 100000.0;
+
 		if(IntersectBVH(cameraRay)) {
 			curColor += shading(cameraRay);
 		}else{
@@ -176,6 +294,11 @@ void main() {
 	// curColor = (1.0 / float(camera.LoopNum))*curColor + (float(camera.LoopNum - 1) / float(camera.LoopNum)) * hist;
 	// 更高效的写法：
 	float blendWeight = 1.0 / float(camera.LoopNum);
+	// 本帧亮度（截断到[0,1]，与显示一致）及其平方累积到亮度矩，第一帧不读取历史（纹理内容未初始化）。
+	// 自适应采样关闭时帧缓冲没有亮度矩附件，FragMoments被丢弃，也不读取historyMoments
+	float frameLum = clamp(luminance(curColor), 0.0, 1.0);
+	vec2 histMoments = (noiseThreshold > 0.0 && camera.LoopNum > 1) ? texelFetch(historyMoments, ivec2(gl_FragCoord.xy), 0).rg : vec2(0.0);
+	FragMoments = mix(histMoments, vec2(frameLum, frameLum * frameLum), blendWeight);
 	curColor = mix(hist, curColor, blendWeight);
 
 	curColor = clamp(curColor, vec3(0.0), vec3(1.0));
@@ -189,17 +312,90 @@ void main() {
 
 
 // ************ 随机数功能 ************** //
-float randcore(uint seed) {
-	seed = (seed ^ uint(61)) ^ (seed >> uint(16));
-	seed *= uint(9);
-	seed = seed ^ (seed >> uint(4));
-	seed *= uint(0x27d4eb2d);
-	wseed = seed ^ (seed >> uint(15));
-	return float(wseed) * (1.0 / 4294967296.0);
+// PCG哈希（Jarzynski & Olano 2020）
+uint pcgHash(uint v) {
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+uint randomKey(uint pixel, uint sampleIndex, uint seed) {
+	return pcgHash(pixel ^ pcgHash(sampleIndex ^ pcgHash(seed)));
+}
+
+// 取高24位，转换为float时没有舍入，与CPU端结果逐位相同
+float randomFloat(uint key, uint dimension) {
+	return float(pcgHash(key ^ pcgHash(dimension)) >> 8u) * (1.0 / 16777216.0);
+}
+
+// 开始一个新的采样：之后的rand()依次使用第RANDOM_FREE_DIMENSION, RANDOM_FREE_DIMENSION + 1...维
+void beginSample(uint pixel, int index) {
+	rngKey = randomKey(pixel, uint(index), uint(randSeed));
+	rngDimension = RANDOM_FREE_DIMENSION;
+	samplePixelKey = pcgHash(pixel ^ pcgHash(uint(randSeed)));
+	sampleIndex = uint(index);
 }
 
 float rand() {
-	return randcore(wseed);
+	return randomFloat(rngKey, rngDimension++);
+}
+
+// ************ Owen扰乱的Sobol序列 ************** //
+// Burley, "Practical Hash-based Owen Scrambling", 2020
+uint reverseBits(uint x) {
+	x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+	x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+	x = ((x >> 4u) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4u);
+	x = ((x >> 8u) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8u);
+	return (x >> 16u) | (x << 16u);
+}
+
+uint laineKarrasPermutation(uint x, uint seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+uint nestedUniformScramble(uint x, uint seed) {
+	return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// Sobol序列第二维，第一维即reverseBits(index)
+uint sobolSecondDimension(uint index) {
+	uint x = 0u;
+	for (uint v = 1u << 31u; index != 0u; index >>= 1u, v ^= v >> 1u)
+		if ((index & 1u) != 0u) x ^= v;
+	return x;
+}
+
+vec2 sobolOwen2D(uint index, uint seed) {
+	index = nestedUniformScramble(index, seed);
+	uint x = nestedUniformScramble(reverseBits(index), pcgHash(seed ^ 1u));
+	uint y = nestedUniformScramble(sobolSecondDimension(index), pcgHash(seed ^ 2u));
+	return vec2(float(x >> 8u), float(y >> 8u)) * (1.0 / 16777216.0);
+}
+
+float sobolOwen1D(uint index, uint seed) {
+	index = nestedUniformScramble(index, seed);
+	return float(nestedUniformScramble(reverseBits(index), pcgHash(seed ^ 1u)) >> 8u) * (1.0 / 16777216.0);
+}
+
+vec2 sample2D(uint slot) {
+	if (samplerType == 1) return sobolOwen2D(sampleIndex, pcgHash(samplePixelKey ^ pcgHash(slot)));
+	return vec2(randomFloat(rngKey, 2u * slot), randomFloat(rngKey, 2u * slot + 1u));
+}
+
+// 一维采样取二维点的第一维
+float sample1D(uint slot) {
+	if (samplerType == 1) return sobolOwen1D(sampleIndex, pcgHash(samplePixelKey ^ pcgHash(slot)));
+	return randomFloat(rngKey, 2u * slot);
+}
+
+uint bounceSlot(int depth, int slot) {
+	return uint(1 + depth * SLOTS_PER_BOUNCE + slot);
 }
 
 // 在单位球面上随机生成一个点
@@ -267,6 +463,48 @@ float At(sampler2D dataTex, float index) {
 	return texture2D(dataTex, texCoord).x;
 }
 
+int getPrimitiveIndex(int ref) {
+	return (primRefNum > 0) ? int(At(texPrimRef, float(ref))) : ref;
+}
+
+#ifdef INDEXED_MESH
+void getVertex(int vertex, out vec3 p, out vec3 n, out vec2 uv) {
+	int offset = vertex * 8;
+	p = vec3(At(texVertex, float(offset)), At(texVertex, float(offset + 1)), At(texVertex, float(offset + 2)));
+	n = vec3(At(texVertex, float(offset + 3)), At(texVertex, float(offset + 4)), At(texVertex, float(offset + 5)));
+	uv = vec2(At(texVertex, float(offset + 6)), At(texVertex, float(offset + 7)));
+}
+
+Material getMaterial(int id) {
+	int base = id * 18;
+	Material m;
+	m.emissive = vec3(At(texMaterial, float(base + 0)), At(texMaterial, float(base + 1)), At(texMaterial, float(base + 2)));
+	m.baseColor = vec3(At(texMaterial, float(base + 3)), At(texMaterial, float(base + 4)), At(texMaterial, float(base + 5)));
+	m.subsurface = At(texMaterial, float(base + 6));
+	m.metallic = At(texMaterial, float(base + 7));
+	m.specular = At(texMaterial, float(base + 8));
+	m.specularTint = At(texMaterial, float(base + 9));
+	m.roughness = At(texMaterial, float(base + 10));
+	m.anisotropic = At(texMaterial, float(base + 11));
+	m.sheen = At(texMaterial, float(base + 12));
+	m.sheenTint = At(texMaterial, float(base + 13));
+	m.clearcoat = At(texMaterial, float(base + 14));
+	m.clearcoatGloss = At(texMaterial, float(base + 15));
+	m.IOR = At(texMaterial, float(base + 16));
+	m.transmission = int(At(texMaterial, float(base + 17)));
+	return m;
+}
+
+Triangle getTriangle(int index) {
+	Triangle tri_t;
+	int offset = index * 4;
+	getVertex(int(At(texMesh, float(offset))), tri_t.p0, tri_t.n0, tri_t.u0);
+	getVertex(int(At(texMesh, float(offset + 1))), tri_t.p1, tri_t.n1, tri_t.u1);
+	getVertex(int(At(texMesh, float(offset + 2))), tri_t.p2, tri_t.n2, tri_t.u2);
+	tri_t.material = getMaterial(int(At(texMesh, float(offset + 3))));
+	return tri_t;
+}
+#else
 Triangle getTriangle(int index) {
 	Triangle tri_t;
 	int offset = index * (9 + 9 + 6 + 3 + 3 + 12);
@@ -320,47 +558,151 @@ Triangle getTriangle(int index) {
 
 	return tri_t;
 }
+#endif
+
+// 水密（watertight）三角形求交，Woop, Benthin, Wald 2013
+// 以光线方向绝对值最大的分量为z轴重排坐标，再剪切使光线变为沿+z的单位光线，三角形只需在xy平面上
+// 做三个二维边函数。共享边的顶点在相邻三角形中变换结果相同，边函数只差符号，接缝处不会漏光；
+// 交点不再减去ε，防自交由次级光线沿法线偏移起点完成
+WatertightRay prepareWatertightRay(Ray r) {
+	vec3 a = abs(r.direction);
+	int kz = (a.x > a.y) ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+	int kx = (kz + 1) % 3;
+	int ky = (kx + 1) % 3;
+	// 保持三角形的环绕方向不变
+	if (r.direction[kz] < 0.0) { int tmp = kx; kx = ky; ky = tmp; }
+	WatertightRay w;
+	w.k = ivec3(kx, ky, kz);
+	w.org = vec3(r.origin[kx], r.origin[ky], r.origin[kz]);
+	w.S = vec3(r.direction[kx] / r.direction[kz], r.direction[ky] / r.direction[kz], 1.0 / r.direction[kz]);
+	return w;
+}
+
+vec3 permuteWatertight(vec3 p, WatertightRay w) {
+	return vec3(p[w.k.x], p[w.k.y], p[w.k.z]);
+}
+
+// p0、p1、p2需已按w.k重排（getTrianglePositions读取时直接按重排后的顺序fetch），只接受 0 < t < tMax
+TriangleHit hitTriangleWatertight(vec3 p0, vec3 p1, vec3 p2, WatertightRay w, float tMax) {
+	TriangleHit h;
+	h.hit = false;
+	h.t = -1.0;
+	h.uv = vec2(0.0);
+	vec3 A = p0 - w.org;
+	vec3 B = p1 - w.org;
+	vec3 C = p2 - w.org;
+	vec2 a = A.xy - w.S.xy * A.z;
+	vec2 b = B.xy - w.S.xy * B.z;
+	vec2 c = C.xy - w.S.xy * C.z;
+
+	// 边函数（未归一化的重心坐标），正反面都接受
+	float U = c.x * b.y - c.y * b.x;
+	float V = a.x * c.y - a.y * c.x;
+	float W = b.x * a.y - b.y * a.x;
+	if ((U < 0.0 || V < 0.0 || W < 0.0) && (U > 0.0 || V > 0.0 || W > 0.0)) return h;
+	float det = U + V + W;
+
+	// 先用未除以det的距离判断范围，det为0时sign为0，同样判为未命中
+	float T = w.S.z * (U * A.z + V * B.z + W * C.z);
+	float sT = T * sign(det);
+	if (sT <= 0.0 || sT >= tMax * abs(det)) return h;
+	float rcpDet = 1.0 / det;
+	h.hit = true;
+	h.t = T * rcpDet;
+	h.uv = vec2(V, W) * rcpDet;
+	return h;
+}
 
-// 用于计算光线与三角形相交的函数，采用两步法实现，非Möller-Trumbore算法
-// 返回值：ray到三角形交点的距离
+// 返回值：ray到三角形交点的距离（未命中返回-1）
 float hitTriangle(Triangle tri, Ray r) {
-	// 1. 找到三角形所在平面法向量
-	vec3 A = tri.p1 - tri.p0;
-	vec3 B = tri.p2 - tri.p0;
-	vec3 N = normalize(cross(A, B));
-
-	// 2. Ray与平面平行，没有交点
-	if (dot(N, r.direction) == 0) return -1.0;
-
-	// 3. 计算光线与平面交点参数t
-	float D = -dot(N, tri.p0);
-	float t = -(dot(N, r.origin) + D) / dot(N, r.direction);
-	if (t < 0) return -1.0; // 排除背面相交
-	
-	// 4. 使用重心坐标测试点是否在三角形内
-	// 交点坐标用射线方程来表示
-	vec3 pHit = r.origin + t * r.direction;
-	// 判断交点是否在三角形内，实使用了向量叉乘，用于判断光线与三角形的交点是否位于三角形内部。这是通过三次边缘检测实现的。
-	vec3 edge0 = tri.p1 - tri.p0;// 边向量
-	vec3 C0 = pHit - tri.p0; // 交点到起点的向量
-	if (dot(N, cross(edge0, C0)) < 0) return -1.0; // 叉乘结果与法向量点积小于0，说明交点在三角形外
-	vec3 edge1 = tri.p2 - tri.p1;
-	vec3 C1 = pHit - tri.p1;
-	if (dot(N, cross(edge1, C1)) < 0) return -1.0;
-	vec3 edge2 = tri.p0 - tri.p2;
-	vec3 C2 = pHit - tri.p2;
-	if (dot(N, cross(edge2, C2)) < 0) return -1.0;
-
-	// 光线与三角形相交
-	// 5. 返回有效相交距离（减去ε避免自相交）
-	return t - 0.000001;
+	WatertightRay w = prepareWatertightRay(r);
+	TriangleHit h = hitTriangleWatertight(permuteWatertight(tri.p0, w), permuteWatertight(tri.p1, w),
+		permuteWatertight(tri.p2, w), w, INF);
+	return h.hit ? h.t : -1.0;
 }
 
 vec3 getTriangleNormal(Triangle tri) {
 	return normalize(cross(tri.p2 - tri.p0, tri.p1 - tri.p0));
 }
 
-LinearBVHNode getLinearBVHNode(int nodeIndex) {
+// 只读取三角形的三个顶点（9次fetch），叶子求交时不需要法线、uv和材质
+// 索引格式多3次下标fetch。分量按k的顺序读取，水密求交需要的坐标轴重排不再额外计算
+void getTrianglePositions(int index, ivec3 k, out vec3 p0, out vec3 p1, out vec3 p2) {
+#ifdef INDEXED_MESH
+	int offset = index * 4;
+	int v0 = int(At(texMesh, float(offset))) * 8;
+	int v1 = int(At(texMesh, float(offset + 1))) * 8;
+	int v2 = int(At(texMesh, float(offset + 2))) * 8;
+	p0 = vec3(At(texVertex, float(v0 + k.x)), At(texVertex, float(v0 + k.y)), At(texVertex, float(v0 + k.z)));
+	p1 = vec3(At(texVertex, float(v1 + k.x)), At(texVertex, float(v1 + k.y)), At(texVertex, float(v1 + k.z)));
+	p2 = vec3(At(texVertex, float(v2 + k.x)), At(texVertex, float(v2 + k.y)), At(texVertex, float(v2 + k.z)));
+#else
+	int offset = index * (9 + 9 + 6 + 3 + 3 + 12);
+	p0 = vec3(At(texMesh, float(offset + k.x)), At(texMesh, float(offset + k.y)), At(texMesh, float(offset + k.z)));
+	p1 = vec3(At(texMesh, float(offset + 3 + k.x)), At(texMesh, float(offset + 3 + k.y)), At(texMesh, float(offset + 3 + k.z)));
+	p2 = vec3(At(texMesh, float(offset + 6 + k.x)), At(texMesh, float(offset + 6 + k.y)), At(texMesh, float(offset + 6 + k.z)));
+#endif
+}
+
+// 光线同时与4个三角形做水密求交（见hitTriangleWatertight），vec4的每个分量对应一个三角形
+// 顶点需已按w.k重排。与原Möller-Trumbore相比不需要叉乘和三维点积，每个三角形约少一半乘加
+// 返回值：各三角形的交点距离，不在(0, tMax)内为-1；u、v为p1、p2的重心坐标
+vec4 hitTriangle4(vec3 p0[4], vec3 p1[4], vec3 p2[4], WatertightRay w, float tMax, out vec4 u, out vec4 v) {
+	vec4 az = vec4(p0[0].z, p0[1].z, p0[2].z, p0[3].z) - w.org.z;
+	vec4 bz = vec4(p1[0].z, p1[1].z, p1[2].z, p1[3].z) - w.org.z;
+	vec4 cz = vec4(p2[0].z, p2[1].z, p2[2].z, p2[3].z) - w.org.z;
+	vec4 ax = vec4(p0[0].x, p0[1].x, p0[2].x, p0[3].x) - w.org.x - w.S.x * az;
+	vec4 ay = vec4(p0[0].y, p0[1].y, p0[2].y, p0[3].y) - w.org.y - w.S.y * az;
+	vec4 bx = vec4(p1[0].x, p1[1].x, p1[2].x, p1[3].x) - w.org.x - w.S.x * bz;
+	vec4 by = vec4(p1[0].y, p1[1].y, p1[2].y, p1[3].y) - w.org.y - w.S.y * bz;
+	vec4 cx = vec4(p2[0].x, p2[1].x, p2[2].x, p2[3].x) - w.org.x - w.S.x * cz;
+	vec4 cy = vec4(p2[0].y, p2[1].y, p2[2].y, p2[3].y) - w.org.y - w.S.y * cz;
+
+	vec4 U = cx * by - cy * bx;
+	vec4 V = ax * cy - ay * cx;
+	vec4 W = bx * ay - by * ax;
+	vec4 det = U + V + W;
+	vec4 T = w.S.z * (U * az + V * bz + W * cz);
+
+	// 三个边函数同号（允许为0）；det为0（含填充的退化三角形）时sT为0，判为未命中
+	vec4 inside = vec4(greaterThanEqual(min(min(U, V), W), vec4(0.0))) + vec4(lessThanEqual(max(max(U, V), W), vec4(0.0)));
+	vec4 sT = T * sign(det);
+	vec4 ok = vec4(greaterThan(inside, vec4(0.5))) * vec4(greaterThan(sT, vec4(0.0)))
+			* vec4(lessThan(sT, tMax * abs(det)));
+	vec4 rcpDet = 1.0 / det;
+	u = V * rcpDet;
+	v = W * rcpDet;
+	return mix(vec4(-1.0), T * rcpDet, greaterThan(ok, vec4(0.5)));
+}
+
+// 与叶子中从first开始的count个三角形求交，每4个一组，只读取顶点位置
+// 不足4个的槽位用退化三角形（det为0）填充；命中更近的三角形时更新hitMin、hitIndex与重心坐标hitUV
+bool intersectLeaf(int first, int count, WatertightRay wray, inout float hitMin, inout int hitIndex, inout vec2 hitUV) {
+	bool hit = false;
+	for (int i = 0; i < count; i += 4) {
+		vec3 p0[4], p1[4], p2[4];
+		int index[4];
+		for (int k = 0; k < 4; ++k) {
+			index[k] = (i + k < count) ? getPrimitiveIndex(first + i + k) : -1;
+			if (index[k] >= 0) getTrianglePositions(index[k], wray.k, p0[k], p1[k], p2[k]);
+			else p0[k] = p1[k] = p2[k] = vec3(0.0);
+		}
+		vec4 u, v;
+		vec4 t = hitTriangle4(p0, p1, p2, wray, hitMin, u, v);
+		for (int k = 0; k < 4; ++k) {
+			if (t[k] > 0.0 && t[k] < hitMin) {
+				hitMin = t[k];
+				hitIndex = index[k];
+				hitUV = vec2(u[k], v[k]);
+				hit = true;
+			}
+		}
+	}
+	return hit;
+}
+
+// 从节点纹理中读取BVH节点，BLAS与TLAS的节点格式相同
+LinearBVHNode fetchLinearBVHNode(sampler2D nodeTex, int nodeIndex) {
 	const int FLOATS_PER_NODE = 9; // 每个节点占用的float数
     int storageOffset = nodeIndex * FLOATS_PER_NODE;
 
@@ -368,31 +710,35 @@ LinearBVHNode getLinearBVHNode(int nodeIndex) {
 
 	// 解析包围盒最小点（3个float）
 	node.pMin = vec3(
-			At(texBvhNode, float(storageOffset + 0)), 
-			At(texBvhNode, float(storageOffset + 1)), 
-			At(texBvhNode, float(storageOffset + 2))
+			At(nodeTex, float(storageOffset + 0)), 
+			At(nodeTex, float(storageOffset + 1)), 
+			At(nodeTex, float(storageOffset + 2))
 		);
 
 	// 解析包围盒最大点（3个float）
 	node.pMax = vec3(
-			At(texBvhNode, float(storageOffset + 3)), 
-			At(texBvhNode, float(storageOffset + 4)), 
-			At(texBvhNode, float(storageOffset + 5))
+			At(nodeTex, float(storageOffset + 3)), 
+			At(nodeTex, float(storageOffset + 4)), 
+			At(nodeTex, float(storageOffset + 5))
 		);
 	
 	// 解析叶节点中三角形数量（1个int）
-	node.nPrimitives = int(At(texBvhNode, float(storageOffset + 6)));
+	node.nPrimitives = int(At(nodeTex, float(storageOffset + 6)));
 
 	// 解析分割轴（0:X,1:Y,2:Z）
-	node.axis = int(At(texBvhNode, float(storageOffset + 7)));
+	node.axis = int(At(nodeTex, float(storageOffset + 7)));
 	
 	// 解析子节点偏移量（1个int）
-	node.childOffset = int(At(texBvhNode, float(storageOffset + 8)));
+	node.childOffset = int(At(nodeTex, float(storageOffset + 8)));
 
 	// 返回BVH节点
     return node;
 }
 
+LinearBVHNode getLinearBVHNode(int nodeIndex) {
+	return fetchLinearBVHNode(texBvhNode, nodeIndex);
+}
+
 // 计算三角形面积
 float getTriangleArea(Triangle tri) {
     vec3 edge1 = tri.p1 - tri.p0;
@@ -494,98 +840,523 @@ float getTriangleArea(Triangle tri) {
 // 	return hit;
 // }
 
-// 优化后的BVH光线与三角形相交检测，防止光线与三角形相交时，三角形法向量始终超外
+// ********* 压缩BVH节点 ********* //
+// 格式见BVHTree::buildCompactNodes：texel 0为根节点包围盒最小点，
+// 节点k占texel 1+2k（两个子包围盒的8位量化值与各轴指数）和2+2k（两个子节点的索引与三角形数量）
+uvec4 fetchCompact(int texel) {
+	int w = textureSize(texBvhCompact, 0).x;
+	return texelFetch(texBvhCompact, ivec2(texel % w, texel / w), 0);
+}
+
+// 8位量化值
+vec3 decodeQuant(uint bits) {
+	return vec3(float(bits & 255u), float((bits >> 8u) & 255u), float((bits >> 16u) & 255u));
+}
+
+// 高8位为IEEE单精度指数域，直接拼成2^e，与CPU端完全一致
+float decodeScale(uint bits) {
+	return uintBitsToFloat((bits >> 24u) << 23u);
+}
+
+// 射线与包围盒相交，返回进入距离，不相交返回-1
+float hitBox(vec3 pMin, vec3 pMax, Ray ray, vec3 invDir, float tMax) {
+	vec3 t0 = (pMin - ray.origin) * invDir;
+	vec3 t1 = (pMax - ray.origin) * invDir;
+	vec3 tNear = min(t0, t1);
+	vec3 tFar = max(t0, t1);
+	float tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+	float tExit = min(min(tFar.x, tFar.y), min(tFar.z, tMax));
+	return (tEnter <= tExit) ? tEnter : -1.0;
+}
+
+// 由最近交点填写全局的rec，三角形的完整数据（法线、材质）只在遍历结束后读取一次
+void setHitRecord(Ray ray, int triIndex, vec2 uv) {
+	Triangle tri = getTriangle(triIndex);
+	vec3 rawNormal = getTriangleNormal(tri);
+	rec.isHit = true;
+	rec.isInside = dot(rawNormal, ray.direction) > 0.0;
+	rec.rayHitMin = ray.hitMin;
+	rec.Pos = ray.origin + ray.hitMin * ray.direction;
+	rec.Normal = dot(rawNormal, -ray.direction) > 0.0 ? rawNormal : -rawNormal;
+	rec.viewDir = -ray.direction;
+	rec.triangleIndex = triIndex;
+	rec.triangleArea = getTriangleArea(tri);
+	rec.material = tri.material;
+	rec.uv = uv;
+#ifdef INDEXED_MESH
+	rec.materialID = int(At(texMesh, float(triIndex * 4 + 3)));
+#else
+	rec.materialID = -1; // 42跨度没有材质表，材质已在rec.material中
+#endif
+}
+
+// 从root开始无栈遍历（单级BVH的root为0，拼接时每个BLAS根节点的跳转链接为-1，遍历不会越过该BLAS），
+// 更新hitMin与最近的三角形。有栈遍历的32项栈放满时也改用它，已找到的交点保留在hitMin中，深度很大的树不会漏掉节点
+void traverseStackless(Ray ray, int root, vec3 invDir, WatertightRay wray, inout float hitMin, inout int hitIndex, inout vec2 hitUV) {
+	int current = root;
+	while (current >= 0) {
+		LinearBVHNode node = getLinearBVHNode(current);
+		bool hitNode = hitBox(node.pMin, node.pMax, ray, invDir, hitMin) >= 0.0;
+		if (hitNode && node.nPrimitives == 0) {
+			current++;
+			continue;
+		}
+		if (hitNode) intersectLeaf(node.childOffset, node.nPrimitives, wray, hitMin, hitIndex, hitUV);
+		current = int(At(texBvhSkip, float(current)));
+	}
+}
+
+// 压缩BVH遍历：每个节点2次texelFetch同时得到两个子包围盒，叶子子节点直接求交，
+// 先访问较近的子节点，入栈时记录进入距离，已找到更近交点时跳过
+bool IntersectCompactBVH(Ray ray) {
+	rec.isHit = false;
+	bool hit = false;
+	int hitTriangleOffset = -1;
+	vec2 hitUV = vec2(0.0);
+	vec3 invDir = 1.0 / ray.direction;
+	WatertightRay wray = prepareWatertightRay(ray);
+
+	int nodesToVisit[32];
+	vec3 originToVisit[32];
+	float tNearToVisit[32];
+	int stackPtr = 0;
+
+	int current = 0;
+	vec3 origin = uintBitsToFloat(fetchCompact(0).xyz);
+
+	while (true) {
+		uvec4 a = fetchCompact(1 + 2 * current);
+		uvec4 b = fetchCompact(2 + 2 * current);
+		vec3 scale = vec3(decodeScale(a.x), decodeScale(a.y), decodeScale(a.z));
+		vec3 lo0 = origin + decodeQuant(a.x) * scale;
+		vec3 hi0 = origin + decodeQuant(a.y) * scale;
+		vec3 lo1 = origin + decodeQuant(a.z) * scale;
+		vec3 hi1 = origin + decodeQuant(a.w) * scale;
+		int count0 = int(b.y);
+		int count1 = int(b.w);
+
+		float t0 = hitBox(lo0, hi0, ray, invDir, ray.hitMin);
+		float t1 = (count1 < 0) ? -1.0 : hitBox(lo1, hi1, ray, invDir, ray.hitMin);
+
+		// 叶子子节点
+		for (int k = 0; k < 2; ++k) {
+			int count = (k == 0) ? count0 : count1;
+			float tk = (k == 0) ? t0 : t1;
+			if (tk < 0.0 || count <= 0) continue;
+			int first = int((k == 0) ? b.x : b.z);
+			if (intersectLeaf(first, count, wray, ray.hitMin, hitTriangleOffset, hitUV)) hit = true;
+			if (k == 0) t0 = -1.0; else t1 = -1.0;
+		}
+
+		// 内部子节点
+		bool visit0 = t0 >= 0.0 && t0 <= ray.hitMin;
+		bool visit1 = t1 >= 0.0 && t1 <= ray.hitMin;
+		if (visit0 && visit1) {
+			if (stackPtr == 32) {
+				// 栈已满（树深度超过32）：改为对整棵树无栈遍历
+				traverseStackless(ray, 0, invDir, wray, ray.hitMin, hitTriangleOffset, hitUV);
+				hit = hitTriangleOffset >= 0;
+				break;
+			}
+			bool nearIs1 = t1 < t0;
+			nodesToVisit[stackPtr] = int(nearIs1 ? b.x : b.z);
+			originToVisit[stackPtr] = nearIs1 ? lo0 : lo1;
+			tNearToVisit[stackPtr] = nearIs1 ? t0 : t1;
+			stackPtr++;
+			current = int(nearIs1 ? b.z : b.x);
+			origin = nearIs1 ? lo1 : lo0;
+			continue;
+		}
+		if (visit0 || visit1) {
+			current = int(visit0 ? b.x : b.z);
+			origin = visit0 ? lo0 : lo1;
+			continue;
+		}
+
+		// 出栈，跳过比当前交点更远的节点
+		while (stackPtr > 0 && tNearToVisit[stackPtr - 1] > ray.hitMin) stackPtr--;
+		if (stackPtr == 0) break;
+		stackPtr--;
+		current = nodesToVisit[stackPtr];
+		origin = originToVisit[stackPtr];
+	}
+
+	if (hit) setHitRecord(ray, hitTriangleOffset, hitUV);
+	return hit;
+}
+
+// ********* 两级BVH（TLAS/BLAS） ********* //
+// 在物体空间中遍历从root开始的BLAS，返回最近命中的三角形下标（未命中返回-1），并更新hitMin与重心坐标hitUV
+// 有栈遍历时在内部节点同时测试两个子包围盒，先访问进入距离较近的子节点，较远的连同进入距离入栈，
+// 出栈时跳过比当前交点更远的节点；进入的子节点沿用已读取的节点数据，只有出栈的节点需要重新读取
+int IntersectBLAS(Ray ray, int root, inout float hitMin, inout vec2 hitUV) {
+	vec3 invDir = 1.0 / ray.direction;
+	WatertightRay wray = prepareWatertightRay(ray);
+	int hitIndex = -1;
+#ifdef STACKLESS_BVH
+	traverseStackless(ray, root, invDir, wray, hitMin, hitIndex, hitUV);
+#else
+	int nodesToVisit[32];
+	float tNearToVisit[32];
+	int stackPtr = 0;
+	LinearBVHNode node = getLinearBVHNode(root);
+	int current = (hitBox(node.pMin, node.pMax, ray, invDir, hitMin) >= 0.0) ? root : -1;
+	while (current >= 0) {
+		if (node.nPrimitives > 0) {
+			intersectLeaf(node.childOffset, node.nPrimitives, wray, hitMin, hitIndex, hitUV);
+		} else {
+			int first = current + 1;
+			int second = node.childOffset;
+			LinearBVHNode node0 = getLinearBVHNode(first);
+			LinearBVHNode node1 = getLinearBVHNode(second);
+			float t0 = hitBox(node0.pMin, node0.pMax, ray, invDir, hitMin);
+			float t1 = hitBox(node1.pMin, node1.pMax, ray, invDir, hitMin);
+			if (t0 >= 0.0 && t1 >= 0.0) {
+				if (stackPtr == 32) {
+					// 栈已满：改为对该BLAS无栈遍历
+					traverseStackless(ray, root, invDir, wray, hitMin, hitIndex, hitUV);
+					return hitIndex;
+				}
+				bool secondNear = t1 < t0;
+				nodesToVisit[stackPtr] = secondNear ? first : second;
+				tNearToVisit[stackPtr] = secondNear ? t0 : t1;
+				stackPtr++;
+				current = secondNear ? second : first;
+				node = secondNear ? node1 : node0;
+				continue;
+			}
+			if (t0 >= 0.0 || t1 >= 0.0) {
+				current = (t0 >= 0.0) ? first : second;
+				node = (t0 >= 0.0) ? node0 : node1;
+				continue;
+			}
+		}
+		// 出栈，跳过比当前交点更远的节点
+		current = -1;
+		while (stackPtr > 0) {
+			stackPtr--;
+			if (tNearToVisit[stackPtr] <= hitMin) {
+				current = nodesToVisit[stackPtr];
+				node = getLinearBVHNode(current);
+				break;
+			}
+		}
+	}
+#endif
+	return hitIndex;
+}
+
+// 读取实例的覆盖材质，顺序与texMesh中三角形的材质部分相同
+Material getInstanceMaterial(int base) {
+	Material m;
+	m.emissive = vec3(At(texInstance, float(base + 14)), At(texInstance, float(base + 15)), At(texInstance, float(base + 16)));
+	m.baseColor = vec3(At(texInstance, float(base + 17)), At(texInstance, float(base + 18)), At(texInstance, float(base + 19)));
+	m.subsurface = At(texInstance, float(base + 20));
+	m.metallic = At(texInstance, float(base + 21));
+	m.specular = At(texInstance, float(base + 22));
+	m.specularTint = At(texInstance, float(base + 23));
+	m.roughness = At(texInstance, float(base + 24));
+	m.anisotropic = At(texInstance, float(base + 25));
+	m.sheen = At(texInstance, float(base + 26));
+	m.sheenTint = At(texInstance, float(base + 27));
+	m.clearcoat = At(texInstance, float(base + 28));
+	m.clearcoatGloss = At(texInstance, float(base + 29));
+	m.IOR = At(texInstance, float(base + 30));
+	m.transmission = int(At(texInstance, float(base + 31)));
+	return m;
+}
+
+// 遍历TLAS，在实例叶子处用逆变换把光线变换到物体空间后遍历BLAS。
+// 方向不归一化，物体空间与世界空间中的t相同，hitMin可以直接共用
+bool IntersectTLAS(Ray ray) {
+	rec.isHit = false;
+	vec3 invDir = 1.0 / ray.direction;
+	int nodesToVisit[32];
+	float tNearToVisit[32];
+	int stackPtr = 0;
+	int current = 0;
+	float tNear = 0.0;
+	int hitInstance = -1;
+	int hitTriangleOffset = -1;
+	vec2 hitUV = vec2(0.0);
+
+	while (true) {
+		LinearBVHNode node = fetchLinearBVHNode(texTlasNode, current);
+		if (tNear <= ray.hitMin && hitBox(node.pMin, node.pMax, ray, invDir, ray.hitMin) >= 0.0) {
+			if (node.nPrimitives > 0) {
+				int base = node.childOffset * INSTANCE_STRIDE;
+				vec4 r0 = vec4(At(texInstance, float(base + 0)), At(texInstance, float(base + 1)), At(texInstance, float(base + 2)), At(texInstance, float(base + 3)));
+				vec4 r1 = vec4(At(texInstance, float(base + 4)), At(texInstance, float(base + 5)), At(texInstance, float(base + 6)), At(texInstance, float(base + 7)));
+				vec4 r2 = vec4(At(texInstance, float(base + 8)), At(texInstance, float(base + 9)), At(texInstance, float(base + 10)), At(texInstance, float(base + 11)));
+				Ray objRay;
+				objRay.origin = vec3(dot(r0, vec4(ray.origin, 1.0)), dot(r1, vec4(ray.origin, 1.0)), dot(r2, vec4(ray.origin, 1.0)));
+				objRay.direction = vec3(dot(r0.xyz, ray.direction), dot(r1.xyz, ray.direction), dot(r2.xyz, ray.direction));
+				objRay.hitMin = ray.hitMin;
+				int index = IntersectBLAS(objRay, int(At(texInstance, float(base + 12))), ray.hitMin, hitUV);
+				if (index >= 0) {
+					hitInstance = node.childOffset;
+					hitTriangleOffset = index;
+				}
+			} else {
+				// 实例数量少，TLAS节点按需读取；按子包围盒的进入距离决定访问顺序
+				LinearBVHNode node0 = fetchLinearBVHNode(texTlasNode, current + 1);
+				LinearBVHNode node1 = fetchLinearBVHNode(texTlasNode, node.childOffset);
+				float t0 = hitBox(node0.pMin, node0.pMax, ray, invDir, ray.hitMin);
+				float t1 = hitBox(node1.pMin, node1.pMax, ray, invDir, ray.hitMin);
+				bool secondNear = t1 >= 0.0 && (t0 < 0.0 || t1 < t0);
+				float tFar = secondNear ? t0 : t1;
+				// TLAS按中位数划分，深度为ceil(log2(instanceNum))，上传时已检查不超过32（见generateSceneTextures）
+				if (tFar >= 0.0 && stackPtr < 32) {
+					nodesToVisit[stackPtr] = secondNear ? current + 1 : node.childOffset;
+					tNearToVisit[stackPtr] = tFar;
+					stackPtr++;
+				}
+				if (t0 >= 0.0 || t1 >= 0.0) {
+					current = secondNear ? node.childOffset : current + 1;
+					tNear = secondNear ? t1 : t0;
+					continue;
+				}
+			}
+		}
+		if (stackPtr == 0) break;
+		stackPtr--;
+		current = nodesToVisit[stackPtr];
+		tNear = tNearToVisit[stackPtr];
+	}
+
+	if (hitInstance < 0) return false;
+
+	int base = hitInstance * INSTANCE_STRIDE;
+	// 逆变换矩阵的前三行，按列构造即得到其转置（法线变换矩阵）
+	mat3 invRowsT = mat3(
+		At(texInstance, float(base + 0)), At(texInstance, float(base + 1)), At(texInstance, float(base + 2)),
+		At(texInstance, float(base + 4)), At(texInstance, float(base + 5)), At(texInstance, float(base + 6)),
+		At(texInstance, float(base + 8)), At(texInstance, float(base + 9)), At(texInstance, float(base + 10)));
+	mat3 model = inverse(transpose(invRowsT));
+
+	Triangle tri = getTriangle(hitTriangleOffset);
+	vec3 rawNormal = normalize(invRowsT * cross(tri.p2 - tri.p0, tri.p1 - tri.p0));
+	rec.isHit = true;
+	rec.isInside = dot(rawNormal, ray.direction) > 0.0;
+	rec.rayHitMin = ray.hitMin;
+	rec.Pos = ray.origin + ray.hitMin * ray.direction;
+	rec.Normal = dot(rawNormal, -ray.direction) > 0.0 ? rawNormal : -rawNormal;
+	rec.viewDir = -ray.direction;
+	rec.triangleIndex = hitTriangleOffset;
+	rec.triangleArea = 0.5 * length(cross(model * (tri.p1 - tri.p0), model * (tri.p2 - tri.p0)));
+	rec.material = (At(texInstance, float(base + 13)) > 0.5) ? getInstanceMaterial(base) : tri.material;
+	rec.uv = hitUV;
+	rec.materialID = -1; // 两级BVH的BLAS为42跨度，材质直接存在三角形与实例中
+	return true;
+}
+
+// 无栈遍历：命中内部节点时进入第一个子节点（下标+1），未命中或处理完叶子时沿跳转链接前进。
+// 访问顺序固定为深度优先顺序，不能先访问近的子节点，但不需要栈，深度很大的树也不会漏掉节点
+bool IntersectStacklessBVH(Ray ray) {
+	rec.isHit = false;
+	int hitTriangleOffset = -1;
+	vec2 hitUV = vec2(0.0);
+	vec3 invDir = 1.0 / ray.direction;
+	WatertightRay wray = prepareWatertightRay(ray);
+
+	traverseStackless(ray, 0, invDir, wray, ray.hitMin, hitTriangleOffset, hitUV);
+
+	if (hitTriangleOffset < 0) return false;
+	setHitRecord(ray, hitTriangleOffset, hitUV);
+	return true;
+}
+
+// 最近交点查询：按数据格式选择遍历方式。原9个float节点格式的有栈遍历与BLAS相同（根节点为0），
+// 命中三角形后立即缩小hitMin，先访问进入距离较近的子节点，出栈时跳过比当前交点更远的节点
 bool IntersectBVH(Ray ray) {
-    rec.isHit = false;
-    bool hit = false;
-    Triangle tri;
-    int hitTriangleOffset = -1; // 存储命中的三角形偏移量
-
-    // 移除const修饰符
-    vec3 invDir = 1.0 / ray.direction;
-    bool dirIsNeg[3] = bool[](ray.direction.x < 0.0, ray.direction.y < 0.0, ray.direction.z < 0.0);
-    
-    int nodesToVisit[32];
-    int stackPtr = 0;
-    int currentNodeIndex = 0;
-    float tMax = ray.hitMin;
-
-    while (stackPtr >= 0 && stackPtr < 32) { // 增加栈保护
-        LinearBVHNode node = getLinearBVHNode(currentNodeIndex);
-        
-        // 优化后的包围盒检测
-        bool intersect = true;
-        float tMin = 0.0;
-        float tMaxBox = tMax;
-        
-        for (int i = 0; i < 3; ++i) {
-            float t0 = (node.pMin[i] - ray.origin[i]) * invDir[i];
-            float t1 = (node.pMax[i] - ray.origin[i]) * invDir[i];
-            
-            if (invDir[i] < 0.0) {
-                float tmp = t0;
-                t0 = t1;
-                t1 = tmp;
-            }
-            
-            tMin = max(tMin, t0);
-            tMaxBox = min(tMaxBox, t1);
-            
-            if (tMin > tMaxBox) {
-                intersect = false;
-                break;
-            }
-        }
-
-        if (!intersect || tMin > tMax) {
-            if (stackPtr == 0) break;
-            currentNodeIndex = nodesToVisit[--stackPtr];
-            continue;
-        }
-
-        if (node.nPrimitives > 0) {
-            // 叶子节点处理
-            for (int i = 0; i < node.nPrimitives; ++i) {
-                int offset = node.childOffset + i;
-                Triangle tri_t = getTriangle(offset);
-                float dis_t = hitTriangle(tri_t, ray);
-                
-                if (dis_t > 0.0 && dis_t < ray.hitMin) {
-                    ray.hitMin = dis_t;
-                    tri = tri_t;
-                    hit = true;
-                    hitTriangleOffset = offset; // 保存命中的三角形偏移
-                }
-            }
-            
-            if (stackPtr == 0) break;
-            currentNodeIndex = nodesToVisit[--stackPtr];
-        } else {
-            // 内部节点处理
-            if (dirIsNeg[node.axis]) {
-                nodesToVisit[stackPtr++] = currentNodeIndex + 1;
-                currentNodeIndex = node.childOffset;
-            } else {
-                nodesToVisit[stackPtr++] = node.childOffset;
-                currentNodeIndex = currentNodeIndex + 1;
-            }
-        }
-    }
+	if (instanceNum > 0) return IntersectTLAS(ray);
+#ifdef STACKLESS_BVH
+	return IntersectStacklessBVH(ray);
+#endif
+#ifdef COMPACT_BVH
+	return IntersectCompactBVH(ray);
+#endif
+	rec.isHit = false;
+	vec2 hitUV = vec2(0.0);
+	int hitTriangleOffset = IntersectBLAS(ray, 0, ray.hitMin, hitUV);
+	if (hitTriangleOffset < 0) return false;
+	setHitRecord(ray, hitTriangleOffset, hitUV);
+	return true;
+}
 
-    if (hit) {
-        vec3 rawNormal = getTriangleNormal(tri);
-        rec.isHit = true;
-        rec.isInside = dot(rawNormal, ray.direction) > 0.0;
-        rec.rayHitMin = ray.hitMin;
-        rec.Pos = ray.origin + ray.hitMin * ray.direction;
-        rec.Normal = dot(rawNormal, -ray.direction) > 0.0 ? rawNormal : -rawNormal;
-        rec.viewDir = -ray.direction;
-        rec.triangleIndex = hitTriangleOffset; // 使用保存的偏移量
-        rec.triangleArea = getTriangleArea(tri);
-        rec.material = tri.material;
-    }
-    
-    return hit;
+// ********* 遮挡查询（阴影光线） ********* //
+// 只判断(0, tMax)内是否有任意三角形，找到第一个就返回。只读取顶点位置，不重建法线与材质，
+// 也不修改全局的rec；子节点不按距离排序，任意顺序都可以提前结束
+bool occludedLeaf(int first, int count, WatertightRay wray, float tMax) {
+	for (int i = 0; i < count; i += 4) {
+		vec3 p0[4], p1[4], p2[4];
+		for (int k = 0; k < 4; ++k) {
+			if (i + k < count) getTrianglePositions(getPrimitiveIndex(first + i + k), wray.k, p0[k], p1[k], p2[k]);
+			else p0[k] = p1[k] = p2[k] = vec3(0.0);
+		}
+		vec4 u, v;
+		if (any(greaterThan(hitTriangle4(p0, p1, p2, wray, tMax, u, v), vec4(0.0)))) return true;
+	}
+	return false;
+}
+
+// 从root开始无栈遍历的遮挡查询，用于STACKLESS_BVH以及有栈遍历的栈放满时
+bool occludedStackless(Ray ray, int root, vec3 invDir, WatertightRay wray, float tMax) {
+	int current = root;
+	while (current >= 0) {
+		LinearBVHNode node = getLinearBVHNode(current);
+		bool hitNode = hitBox(node.pMin, node.pMax, ray, invDir, tMax) >= 0.0;
+		if (hitNode && node.nPrimitives == 0) {
+			current++;
+			continue;
+		}
+		if (hitNode && occludedLeaf(node.childOffset, node.nPrimitives, wray, tMax)) return true;
+		current = int(At(texBvhSkip, float(current)));
+	}
+	return false;
+}
+
+bool OccludedCompactBVH(Ray ray, float tMax) {
+	vec3 invDir = 1.0 / ray.direction;
+	WatertightRay wray = prepareWatertightRay(ray);
+	int nodesToVisit[32];
+	vec3 originToVisit[32];
+	int stackPtr = 0;
+	int current = 0;
+	vec3 origin = uintBitsToFloat(fetchCompact(0).xyz);
+
+	while (true) {
+		uvec4 a = fetchCompact(1 + 2 * current);
+		uvec4 b = fetchCompact(2 + 2 * current);
+		vec3 scale = vec3(decodeScale(a.x), decodeScale(a.y), decodeScale(a.z));
+		vec3 lo0 = origin + decodeQuant(a.x) * scale;
+		vec3 hi0 = origin + decodeQuant(a.y) * scale;
+		vec3 lo1 = origin + decodeQuant(a.z) * scale;
+		vec3 hi1 = origin + decodeQuant(a.w) * scale;
+		int count0 = int(b.y);
+		int count1 = int(b.w);
+		bool visit0 = hitBox(lo0, hi0, ray, invDir, tMax) >= 0.0;
+		bool visit1 = count1 >= 0 && hitBox(lo1, hi1, ray, invDir, tMax) >= 0.0;
+
+		if (visit0 && count0 > 0) {
+			if (occludedLeaf(int(b.x), count0, wray, tMax)) return true;
+			visit0 = false;
+		}
+		if (visit1 && count1 > 0) {
+			if (occludedLeaf(int(b.z), count1, wray, tMax)) return true;
+			visit1 = false;
+		}
+
+		if (visit0 && visit1) {
+			if (stackPtr == 32) return occludedStackless(ray, 0, invDir, wray, tMax);
+			nodesToVisit[stackPtr] = int(b.z);
+			originToVisit[stackPtr] = lo1;
+			stackPtr++;
+		}
+		if (visit0 || visit1) {
+			current = int(visit0 ? b.x : b.z);
+			origin = visit0 ? lo0 : lo1;
+			continue;
+		}
+		if (stackPtr == 0) break;
+		stackPtr--;
+		current = nodesToVisit[stackPtr];
+		origin = originToVisit[stackPtr];
+	}
+	return false;
+}
+
+bool OccludedStacklessBVH(Ray ray, float tMax) {
+	return occludedStackless(ray, 0, 1.0 / ray.direction, prepareWatertightRay(ray), tMax);
+}
+
+// root为BLAS根节点，光线已变换到物体空间
+bool OccludedBLAS(Ray ray, int root, float tMax) {
+	vec3 invDir = 1.0 / ray.direction;
+	WatertightRay wray = prepareWatertightRay(ray);
+#ifdef STACKLESS_BVH
+	return occludedStackless(ray, root, invDir, wray, tMax);
+#else
+	int nodesToVisit[32];
+	int stackPtr = 0;
+	int current = root;
+	while (true) {
+		LinearBVHNode node = getLinearBVHNode(current);
+		if (hitBox(node.pMin, node.pMax, ray, invDir, tMax) >= 0.0) {
+			if (node.nPrimitives == 0) {
+				if (stackPtr == 32) return occludedStackless(ray, root, invDir, wray, tMax);
+				nodesToVisit[stackPtr++] = node.childOffset;
+				current = current + 1;
+				continue;
+			}
+			if (occludedLeaf(node.childOffset, node.nPrimitives, wray, tMax)) return true;
+		}
+		if (stackPtr == 0) break;
+		current = nodesToVisit[--stackPtr];
+	}
+#endif
+	return false;
+}
+
+bool OccludedTLAS(Ray ray, float tMax) {
+	vec3 invDir = 1.0 / ray.direction;
+	int nodesToVisit[32];
+	int stackPtr = 0;
+	int current = 0;
+	while (true) {
+		LinearBVHNode node = fetchLinearBVHNode(texTlasNode, current);
+		if (hitBox(node.pMin, node.pMax, ray, invDir, tMax) >= 0.0) {
+			if (node.nPrimitives == 0) {
+				// TLAS深度不超过32，见IntersectTLAS
+				if (stackPtr < 32) nodesToVisit[stackPtr++] = node.childOffset;
+				current = current + 1;
+				continue;
+			}
+			int base = node.childOffset * INSTANCE_STRIDE;
+			vec4 r0 = vec4(At(texInstance, float(base + 0)), At(texInstance, float(base + 1)), At(texInstance, float(base + 2)), At(texInstance, float(base + 3)));
+			vec4 r1 = vec4(At(texInstance, float(base + 4)), At(texInstance, float(base + 5)), At(texInstance, float(base + 6)), At(texInstance, float(base + 7)));
+			vec4 r2 = vec4(At(texInstance, float(base + 8)), At(texInstance, float(base + 9)), At(texInstance, float(base + 10)), At(texInstance, float(base + 11)));
+			Ray objRay;
+			objRay.origin = vec3(dot(r0, vec4(ray.origin, 1.0)), dot(r1, vec4(ray.origin, 1.0)), dot(r2, vec4(ray.origin, 1.0)));
+			objRay.direction = vec3(dot(r0.xyz, ray.direction), dot(r1.xyz, ray.direction), dot(r2.xyz, ray.direction));
+			objRay.hitMin = tMax;
+			if (OccludedBLAS(objRay, int(At(texInstance, float(base + 12))), tMax)) return true;
+		}
+		if (stackPtr == 0) break;
+		current = nodesToVisit[--stackPtr];
+	}
+	return false;
+}
+
+// 与IntersectBVH使用相同的数据格式选择
+bool OccludedBVH(Ray ray, float tMax) {
+	if (instanceNum > 0) return OccludedTLAS(ray, tMax);
+#ifdef STACKLESS_BVH
+	return OccludedStacklessBVH(ray, tMax);
+#endif
+#ifdef COMPACT_BVH
+	return OccludedCompactBVH(ray, tMax);
+#endif
+	vec3 invDir = 1.0 / ray.direction;
+	WatertightRay wray = prepareWatertightRay(ray);
+	int nodesToVisit[32];
+	int stackPtr = 0;
+	int current = 0;
+	while (true) {
+		LinearBVHNode node = getLinearBVHNode(current);
+		if (hitBox(node.pMin, node.pMax, ray, invDir, tMax) >= 0.0) {
+			if (node.nPrimitives == 0) {
+				if (stackPtr == 32) return occludedStackless(ray, 0, invDir, wray, tMax);
+				nodesToVisit[stackPtr++] = node.childOffset;
+				current = current + 1;
+				continue;
+			}
+			if (occludedLeaf(node.childOffset, node.nPrimitives, wray, tMax)) return true;
+		}
+		if (stackPtr == 0) break;
+		current = nodesToVisit[--stackPtr];
+	}
+	return false;
 }
 
 // =========================================================
@@ -646,8 +1417,8 @@ vec3 calculateRefract(vec3 I, vec3 N, float ior) {
         : eta * I + (eta * cosi - sqrt(k)) * n;
 }
 
-// 采样函数
-sampleDir sample_(vec3 wo, vec3 N, Material material){
+// 采样函数，u为本次反弹SLOT_BSDF槽位的二维采样
+sampleDir sample_(vec3 wo, vec3 N, Material material, vec2 u){
 	sampleDir result;
 	result.reflectDir = vec3(0.0, 0.0, 0.0);
 	result.refractDir = vec3(0.0, 0.0, 0.0);
@@ -655,8 +1426,8 @@ sampleDir sample_(vec3 wo, vec3 N, Material material){
 	switch(material.transmission) {
 		case 0: { // 漫反射材质
 			// 余弦加权半球采样
-			float r0 = rand();
-			float r1 = rand();
+			float r0 = u.x;
+			float r1 = u.y;
 			float phi = 2.0 * PI * r0;
 			float z = sqrt(1.0 - r1);  // 余弦加权分布
 			float r = sqrt(r1);
@@ -1006,7 +1777,7 @@ vec3 shading(Ray r)
 
 	// 随机选择一个光源三角形
 	int lightTriCount = 2;
-	int lightIndex = int(rand() * lightTriCount);
+	int lightIndex = int(sample1D(bounceSlot(0, SLOT_LIGHT_SELECT)) * lightTriCount);
 	lightIndex = clamp(lightIndex, 0, lightTriCount-1);
 	Triangle lightTri = triLight[lightIndex];
 
@@ -1019,8 +1790,9 @@ vec3 shading(Ray r)
 	if(rec.isHit && rec.material.transmission != -1)
 	{
 		// 在三角形表面均匀采样
-		float u = rand();
-		float v = rand() * (1.0 - u);
+		vec2 uLight = sample2D(bounceSlot(0, SLOT_LIGHT_POINT));
+		float u = uLight.x;
+		float v = uLight.y * (1.0 - u);
 		vec3 lightPoint = lightTri.p0 
 			+ u * (lightTri.p1 - lightTri.p0)
 			+ v * (lightTri.p2 - lightTri.p0);
@@ -1032,9 +1804,8 @@ vec3 shading(Ray r)
 		shadowRay.direction = normalize(rec.Pos - lightPoint);
 		shadowRay.hitMin = 100000;
 
-		// 可见性检测
-		bool hitShadow = IntersectBVH(shadowRay);
-		if(abs(rec.rayHitMin - dist) < 0.0013)
+		// 可见性检测：光源与着色点之间没有遮挡（着色点本身在tMax之外），不修改rec
+		if(!OccludedBVH(shadowRay, dist - 0.0013))
 		{
 			float cosTheta = max(dot(rec.Normal, -shadowRay.direction), 0.0); // 入射角
 			float cosThetaPrime = max(dot(lightNormal, shadowRay.direction), 0.0); // 光源与法线夹角 
@@ -1053,16 +1824,14 @@ vec3 shading(Ray r)
 		}
 	}
 
-	bool hit = IntersectBVH(r);
-
 	// ========== 间接光照部分 ==========
 	for(int depth=0; depth<60; depth++){
 		if(flag == 0) break;
 
 		// 间接光照
-		if(depth > 3 && rand() > P_RR) break;
+		if(depth > 3 && sample1D(bounceSlot(depth, SLOT_RUSSIAN_ROULETTE)) > P_RR) break;
 
-		sampleDir sampleResult = sample_(rec.viewDir, rec.Normal, rec.material);
+		sampleDir sampleResult = sample_(rec.viewDir, rec.Normal, rec.material, sample2D(bounceSlot(depth, SLOT_BSDF)));
 		vec3 dir_next = sampleResult.reflectDir;
 
 		f_r = eval_(dir_next, rec.viewDir, rec.Normal, rec.material);
@@ -1097,7 +1866,7 @@ vec3 shading(Ray r)
 			}
 			else
 			{
-				if(rand() > P_RR)
+				if(sample1D(bounceSlot(depth, SLOT_LOBE)) > P_RR)
 				{
 					dir_next = sampleResult.reflectDir;
 				}